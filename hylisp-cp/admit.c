@@ -0,0 +1,319 @@
+#include <string.h>
+
+#include "lib.h"
+
+/* Admission of received messages by source.
+   Every class with a rate has two sets of leaky buckets, one keyed by
+   source address and one by its /24 (IPv4) or /48 (IPv6). A message is
+   admitted when both have room, the source bucket is charged first so a
+   source over its own limit does not use the room of its neighbours.
+   A set is a count-min sketch of buckets (conservative update) plus a
+   small exact table: a source filling half of its burst in the sketch
+   is moved to the table and is no longer added to the sketch, so the
+   few heavy hitters do not inflate the estimate of everybody else.
+   Buckets are 64 bits (msec, level) updated with compare and swap, the
+   receive path takes no lock. A reload replaces the sets whose limits
+   changed, the old ones are freed at the next reload so no receiver is
+   still charging them. */
+
+#define AD_DEPTH	4	/* rows of sketch */
+#define AD_WIDTH	4096	/* buckets per row, power of 2 */
+#define AD_HH		256	/* exact buckets of heavy hitters, power of 2 */
+#define AD_HH_PROBE	8
+#define AD_HH_IDLE	10000	/* msec before a heavy hitter slot is reused */
+#define AD_UNIT		1000	/* a message in bucket level */
+
+/* bucket: msec of last update (32 bits, wraps) | level in 1/AD_UNIT messages */
+#define AD_T(b)		((uint32_t)((b) >> 32))
+#define AD_LEVEL(b)	((uint32_t)(b))
+#define AD_BUCKET(t, l)	(((uint64_t)(t) << 32) | (l))
+
+struct admit_hh {
+	uint64_t key;		/* fingerprint, 0 if free */
+	uint64_t bucket;
+};
+
+struct admit_set {
+	uint32_t rate;
+	uint32_t burst;		/* in AD_UNIT */
+	uint64_t cm[AD_DEPTH][AD_WIDTH];
+	struct admit_hh hh[AD_HH];
+};
+
+static const struct admit_conf ad_default[DC_MAX] = {
+	[DC_REQUEST]	= { 0, 0, 0, 0 },
+	[DC_REGISTER]	= { 0, 0, 0, 0 },
+	[DC_REPLY]	= { 0, 0, 0, 0 },
+};
+
+struct admit_conf admit_conf[DC_MAX] = {
+	[DC_REQUEST]	= { 0, 0, 0, 0 },
+	[DC_REGISTER]	= { 0, 0, 0, 0 },
+	[DC_REPLY]	= { 0, 0, 0, 0 },
+};
+
+static struct admit_set *ad_src[DC_MAX];
+static struct admit_set *ad_pfx[DC_MAX];
+static struct admit_set *ad_retired[2 * DC_MAX];	/* replaced at last reload */
+static pthread_mutex_t ad_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t ad_seed[AD_DEPTH + 1];
+
+static const enum stats_counter ad_shed[DC_MAX] = {
+	STAT_RATE_REQUEST,
+	STAT_RATE_REGISTER,
+	STAT_RATE_REPLY,
+};
+
+/* class_rate = src_rate src_burst prefix_rate prefix_burst
+   each value can be 'default' */
+	int
+admit_parse_conf(enum dispatch_class c, char data[][255], int n)
+{
+	struct admit_conf *ac = &admit_conf[c];
+	uint32_t *v[4] = { &ac->src_rate, &ac->src_burst, &ac->pfx_rate, &ac->pfx_burst };
+	int i;
+
+	for (i = 0; i < 4 && i + 2 < n; i++) {
+		if (strcasecmp(data[i + 2], "default") == 0)
+			continue;
+		if (atoi(data[i + 2]) < 0)
+			return -1;
+		*v[i] = atoi(data[i + 2]);
+	}
+	if ((ac->src_rate && !ac->src_burst) || (ac->pfx_rate && !ac->pfx_burst))
+		return -1;
+	return 0;
+}
+
+	static uint64_t
+_ad_mix(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+/* Hash of the address, or of its /24 or /48 */
+	static uint64_t
+_ad_key(union sockunion *src, int prefix)
+{
+	const uint8_t *a;
+	uint64_t h;
+	int i, n;
+
+	if (src->sa.sa_family == AF_INET) {
+		a = (const uint8_t *)&src->sin.sin_addr;
+		n = prefix ? 3 : sizeof(struct in_addr);
+	}else{
+		a = (const uint8_t *)&src->sin6.sin6_addr;
+		n = prefix ? 6 : sizeof(struct in6_addr);
+	}
+	h = 0xcbf29ce484222325ULL ^ ((uint64_t)src->sa.sa_family << 8 | prefix);
+	for (i = 0; i < n; i++)
+		h = (h ^ a[i]) * 0x100000001b3ULL;
+	return h;
+}
+
+/* Level of bucket b drained up to now */
+	static uint32_t
+_ad_level(struct admit_set *s, uint64_t b, uint32_t now)
+{
+	uint64_t drain;
+
+	/* rate messages per second is rate units per msec */
+	drain = (uint64_t)(uint32_t)(now - AD_T(b)) * s->rate;
+	return (drain >= AD_LEVEL(b)) ? 0 : AD_LEVEL(b) - drain;
+}
+
+/* Raise bucket to at least level, unless already higher */
+	static void
+_ad_raise(struct admit_set *s, uint64_t *bp, uint32_t level, uint32_t now)
+{
+	uint64_t b;
+
+	b = __atomic_load_n(bp, __ATOMIC_RELAXED);
+	do {
+		if (_ad_level(s, b, now) >= level)
+			return;
+	} while (!__atomic_compare_exchange_n(bp, &b, AD_BUCKET(now, level), 1,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+	static struct admit_hh *
+_ad_hh_find(struct admit_set *s, uint64_t key)
+{
+	struct admit_hh *e;
+	int i;
+
+	for (i = 0; i < AD_HH_PROBE; i++) {
+		e = &s->hh[(key + i) & (AD_HH - 1)];
+		if (__atomic_load_n(&e->key, __ATOMIC_ACQUIRE) == key)
+			return e;
+	}
+	return NULL;
+}
+
+/* Take a free or idle slot for key, its bucket starts at level */
+	static void
+_ad_hh_add(struct admit_set *s, uint64_t key, uint32_t level, uint32_t now)
+{
+	struct admit_hh *e;
+	uint64_t old;
+	int i;
+
+	for (i = 0; i < AD_HH_PROBE; i++) {
+		e = &s->hh[(key + i) & (AD_HH - 1)];
+		old = __atomic_load_n(&e->key, __ATOMIC_ACQUIRE);
+		if (old && (uint32_t)(now - AD_T(__atomic_load_n(&e->bucket,
+					__ATOMIC_RELAXED))) < AD_HH_IDLE)
+			continue;
+		/* bucket first: a reader matching the key sees the new level */
+		__atomic_store_n(&e->bucket, AD_BUCKET(now, level), __ATOMIC_RELAXED);
+		if (__atomic_compare_exchange_n(&e->key, &old, key, 0,
+					__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			return;
+	}
+}
+
+/* Charge one message, return 1 if there was room */
+	static int
+_ad_charge(struct admit_set *s, uint64_t h, uint32_t now)
+{
+	struct admit_hh *e;
+	uint64_t key, b;
+	uint32_t est, level, idx[AD_DEPTH];
+	int i;
+
+	key = _ad_mix(h ^ ad_seed[AD_DEPTH]) | 1;
+	if ((e = _ad_hh_find(s, key)) != NULL) {
+		b = __atomic_load_n(&e->bucket, __ATOMIC_RELAXED);
+		do {
+			level = _ad_level(s, b, now);
+			if (level + AD_UNIT > s->burst)
+				return 0;
+		} while (!__atomic_compare_exchange_n(&e->bucket, &b,
+					AD_BUCKET(now, level + AD_UNIT), 1,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+		return 1;
+	}
+
+	est = UINT32_MAX;
+	for (i = 0; i < AD_DEPTH; i++) {
+		idx[i] = _ad_mix(h ^ ad_seed[i]) & (AD_WIDTH - 1);
+		est = min(est, _ad_level(s, __atomic_load_n(&s->cm[i][idx[i]],
+					__ATOMIC_RELAXED), now));
+	}
+	if (est + AD_UNIT > s->burst)
+		return 0;
+	for (i = 0; i < AD_DEPTH; i++)
+		_ad_raise(s, &s->cm[i][idx[i]], est + AD_UNIT, now);
+	if (est + AD_UNIT > s->burst / 2)
+		_ad_hh_add(s, key, est + AD_UNIT, now);
+	return 1;
+}
+
+	static uint32_t
+_ad_burst(uint32_t burst)
+{
+	return (uint32_t)min((uint64_t)burst * AD_UNIT, UINT32_MAX / 2);
+}
+
+	static struct admit_set *
+_ad_set(uint32_t rate, uint32_t burst)
+{
+	struct admit_set *s;
+
+	if (!rate || !(s = calloc(1, sizeof(struct admit_set))))
+		return NULL;
+	s->rate = rate;
+	s->burst = _ad_burst(burst);
+	return s;
+}
+
+/* Replace set *sp if its limits are not rate, burst any more,
+   return 1 if it was replaced. Requires ad_mutex */
+	static int
+_ad_replace(struct admit_set **sp, struct admit_set **retired,
+		uint32_t rate, uint32_t burst)
+{
+	struct admit_set *s = *sp;
+
+	if (s ? (s->rate == rate && s->burst == _ad_burst(burst)) : !rate)
+		return 0;
+	free(*retired);
+	*retired = __atomic_exchange_n(sp, _ad_set(rate, burst), __ATOMIC_ACQ_REL);
+	return 1;
+}
+
+/* Publish the sets of admit_conf, keeping the buckets of unchanged ones */
+	static void
+_ad_publish(void)
+{
+	struct admit_conf *ac;
+	int c, n;
+
+	pthread_mutex_lock(&ad_mutex);
+	for (c = 0; c < DC_MAX; c++) {
+		ac = &admit_conf[c];
+		n = _ad_replace(&ad_src[c], &ad_retired[2 * c], ac->src_rate, ac->src_burst);
+		n |= _ad_replace(&ad_pfx[c], &ad_retired[2 * c + 1], ac->pfx_rate, ac->pfx_burst);
+		if (n)
+			cp_log(LLOG, "admit %s: source %u/s burst %u, prefix %u/s burst %u\n",
+					dispatch_class_name[c],
+					ac->src_rate, ac->src_burst, ac->pfx_rate, ac->pfx_burst);
+	}
+	pthread_mutex_unlock(&ad_mutex);
+}
+
+	void
+admit_init(void)
+{
+	int i;
+
+	for (i = 0; i <= AD_DEPTH; i++)
+		ad_seed[i] = ((uint64_t)random() << 32) ^ random();
+	_ad_publish();
+}
+
+	void
+admit_reset_conf(void)
+{
+	memcpy(admit_conf, ad_default, sizeof(admit_conf));
+}
+
+	void
+admit_reconfigure(void)
+{
+	_ad_publish();
+}
+
+	int
+admit(uint8_t lisp_type, union sockunion *src)
+{
+	struct admit_set *as, *ap;
+	uint32_t now;
+	int c;
+
+	if ((c = dispatch_class(lisp_type)) < 0)
+		return 1;
+	as = __atomic_load_n(&ad_src[c], __ATOMIC_ACQUIRE);
+	ap = __atomic_load_n(&ad_pfx[c], __ATOMIC_ACQUIRE);
+	if (!as && !ap)
+		return 1;
+	if (src->sa.sa_family != AF_INET && src->sa.sa_family != AF_INET6)
+		return 1;
+	now = (uint32_t)timer_now_ms();
+	if (as && !_ad_charge(as, _ad_key(src, 0), now)) {
+		stats_inc(ad_shed[c]);
+		return 0;
+	}
+	if (ap && !_ad_charge(ap, _ad_key(src, 1), now)) {
+		stats_inc(ad_shed[c]);
+		stats_inc(STAT_RATE_PREFIX);
+		return 0;
+	}
+	return 1;
+}
@@ -0,0 +1,31 @@
+#ifndef _ADMIT_H
+	#define _ADMIT_H
+
+#include <stdint.h>
+
+#include "dispatch.h"
+
+union sockunion;
+
+/* Token buckets of a message class, rates in messages per second.
+   rate 0 disables the limit */
+struct admit_conf {
+	uint32_t src_rate;	/* per source address */
+	uint32_t src_burst;
+	uint32_t pfx_rate;	/* per /24 or /48 of sources */
+	uint32_t pfx_burst;
+};
+
+extern struct admit_conf admit_conf[DC_MAX];
+
+int admit_parse_conf(enum dispatch_class c, char data[][255], int n);
+void admit_init(void);
+/* Back to the built-in limits, before the configuration is parsed again */
+void admit_reset_conf(void);
+/* Apply admit_conf after a reload */
+void admit_reconfigure(void);
+/* Charge a received message to its source, before anything is allocated
+   for it. Return 1 if it can be processed, 0 if it is shed */
+int admit(uint8_t lisp_type, union sockunion *src);
+
+#endif
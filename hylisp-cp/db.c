@@ -12,6 +12,7 @@ struct db_node *_petr;
 struct in_addr *src_addr[MIF];
 struct in6_addr *src_addr6[MIF];
 struct db_table *table;
+uint32_t db_gen;
 
 	void 
 ms_free_node(void *node)
@@ -21,8 +22,13 @@ ms_free_node(void *node)
 	if (node) {
 			
 		nd = (struct db_node *)node;
-		if (nd->flags)
+		if (nd->flags) {
+			if (((struct mapping_flags *)nd->flags)->age) {
+				timer_del_sync(((struct mapping_flags *)nd->flags)->age);
+				free(((struct mapping_flags *)nd->flags)->age);
+			}
 			free(nd->flags);
+		}
 		if (nd->info)
 			free(nd->info);
 		free(node);
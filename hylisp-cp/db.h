@@ -37,6 +37,7 @@ struct site_info {
 		u_char active;
 		char *hashing;
 		struct list_t  *eid;		 		
+		int nhash;		/* next slot of hashing */
 };
 
 struct mapping_flags {
@@ -51,6 +52,8 @@ struct mapping_flags {
 	uint8_t range;	/*range of EID: an mapping, a global EID-range */
 	uint8_t active:1;
 	void *rsvd;
+	struct timer_ev *age;	/* expiry of a cached referral (MR) or
+				   of a registered EID-prefix (MS) */
 };
 
 struct hop_entry {
@@ -100,6 +103,7 @@ struct pk_req_entry {
 	uint16_t buf_len; /*package len */
 	uint8_t ttl; /* how long exist in queue, ttl = n (n second) */
 	uint8_t hop; /* number of recue - use for map-request */
+	struct timespec rx_ts; /* time of reception, CLOCK_MONOTONIC */
 };
 
 struct pk_rpl_entry {
@@ -109,16 +113,38 @@ struct pk_rpl_entry {
 	void *request_id;
 };
 
+/* one pre-encoded Map-Register */
+struct reg_seg {
+	void *buf;
+	uint16_t len;
+};
+
 struct ms_entry {
 	union sockunion addr;
 	uint8_t id;
 	char *key;
 	int proxy;
 	struct list_t *eids; /* list of mapping register to this MS */
+	struct timer_ev refresh;	/* next Map-Register */
+	int reg_count;
+	struct reg_seg *reg_seg;	/* pre-encoded Map-Registers */
+	int reg_nseg;
+	int reg_cur;		/* next segment of current train */
+	uint32_t reg_gen;	/* db_gen of reg_seg */
+	HMAC_SHA1_CTX reg_key;	/* key state, message not started */
 };
 
 struct mr_entry {
 	union sockunion addr;
+	/* health, see resolver.c */
+	uint32_t srtt;		/* usec, 0 until first reply */
+	uint32_t rttvar;	/* usec */
+	int fails;		/* timeouts in a row */
+	uint64_t open_until;	/* msec, not selected before */
+	uint64_t sent;
+	uint64_t replies;
+	uint64_t timeouts;
+	struct hist *lat;	/* resolution latency by outcome */
 };
 
 struct petr_entry {
@@ -134,6 +160,8 @@ extern struct list_t *xtr_petr;
 extern struct db_node *_petr;/* db node has empty EID-prefix and list of PETR as RLOC */
 extern struct in_addr *src_addr[];
 extern struct in6_addr *src_addr6[];
+/* bumped on every change of mapping database */
+extern uint32_t db_gen;
 
 /*make new node with pre-set type */
 struct mapping_flags *ms_new_node_ex(u_char n_type);
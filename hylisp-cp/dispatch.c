@@ -0,0 +1,259 @@
+#include <string.h>
+
+#include "lib.h"
+#include "udp.h"
+
+/* Classified dispatch of received control messages.
+   Every class has a bounded FIFO and a maximum number of busy workers, so
+   a burst of Map-Registers can not hold all workers nor all queue slots.
+   Idle workers pick the next class by smooth weighted round robin among
+   classes having work and a free budget. The receiver never blocks: a
+   full queue applies the class policy, and when the total reaches
+   queue_size the register class is shed first. */
+
+#define DC_DEF_QUEUE	1000
+
+struct dispatch_queue {
+	void **ring;
+	unsigned int size;
+	unsigned int head;
+	unsigned int count;
+	int active;	/* workers busy on this class */
+	int current;	/* smooth weighted round robin state */
+};
+
+struct dispatch_conf dispatch_conf[DC_MAX] = {
+	[DC_REQUEST]	= { 0, 4, 0, DP_DROP_OLDEST },
+	[DC_REGISTER]	= { 0, 1, 0, DP_DROP_OLDEST },
+	[DC_REPLY]	= { 0, 2, 0, DP_DROP_OLDEST },
+};
+
+const char *dispatch_class_name[DC_MAX] = {
+	"request",
+	"register",
+	"reply",
+};
+
+/* share of queue_size of each class (percent) when size is not set */
+static const int dc_share[DC_MAX] = { 50, 30, 20 };
+
+static const enum stats_counter dc_shed[DC_MAX] = {
+	STAT_SHED_REQUEST,
+	STAT_SHED_REGISTER,
+	STAT_SHED_REPLY,
+};
+
+static struct dispatch_queue dq[DC_MAX];
+static unsigned int dq_total;
+static unsigned int dq_limit;
+static pthread_mutex_t dq_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dq_cv = PTHREAD_COND_INITIALIZER;
+
+static void *(*dq_run)(void *);
+static uint32_t (*dq_drop)(void *);
+
+/* class_name = size weight workers policy
+   each value can be 'default' */
+	int
+dispatch_parse_conf(enum dispatch_class c, char data[][255], int n)
+{
+	struct dispatch_conf *dc = &dispatch_conf[c];
+
+	if (n > 2 && strcasecmp(data[2], "default") != 0)
+		dc->size = atoi(data[2]);
+	if (n > 3 && strcasecmp(data[3], "default") != 0)
+		dc->weight = atoi(data[3]);
+	if (n > 4 && strcasecmp(data[4], "default") != 0)
+		dc->workers = atoi(data[4]);
+	if (n > 5 && strcasecmp(data[5], "default") != 0) {
+		if (strcasecmp(data[5], "drop-oldest") == 0)
+			dc->policy = DP_DROP_OLDEST;
+		else if (strcasecmp(data[5], "drop-new") == 0)
+			dc->policy = DP_DROP_NEW;
+		else
+			return -1;
+	}
+	if (dc->size < 0 || dc->weight <= 0 || dc->workers < 0)
+		return -1;
+	return 0;
+}
+
+	int
+dispatch_class(uint8_t lisp_type)
+{
+	switch (lisp_type) {
+	case LISP_TYPE_MAP_REQUEST:
+	case LISP_TYPE_ENCAPSULATED_CONTROL_MESSAGE:
+		return DC_REQUEST;
+	case LISP_TYPE_MAP_REGISTER:
+	case LISP_TYPE_MAP_NOTIFY:
+		return DC_REGISTER;
+	case LISP_TYPE_MAP_REPLY:
+	case LISP_TYPE_MAP_REFERRAL:
+		return DC_REPLY;
+	default:
+		return -1;
+	}
+}
+
+/* Requires dq_mutex */
+	static void *
+_dispatch_pop(int c)
+{
+	struct dispatch_queue *q = &dq[c];
+	void *pke;
+
+	pke = q->ring[q->head];
+	q->head = (q->head + 1) % q->size;
+	q->count--;
+	dq_total--;
+	return pke;
+}
+
+/* Requires dq_mutex */
+	static void
+_dispatch_push(int c, void *pke)
+{
+	struct dispatch_queue *q = &dq[c];
+
+	q->ring[(q->head + q->count) % q->size] = pke;
+	q->count++;
+	dq_total++;
+}
+
+/* Requires dq_mutex. Return next class to serve, -1 if none */
+	static int
+_dispatch_pick()
+{
+	int c, best, total;
+
+	best = -1;
+	total = 0;
+	for (c = 0; c < DC_MAX; c++) {
+		if (!dq[c].count || dq[c].active >= dispatch_conf[c].workers)
+			continue;
+		dq[c].current += dispatch_conf[c].weight;
+		total += dispatch_conf[c].weight;
+		if (best < 0 || dq[c].current > dq[best].current)
+			best = c;
+	}
+	if (best >= 0)
+		dq[best].current -= total;
+	return best;
+}
+
+	static void *
+_dispatch_worker(void *data)
+{
+	int c;
+	void *pke;
+
+	for (;;) {
+		pthread_mutex_lock(&dq_mutex);
+		while ((c = _dispatch_pick()) < 0)
+			pthread_cond_wait(&dq_cv, &dq_mutex);
+		pke = _dispatch_pop(c);
+		dq[c].active++;
+		pthread_mutex_unlock(&dq_mutex);
+
+		dq_run(pke);
+
+		pthread_mutex_lock(&dq_mutex);
+		dq[c].active--;
+		/* a worker may wait for this class budget */
+		if (dq[c].count)
+			pthread_cond_signal(&dq_cv);
+		pthread_mutex_unlock(&dq_mutex);
+	}
+	return NULL;
+}
+
+	int
+dispatch_start(void *(*run)(void *), uint32_t (*drop)(void *))
+{
+	int c, i, nworkers;
+	pthread_t th;
+	pthread_attr_t attr;
+
+	dq_run = run;
+	dq_drop = drop;
+	dq_limit = (PK_POOL_MAX > 0) ? PK_POOL_MAX : DC_DEF_QUEUE;
+	nworkers = (max_thread > 0) ? max_thread : 2;
+
+	for (c = 0; c < DC_MAX; c++) {
+		if (!dispatch_conf[c].size)
+			dispatch_conf[c].size = max(1, dq_limit * dc_share[c] / 100);
+		if (!dispatch_conf[c].workers || dispatch_conf[c].workers > nworkers)
+			dispatch_conf[c].workers = nworkers;
+		dq[c].size = dispatch_conf[c].size;
+		if ((dq[c].ring = calloc(dq[c].size, sizeof(void *))) == NULL)
+			return -1;
+		cp_log(LLOG, "Dispatch class %s: queue %d, weight %d, workers %d, %s\n",
+				dispatch_class_name[c], dispatch_conf[c].size,
+				dispatch_conf[c].weight, dispatch_conf[c].workers,
+				dispatch_conf[c].policy == DP_DROP_OLDEST ? "drop-oldest" : "drop-new");
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for (i = 0; i < nworkers; i++) {
+		if (pthread_create(&th, &attr, _dispatch_worker, NULL) != 0) {
+			pthread_attr_destroy(&attr);
+			return -1;
+		}
+	}
+	pthread_attr_destroy(&attr);
+	return 0;
+}
+
+/* Queue a received message, never blocks.
+   Return 1 if queued, 0 if it was shed */
+	int
+dispatch_queue(uint8_t lisp_type, void *pke)
+{
+	int c, i;
+	void *victim[2] = { NULL, NULL };
+
+	if ((c = dispatch_class(lisp_type)) < 0) {
+		dq_drop(pke);
+		return 0;
+	}
+
+	pthread_mutex_lock(&dq_mutex);
+	if (dq_total >= dq_limit && c != DC_REGISTER && dq[DC_REGISTER].count) {
+		/* global overload: Map-Registers are refreshed periodically,
+		   shed them before anything else */
+		victim[0] = _dispatch_pop(DC_REGISTER);
+		stats_inc(dc_shed[DC_REGISTER]);
+	}
+	if (dq[c].count >= dq[c].size || dq_total >= dq_limit) {
+		stats_inc(dc_shed[c]);
+		if (dispatch_conf[c].policy == DP_DROP_OLDEST && dq[c].count) {
+			victim[1] = _dispatch_pop(c);
+		}else{
+			victim[1] = pke;
+			pke = NULL;
+		}
+	}
+	if (pke) {
+		_dispatch_push(c, pke);
+		pthread_cond_signal(&dq_cv);
+	}
+	pthread_mutex_unlock(&dq_mutex);
+
+	for (i = 0; i < 2; i++)
+		if (victim[i])
+			dq_drop(victim[i]);
+	return (pke != NULL);
+}
+
+	unsigned int
+dispatch_depth(enum dispatch_class c)
+{
+	unsigned int n;
+
+	pthread_mutex_lock(&dq_mutex);
+	n = dq[c].count;
+	pthread_mutex_unlock(&dq_mutex);
+	return n;
+}
@@ -0,0 +1,35 @@
+#ifndef _DISPATCH_H
+	#define _DISPATCH_H
+
+#include <stdint.h>
+
+/* Message classes, each one has its own queue and worker budget */
+enum dispatch_class {
+	DC_REQUEST,	/* Map-Request, ECM */
+	DC_REGISTER,	/* Map-Register, Map-Notify */
+	DC_REPLY,	/* Map-Reply, Map-Referral */
+	DC_MAX
+};
+
+/* overload policy of a full class queue */
+#define DP_DROP_NEW	0	/* discard the arriving message */
+#define DP_DROP_OLDEST	1	/* discard the head of the queue */
+
+struct dispatch_conf {
+	int size;	/* queue length, 0: share of queue_size */
+	int weight;	/* share of workers when classes compete */
+	int workers;	/* max workers busy on this class, 0: max_thread */
+	int policy;	/* DP_DROP_NEW or DP_DROP_OLDEST */
+};
+
+extern struct dispatch_conf dispatch_conf[DC_MAX];
+extern const char *dispatch_class_name[DC_MAX];
+
+int dispatch_parse_conf(enum dispatch_class c, char data[][255], int n);
+/* Class of a LISP message type, -1 if not a control message */
+int dispatch_class(uint8_t lisp_type);
+int dispatch_start(void *(*run)(void *), uint32_t (*drop)(void *));
+int dispatch_queue(uint8_t lisp_type, void *pke);
+unsigned int dispatch_depth(enum dispatch_class c);
+
+#endif
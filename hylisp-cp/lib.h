@@ -30,13 +30,22 @@
 #include	<net/route.h>
 #include	<ifaddrs.h>
 
+/* shared with the hypervisor, taken from the source tree so that it
+   does not need to be installed first */
+#include "../hylisp-hv/hdr/hylispcksum.h"
 #include "radix/db.h"
 #include "radix/db_table.h"
 #include "radix/db_prefix.h"
 #include "list/list.h"
 #include "hmac/hmac_sha.h"
+#include "timer.h"
 #include "db.h"
 #include "thr_pool/thr_pool.h"
+#include "log.h"
+#include "stats.h"
+#include "dispatch.h"
+#include "admit.h"
+#include "resolver.h"
 
 #define	TRUE	1
 #define	FALSE	0
@@ -59,6 +68,34 @@
 #define MR_MAX_LOOKUP	10
 #define MAX_LOOKUPS     100 
 #define MAP_REPLY_TIMEOUT	2
+#define MAP_REGISTER_INTERVAL	60	/* seconds between two Map-Registers */
+#define MAP_REGISTER_JITTER	10	/* percent of interval */
+#define MAP_REGISTER_RATE	50	/* max Map-Registers sent per second */
+#define MAP_REGISTER_MSS	1200	/* max size of one Map-Register, no IP fragment */
+#define MAP_REGISTER_TTL	180	/* MS drops registration not refreshed */
+#define MS_REG_HASHES		16	/* Map-Registers of a site known unchanged */
+#define MAP_CACHE_MAX_TTL	1440	/* minutes, cap of record TTL in map-cache */
+#define MAP_CACHE_LEAD		10	/* min seconds a hot entry is refreshed before expiry */
+#define MAP_CACHE_HOT_WINDOW	60	/* seconds: a miss after expiry marks an entry hot */
+#define MAP_CACHE_FILE		"/var/db/hylispcp.mapcache"	/* kept across restarts */
+#define MAP_CACHE_SAVE		60	/* seconds between two saves of map-cache */
+#define MAP_CACHE_NEG_MAX	65536	/* max entries of negative cache */
+#define MAP_CACHE_NEG_BACKOFF	4	/* seconds, misses ignored after first timeout */
+#define MAP_CACHE_NEG_BACKOFF_MAX	300	/* seconds, cap of timeout backoff */
+#define MAP_CACHE_NEG_SWEEP	10	/* seconds between purges of negative cache */
+#define MISS_BURST		64	/* mapping socket messages read per wakeup */
+#define MISS_QUEUE		1024	/* misses waiting for a lookup */
+#define MISS_MAX_AGE		1000	/* msec, older misses are dropped */
+#define MISS_START_MAX		16	/* lookups started per wakeup */
+#define MISS_PREFIX_RATE	10	/* lookups per second per destination prefix */
+#define MISS_PREFIX_LEN4	24	/* destination prefix of rate limit */
+#define MISS_PREFIX_LEN6	48
+#define MISS_TRACE_RING		64	/* sampled resolutions kept for dump */
+#define MR_RTT_INIT		100	/* msec, assumed RTT of a resolver not measured yet */
+#define MR_RTO_MIN		200	/* msec, min retransmission timeout */
+#define MR_FAIL_MAX		3	/* timeouts in a row before a resolver is cut off */
+#define MR_OPEN_TIME		5	/* seconds a resolver is cut off, doubled at each new failure */
+#define MR_OPEN_TIME_MAX	300
 #define	MIN_EPHEMERAL_PORT	32768
 #define	MAX_EPHEMERAL_PORT	65535
 #define OUTPUT_ERROR	stderr
@@ -76,10 +113,6 @@
 #define MTTL 10	//max recuse map-referral
 #define MIF 10 //max inteface support
 
-#define LNONE	0
-#define LLOG	1
-#define LDEBUG	2
-
 #define	LOOPBACK		"127.0.0.1"
 #define	LOOPBACK6		"::1"
 #define	LINK_LOCAL		"fe80"
@@ -93,6 +126,7 @@ extern struct db_table *table;
 extern u_char _fncs;
 extern u_char lisp_te;
 extern u_char srcport_rand;
+extern int miss_trace;
 extern char *config_file[];
 int PK_POOL_MAX;
 int min_thread;
@@ -219,6 +253,7 @@ int pending_request(void *data, struct communication_fct *fct, struct db_node *r
 int udp_init_socket();
 int udp_preparse_pk(void *data);
 extern void *plugin_openlisp(void *data);
+extern void miss_trace_dump(FILE *fp);
 
 char *sk_get_ip(union sockunion *sk, char *ip);
 int sk_get_port(union sockunion *sk);
@@ -229,7 +264,5 @@ int _parser_config(const char *filename);
 int timespec_subtract(struct timespec *res, struct timespec *x, struct timespec *y);
 int entrycmp(void *esrc, void *edst);
 int _insert_ip_ordered(void *data, void *entry);
-ushort ip_checksum (unsigned short *buf, int nwords);
 int is_my_addr(union sockunion *sk);
-void cp_log(int level, char *format, ...);
 #endif
@@ -0,0 +1,314 @@
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+
+#include "lib.h"
+
+#define LOG_RING_SIZE	2048	/* records per thread, power of 2 */
+#define LOG_REC_SIZE	256	/* longest message kept, longer ones are cut */
+#define LOG_IDLE_USEC	50000	/* writer sleep when all rings are empty */
+#define LOG_CACHELINE	64
+
+/* One record: binary header filled by the caller plus the message text.
+   Arguments often point to the caller's stack (ip buffers, prefix2str())
+   so they are rendered before returning, only the I/O is deferred */
+struct log_rec {
+	struct timespec ts;	/* CLOCK_MONOTONIC, used to merge rings */
+	uint16_t len;
+	uint8_t level;
+	char msg[LOG_REC_SIZE];
+};
+
+/* Single producer (owner thread), single consumer (writer thread) */
+struct log_ring {
+	struct log_ring *next;
+	int dead;		/* owner thread has exited */
+	uint64_t reported;	/* drops already reported by the writer */
+	char pad0[LOG_CACHELINE];
+	uint64_t head;		/* written by owner only */
+	uint64_t dropped;	/* written by owner only */
+	char pad1[LOG_CACHELINE];
+	uint64_t tail;		/* written by writer only */
+	char pad2[LOG_CACHELINE];
+	struct log_rec recs[LOG_RING_SIZE];
+};
+
+static FILE *flog = NULL;
+static const char *log_path = NULL;
+static volatile sig_atomic_t log_reopen = 0;
+
+/* protects log_rings list and the output stream */
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct log_ring *log_rings = NULL;
+static uint64_t log_reaped_drops = 0;
+
+static pthread_key_t log_key;
+static pthread_once_t log_key_once = PTHREAD_ONCE_INIT;
+static pthread_t log_th;
+static int log_running = 0;
+static int log_stop = 0;
+
+	static void
+_log_ring_release(void *data)
+{
+	struct log_ring *r = data;
+
+	/* writer frees the ring once it is drained */
+	__atomic_store_n(&r->dead, 1, __ATOMIC_RELEASE);
+}
+
+	static void
+_log_key_init()
+{
+	pthread_key_create(&log_key, _log_ring_release);
+}
+
+/* ring of calling thread, created on first use */
+	static struct log_ring *
+_log_ring_self()
+{
+	struct log_ring *r;
+
+	pthread_once(&log_key_once, _log_key_init);
+	if ((r = pthread_getspecific(log_key)) != NULL)
+		return r;
+
+	if ((r = calloc(1, sizeof(struct log_ring))) == NULL)
+		return NULL;
+	pthread_setspecific(log_key, r);
+
+	pthread_mutex_lock(&log_mutex);
+	r->next = log_rings;
+	log_rings = r;
+	pthread_mutex_unlock(&log_mutex);
+	return r;
+}
+
+	static FILE *
+_log_stream()
+{
+	return (flog != NULL) ? flog : OUTPUT_STREAM;
+}
+
+/* Requires log_mutex */
+	static void
+_log_do_reopen()
+{
+	FILE *fd;
+
+	log_reopen = 0;
+	if (log_path == NULL || flog == NULL)
+		return;
+	fd = freopen(log_path, "a", flog);
+	flog = fd;
+}
+
+	static int
+_log_ts_before(struct timespec *a, struct timespec *b)
+{
+	if (a->tv_sec != b->tv_sec)
+		return a->tv_sec < b->tv_sec;
+	return a->tv_nsec < b->tv_nsec;
+}
+
+/* Write pending records of all rings in time order. Return number of
+   records written */
+	static int
+_log_drain()
+{
+	struct log_ring *r, *best, **pr;
+	struct log_rec *rec, *brec;
+	uint64_t dropped;
+	FILE *out;
+	int n;
+
+	n = 0;
+	pthread_mutex_lock(&log_mutex);
+	if (log_reopen)
+		_log_do_reopen();
+	out = _log_stream();
+
+	/* bounded so that a reopen request is not delayed forever */
+	while (n < LOG_RING_SIZE) {
+		best = NULL;
+		brec = NULL;
+		for (r = log_rings; r != NULL; r = r->next) {
+			if (r->tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE))
+				continue;
+			rec = &r->recs[r->tail & (LOG_RING_SIZE - 1)];
+			if (best == NULL || _log_ts_before(&rec->ts, &brec->ts)) {
+				best = r;
+				brec = rec;
+			}
+		}
+		if (best == NULL)
+			break;
+
+		fwrite(brec->msg, 1, brec->len, out);
+		__atomic_store_n(&best->tail, best->tail + 1, __ATOMIC_RELEASE);
+		n++;
+	}
+
+	/* report overflows and free rings of exited threads */
+	pr = &log_rings;
+	while ((r = *pr) != NULL) {
+		dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+		if (dropped != r->reported) {
+			fprintf(out, "[log: %llu messages dropped]\n",
+						(unsigned long long)(dropped - r->reported));
+			r->reported = dropped;
+			n++;
+		}
+		if (__atomic_load_n(&r->dead, __ATOMIC_ACQUIRE) &&
+				r->tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) {
+			*pr = r->next;
+			log_reaped_drops += dropped;
+			free(r);
+			continue;
+		}
+		pr = &r->next;
+	}
+
+	if (n > 0)
+		fflush(out);
+	pthread_mutex_unlock(&log_mutex);
+	return n;
+}
+
+	static void *
+_log_writer(void *data)
+{
+	while (!__atomic_load_n(&log_stop, __ATOMIC_ACQUIRE)) {
+		if (_log_drain() == 0 && !log_reopen)
+			usleep(LOG_IDLE_USEC);
+	}
+	return NULL;
+}
+
+/* Synchronous path: used while writer thread is not running
+   (configuration parsing, shutdown) */
+	static void
+_log_sync(const char *format, va_list args)
+{
+	FILE *out;
+
+	pthread_mutex_lock(&log_mutex);
+	if (log_reopen)
+		_log_do_reopen();
+	out = _log_stream();
+	vfprintf(out, format, args);
+	fflush(out);
+	pthread_mutex_unlock(&log_mutex);
+}
+
+/* Called through cp_log() only, level is already checked */
+	void
+_cp_log(int level, const char *format, ...)
+{
+	va_list args;
+	struct log_ring *r;
+	struct log_rec *rec;
+	uint64_t head;
+	int n;
+
+	va_start(args, format);
+	if (!__atomic_load_n(&log_running, __ATOMIC_ACQUIRE) ||
+			(r = _log_ring_self()) == NULL) {
+		_log_sync(format, args);
+		va_end(args);
+		return;
+	}
+
+	head = r->head;
+	if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= LOG_RING_SIZE) {
+		/* ring full: never block the caller */
+		__atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+		va_end(args);
+		return;
+	}
+
+	rec = &r->recs[head & (LOG_RING_SIZE - 1)];
+	clock_gettime(CLOCK_MONOTONIC, &rec->ts);
+	n = vsnprintf(rec->msg, LOG_REC_SIZE, format, args);
+	va_end(args);
+	if (n < 0)
+		n = 0;
+	rec->len = (n < LOG_REC_SIZE) ? n : LOG_REC_SIZE - 1;
+	rec->level = level;
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* SIGUSR1 handler: file is reopened by writer (or next synchronous log) */
+	void
+reopenlog(int sig)
+{
+	log_reopen = 1;
+}
+
+	int
+cp_log_open(const char *path)
+{
+	pthread_mutex_lock(&log_mutex);
+	if (path != NULL) {
+		if ((flog = fopen(path, "a")) == NULL) {
+			pthread_mutex_unlock(&log_mutex);
+			return -1;
+		}
+		log_path = path;
+		signal(SIGUSR1, reopenlog);
+	}else{
+		flog = NULL;
+		log_path = NULL;
+	}
+	pthread_mutex_unlock(&log_mutex);
+	return 0;
+}
+
+	int
+cp_log_start()
+{
+	if (__atomic_load_n(&log_running, __ATOMIC_ACQUIRE))
+		return 0;
+
+	log_stop = 0;
+	if (pthread_create(&log_th, NULL, _log_writer, NULL) != 0) {
+		/* keep logging synchronously */
+		return -1;
+	}
+	__atomic_store_n(&log_running, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* Flush all pending messages and close log file */
+	void
+cp_log_stop()
+{
+	if (__atomic_load_n(&log_running, __ATOMIC_ACQUIRE)) {
+		__atomic_store_n(&log_running, 0, __ATOMIC_RELEASE);
+		__atomic_store_n(&log_stop, 1, __ATOMIC_RELEASE);
+		pthread_join(log_th, NULL);
+		while (_log_drain() > 0)
+			;
+	}
+
+	pthread_mutex_lock(&log_mutex);
+	if (flog != NULL)
+		fclose(flog);
+	flog = NULL;
+	pthread_mutex_unlock(&log_mutex);
+}
+
+/* Total of messages lost because a ring was full */
+	uint64_t
+cp_log_dropped()
+{
+	struct log_ring *r;
+	uint64_t total;
+
+	pthread_mutex_lock(&log_mutex);
+	total = log_reaped_drops;
+	for (r = log_rings; r != NULL; r = r->next)
+		total += __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&log_mutex);
+	return total;
+}
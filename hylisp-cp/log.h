@@ -0,0 +1,31 @@
+#ifndef _LOG_H
+	#define _LOG_H
+
+#include <stdint.h>
+
+#define LNONE	0
+#define LLOG	1
+#define LDEBUG	2
+
+#define LOG_FILE	"/var/log/opencp.log"
+
+extern int _debug;
+
+/* Level is tested at the call site so that arguments (sk_get_ip(),
+   prefix2str()...) are not evaluated when the message is filtered out */
+#define cp_log(level, ...)				\
+	do {						\
+		if (_debug >= (level))			\
+			_cp_log((level), __VA_ARGS__);	\
+	} while (0)
+
+void _cp_log(int level, const char *format, ...);
+
+/* path NULL means log to OUTPUT_STREAM */
+int cp_log_open(const char *path);
+int cp_log_start();
+void cp_log_stop();
+void reopenlog(int sig);
+uint64_t cp_log_dropped();
+
+#endif
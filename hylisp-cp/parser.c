@@ -23,6 +23,7 @@ static void *_mapping;
 u_char _fncs;
 u_char lisp_te=0;
 u_char srcport_rand = 1;
+int miss_trace = 0;
 char *config_file[6];
 	
 /* compare priority bw 2 entry */
@@ -1570,6 +1571,13 @@ _parser_config(const char *filename)
 				srcport_rand = 0;
 		}
 		
+		if (0 == strcasecmp(data[0], "miss_trace")) {
+			if (strcasecmp(data[2], "default") != 0)
+				miss_trace = atoi(data[2]);
+			else
+				miss_trace = 0;
+		}
+		
 		if (0 == strcasecmp(data[0], "lisp_te")) {
 			if (strncasecmp(data[2], "yes",3) ==0) {
 				lisp_te = 1;
@@ -1584,6 +1592,42 @@ _parser_config(const char *filename)
 			}					
 		}
 		
+		if ((0 == strcasecmp(data[0], "request_class")) ||
+				(0 == strcasecmp(data[0], "register_class")) ||
+				(0 == strcasecmp(data[0], "reply_class"))) {
+			enum dispatch_class dc;
+			
+			if (0 == strcasecmp(data[0], "request_class"))
+				dc = DC_REQUEST;
+			else if (0 == strcasecmp(data[0], "register_class"))
+				dc = DC_REGISTER;
+			else
+				dc = DC_REPLY;
+			if (dispatch_parse_conf(dc, data, i) < 0) {
+				printf("Error configure file: %s must be: size weight workers drop-oldest|drop-new, at line: %d\n", data[0], ln);
+				cp_log(LLOG, "Error configure file: %s must be: size weight workers drop-oldest|drop-new, at line: %d\n", data[0], ln);
+				exit(1);
+			}
+		}
+		
+		if ((0 == strcasecmp(data[0], "request_rate")) ||
+				(0 == strcasecmp(data[0], "register_rate")) ||
+				(0 == strcasecmp(data[0], "reply_rate"))) {
+			enum dispatch_class dc;
+			
+			if (0 == strcasecmp(data[0], "request_rate"))
+				dc = DC_REQUEST;
+			else if (0 == strcasecmp(data[0], "register_rate"))
+				dc = DC_REGISTER;
+			else
+				dc = DC_REPLY;
+			if (admit_parse_conf(dc, data, i) < 0) {
+				printf("Error configure file: %s must be: src_rate src_burst prefix_rate prefix_burst, at line: %d\n", data[0], ln);
+				cp_log(LLOG, "Error configure file: %s must be: src_rate src_burst prefix_rate prefix_burst, at line: %d\n", data[0], ln);
+				exit(1);
+			}
+		}
+		
 		if ((0 == strcasecmp(data[0], "min_thread"))) {
 			if (strcasecmp(data[2], "default") !=0) {
 				min_thread = atoi(data[2]);
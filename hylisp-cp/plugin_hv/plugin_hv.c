@@ -37,7 +37,11 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <netinet/in.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <hylisphv.h>
+#include <hylispring.h>
 
 #include "../lib.h"
 
@@ -46,6 +50,19 @@ uint16_t virtual_udp_port = 0;
 int virtual_map_socket = -1;
 int ipv4_hv_socket = -1;
 int ipv6_hv_socket = -1;
+static int nonce_hv_socket = -1;
+
+/* Shared-memory rings, if asked for (-r) and granted */
+int _rings = 0;
+int hv_west_doorbell = -1;
+static hv_shared_rings* hv_rings = NULL;
+static int hv_east_doorbell = -1;
+static int hv_east_stalled = 0;		/* last message dropped, do not wait again */
+
+#define HV_EAST_WAIT	1000	/* 1 ms attempts on a full east ring before dropping */
+
+static void announce_nonce(const uint8_t*, size_t);
+static void map_rings(int, int, int);
 
 void register_virtual_plane() {
 	int r;
@@ -82,7 +99,7 @@ void register_virtual_plane() {
 
 	hv_registration_message reg_msg;
 
-	reg_msg.action = ACTION_REGISTER;
+	reg_msg.action = _rings ? ACTION_REGISTER_RINGS : ACTION_REGISTER;
 	memcpy(&(reg_msg.socket), &local_addr, sizeof(struct sockaddr_un));
 	reg_msg.port = virtual_udp_port;
 	reg_msg.pid = getpid();
@@ -109,14 +126,16 @@ void register_virtual_plane() {
 		exit(0);
 	}
 
-	close(reg_s);
+	/* Kept open to announce nonces */
+	nonce_hv_socket = reg_s;
 
 	/* Waiting for ACK to get remote endpoint and socket descriptors */
 	char buf[5];
+	memset(buf, 0, sizeof(buf));
 
 	struct iovec iov[1];
 	iov[0].iov_base = buf;
-	iov[0].iov_len = 5;
+	iov[0].iov_len = 4;
 
 	struct msghdr msg;
 	struct cmsghdr *cmptr;
@@ -126,14 +145,15 @@ void register_virtual_plane() {
 	msg.msg_name = NULL;
 	msg.msg_namelen = 0;
 
-	cmptr = malloc(CMSG_SPACE(2 * sizeof(int)));
+	/* IPv4 and IPv6 sockets, then shared memory and doorbells if granted */
+	cmptr = malloc(CMSG_SPACE(5 * sizeof(int)));
 	if (cmptr == NULL) {
 		perror("malloc");
 		exit(0);
 	}
 
 	msg.msg_control = (caddr_t) cmptr;
-	msg.msg_controllen = CMSG_SPACE(2 * sizeof(int));
+	msg.msg_controllen = CMSG_SPACE(5 * sizeof(int));
 
 	r = recvmsg(virtual_map_socket, &msg, 0);
 	if (r < 0) {
@@ -142,8 +162,16 @@ void register_virtual_plane() {
 	}
 
 	int* cmsg_data = (int*) CMSG_DATA(cmptr);
+	int number_of_fds = (cmptr->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+	if (strcmp(buf, "ACKR") == 0 && number_of_fds >= 4) {
+		number_of_fds -= 3;
+		map_rings(cmsg_data[number_of_fds], cmsg_data[number_of_fds + 1], cmsg_data[number_of_fds + 2]);
+	} else if (_rings) {
+		cp_log(LLOG, "Hypervisor has no shared-memory rings, using sockets\n");
+	}
+
 	ipv4_hv_socket = cmsg_data[0];
-	if (cmptr->cmsg_len == CMSG_LEN(2 * sizeof(int))) {
+	if (number_of_fds == 2) {
 		ipv6_hv_socket = cmsg_data[1];
 	}
 
@@ -156,6 +184,8 @@ void register_virtual_plane() {
 
 ssize_t sendtov(int real_socket, const void* message, size_t length, int flags, const struct sockaddr* dest_addr, socklen_t dest_len) {
 	if (_virtual && (real_socket == skfd || real_socket == skfd6)) {
+		announce_nonce(message, length);
+
 		if (real_socket == skfd) {
 			return sendto(ipv4_hv_socket, message, length, flags, dest_addr, dest_len);
 		} else {
@@ -166,3 +196,183 @@ ssize_t sendtov(int real_socket, const void* message, size_t length, int flags,
 	}
 }
 
+
+/*
+ * Tells the hypervisor the nonce of a Map-Request, Map-Register or
+ * Encapsulated Control Message before it is sent, so that the Map-Reply or
+ * Map-Notify answering it is delivered to this control plane only.
+ */
+static void announce_nonce(const uint8_t* message, size_t length) {
+	const uint8_t* lisp = message;
+	size_t lisp_len = length;
+
+	if (nonce_hv_socket < 0 || length < 12) {
+		return;
+	}
+
+	if ((*message >> 4) == 8) {
+		/* Encapsulated Control Message: LISP header, inner IP and UDP headers */
+		size_t inner;
+		if ((message[4] >> 4) == 4) {
+			inner = 4 + (message[4] & 0x0F) * 4 + 8;
+		} else {
+			inner = 4 + 40 + 8;
+		}
+		if (inner + 12 > length) {
+			return;
+		}
+		lisp = message + inner;
+		lisp_len = length - inner;
+	}
+
+	hv_nonce_message nonce_msg;
+	memset(&nonce_msg, 0, sizeof(nonce_msg));
+
+	nonce_msg.type = *lisp >> 4;
+	if (lisp_len < 12 || (nonce_msg.type != 1 && nonce_msg.type != 3)) {
+		return;
+	}
+
+	memcpy(&(nonce_msg.nonce), lisp + 4, 8);
+	if (nonce_msg.nonce == 0) {
+		return;
+	}
+	nonce_msg.action = ACTION_NONCE;
+	nonce_msg.port = virtual_udp_port;
+
+	/* Best effort: without it, the answer is sent to all control planes */
+	send(nonce_hv_socket, &nonce_msg, sizeof(nonce_msg), MSG_DONTWAIT);
+}
+
+static void map_rings(int region, int west_doorbell, int east_doorbell) {
+	hv_shared_rings* rings;
+	rings = mmap(NULL, sizeof(hv_shared_rings), PROT_READ | PROT_WRITE, MAP_SHARED, region, 0);
+	close(region);
+
+	if (rings == MAP_FAILED || rings->magic != HV_RING_MAGIC || rings->version != HV_RING_VERSION) {
+		cp_log(LLOG, "Can not map shared-memory rings, using sockets\n");
+		if (rings != MAP_FAILED) {
+			munmap(rings, sizeof(hv_shared_rings));
+		}
+		close(west_doorbell);
+		close(east_doorbell);
+		return;
+	}
+
+	fcntl(west_doorbell, F_SETFL, O_NONBLOCK);
+	fcntl(east_doorbell, F_SETFL, O_NONBLOCK);
+	/* A dead hypervisor must show as EPIPE on the doorbell, not kill us */
+	signal(SIGPIPE, SIG_IGN);
+
+	hv_rings = rings;
+	hv_west_doorbell = west_doorbell;
+	hv_east_doorbell = east_doorbell;
+
+	cp_log(LLOG, "Using shared-memory rings with the hypervisor\n");
+}
+
+/*
+ * Returns 1 if the caller may sleep on hv_west_doorbell, 0 if there are
+ * control packets to read.
+ */
+int hv_west_sleep() {
+	return hv_ring_sleep(&(hv_rings->west));
+}
+
+/*
+ * Hands the control packets of the west ring to fn, in place: fn copies
+ * what it keeps.
+ */
+void hv_west_receive(void (*fn)(uint8_t*, int, union sockunion*, union sockunion*)) {
+	hv_ring* ring = &(hv_rings->west);
+
+	hv_ring_awake(ring);
+
+	char b[64];
+	while (read(hv_west_doorbell, b, sizeof(b)) > 0) {
+		;
+	}
+
+	hv_ring_slot* slot;
+	while ((slot = hv_ring_peek(ring)) != NULL) {
+		union sockunion ssk;
+		union sockunion dsk;
+		memset(&ssk, 0, sizeof(ssk));
+		memset(&dsk, 0, sizeof(dsk));
+
+		if (slot->h.family == AF_INET) {
+			ssk.sin.sin_family = dsk.sin.sin_family = AF_INET;
+			memcpy(&(ssk.sin.sin_addr), slot->h.source, 4);
+			memcpy(&(dsk.sin.sin_addr), slot->h.destination, 4);
+			ssk.sin.sin_port = slot->h.source_port;
+			dsk.sin.sin_port = slot->h.destination_port;
+		} else {
+			ssk.sin6.sin6_family = dsk.sin6.sin6_family = AF_INET6;
+			memcpy(&(ssk.sin6.sin6_addr), slot->h.source, 16);
+			memcpy(&(dsk.sin6.sin6_addr), slot->h.destination, 16);
+			ssk.sin6.sin6_port = slot->h.source_port;
+			dsk.sin6.sin6_port = slot->h.destination_port;
+		}
+
+		int len = slot->h.len;
+		if (len > HV_RING_DATA_LEN) {
+			len = HV_RING_DATA_LEN;
+		}
+
+		fn(slot->data, len, &ssk, &dsk);
+		hv_ring_release(ring);
+	}
+}
+
+/* 1 if the hypervisor closed the other end of the east doorbell */
+static int hv_east_gone() {
+	struct pollfd pfd;
+
+	pfd.fd = hv_east_doorbell;
+	pfd.events = POLLOUT;
+	pfd.revents = 0;
+	return poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLHUP | POLLERR));
+}
+
+/*
+ * Sends a Map message through the east ring, waiting while it is full so
+ * that messages keep their order. Returns -1 if the socket must be used,
+ * HV_EAST_DROPPED (errno set) if the hypervisor did not make room in time
+ * or is gone: the message is dropped and counted.
+ */
+int hv_east_send(const void* message, size_t length) {
+	if (hv_rings == NULL || length > HV_RING_DATA_LEN) {
+		return -1;
+	}
+
+	hv_ring* ring = &(hv_rings->east);
+
+	hv_ring_slot* slot;
+	int tries = 0;
+	while ((slot = hv_ring_reserve(ring)) == NULL) {
+		if (hv_east_stalled || ++tries > HV_EAST_WAIT || hv_east_gone()) {
+			if (!hv_east_stalled) {
+				cp_log(LLOG, "Hypervisor does not consume the east ring, dropping Map messages\n");
+			}
+			hv_east_stalled = 1;
+			stats_inc(STAT_TX_HV_DROP);
+			errno = hv_east_gone() ? EPIPE : ENOBUFS;
+			return HV_EAST_DROPPED;
+		}
+		usleep(1000);
+	}
+	hv_east_stalled = 0;
+
+	memset(&(slot->h), 0, sizeof(hv_ring_slot_header));
+	slot->h.len = length;
+	memcpy(slot->data, message, length);
+
+	if (hv_ring_commit(ring)) {
+		uint8_t b = 0;
+		if (write(hv_east_doorbell, &b, 1) < 0 && errno != EAGAIN) {
+			cp_log(LDEBUG, "Can not ring the hypervisor doorbell\n");
+		}
+	}
+
+	return 0;
+}
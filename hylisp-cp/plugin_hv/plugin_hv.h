@@ -37,7 +37,18 @@ extern int virtual_map_socket;
 extern int common_udp4_socket;
 extern int common_udp6_socket;
 
+extern int _rings;
+extern int hv_west_doorbell;
+
+union sockunion;
+
 void register_virtual_plane();
 ssize_t sendtov(int, const void*, size_t, int, const struct sockaddr*, socklen_t);
 
+/* Shared-memory rings, hv_west_doorbell is -1 without them */
+int hv_west_sleep();
+void hv_west_receive(void (*)(uint8_t*, int, union sockunion*, union sockunion*));
+#define HV_EAST_DROPPED	-2
+int hv_east_send(const void*, size_t);
+
 #endif /* PLUGINHV_PLUGINHV_H_ */
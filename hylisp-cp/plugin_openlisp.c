@@ -1,4 +1,6 @@
 #ifdef OPENLISP
+#include <fcntl.h>
+
 #include "lib.h"
 #include "udp.h"
 #include "plugin_hv/plugin_hv.h"
@@ -7,8 +9,23 @@
 #include <net/lisp/maptables.h>
 
 #define PSIZE	4089
+#define OPL_MSGSIZE	(PSIZE + sizeof(struct map_msghdr))
 static int timeout = MAP_REPLY_TIMEOUT;
 
+/* Timeline of one resolution, usec from miss */
+struct miss_trace {
+	struct miss_trace *next;	/* installed by the same message */
+	union sockunion eid;
+	struct timespec t0;		/* miss received */
+	struct mr_entry *mr;		/* mapresolver which replied or last tried */
+	enum mr_outcome outcome;
+	int sampled;
+	int nsend;
+	uint32_t send[COUNT];		/* each Map-Request */
+	uint32_t reply;
+	uint32_t install;
+};
+
 struct eid_lookup {
     union sockunion eid;/* Destination EID */
     int rx;                     /* Receiving socket */
@@ -19,11 +36,17 @@ struct eid_lookup {
     int count;                  /* Current count of retries */
     uint64_t active;            /* Unique lookup identifier, 0 if inactive */
 	union sockunion *mr;		/* Point to mapresolver */	
+	struct mr_entry *mre;		/* mapresolver of last Map-Request */
+	struct mr_entry *tx_mr[COUNT];	/* mapresolver of each Map-Request */
+	struct timespec tx[COUNT];	/* send time of each Map-Request */
+	struct miss_trace *trace;	/* NULL if not started by a miss */
+	struct timer_ev retry;		/* retransmission */
+	int due;			/* retry timer fired, set by timer thread */
 };
 
 struct eid_lookup lookups[MAX_LOOKUPS];
-struct pollfd fds[MAX_LOOKUPS + 1];
-int fds_idx[MAX_LOOKUPS +1];
+struct pollfd fds[MAX_LOOKUPS + 3];
+int fds_idx[MAX_LOOKUPS + 3];
 nfds_t nfds = 0;
 struct protoent	    *proto;
 int udpproto;
@@ -33,59 +56,95 @@ int openlispsck;
 int _virtual;
 int virtual_map_socket;
 
-static void map_message_handler(union sockunion *mr);
+static void map_message_handler(void);
+static void miss_dispatch(void);
 int check_eid(union sockunion *eid);
-void  new_lookup(union sockunion *eid,  union sockunion *mr);
+void  new_lookup(union sockunion *eid, struct timespec *miss);
 int  send_mr(int idx);
-int read_rec(union map_reply_record_generic *rec);
-int opl_add(int s, struct db_node *node, int db);
-int opl_del(int s, struct db_node *node, int db);
+int read_rec(union map_reply_record_generic *rec, struct miss_trace **tr);
+
+static int retry_wake[2] = { -1, -1 };
+
+/* Retransmission timer of a lookup: lookups[] belongs to the event loop
+   thread, the timer thread only marks the lookup and wakes it up */
+	static void
+_lookup_retry(void *data)
+{
+	int idx = (intptr_t)data;
+	
+	__atomic_store_n(&lookups[idx].due, 1, __ATOMIC_RELEASE);
+	write(retry_wake[1], "", 1);
+}
+
+/* Retransmissions, on event loop thread.
+   A mark left by a callback that raced with the end of its lookup is
+   ignored: the slot is inactive, or a new lookup armed its timer again */
+	static void
+_lookup_retry_run(void)
+{
+	char c[64];
+	int i;
+	
+	while (read(retry_wake[0], c, sizeof(c)) > 0)
+		;
+	for (i = 1; i < MAX_LOOKUPS; i++) {
+		if (!__atomic_exchange_n(&lookups[i].due, 0, __ATOMIC_ACQ_REL))
+			continue;
+		if (lookups[i].active && !timer_pending(&lookups[i].retry))
+			send_mr(i);
+	}
+}
+/* Installation of mappings in OpenLISP */
+#define OPL_DEL		0x01
+#define OPL_ADD		0x02
+#define OPL_UPDATE	(OPL_DEL | OPL_ADD)
+#define OPL_HASH	1024
+#define OPL_BATCH	64
+
+void opl_install(uint8_t op, struct prefix *p, struct list_t *rloc, uint8_t db, 
+				struct miss_trace *tr);
+struct list_t *opl_rloc_dup(struct list_t *rloc);
 int opl_get(int s, struct db_node *mapp, int db, struct db_node *rs);
-int opl_update(int s, struct db_node *node, uint8_t);
+static void *opl_writer(void *data);
+static int _opl_rloc_free(void *data);
+static unsigned int _opl_hash(struct prefix *p, uint8_t db);
+static int _opl_prefix_same(struct prefix *a, struct prefix *b);
+
+/* Life of map-cache entries installed in OpenLISP */
+void mc_installed(struct prefix *p, uint32_t ttl, struct list_t *rloc);
+static void _mc_idle(struct prefix *p);
+static void _mc_deleted(char *msg, ssize_t n);
+static int mc_init(void);
+static void mc_refresh_run(void);
+static void mc_save(void);
+static int mc_load(void);
+static void opl_save_request(void);
+static void opl_drain(void);
+/* Negative cache */
+static int neg_lookup(union sockunion *eid);
+static void neg_add(struct prefix *p, uint32_t ttl);
+static void neg_timeout(union sockunion *eid);
+static void neg_remove(struct prefix *p);
 
 	size_t
 prefix2sockaddr(struct prefix *p, union sockunion *rs)
 {	
-	char ip[INET6_ADDRSTRLEN];
-	inet_ntop(p->family, (void *)&p->u.prefix, ip, INET6_ADDRSTRLEN);
-	
-	struct addrinfo *res;
-	struct addrinfo hints;
-	int e; 
-    struct protoent	    *proto;
-    if ((proto = getprotobyname("UDP")) == NULL) {
-		perror ("getprotobyname");
-		return 0;
-    }
-		
-	memset(&hints, 0, sizeof(struct addrinfo));
-	hints.ai_family = AF_UNSPEC;	//Allow IPv4 or IPv6 
-	hints.ai_socktype  = SOCK_DGRAM;	// Datagram socket 
-	hints.ai_flags  = AI_PASSIVE;	
-    hints.ai_canonname = NULL;
-    hints.ai_addr      = NULL;
-    hints.ai_next      = NULL;
-	
-	if ((e = getaddrinfo(ip, NULL, &hints, &res)) != 0) {
-		cp_log(LLOG, "getaddrinfo: %s\n", gai_strerror(e));
-		return 0;
-	}
-		
-	//----------------------------
-	
 	switch (p->family) {
 	case AF_INET:
-		memcpy(&rs->sin, res->ai_addr, sizeof(struct sockaddr_in));
+		bzero(&rs->sin, sizeof(struct sockaddr_in));
+		rs->sa.sa_len = sizeof(struct sockaddr_in);
+		rs->sin.sin_family = AF_INET;
+		rs->sin.sin_addr = p->u.prefix4;
 		return sizeof(struct sockaddr_in);
-		break;
 	case AF_INET6:
-		memcpy(&rs->sin6, res->ai_addr, sizeof(struct sockaddr_in6));
+		bzero(&rs->sin6, sizeof(struct sockaddr_in6));
+		rs->sa.sa_len = sizeof(struct sockaddr_in6);
+		rs->sin6.sin6_family = AF_INET6;
+		rs->sin6.sin6_addr = p->u.prefix6;
 		return sizeof(struct sockaddr_in6);
-		break;
 	default:
 		return 0;
 	}
-	return 0;
 }
 
 	size_t
@@ -125,43 +184,345 @@ _get_sock_size(union sockunion *eid)
 	return ss_len;
 }
 
-/*Get a random map-resolver from list */
-	union sockunion *
-_get_mr()
+/* Use mapresolver mre for next Map-Request of lookup idx */
+	static void
+_lookup_set_mr(int idx, struct mr_entry *mre)
 {
-	int nms;
-	int rn;
-	struct list_entry_t *rt;
+	union sockunion *mr = &mre->addr;
 	
-	nms =xtr_mr->count;
-	rn = ((random()^time(NULL) ) % nms);
-	rt = xtr_mr->head.next;
-	while (rt != &xtr_mr->tail && rn-- > 0)
-		rt = rt->next;
-		
-	return ((union sockunion *)rt->data);	
+	if (mr->sa.sa_family == AF_INET)
+		mr->sin.sin_port = htons(LISP_CP_PORT);
+	else
+		mr->sin6.sin6_port = htons(LISP_CP_PORT);
+	lookups[idx].mre = mre;
+	lookups[idx].mr = mr;
+}
+
+	static uint64_t
+_usec_since(struct timespec *ts)
+{
+	struct timespec now;
+	int64_t usec;
+	
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	usec = (int64_t)(now.tv_sec - ts->tv_sec) * 1000000 +
+				(now.tv_nsec - ts->tv_nsec) / 1000;
+	return (usec > 0) ? usec : 0;
+}
+
+/* Miss tracing.
+   A lookup started by a miss owns a miss_trace, handed over with the
+   first record of the Map-Reply to the install request, and ended by the
+   writer once the message is written to the mapping socket (or by the
+   last timeout). Ownership moves by atomic exchange of lookups[].trace.
+   Every resolution feeds the phase histograms and the histogram of its
+   mapresolver and outcome, one out of miss_trace is kept for dump. */
+
+static struct miss_trace trace_ring[MISS_TRACE_RING];
+static unsigned int trace_pos;
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+	static struct miss_trace *
+_trace_new(union sockunion *eid, struct timespec *t0)
+{
+	struct miss_trace *tr;
+	
+	if (!(tr = calloc(1, sizeof(struct miss_trace))))
+		return NULL;
+	memcpy(&tr->eid, eid, _get_sock_size(eid));
+	tr->t0 = *t0;
+	tr->sampled = (miss_trace > 0 && random() % miss_trace == 0);
+	return tr;
+}
+
+/* End a chain of traces */
+	static void
+_trace_end(struct miss_trace *tr)
+{
+	struct miss_trace *next;
+	uint64_t us;
+	
+	for (; tr; tr = next) {
+		next = tr->next;
+		us = _usec_since(&tr->t0);
+		if (tr->outcome != MR_TIMEOUT && tr->outcome != MR_ERROR) {
+			tr->install = us;
+			stats_hist_add(HIST_MISS_INSTALL, us - min(tr->reply, us));
+			stats_hist_add(HIST_MISS_E2E, us);
+		}
+		mr_hist_add(tr->mr, tr->outcome, us);
+		if (tr->sampled) {
+			pthread_mutex_lock(&trace_mutex);
+			memcpy(&trace_ring[trace_pos++ % MISS_TRACE_RING], tr, sizeof(struct miss_trace));
+			pthread_mutex_unlock(&trace_mutex);
+		}
+		free(tr);
+	}
+}
+
+	void
+miss_trace_dump(FILE *fp)
+{
+	struct miss_trace *tr;
+	char ip[INET6_ADDRSTRLEN], mr[INET6_ADDRSTRLEN];
+	unsigned int i, n;
+	int j;
+	
+	pthread_mutex_lock(&trace_mutex);
+	n = min(trace_pos, MISS_TRACE_RING);
+	for (i = trace_pos - n; i != trace_pos; i++) {
+		tr = &trace_ring[i % MISS_TRACE_RING];
+		fprintf(fp, "eid=%s mr=%s outcome=%s send=", sk_get_ip(&tr->eid, ip),
+				tr->mr ? sk_get_ip(&tr->mr->addr, mr) : "-",
+				mr_outcome_name[tr->outcome]);
+		for (j = 0; j < tr->nsend; j++)
+			fprintf(fp, "%s%u", j ? "," : "", tr->send[j]);
+		if (tr->outcome == MR_TIMEOUT)
+			fprintf(fp, " (usec)\n");
+		else if (tr->outcome == MR_ERROR)
+			fprintf(fp, " reply=%u (usec)\n", tr->reply);
+		else
+			fprintf(fp, " reply=%u install=%u (usec)\n", tr->reply, tr->install);
+	}
+	pthread_mutex_unlock(&trace_mutex);
+}
+
+/* End a trace of a resolution which installed nothing */
+	static void
+_trace_error(struct miss_trace *tr)
+{
+	if (tr)
+		tr->outcome = MR_ERROR;
+	_trace_end(tr);
+}
+
+/* Map-Reply to Map-Request i of lookup idx, take its trace */
+	static struct miss_trace *
+_trace_reply(int idx, int i)
+{
+	struct miss_trace *tr;
+	
+	if ((tr = __atomic_exchange_n(&lookups[idx].trace, NULL, __ATOMIC_ACQ_REL)) != NULL) {
+		tr->reply = _usec_since(&tr->t0);
+		tr->mr = lookups[idx].tx_mr[i];
+	}
+	return tr;
+}
+
+/* Miss intake.
+   The mapping socket is drained by bursts of MISS_BURST messages into a
+   FIFO of pending misses, a miss for an EID already queued, in lookup or
+   negatively cached is dropped at once. miss_dispatch() starts at most
+   MISS_START_MAX lookups per wakeup, and at most MISS_PREFIX_RATE per
+   second for a destination prefix, so Map-Replies and retransmissions
+   are not delayed by a miss storm. All run on event loop thread. */
+
+#define MISS_HASH	1024
+#define MISS_RATE_SLOTS	4096
+
+struct miss_entry {
+	struct miss_entry *next;	/* FIFO or free list */
+	struct miss_entry *hnext;	/* dedup bucket */
+	union sockunion eid;
+	size_t len;
+	unsigned int h;
+	uint64_t t;			/* msec, received */
+	struct timespec ts;		/* received, for tracing */
+};
+
+/* token bucket of a destination prefix */
+struct miss_rate {
+	struct prefix p;
+	uint64_t last;			/* msec */
+	uint32_t tokens;		/* milli-tokens */
+};
+
+static struct miss_entry miss_pool[MISS_QUEUE];
+static struct miss_entry *miss_free;
+static struct miss_entry *miss_head;
+static struct miss_entry **miss_tail = &miss_head;
+static struct miss_entry *miss_hash[MISS_HASH];
+static struct miss_rate miss_rate[MISS_RATE_SLOTS];
+
+	static void
+_miss_init(void)
+{
+	int i;
+	
+	for (i = 0; i < MISS_QUEUE; i++) {
+		miss_pool[i].next = miss_free;
+		miss_free = &miss_pool[i];
+	}
+}
+
+	static unsigned int
+_miss_hash(union sockunion *eid, size_t len)
+{
+	unsigned char *c = (unsigned char *)eid;
+	uint32_t h;
+	size_t i;
+	
+	for (h = 0, i = 0; i < len; i++)
+		h = h * 31 + c[i];
+	return h;
+}
+
+/* Remove m from FIFO (pm points to it) and dedup bucket */
+	static void
+_miss_release(struct miss_entry **pm, struct miss_entry *m)
+{
+	struct miss_entry **ph;
+	
+	if ((*pm = m->next) == NULL)
+		miss_tail = pm;
+	for (ph = &miss_hash[m->h % MISS_HASH]; *ph; ph = &(*ph)->hnext) {
+		if (*ph == m) {
+			*ph = m->hnext;
+			break;
+		}
+	}
+	m->next = miss_free;
+	miss_free = m;
+}
+
+	static void
+_miss_queue(union sockunion *eid, uint64_t now, struct timespec *ts)
+{
+	struct miss_entry *m;
+	size_t len;
+	unsigned int h;
+	
+	if ((int)(len = _get_sock_size(eid)) <= 0)
+		return;
+	if (neg_lookup(eid)) {
+		stats_inc(STAT_MISS_SUPPRESSED);
+		return;
+	}
+	h = _miss_hash(eid, len);
+	for (m = miss_hash[h % MISS_HASH]; m; m = m->hnext) {
+		if (m->len == len && !memcmp(&m->eid, eid, len)) {
+			stats_inc(STAT_MISS_DEDUP);
+			return;
+		}
+	}
+	if (!(m = miss_free)) {
+		stats_inc(STAT_MISS_DROP);
+		return;
+	}
+	miss_free = m->next;
+	memcpy(&m->eid, eid, len);
+	m->len = len;
+	m->h = h;
+	m->t = now;
+	m->ts = *ts;
+	m->next = NULL;
+	m->hnext = miss_hash[h % MISS_HASH];
+	miss_hash[h % MISS_HASH] = m;
+	*miss_tail = m;
+	miss_tail = &m->next;
 }
 
-/* Process message from OpenLISP socket */
+/* Process messages from OpenLISP socket */
 	static void 
-map_message_handler(union sockunion *mr)
+map_message_handler(void)
 {
-    struct timespec now;
     char msg[PSIZE];         /* buffer for mapping messages */
-    int n = 0;              /* number of bytes received on mapping socket */
+    ssize_t n;              /* number of bytes received on mapping socket */
     union sockunion *eid;
+	unsigned char map_type;
+	uint64_t now;
+	struct timespec ts;
+	int burst;
 	
-    n = read(lookups[0].rx, msg, PSIZE);
-    clock_gettime(CLOCK_REALTIME, &now);
+	now = timer_now_ms();
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	for (burst = 0; burst < MISS_BURST; burst++) {
+		if ((n = recv(lookups[0].rx, msg, PSIZE, MSG_DONTWAIT)) <= 0)
+			break;
+		if (n < sizeof(struct map_msghdr) + sizeof(struct sockaddr_in))
+			continue;
+		map_type = ((struct map_msghdr *)msg)->map_type;
+		if (map_type == MAPM_MISS_EID || map_type == MAPM_MISS_HEADER || map_type == MAPM_MISS_PACKET) {
+			eid = (union sockunion *)CO(msg,sizeof(struct map_msghdr));
+			stats_inc(STAT_MISS);
+			_miss_queue(eid, now, &ts);
+		}else if (map_type == MAPM_DELETE && (((struct map_msghdr *)msg)->map_flags & 
+					(MAPF_EXPIRED | MAPF_DB)) == MAPF_EXPIRED) {
+			_mc_deleted(msg, n);
+		}
+	}
+}
+
+/* Return 1 if a lookup for eid may start now */
+	static int
+_miss_rate_ok(union sockunion *eid, uint64_t now)
+{
+	struct prefix p;
+	struct miss_rate *r;
+	uint64_t add;
 	
+	bzero(&p, sizeof(struct prefix));
+	if (!sockaddr2prefix(eid, &p))
+		return 1;
+	p.prefixlen = (p.family == AF_INET) ? MISS_PREFIX_LEN4 : MISS_PREFIX_LEN6;
+	apply_mask(&p);
+	r = &miss_rate[_opl_hash(&p, 0) % MISS_RATE_SLOTS];
+	if (!_opl_prefix_same(&r->p, &p)) {
+		/* slot taken over by another prefix */
+		memcpy(&r->p, &p, sizeof(struct prefix));
+		r->tokens = MISS_PREFIX_RATE * 1000;
+		r->last = now;
+	}
+	add = (now - r->last) * MISS_PREFIX_RATE;
+	r->tokens = min(r->tokens + add, MISS_PREFIX_RATE * 1000);
+	r->last = now;
+	if (r->tokens < 1000)
+		return 0;
+	r->tokens -= 1000;
+	return 1;
+}
 
-    unsigned char map_type = ((struct map_msghdr *)msg)->map_type;
+	static int
+_lookup_free(void)
+{
+	int i;
+	
+	for (i = 1; i < MAX_LOOKUPS; i++)
+		if (!lookups[i].active)
+			return 1;
+	return 0;
+}
 
-    if (map_type == MAPM_MISS_EID || map_type == MAPM_MISS_HEADER || map_type == MAPM_MISS_PACKET) {
-        eid = (union sockunion *)CO(msg,sizeof(struct map_msghdr));
-		if (check_eid(eid)) {
-			new_lookup(eid, mr);
+/* Start lookups of queued misses */
+	static void
+miss_dispatch(void)
+{
+	struct miss_entry **pm, *m;
+	uint64_t now;
+	int n;
+	
+	now = timer_now_ms();
+	n = 0;
+	pm = &miss_head;
+	while ((m = *pm) != NULL && n < MISS_START_MAX) {
+		if (now - m->t > MISS_MAX_AGE) {
+			/* data plane sends a new miss if still needed */
+			stats_inc(STAT_MISS_DROP);
+		}else if (!check_eid(&m->eid)) {
+			stats_inc(STAT_MISS_DEDUP);
+		}else if (neg_lookup(&m->eid)) {
+			stats_inc(STAT_MISS_SUPPRESSED);
+		}else if (!_lookup_free()) {
+			break;
+		}else if (!_miss_rate_ok(&m->eid, now)) {
+			stats_inc(STAT_MISS_RATELIMIT);
+			pm = &m->next;
+			continue;
+		}else{
+			new_lookup(&m->eid, &m->ts);
+			n++;
 		}
+		_miss_release(pm, m);
 	}
 }
 
@@ -181,9 +542,12 @@ check_eid(union sockunion *eid)
 
 /*Add new EID to poll*/
 	void 
-new_lookup(union sockunion *eid,  union sockunion *mr)
+new_lookup(union sockunion *eid, struct timespec *miss)
 {
     int i,e,r;
+	struct mr_entry *mre;
+	struct miss_trace *tr;
+	union sockunion *mr;
     uint16_t sport;             /* inner EMR header source port */
     char sport_str[NI_MAXSERV]; /* source port in string format */
     struct addrinfo hints;
@@ -196,6 +560,9 @@ new_lookup(union sockunion *eid,  union sockunion *mr)
 
     if (i >= MAX_LOOKUPS)
 	    return;
+	if (!(mre = mr_select(NULL, 0)))
+		return;
+	mr = &mre->addr;
     	
 	if (srcport_rand) {
 		/*new socket for map-request */
@@ -237,14 +604,17 @@ new_lookup(union sockunion *eid,  union sockunion *mr)
     memcpy(&lookups[i].eid, eid, _get_sock_size(eid));
     lookups[i].rx = r;
     lookups[i].sport = sport;
-    clock_gettime(CLOCK_REALTIME, &lookups[i].start);
+    clock_gettime(CLOCK_MONOTONIC, &lookups[i].start);
     lookups[i].count = 0;
+	/* trace left by the former lookup of the slot */
+	if ((tr = __atomic_exchange_n(&lookups[i].trace, 
+				miss ? _trace_new(eid, miss) : NULL, __ATOMIC_ACQ_REL)) != NULL) {
+		if (!tr->mr)
+			tr->mr = lookups[i].mre;
+		_trace_error(tr);
+	}
     lookups[i].active = 1;
-	if (mr->sa.sa_family == AF_INET)
-		mr->sin.sin_port = htons(LISP_CP_PORT);
-	else
-		mr->sin6.sin6_port = htons(LISP_CP_PORT);
-	lookups[i].mr = mr;
+	_lookup_set_mr(i, mre);
     send_mr(i);
 }
 
@@ -271,11 +641,34 @@ send_mr(int idx)
 	char ip[INET6_ADDRSTRLEN];
 	int mask; 
 	eid = &lookups[idx].eid;
-	if (lookups[idx].count >= COUNT && srcport_rand) {
+	if (lookups[idx].count > 0) {
+		/* previous Map-Request not answered in time */
+		mr_timeout(lookups[idx].tx_mr[lookups[idx].count - 1]);
+	}
+	if (lookups[idx].count >= COUNT) {
+		struct miss_trace *tr;
+		
+		if ((tr = __atomic_exchange_n(&lookups[idx].trace, NULL, __ATOMIC_ACQ_REL)) != NULL) {
+			tr->outcome = MR_TIMEOUT;
+			tr->mr = lookups[idx].mre;
+			_trace_end(tr);
+		}
+		stats_inc(STAT_MISS_TIMEOUT);
+		neg_timeout(&lookups[idx].eid);
 		lookups[idx].active = 0;
-		close(lookups[idx].rx);
+		if (srcport_rand)
+			close(lookups[idx].rx);
         return 0;
     }
+	if (lookups[idx].count > 0) {
+		/* retransmit to another mapresolver, same family as socket */
+		struct mr_entry *mre;
+		
+		if ((mre = mr_select(lookups[idx].mre, lookups[idx].mr->sa.sa_family)) != NULL)
+			_lookup_set_mr(idx, mre);
+	}
+	timer_add(&lookups[idx].retry, min(timeout * 1000, mr_rto(lookups[idx].mre)), 
+				_lookup_retry, (void *)(intptr_t)idx);
 	bzero(buf,PSIZE);
 	lh = (struct lisp_control_hdr *)buf;
 	ih = (struct ip *)CO(lh, sizeof(struct lisp_control_hdr));
@@ -413,7 +806,7 @@ send_mr(int idx)
 		ih->ip_sum        = 0;         
 		ih->ip_src.s_addr = afi_addr_src.ip.address.s_addr;
 		ih->ip_dst.s_addr = eid->sin.sin_addr.s_addr;
-		ih->ip_sum = ip_checksum((uint16_t *)ih, (ih->ip_hl)*2);
+		ih->ip_sum = cksum(ih, (ih->ip_hl) * 4);
 		break;
 	case AF_INET6:
 		ip_len = (uint8_t *)ptr - (uint8_t *)ih;
@@ -427,19 +820,36 @@ send_mr(int idx)
 	}
 	
 	char ip2[INET6_ADDRSTRLEN];
+	lookups[idx].tx_mr[lookups[idx].count] = lookups[idx].mre;
+	clock_gettime(CLOCK_MONOTONIC, &lookups[idx].tx[lookups[idx].count]);
+	mr_sent(lookups[idx].mre);
+	{
+		struct miss_trace *tr;
+		
+		/* taken during update, a reply meanwhile is not traced */
+		if ((tr = __atomic_exchange_n(&lookups[idx].trace, NULL, __ATOMIC_ACQ_REL)) != NULL) {
+			if (tr->nsend < COUNT)
+				tr->send[tr->nsend++] = _usec_since(&tr->t0);
+			if (tr->nsend == 1)
+				stats_hist_add(HIST_MISS_QUEUE, tr->send[0]);
+			__atomic_store_n(&lookups[idx].trace, tr, __ATOMIC_RELEASE);
+		}
+	}
 	if (sendtov(lookups[idx].rx, (void *)buf, (uint8_t *)ptr - (uint8_t *)lh, 0, 
 						&(lookups[idx].mr->sa), sockaddr_len) < 0) {
+		stats_inc(STAT_TX_ERR);
 		cp_log(LLOG, "\n#Error send Map-Request to %s:%d <nonce=0x%x - 0x%x>\n", \
 						sk_get_ip(lookups[idx].mr, ip2) , sk_get_port(lookups[idx].mr),\
 						nonce0, nonce1);			
 		cp_log(LDEBUG, "   EID %s/%d\n",ip,mask);		
+		lookups[idx].count++;
         return 0;
     } else {
         cnt = lookups[idx].count;
         lookups[idx].nonce0[cnt] = nonce0;
         lookups[idx].nonce1[cnt] = nonce1;
 		lookups[idx].count++;
-		
+		stats_inc(STAT_TX_REQUEST);
 		
 		cp_log(LLOG, "\n#Send Map-Request to %s:%d <nonce=0x%x - 0x%x>\n", \
 						sk_get_ip(lookups[idx].mr, ip2) , sk_get_port(lookups[idx].mr),\
@@ -451,7 +861,7 @@ send_mr(int idx)
 
 /* Process with map-reply */
 	int
-read_rec(union map_reply_record_generic *rec)
+read_rec(union map_reply_record_generic *rec, struct miss_trace **tr)
 {
 	size_t rlen;
 	union map_reply_locator_generic *loc;
@@ -727,13 +1137,665 @@ read_rec(union map_reply_record_generic *rec)
 			return 0;
 		}		
 	}
-	/* add to OpenLISP mapping cache */
-	opl_add(openlispsck, &node, 0);
-	if (node.info)
-		list_destroy((struct list_t *)node.info, NULL);
+	/* add to OpenLISP mapping cache, locators are handed over */
+	if (tr && *tr)
+		(*tr)->outcome = rec->record.locator_count ? MR_POSITIVE : MR_NEGATIVE;
+	mc_installed(&node.p, mflags.ttl, (struct list_t *)node.info);
+	opl_install(OPL_ADD, &node.p, (struct list_t *)node.info, 0, tr ? *tr : NULL);
+	if (tr)
+		*tr = NULL;
+	if (rec->record.locator_count == 0)
+		neg_add(&node.p, mflags.ttl);
+	else
+		neg_remove(&node.p);
 	return (rlen);
 }
 
+/* Map-cache lifecycle.
+   The control plane deletes entries when their record TTL is over.
+   Entries are not static in OpenLISP, which deletes one unused for its
+   cache expiry time and reports it (MAPM_DELETE with MAPF_EXPIRED): that
+   is the only sign of use given by the data plane. An entry missed again
+   within MAP_CACHE_HOT_WINDOW after it expired is hot, and gets a
+   Map-Request sent in background shortly before each expiry, the
+   Map-Reply replaces its locators in place, until OpenLISP reports it
+   unused. Cold entries just expire. An expired entry stays as tombstone
+   during the hot window. */
+
+enum mc_state {
+	MC_INSTALLED,
+	MC_REFRESH,	/* Map-Request in background sent */
+	MC_EXPIRED,	/* tombstone */
+};
+
+struct mc_entry {
+	struct mc_entry *hnext;
+	struct mc_entry *rnext;		/* mc_refresh list */
+	struct prefix p;
+	enum mc_state state;
+	int hot;			/* refreshed in background until unused */
+	int queued;			/* in mc_refresh list */
+	uint64_t expire;		/* msec, end of TTL */
+	uint64_t deadline;		/* msec, when timer is due */
+	uint64_t used;			/* msec, last install after a miss */
+	struct list_t *rloc;		/* copy of installed locators */
+	struct timer_ev timer;
+};
+
+static struct mc_entry *mc_hash[OPL_HASH];
+static struct mc_entry *mc_refresh;
+static int mc_wake[2] = { -1, -1 };
+static pthread_mutex_t mc_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void _mc_timeout(void *data);
+
+/* Requires mc_mutex */
+	static void
+_mc_arm(struct mc_entry *e, uint64_t now, uint32_t msec)
+{
+	e->deadline = now + msec;
+	timer_add(&e->timer, msec, _mc_timeout, e);
+}
+
+/* Requires mc_mutex */
+	static void
+_mc_free(struct mc_entry *e)
+{
+	struct mc_entry **pe;
+	
+	for (pe = &mc_hash[_opl_hash(&e->p, 0)]; *pe; pe = &(*pe)->hnext) {
+		if (*pe == e) {
+			*pe = e->hnext;
+			break;
+		}
+	}
+	free(e);
+}
+
+	static void
+_mc_timeout(void *data)
+{
+	struct mc_entry *e = data;
+	uint64_t now;
+	
+	now = timer_now_ms();
+	pthread_mutex_lock(&mc_mutex);
+	/* entry updated while this callback was waiting */
+	if (now + TIMER_TICK_MS < e->deadline) {
+		pthread_mutex_unlock(&mc_mutex);
+		return;
+	}
+	switch (e->state) {
+	case MC_INSTALLED:
+		if (e->hot && e->expire > now) {
+			e->state = MC_REFRESH;
+			if (!e->queued) {
+				e->queued = 1;
+				e->rnext = mc_refresh;
+				mc_refresh = e;
+				write(mc_wake[1], "", 1);
+			}
+			/* old locators are used until reply or expiry */
+			_mc_arm(e, now, e->expire - now);
+			stats_inc(STAT_MC_REFRESH);
+			break;
+		}
+		/* FALLTHROUGH */
+	case MC_REFRESH:
+		cp_log(LDEBUG, "map-cache: %s/%d expired\n", 
+					(char *)prefix2str(&e->p), e->p.prefixlen);
+		opl_install(OPL_DEL, &e->p, NULL, 0, NULL);
+		if (e->rloc) {
+			list_destroy(e->rloc, _opl_rloc_free);
+			e->rloc = NULL;
+		}
+		e->state = MC_EXPIRED;
+		_mc_arm(e, now, MAP_CACHE_HOT_WINDOW * 1000);
+		stats_inc(STAT_MC_EXPIRE);
+		break;
+	case MC_EXPIRED:
+		if (e->queued)
+			_mc_arm(e, now, MAP_CACHE_HOT_WINDOW * 1000);
+		else
+			_mc_free(e);
+		break;
+	}
+	pthread_mutex_unlock(&mc_mutex);
+}
+
+/* Track a mapping installed in cache for ttl_ms, rloc is handed over.
+   hot < 0 to infer it from the entry history */
+	static void
+_mc_track(struct prefix *p, uint64_t ttl_ms, struct list_t *rloc, int hot, uint64_t used)
+{
+	struct mc_entry *e;
+	unsigned int h;
+	uint64_t now, lead;
+	uint32_t when;
+	
+	now = timer_now_ms();
+	h = _opl_hash(p, 0);
+	pthread_mutex_lock(&mc_mutex);
+	for (e = mc_hash[h]; e; e = e->hnext)
+		if (_opl_prefix_same(&e->p, p))
+			break;
+	if (!e) {
+		if (!(e = calloc(1, sizeof(struct mc_entry)))) {
+			pthread_mutex_unlock(&mc_mutex);
+			return;
+		}
+		memcpy(&e->p, p, sizeof(struct prefix));
+		e->hnext = mc_hash[h];
+		mc_hash[h] = e;
+	}else if (e->state == MC_EXPIRED && hot < 0) {
+		/* still in use after expiry */
+		e->hot = 1;
+	}
+	if (hot >= 0)
+		e->hot = hot;
+	/* reply to a background refresh is no sign of use */
+	if (e->state != MC_REFRESH)
+		e->used = used;
+	e->state = MC_INSTALLED;
+	if (e->rloc)
+		list_destroy(e->rloc, _opl_rloc_free);
+	e->rloc = rloc;
+	
+	e->expire = now + ttl_ms;
+	when = ttl_ms;
+	if (!ttl_ms) {
+		e->hot = 0;
+	}else if (e->hot) {
+		lead = max(ttl_ms / 10, MAP_CACHE_LEAD * 1000);
+		when = (ttl_ms > 2 * lead) ? ttl_ms - lead : ttl_ms / 2;
+		/* hot entries of one reply must not be refreshed together */
+		when = timer_jitter(when, 5);
+	}
+	_mc_arm(e, now, when);
+	pthread_mutex_unlock(&mc_mutex);
+}
+
+/* OpenLISP deleted the mapping of p, unused for its cache expiry time */
+	static void
+_mc_idle(struct prefix *p)
+{
+	struct mc_entry *e;
+	uint64_t now;
+	
+	now = timer_now_ms();
+	pthread_mutex_lock(&mc_mutex);
+	for (e = mc_hash[_opl_hash(p, 0)]; e; e = e->hnext)
+		if (_opl_prefix_same(&e->p, p))
+			break;
+	if (e && e->state != MC_EXPIRED) {
+		e->hot = 0;
+		/* a pending background refresh installs it once more, cold */
+		if (e->state == MC_INSTALLED) {
+			if (e->rloc) {
+				list_destroy(e->rloc, _opl_rloc_free);
+				e->rloc = NULL;
+			}
+			e->state = MC_EXPIRED;
+			_mc_arm(e, now, MAP_CACHE_HOT_WINDOW * 1000);
+		}
+		stats_inc(STAT_MC_IDLE);
+	}
+	pthread_mutex_unlock(&mc_mutex);
+}
+
+/* Track a mapping just installed in cache, ttl in minutes */
+	void
+mc_installed(struct prefix *p, uint32_t ttl, struct list_t *rloc)
+{
+	_mc_track(p, (uint64_t)min(ttl, MAP_CACHE_MAX_TTL) * 60 * 1000, 
+				opl_rloc_dup(rloc), -1, timer_now_ms());
+}
+
+/* Map-cache file.
+   Written by the writer thread every MAP_CACHE_SAVE seconds and on
+   SIGTERM/SIGINT, to a temporary file renamed over the old one. Entries
+   are loaded back at start with their remaining TTL, before the mapping
+   socket is read for misses. Host byte order: the file does not move. */
+
+#define MC_FILE_MAGIC	0x484c4d43	/* HLMC */
+#define MC_FILE_VERSION	1
+
+struct mc_file_hdr {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t rsvd;
+	uint32_t count;
+	uint64_t saved;		/* wall clock, seconds */
+};
+
+struct mc_file_rec {
+	uint8_t family;
+	uint8_t prefixlen;
+	uint8_t hot;
+	uint8_t nloc;
+	uint32_t ttl;		/* msec left */
+	uint32_t idle;		/* sec since last use */
+	uint8_t addr[16];
+};
+
+struct mc_file_loc {
+	uint8_t family;
+	uint8_t priority;
+	uint8_t weight;
+	uint8_t flags;
+#define MC_LOC_L	0x01
+#define MC_LOC_R	0x02
+#define MC_LOC_P	0x04
+	uint8_t addr[16];
+};
+
+static struct timer_ev mc_save_timer;
+static pthread_mutex_t mc_save_mutex = PTHREAD_MUTEX_INITIALIZER;
+static volatile sig_atomic_t mc_stop;
+
+	static void
+_mc_save_timeout(void *data)
+{
+	opl_save_request();
+	timer_add(&mc_save_timer, MAP_CACHE_SAVE * 1000, _mc_save_timeout, NULL);
+}
+
+	static void
+_mc_shutdown(int sig)
+{
+	mc_stop = 1;
+	write(mc_wake[1], "", 1);
+}
+
+	static void
+mc_save(void)
+{
+	struct mc_file_hdr hdr;
+	struct mc_file_rec *fr;
+	struct mc_file_loc *fl;
+	struct mc_entry *e;
+	struct list_entry_t *ptr;
+	struct map_entry *me;
+	char *buf, *nbuf, tmp[MAXPATHLEN];
+	size_t len, size, need;
+	uint64_t now;
+	int i, fd;
+	
+	now = timer_now_ms();
+	bzero(&hdr, sizeof(hdr));
+	hdr.magic = MC_FILE_MAGIC;
+	hdr.version = MC_FILE_VERSION;
+	hdr.saved = time(NULL);
+	size = 4096;
+	if (!(buf = malloc(size)))
+		return;
+	len = 0;
+	
+	/* snapshot in memory, file written without mc_mutex */
+	pthread_mutex_lock(&mc_mutex);
+	for (i = 0; i < OPL_HASH; i++) {
+		for (e = mc_hash[i]; e; e = e->hnext) {
+			if (e->state == MC_EXPIRED || e->expire <= now)
+				continue;
+			need = sizeof(struct mc_file_rec) + 
+				(e->rloc ? e->rloc->count : 0) * sizeof(struct mc_file_loc);
+			if (len + need > size) {
+				size = 2 * (len + need);
+				if (!(nbuf = realloc(buf, size)))
+					break;
+				buf = nbuf;
+			}
+			fr = (struct mc_file_rec *)CO(buf, len);
+			bzero(fr, sizeof(struct mc_file_rec));
+			fr->family = e->p.family;
+			fr->prefixlen = e->p.prefixlen;
+			fr->hot = e->hot;
+			fr->ttl = min(e->expire - now, UINT32_MAX);
+			fr->idle = min((now - min(e->used, now)) / 1000, UINT32_MAX);
+			memcpy(fr->addr, &e->p.u.prefix, SIN_LEN(e->p.family));
+			fl = (struct mc_file_loc *)CO(fr, sizeof(struct mc_file_rec));
+			for (ptr = e->rloc ? e->rloc->head.next : NULL; 
+					ptr && ptr != &e->rloc->tail && fr->nloc < 255; ptr = ptr->next) {
+				me = ptr->data;
+				bzero(fl, sizeof(struct mc_file_loc));
+				fl->family = me->rloc.sa.sa_family;
+				fl->priority = me->priority;
+				fl->weight = me->weight;
+				fl->flags = (me->L ? MC_LOC_L : 0) | (me->r ? MC_LOC_R : 0) | 
+							(me->p ? MC_LOC_P : 0);
+				if (fl->family == AF_INET)
+					memcpy(fl->addr, &me->rloc.sin.sin_addr, sizeof(struct in_addr));
+				else
+					memcpy(fl->addr, &me->rloc.sin6.sin6_addr, sizeof(struct in6_addr));
+				fl++;
+				fr->nloc++;
+			}
+			len = (char *)fl - buf;
+			hdr.count++;
+		}
+	}
+	pthread_mutex_unlock(&mc_mutex);
+	
+	/* writer thread and shutdown may save at once */
+	pthread_mutex_lock(&mc_save_mutex);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", MAP_CACHE_FILE);
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0) {
+		cp_log(LLOG, "map-cache: can not write %s\n", tmp);
+	}else if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) || 
+			write(fd, buf, len) != (ssize_t)len || fsync(fd) < 0) {
+		cp_log(LLOG, "map-cache: can not write %s\n", tmp);
+		close(fd);
+		unlink(tmp);
+	}else{
+		close(fd);
+		if (rename(tmp, MAP_CACHE_FILE) < 0)
+			unlink(tmp);
+		else
+			cp_log(LDEBUG, "map-cache: %u entries saved\n", hdr.count);
+	}
+	pthread_mutex_unlock(&mc_save_mutex);
+	free(buf);
+}
+
+/* Install entries of map-cache file still valid, return their number */
+	static int
+mc_load(void)
+{
+	struct mc_file_hdr hdr;
+	struct mc_file_rec fr;
+	struct mc_file_loc fl;
+	struct prefix p;
+	struct list_t *rloc;
+	struct map_entry *me;
+	uint64_t elapsed, now;
+	uint32_t i, j;
+	int fd, n, bad;
+	
+	if ((fd = open(MAP_CACHE_FILE, O_RDONLY)) < 0)
+		return 0;
+	if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) || 
+			hdr.magic != MC_FILE_MAGIC || hdr.version != MC_FILE_VERSION) {
+		cp_log(LLOG, "map-cache: %s ignored, bad header\n", MAP_CACHE_FILE);
+		close(fd);
+		return 0;
+	}
+	now = timer_now_ms();
+	elapsed = (time(NULL) > hdr.saved) ? (time(NULL) - hdr.saved) * 1000 : 0;
+	n = 0;
+	for (i = 0; i < hdr.count; i++) {
+		if (read(fd, &fr, sizeof(fr)) != sizeof(fr))
+			break;
+		rloc = list_init();
+		bad = (fr.family == AF_INET) ? fr.prefixlen > 32 :
+			(fr.family == AF_INET6) ? fr.prefixlen > 128 : 1;
+		for (j = 0; j < fr.nloc; j++) {
+			if (read(fd, &fl, sizeof(fl)) != sizeof(fl))
+				break;
+			/* read all locators of a bad record to reach the next one */
+			if (fl.family != AF_INET && fl.family != AF_INET6)
+				bad = 1;
+			if (bad || !rloc || !(me = calloc(1, sizeof(struct map_entry))))
+				continue;
+			me->priority = fl.priority;
+			me->weight = fl.weight;
+			me->L = (fl.flags & MC_LOC_L) ? 1 : 0;
+			me->r = (fl.flags & MC_LOC_R) ? 1 : 0;
+			me->p = (fl.flags & MC_LOC_P) ? 1 : 0;
+			me->rloc.sa.sa_family = fl.family;
+			if (fl.family == AF_INET)
+				memcpy(&me->rloc.sin.sin_addr, fl.addr, sizeof(struct in_addr));
+			else
+				memcpy(&me->rloc.sin6.sin6_addr, fl.addr, sizeof(struct in6_addr));
+			list_insert(rloc, me, NULL);
+		}
+		if (j < fr.nloc || fr.ttl <= elapsed || bad) {
+			if (rloc)
+				list_destroy(rloc, _opl_rloc_free);
+			if (j < fr.nloc)
+				break;
+			continue;
+		}
+		bzero(&p, sizeof(struct prefix));
+		p.family = fr.family;
+		p.prefixlen = fr.prefixlen;
+		memcpy(&p.u.prefix, fr.addr, SIN_LEN(fr.family));
+		
+		/* entry may still be in OpenLISP if only control plane restarted */
+		_mc_track(&p, fr.ttl - elapsed, opl_rloc_dup(rloc), fr.hot,
+					now - min(now, (uint64_t)fr.idle * 1000));
+		opl_install(OPL_UPDATE, &p, rloc, 0, NULL);
+		n++;
+	}
+	close(fd);
+	cp_log(LLOG, "map-cache: %d entries restored from %s\n", n, MAP_CACHE_FILE);
+	return n;
+}
+
+/* Send Map-Requests for entries to refresh, on event loop thread */
+	static void
+mc_refresh_run(void)
+{
+	char c[64];
+	struct mc_entry *e;
+	union sockunion eid;
+	size_t l;
+	
+	while (read(mc_wake[0], c, sizeof(c)) > 0)
+		;
+	if (mc_stop) {
+		opl_drain();
+		mc_save();
+		cp_log(LLOG, "map-cache saved, exit\n");
+		cp_log_stop();
+		exit(EXIT_SUCCESS);
+	}
+	for (;;) {
+		pthread_mutex_lock(&mc_mutex);
+		if (!(e = mc_refresh)) {
+			pthread_mutex_unlock(&mc_mutex);
+			break;
+		}
+		mc_refresh = e->rnext;
+		e->queued = 0;
+		l = (e->state == MC_REFRESH) ? prefix2sockaddr(&e->p, &eid) : 0;
+		pthread_mutex_unlock(&mc_mutex);
+		
+		if (l && check_eid(&eid))
+			new_lookup(&eid, NULL);
+	}
+}
+
+/* Negative cache.
+   Holes from negative Map-Replies and EIDs whose lookup timed out, by
+   covering prefix. A miss matching an entry does not start a lookup.
+   Timeouts back off exponentially from MAP_CACHE_NEG_BACKOFF, the level
+   is remembered during one more interval after the entry is over. */
+
+struct neg_entry {
+	uint64_t expire;	/* msec, misses suppressed until */
+	uint64_t forget;	/* msec, entry removed after */
+	int backoff;		/* timeouts in a row */
+};
+
+static struct db_table *neg_db4;
+static struct db_table *neg_db6;
+static unsigned int neg_count;
+static struct timer_ev neg_sweep;
+static pthread_mutex_t neg_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+	static struct db_table *
+_neg_table(struct prefix *p)
+{
+	return (p->family == AF_INET) ? neg_db4 : neg_db6;
+}
+
+	static int
+_neg_prefix(union sockunion *eid, struct prefix *p)
+{
+	bzero(p, sizeof(struct prefix));
+	if (!sockaddr2prefix(eid, p))
+		return 0;
+	p->prefixlen = (p->family == AF_INET) ? 32 : 128;
+	return 1;
+}
+
+/* Requires neg_mutex */
+	static void
+_neg_delete(struct db_node *node)
+{
+	free(db_node_set_info(node, NULL));
+	neg_count--;
+	db_unlock_node(node);
+}
+
+/* Requires neg_mutex. Return entry of exact prefix, created if needed */
+	static struct neg_entry *
+_neg_get(struct prefix *p)
+{
+	struct db_node *node;
+	struct neg_entry *ne;
+	
+	node = db_node_get(_neg_table(p), p);
+	if ((ne = node->info) != NULL) {
+		db_unlock_node(node);
+		return ne;
+	}
+	if (neg_count >= MAP_CACHE_NEG_MAX || !(ne = calloc(1, sizeof(struct neg_entry)))) {
+		db_unlock_node(node);
+		return NULL;
+	}
+	/* lock of db_node_get() is kept by the entry */
+	db_node_set_info(node, ne);
+	neg_count++;
+	return ne;
+}
+
+/* Return 1 if misses for eid are suppressed */
+	static int
+neg_lookup(union sockunion *eid)
+{
+	struct prefix p;
+	struct db_node *node;
+	int rt;
+	
+	if (!neg_db4 || !_neg_prefix(eid, &p))
+		return 0;
+	pthread_mutex_lock(&neg_mutex);
+	rt = 0;
+	if ((node = db_node_match(_neg_table(&p), &p)) != NULL) {
+		rt = (((struct neg_entry *)node->info)->expire > timer_now_ms());
+		db_unlock_node(node);
+	}
+	pthread_mutex_unlock(&neg_mutex);
+	return rt;
+}
+
+/* Negative Map-Reply for hole p, ttl in minutes */
+	static void
+neg_add(struct prefix *p, uint32_t ttl)
+{
+	struct prefix hole;
+	struct neg_entry *ne;
+	
+	if (!ttl || !neg_db4)
+		return;
+	memcpy(&hole, p, sizeof(struct prefix));
+	apply_mask(&hole);
+	pthread_mutex_lock(&neg_mutex);
+	if ((ne = _neg_get(&hole)) != NULL) {
+		ne->expire = timer_now_ms() + (uint64_t)min(ttl, MAP_CACHE_MAX_TTL) * 60 * 1000;
+		ne->forget = ne->expire;
+		ne->backoff = 0;
+	}
+	pthread_mutex_unlock(&neg_mutex);
+}
+
+/* Lookup of eid timed out */
+	static void
+neg_timeout(union sockunion *eid)
+{
+	struct prefix p;
+	struct neg_entry *ne;
+	uint64_t now, wait;
+	
+	if (!neg_db4 || !_neg_prefix(eid, &p))
+		return;
+	pthread_mutex_lock(&neg_mutex);
+	if ((ne = _neg_get(&p)) != NULL) {
+		now = timer_now_ms();
+		if (ne->forget <= now)
+			ne->backoff = 0;
+		wait = min((uint64_t)MAP_CACHE_NEG_BACKOFF << min(ne->backoff, 16), 
+					(uint64_t)MAP_CACHE_NEG_BACKOFF_MAX) * 1000;
+		ne->backoff++;
+		ne->expire = now + wait;
+		ne->forget = ne->expire + wait;
+		cp_log(LDEBUG, "negative cache: %s backoff %d sec\n", 
+					(char *)prefix2str(&p), (int)(wait / 1000));
+	}
+	pthread_mutex_unlock(&neg_mutex);
+}
+
+/* Mapping found for p: drop entries it covers */
+	static void
+neg_remove(struct prefix *p)
+{
+	struct prefix q;
+	struct db_node *top, *node;
+	
+	if (!neg_db4)
+		return;
+	memcpy(&q, p, sizeof(struct prefix));
+	apply_mask(&q);
+	pthread_mutex_lock(&neg_mutex);
+	top = db_node_get(_neg_table(&q), &q);
+	for (node = db_lock_node(top); node; node = db_route_next_until(node, top))
+		if (node->info)
+			_neg_delete(node);
+	db_unlock_node(top);
+	pthread_mutex_unlock(&neg_mutex);
+}
+
+	static void
+_neg_sweep(void *data)
+{
+	struct db_table *t[2] = { neg_db4, neg_db6 };
+	struct db_node *node;
+	uint64_t now;
+	int i;
+	
+	now = timer_now_ms();
+	pthread_mutex_lock(&neg_mutex);
+	for (i = 0; i < 2; i++)
+		for (node = db_table_top(t[i]); node; node = db_route_next(node))
+			if (node->info && ((struct neg_entry *)node->info)->forget <= now)
+				_neg_delete(node);
+	pthread_mutex_unlock(&neg_mutex);
+	timer_add(&neg_sweep, MAP_CACHE_NEG_SWEEP * 1000, _neg_sweep, NULL);
+}
+
+	static int
+mc_init(void)
+{
+	struct prefix p;
+	
+	/* roots of negative cache, never removed */
+	neg_db4 = db_table_init(NULL);
+	neg_db6 = db_table_init(NULL);
+	str2prefix("0.0.0.0/0", &p);
+	db_node_get(neg_db4, &p);
+	str2prefix("0::/0", &p);
+	db_node_get(neg_db6, &p);
+	timer_add(&neg_sweep, MAP_CACHE_NEG_SWEEP * 1000, _neg_sweep, NULL);
+	timer_add(&mc_save_timer, MAP_CACHE_SAVE * 1000, _mc_save_timeout, NULL);
+	
+	if (pipe(mc_wake) < 0)
+		return -1;
+	fcntl(mc_wake[0], F_SETFL, O_NONBLOCK);
+	fcntl(mc_wake[1], F_SETFL, O_NONBLOCK);
+	return 0;
+}
+
 /* get map-reply */
 	int 
 read_mr(int idx)
@@ -748,6 +1810,7 @@ read_mr(int idx)
 	socklen_t sockaddr_len;
 	int rec_len;
 	char ip[INET6_ADDRSTRLEN];
+	struct miss_trace *tr;
 	
 	if (lookups[idx].mr->sa.sa_family == AF_INET)
 		sockaddr_len = sizeof(struct sockaddr_in);
@@ -777,27 +1840,37 @@ read_mr(int idx)
 					nonce0,nonce1);
 	
 		
-	for (i = 0;i <= MAX_COUNT ; i++) {
+	for (i = 0;i < lookups[idx].count && i < MAX_COUNT ; i++) {
 		if (lookups[idx].nonce0[i] == nonce0 && lookups[idx].nonce1[i] == nonce1)
 			break;		
 	}
-	if (i > MAX_COUNT)
+	if (i >= lookups[idx].count || i >= MAX_COUNT) {
+		stats_inc(STAT_DROP_REPLY);
 		return 0;
+	}
+	mr_reply(lookups[idx].tx_mr[i], _usec_since(&lookups[idx].tx[i]));
 		
 	if (lh->record_count <= 0)
 		return 0;
 
 	/* process map-reply */
 	lcm = (union map_reply_record_generic *)CO(lh,sizeof(struct  map_reply_hdr));
+	tr = _trace_reply(idx, i);
 	
 	for (i = 0; i < lh->record_count; i++) {
-		if ((rec_len = read_rec(lcm)) < 0) {
+		if ((rec_len = read_rec(lcm, &tr)) < 0) {
 			cp_log(LLOG, "Record error\n");
+			_trace_error(tr);
 			return -1;
 		}
 		lcm = (union map_reply_record_generic *)CO(lcm,rec_len);
 	}
+	/* no record installed */
+	_trace_error(tr);
 	
+	stats_inc(STAT_MISS_RESOLVED);
+	stats_hist_since(HIST_MISS, &lookups[idx].start);
+	timer_del(&lookups[idx].retry);
 	lookups[idx].active = 0;
     	if (srcport_rand)
 		close(lookups[idx].rx);
@@ -816,6 +1889,7 @@ get_mr(void *data)
 	int rec_len;
 	char ip[INET6_ADDRSTRLEN];
 	char *buf;
+	struct miss_trace *tr;
 	
 	pke = (struct pk_req_entry *)data;
 	buf = pke->buf;
@@ -834,32 +1908,44 @@ get_mr(void *data)
 					nonce0,nonce1);
 			
 	for (idx = 1; idx < MAX_LOOKUPS; idx++) {
-		for (i = 0; i <= MAX_COUNT ; i++) {
+		if (!lookups[idx].active)
+			continue;
+		for (i = 0; i < lookups[idx].count && i < MAX_COUNT ; i++) {
 			if (lookups[idx].nonce0[i] == nonce0 && lookups[idx].nonce1[i] == nonce1)
 				break;		
 		}
-		if (i > MAX_COUNT)
+		if (i >= lookups[idx].count || i >= MAX_COUNT)
 			continue;
 		else
 			break;
 	}	
 	
-	if (idx > MAX_LOOKUPS)
+	if (idx >= MAX_LOOKUPS) {
+		stats_inc(STAT_DROP_REPLY);
 		return 0;
+	}
+	mr_reply(lookups[idx].tx_mr[i], _usec_since(&lookups[idx].tx[i]));
 		
 	if (lh->record_count <= 0)
 		return 0;
 
 	/* process map-reply */
 	lcm = (union map_reply_record_generic *)CO(lh,sizeof(struct  map_reply_hdr));
+	tr = _trace_reply(idx, i);
 	
 	for (i = 0; i < lh->record_count; i++) {
-		if ((rec_len = read_rec(lcm)) < 0) {
+		if ((rec_len = read_rec(lcm, &tr)) < 0) {
 			cp_log(LLOG, "Record error\n");
+			_trace_error(tr);
 			return -1;
 		}
 		lcm = (union map_reply_record_generic *)CO(lcm,rec_len);
-	}	
+	}
+	/* no record installed */
+	_trace_error(tr);	
+	stats_inc(STAT_MISS_RESOLVED);
+	stats_hist_since(HIST_MISS, &lookups[idx].start);
+	timer_del(&lookups[idx].retry);
 	lookups[idx].active = 0;    
 	return 0;
 }
@@ -869,58 +1955,37 @@ get_mr(void *data)
 	static void 
 event_loop(void)
 {	
+	/* poll() waits for mapping socket events, map-cache refreshes,
+	   retransmissions signalled by the timer thread and Map-Replies */
 	for (;;) {
-        int e, i, j, l = -1;
-        int poll_timeout = INFTIM; /* poll() timeout in milliseconds. We initialize
-                                   to INFTIM = -1 (infinity). If there are no
-                                   active lookups, we wait in poll() until a
-                                   mapping socket event is received. */
-        struct timespec now, deadline, delta, to, tmp;
+        int e, i, j;
 		
-        to.tv_sec  = timeout;
-        to.tv_nsec = 0;
-
-        nfds = 1;
-
-        clock_gettime(CLOCK_REALTIME, &now);
-
-        for (i = 1; i < MAX_LOOKUPS; i++) {
-            if (!(lookups[i].active)) continue;
-
-            deadline.tv_sec = lookups[i].start.tv_sec + (lookups[i].count +1) * timeout; 
-            deadline.tv_nsec = lookups[i].start.tv_nsec;
-
-            timespec_subtract(&delta, &deadline, &now);
-			if (srcport_rand) {
+        nfds = 3;
+		if (srcport_rand) {
+			for (i = 1; i < MAX_LOOKUPS; i++) {
+				if (!(lookups[i].active)) continue;
 				fds[nfds].fd     = lookups[i].rx;
 				fds[nfds].events = POLLIN;
 				fds_idx[nfds]    = i;
 				nfds++;
 			}
-			
-            /* Find the minimum delta */
-            if (timespec_subtract(&tmp, &delta, &to)) {
-				to.tv_sec    = delta.tv_sec;
-                to.tv_nsec   = delta.tv_nsec;
-                poll_timeout = to.tv_sec * 1000 + to.tv_nsec / 1000000;
-                if (to.tv_sec < 0) poll_timeout = 0;
-                l = i;
-            }			
-        } /* Finished iterating through all lookups */
-
-        e = poll(fds, nfds, poll_timeout);
-        if (e < 0) continue;
-        if (e == 0)                             /* If timeout expires */
-            if (l >= 0)                         /* and slot is defined */
-	         send_mr(l);                    /* retry Map-Request */
-        for (j = nfds - 1; j >= 0; j--) {
+		}
+
+		/* Map-Replies first, then new misses */
+        e = poll(fds, nfds, miss_head ? TIMER_TICK_MS : INFTIM);
+        for (j = nfds - 1; e > 0 && j >= 0; j--) {
             if (fds[j].revents == POLLIN) {
 				if (j == 0)
-                    map_message_handler(_get_mr());
+                    map_message_handler();
+				else if (j == 1)
+					mc_refresh_run();
+				else if (j == 2)
+					_lookup_retry_run();
                 else
                     read_mr(fds_idx[j]);
             }
         }
+		miss_dispatch();
     }
 }
 
@@ -937,6 +2002,7 @@ plugin_openlisp(void *data)
 {
 	int i;
 	struct protoent	    *proto;
+	pthread_t writer_th;
 
 	if ((proto = getprotobyname("UDP")) == NULL) {
 		perror ("getprotobyname");
@@ -950,11 +2016,30 @@ plugin_openlisp(void *data)
 		openlispsck = socket(PF_MAP, SOCK_RAW, 0);
 	}
 
+	pthread_create(&writer_th, NULL, opl_writer, NULL);
+
 	lookups[0].rx = fds[0].fd = openlispsck;
     fds[0].events = POLLIN;
     fds_idx[0] = -1;
-    nfds = 1;
+	if (mc_init() < 0) {
+		cp_log(LLOG, "Can not create wake-up pipe of map-cache\n");
+		exit(1);
+	}
+	fds[1].fd = mc_wake[0];
+	fds[1].events = POLLIN;
+	fds_idx[1] = -1;
+	if (pipe(retry_wake) < 0) {
+		cp_log(LLOG, "Can not create wake-up pipe of lookups\n");
+		exit(1);
+	}
+	fcntl(retry_wake[0], F_SETFL, O_NONBLOCK);
+	fcntl(retry_wake[1], F_SETFL, O_NONBLOCK);
+	fds[2].fd = retry_wake[0];
+	fds[2].events = POLLIN;
+	fds_idx[2] = -1;
+    nfds = 3;
 
+	_miss_init();
 	/* Initialize lookups[]: all inactive */
 	for (i = 0; i < MAX_LOOKUPS; i++)
         lookups[i].active = 0;
@@ -965,11 +2050,16 @@ plugin_openlisp(void *data)
 	if (_fncs & (_FNC_XTR | _FNC_RTR)) {
 		while (ptr != &etr_db->tail) {
 			if ((node = (struct db_node *)(ptr->data))) {
-				opl_update(openlispsck, node, 1);			
+				opl_install(OPL_UPDATE, &node->p, opl_rloc_dup(node->info), 1, NULL);
 			}
 			ptr = ptr->next;
 		}
 	}
+	/* warm restart: mappings back in data plane before the first miss */
+	if ((_fncs & _FNC_XTR) && mc_load() > 0)
+		opl_drain();
+	signal(SIGTERM, _mc_shutdown);
+	signal(SIGINT, _mc_shutdown);
 	event_loop();	
   	pthread_exit(NULL);
 	return 0;
@@ -1004,11 +2094,12 @@ opl_errno(int oerrno)
 }
 	
 	void *
-opl_new_msg(uint16_t version, uint16_t map_type, uint32_t map_flags, uint16_t map_addrs)
+opl_new_msg(void *buf, uint16_t version, uint16_t map_type, uint32_t map_flags, uint16_t map_addrs)
 {
 	struct map_msghdr *mhdr;
 		
-	mhdr = calloc(PSIZE+sizeof(struct map_msghdr), sizeof(char));
+	mhdr = buf;
+	bzero(mhdr, OPL_MSGSIZE);
 	mhdr->map_version = version;
 	mhdr->map_type =  map_type;      
 	mhdr->map_flags = map_flags;
@@ -1093,6 +2184,44 @@ opl_sockaddr2mask(union sockunion *sk, int *rs)
 	return 0;
 }
 
+/* MAPM_DELETE of a map-cache mapping OpenLISP found unused */
+	static void
+_mc_deleted(char *msg, ssize_t n)
+{
+	struct map_msghdr *mhdr = (struct map_msghdr *)msg;
+	union sockunion *sk;
+	struct prefix p;
+	u_char *b, m;
+	ssize_t l;
+	int i, off;
+	
+	if (!(mhdr->map_addrs & MAPA_EID))
+		return;
+	sk = (union sockunion *)CO(msg, sizeof(struct map_msghdr));
+	bzero(&p, sizeof(struct prefix));
+	if (!sockaddr2prefix(sk, &p) || sizeof(struct map_msghdr) + _get_sock_size(sk) > n)
+		return;
+	p.prefixlen = (p.family == AF_INET) ? 32 : 128;
+	
+	l = sizeof(struct map_msghdr) + SS_LEN(sk);
+	if ((mhdr->map_addrs & MAPA_EIDMASK) && l < n) {
+		/* radix mask: family may be unset and trailing zero octets cut */
+		sk = (union sockunion *)CO(msg, l);
+		b = (u_char *)sk;
+		off = (p.family == AF_INET) ? (u_char *)&sk->sin.sin_addr - b : 
+					(u_char *)&sk->sin6.sin6_addr - b;
+		p.prefixlen = 0;
+		for (i = off; i < sk->sa.sa_len && i < off + SIN_LEN(p.family) && l + i < n; i++) {
+			for (m = b[i]; m & 0x80; m <<= 1)
+				p.prefixlen++;
+			if (b[i] != 255)
+				break;
+		}
+	}
+	apply_mask(&p);
+	_mc_idle(&p);
+}
+
 /* Add a mapping to database of openlisp 
 	db = 1:database, db=0:cache
 */
@@ -1208,10 +2337,9 @@ opl_add_rloc(void *buf, struct db_node *mapp)
 	return mhdr->map_msglen;
 }
 
-	int 
-opl_add(int s, struct db_node *mapp, int db)
+	static int 
+_opl_msg_add(void *buf, struct db_node *mapp, int db)
 {
-	void *buf;
 	ssize_t l;
 	int lcount;
 	struct list_t *ll;
@@ -1227,9 +2355,10 @@ opl_add(int s, struct db_node *mapp, int db)
 	if (lcount == 0 && _petr == NULL)
 		map_neg = MAPF_NEGATIVE;
 		
-	buf = opl_new_msg(MAPM_VERSION, \
+	/* map-cache not static: OpenLISP deletes unused entries, see _mc_idle() */
+	opl_new_msg(buf, MAPM_VERSION, \
 						MAPM_ADD,\
-						((db == 1? MAPF_DB: 0) | MAPF_STATIC | MAPF_UP) | map_neg,\
+						((db == 1? MAPF_DB | MAPF_STATIC: 0) | MAPF_UP) | map_neg,\
                                                 MAPA_EID | (map_neg? 0 : MAPA_RLOC));
 	
 	if ((l = opl_add_mapp(buf, mapp)) <= 0)
@@ -1238,61 +2367,28 @@ opl_add(int s, struct db_node *mapp, int db)
 		return -1;
 	if (lcount == 0 && _petr && (l = opl_add_rloc(buf, _petr)) <=0)
 		return -1;
-	cp_log(LLOG, "add %s %s", (db ==1 ? "database":"cache"), (char *)prefix2str(&mapp->p));	
-	
-	/*send to openlisp database */
-	errno = 0;
-	if ((l = write(s, (char *)buf, l)) < 0 ) {
-		if (_debug == LLOG || _debug == LDEBUG)
-			opl_errno(errno);
-		return -1;
-	}
-	
-	if (_debug == LLOG || _debug == LDEBUG)
-		opl_errno(0);
 	return l;
 }
 
 /* Delete a mapping from Openlisp database
 	db: for future
 */
-	int 
-opl_del(int s, struct db_node *mapp, int db)
+	static int 
+_opl_msg_del(void *buf, struct db_node *mapp, int db)
 {
-	
-	void *buf;
-	ssize_t l;
-		
-	buf = opl_new_msg(MAPM_VERSION, \
+	opl_new_msg(buf, MAPM_VERSION, \
 						MAPM_DELETE,\
 						(db == 1? MAPF_DB: MAPF_ALL) | MAPF_STATIC | MAPF_UP,\
 						MAPA_EID);
 	
-	if ((l=opl_add_mapp(buf, mapp)) < 0)
-		return -1;
-		
-	cp_log(LLOG, "delete  %s", (char *)prefix2str(&mapp->p));	
-	
-	/*send to openlisp database */
-	errno = 0;
-	/*send to openlisp database */
-	if ((l = write(s, (char *)buf, l)) < 0) {
-		if (_debug == LLOG || _debug == LDEBUG)
-			opl_errno(errno);
-		return -1;
-	}
-		
-	if (_debug == LLOG || _debug == LDEBUG)
-		opl_errno(0);	
-	
-	return l;
+	return opl_add_mapp(buf, mapp);
 }
 
 /* Find a mapping from Openlisp database */
 	int 
 opl_get(int s, struct db_node *mapp, int db, struct db_node *rs)
 {
-	void *buf;
+	char buf[OPL_MSGSIZE];
 	struct map_msghdr *mhdr;
 	void *mmc;
 	union sockunion *rc;
@@ -1301,7 +2397,7 @@ opl_get(int s, struct db_node *mapp, int db, struct db_node *rs)
 	int c_seq, c;
 	pid_t   c_pid;  
 	
-	buf = opl_new_msg(MAPM_VERSION, \
+	opl_new_msg(buf, MAPM_VERSION, \
 						MAPM_GET,\
 						(db?MAPF_DB:MAPF_ALL) | MAPF_STATIC | MAPF_UP,\
 						MAPA_EID);
@@ -1388,12 +2484,239 @@ opl_get(int s, struct db_node *mapp, int db, struct db_node *rs)
 	return 0;
 }
 
-/* update db */
-	int 
-opl_update(int s, struct db_node *node, uint8_t db)
-{	
-	opl_del(s,node,db);
-	opl_add(s,node,db);
-	return 0;
+/* Asynchronous installation.
+   Requests are queued by EID-prefix: a new request for a pending prefix
+   is merged in place (last locators win, a delete cancels a pending add),
+   so a burst of Map-Replies for the same EID costs one message. The writer
+   thread takes the whole queue at once, builds up to OPL_BATCH messages
+   in its buffer ring and writes them back to back, callers never block
+   on the mapping socket. */
+
+struct opl_req {
+	struct opl_req *next;		/* FIFO order */
+	struct opl_req *hnext;		/* same hash bucket */
+	struct prefix p;
+	struct list_t *rloc;		/* owned, NULL for delete */
+	struct miss_trace *trace;	/* resolutions waiting for this install */
+	uint8_t op;
+	uint8_t db;
+};
+
+static struct opl_req *opl_hash[OPL_HASH];
+static struct opl_req *opl_head;
+static struct opl_req **opl_tail = &opl_head;
+static pthread_mutex_t opl_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t opl_cv = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t opl_idle = PTHREAD_COND_INITIALIZER;
+static int opl_busy;		/* writer has requests out of the queue */
+static int mc_save_req;		/* writer has to save the map-cache */
+
+	static int
+_opl_rloc_free(void *data)
+{
+	free(data);
+	return 1;
+}
+
+	static void
+_opl_req_free(struct opl_req *r)
+{
+	if (r->rloc)
+		list_destroy(r->rloc, _opl_rloc_free);
+	_trace_end(r->trace);
+	free(r);
+}
+
+	static int
+_opl_prefix_same(struct prefix *a, struct prefix *b)
+{
+	return (a->family == b->family && a->prefixlen == b->prefixlen &&
+		memcmp(&a->u.prefix, &b->u.prefix, 
+			(a->family == AF_INET) ? sizeof(struct in_addr) : sizeof(struct in6_addr)) == 0);
+}
+
+	static unsigned int
+_opl_hash(struct prefix *p, uint8_t db)
+{
+	uint32_t h;
+	int i, n;
+	
+	h = p->prefixlen ^ (db << 8);
+	n = (p->family == AF_INET) ? sizeof(struct in_addr) : sizeof(struct in6_addr);
+	for (i = 0; i < n; i++)
+		h = h * 31 + (&p->u.prefix)[i];
+	return h % OPL_HASH;
+}
+
+	static int
+_opl_same(struct opl_req *r, struct prefix *p, uint8_t db)
+{
+	return (r->db == db && _opl_prefix_same(&r->p, p));
+}
+
+/* Copy of a locator list, for callers keeping their own */
+	struct list_t *
+opl_rloc_dup(struct list_t *rloc)
+{
+	struct list_t *rs;
+	struct list_entry_t *ptr;
+	struct map_entry *e;
+	
+	if (!rloc || !(rs = list_init()))
+		return NULL;
+	for (ptr = rloc->head.next; ptr != &rloc->tail; ptr = ptr->next) {
+		if (!(e = malloc(sizeof(struct map_entry))))
+			break;
+		memcpy(e, ptr->data, sizeof(struct map_entry));
+		e->pe = NULL;
+		list_insert(rs, e, NULL);
+	}
+	return rs;
+}
+
+/* Queue installation of a mapping, rloc is handed over (may be NULL) */
+	void
+opl_install(uint8_t op, struct prefix *p, struct list_t *rloc, uint8_t db, 
+				struct miss_trace *tr)
+{
+	struct opl_req *r;
+	unsigned int h;
+	
+	if (op == OPL_DEL && rloc) {
+		list_destroy(rloc, _opl_rloc_free);
+		rloc = NULL;
+	}
+	h = _opl_hash(p, db);
+	pthread_mutex_lock(&opl_mutex);
+	for (r = opl_hash[h]; r; r = r->hnext)
+		if (_opl_same(r, p, db))
+			break;
+	if (r) {
+		/* merge with pending request */
+		r->op = (op == OPL_DEL) ? OPL_DEL : (r->op | op);
+		if (r->rloc)
+			list_destroy(r->rloc, _opl_rloc_free);
+		r->rloc = rloc;
+		if (tr) {
+			tr->next = r->trace;
+			r->trace = tr;
+		}
+		pthread_mutex_unlock(&opl_mutex);
+		return;
+	}
+	if (!(r = calloc(1, sizeof(struct opl_req)))) {
+		pthread_mutex_unlock(&opl_mutex);
+		cp_log(LLOG, "opl_install: not enough memory\n");
+		if (rloc)
+			list_destroy(rloc, _opl_rloc_free);
+		_trace_end(tr);
+		return;
+	}
+	memcpy(&r->p, p, sizeof(struct prefix));
+	r->rloc = rloc;
+	r->trace = tr;
+	r->op = op;
+	r->db = db;
+	r->hnext = opl_hash[h];
+	opl_hash[h] = r;
+	*opl_tail = r;
+	opl_tail = &r->next;
+	pthread_cond_signal(&opl_cv);
+	pthread_mutex_unlock(&opl_mutex);
+}
+
+/* Ask the writer to save the map-cache, out of the timer thread */
+	static void
+opl_save_request(void)
+{
+	pthread_mutex_lock(&opl_mutex);
+	mc_save_req = 1;
+	pthread_cond_signal(&opl_cv);
+	pthread_mutex_unlock(&opl_mutex);
+}
+
+/* Wait until all queued mappings are written to OpenLISP */
+	static void
+opl_drain(void)
+{
+	pthread_mutex_lock(&opl_mutex);
+	while (opl_head || opl_busy)
+		pthread_cond_wait(&opl_idle, &opl_mutex);
+	pthread_mutex_unlock(&opl_mutex);
+}
+
+/* Thread owning writes of mappings to OpenLISP */
+	static void *
+opl_writer(void *data)
+{
+	static char ring[OPL_BATCH][OPL_MSGSIZE];
+	int len[OPL_BATCH];
+	struct opl_req *req[OPL_BATCH];
+	struct opl_req *q, *r;
+	struct db_node node;
+	struct map_msghdr *mhdr;
+	int n, i, l, e, save;
+	
+	for (;;) {
+		pthread_mutex_lock(&opl_mutex);
+		opl_busy = 0;
+		if (!opl_head)
+			pthread_cond_broadcast(&opl_idle);
+		while (!opl_head && !mc_save_req)
+			pthread_cond_wait(&opl_cv, &opl_mutex);
+		q = opl_head;
+		opl_head = NULL;
+		opl_tail = &opl_head;
+		bzero(opl_hash, sizeof(opl_hash));
+		save = mc_save_req;
+		mc_save_req = 0;
+		opl_busy = 1;
+		pthread_mutex_unlock(&opl_mutex);
+		
+		if (save)
+			mc_save();
+		
+		while (q) {
+			/* build a batch, an update takes two slots */
+			for (n = 0; q && n < OPL_BATCH - 1; ) {
+				r = q;
+				q = q->next;
+				bzero(&node, sizeof(struct db_node));
+				memcpy(&node.p, &r->p, sizeof(struct prefix));
+				node.info = r->rloc;
+				if ((r->op & OPL_DEL) && (l = _opl_msg_del(ring[n], &node, r->db)) > 0) {
+					req[n] = r;
+					len[n++] = l;
+				}
+				if ((r->op & OPL_ADD) && (l = _opl_msg_add(ring[n], &node, r->db)) > 0) {
+					req[n] = r;
+					len[n++] = l;
+				}
+				if (!n || req[n - 1] != r)
+					_opl_req_free(r);
+			}
+			
+			/* flush */
+			for (i = 0; i < n; i++) {
+				mhdr = (struct map_msghdr *)ring[i];
+				cp_log(LLOG, "%s %s %s", 
+					(mhdr->map_type == MAPM_ADD) ? "add" : "delete",
+					(req[i]->db == 1 ? "database":"cache"), 
+					(char *)prefix2str(&req[i]->p));
+				errno = 0;
+				/* hypervisor ring if any, only a message it drops is an error */
+				e = hv_east_send(ring[i], len[i]);
+				if (e == HV_EAST_DROPPED || 
+						(e < 0 && write(openlispsck, ring[i], len[i]) < 0)) {
+					if (_debug == LLOG || _debug == LDEBUG)
+						opl_errno(errno);
+				}else if (_debug == LLOG || _debug == LDEBUG)
+					opl_errno(0);
+				if (i == n - 1 || req[i + 1] != req[i])
+					_opl_req_free(req[i]);
+			}
+		}
+	}
+	return NULL;
 }
 #endif
@@ -6,6 +6,10 @@ extern struct communication_fct udp_fct;
 	void
 plumb()
 {
+	/* ADD timer wheel, used by every front-end */
+	pthread_t timer_th;
+	pthread_create(&timer_th, NULL, timer_run, NULL);
+
 	/* ADD CLI front-end to the server */
 	pthread_t cli_th;
 	pthread_create(&cli_th, NULL, cli_fct.start_communication, NULL);
@@ -13,6 +17,10 @@ plumb()
 	/* ADD UDP draft-ietf-lisp-23 front-end to the server */
 	pthread_t udp_th;
 	pthread_create(&udp_th, NULL, udp_fct.start_communication, NULL);
+
+	/* ADD statistics control socket */
+	pthread_t stats_th;
+	pthread_create(&stats_th, NULL, stats_start_ctl, NULL);
 		
 	pthread_join(cli_th, NULL);
 	pthread_join(udp_th, NULL);	
@@ -0,0 +1,224 @@
+#include "lib.h"
+
+/* Health of Map-Resolvers of xTR.
+   RTT is estimated from replies matched by nonce to the Map-Request that
+   got them, so retransmissions do not bias it (RFC 6298 smoothing).
+   MR_FAIL_MAX timeouts in a row cut a resolver off for MR_OPEN_TIME,
+   doubled at each new timeout while it keeps failing; once the time is
+   over it can be selected again and the first reply closes the circuit. */
+
+static pthread_mutex_t mr_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+const char *mr_outcome_name[MR_OUT_MAX] = {
+	"positive",
+	"negative",
+	"timeout",
+	"error",
+};
+
+/* Requires mr_mutex */
+	static uint64_t
+_mr_score(struct mr_entry *mr)
+{
+	if (!mr->srtt)
+		return MR_RTT_INIT * 1000;
+	return (uint64_t)mr->srtt + 4 * (uint64_t)mr->rttvar;
+}
+
+/* Requires mr_mutex */
+	static int
+_mr_usable(struct mr_entry *mr, struct mr_entry *exclude, int family, uint64_t now)
+{
+	return (mr != exclude && mr->open_until <= now &&
+			(!family || mr->addr.sa.sa_family == family));
+}
+
+	struct mr_entry *
+mr_select(struct mr_entry *exclude, int family)
+{
+	struct list_entry_t *ptr;
+	struct mr_entry *mr, *a, *b, *best;
+	uint64_t now;
+	int n, i, j, k;
+
+	if (!xtr_mr || !xtr_mr->count)
+		return NULL;
+	now = timer_now_ms();
+	pthread_mutex_lock(&mr_mutex);
+	n = 0;
+	for (ptr = xtr_mr->head.next; ptr != &xtr_mr->tail; ptr = ptr->next)
+		if (_mr_usable(ptr->data, exclude, family, now))
+			n++;
+
+	best = NULL;
+	if (n > 0) {
+		/* power of two choices */
+		i = random() % n;
+		j = (n > 1) ? (i + 1 + random() % (n - 1)) % n : i;
+		a = b = NULL;
+		k = 0;
+		for (ptr = xtr_mr->head.next; ptr != &xtr_mr->tail; ptr = ptr->next) {
+			if (!_mr_usable(ptr->data, exclude, family, now))
+				continue;
+			if (k == i)
+				a = ptr->data;
+			if (k == j)
+				b = ptr->data;
+			k++;
+		}
+		best = (_mr_score(a) <= _mr_score(b)) ? a : b;
+	}else{
+		/* all cut off: the one back first, exclude as last resort */
+		for (ptr = xtr_mr->head.next; ptr != &xtr_mr->tail; ptr = ptr->next) {
+			mr = ptr->data;
+			if (family && mr->addr.sa.sa_family != family)
+				continue;
+			if (!best || (best == exclude && mr != exclude) ||
+					(mr != exclude && mr->open_until < best->open_until))
+				best = mr;
+		}
+	}
+	pthread_mutex_unlock(&mr_mutex);
+	return best;
+}
+
+	void
+mr_sent(struct mr_entry *mr)
+{
+	if (mr)
+		__atomic_add_fetch(&mr->sent, 1, __ATOMIC_RELAXED);
+}
+
+	void
+mr_reply(struct mr_entry *mr, uint64_t rtt)
+{
+	uint32_t r, delta;
+
+	if (!mr)
+		return;
+	r = min(rtt, (uint64_t)UINT32_MAX / 8);
+	pthread_mutex_lock(&mr_mutex);
+	if (!mr->srtt) {
+		mr->srtt = max(r, 1);
+		mr->rttvar = r / 2;
+	}else{
+		delta = (mr->srtt > r) ? mr->srtt - r : r - mr->srtt;
+		mr->rttvar = (3 * mr->rttvar + delta) / 4;
+		mr->srtt = max((7 * mr->srtt + r) / 8, 1);
+	}
+	mr->fails = 0;
+	mr->open_until = 0;
+	mr->replies++;
+	pthread_mutex_unlock(&mr_mutex);
+}
+
+	void
+mr_timeout(struct mr_entry *mr)
+{
+	char ip[INET6_ADDRSTRLEN];
+	uint64_t open;
+
+	if (!mr)
+		return;
+	pthread_mutex_lock(&mr_mutex);
+	mr->timeouts++;
+	if (++mr->fails >= MR_FAIL_MAX) {
+		open = min((uint64_t)MR_OPEN_TIME << min(mr->fails - MR_FAIL_MAX, 16),
+					(uint64_t)MR_OPEN_TIME_MAX);
+		mr->open_until = timer_now_ms() + open * 1000;
+		cp_log(LLOG, "Map-Resolver %s: %d timeouts, not used for %d sec\n",
+					sk_get_ip(&mr->addr, ip), mr->fails, (int)open);
+	}
+	pthread_mutex_unlock(&mr_mutex);
+}
+
+	uint32_t
+mr_rto(struct mr_entry *mr)
+{
+	uint64_t rto;
+
+	if (!mr)
+		return MAP_REPLY_TIMEOUT * 1000;
+	pthread_mutex_lock(&mr_mutex);
+	rto = mr->srtt ? _mr_score(mr) / 1000 : MAP_REPLY_TIMEOUT * 1000;
+	pthread_mutex_unlock(&mr_mutex);
+	return min(max(rto, MR_RTO_MIN), MAP_REPLY_TIMEOUT * 1000);
+}
+
+	void
+mr_hist_add(struct mr_entry *mr, enum mr_outcome o, uint64_t usec)
+{
+	if (!mr)
+		return;
+	pthread_mutex_lock(&mr_mutex);
+	if (mr->lat || (mr->lat = calloc(MR_OUT_MAX, sizeof(struct hist))) != NULL)
+		hist_add(&mr->lat[o], usec);
+	pthread_mutex_unlock(&mr_mutex);
+}
+
+	void
+mr_stats_text(FILE *fp)
+{
+	struct list_entry_t *ptr;
+	struct mr_entry *mr;
+	char ip[INET6_ADDRSTRLEN];
+	char name[32];
+	uint64_t now;
+	int o;
+
+	if (!xtr_mr)
+		return;
+	now = timer_now_ms();
+	pthread_mutex_lock(&mr_mutex);
+	for (ptr = xtr_mr->head.next; ptr != &xtr_mr->tail; ptr = ptr->next) {
+		mr = ptr->data;
+		fprintf(fp, "mr %-15s srtt=%u rttvar=%u sent=%llu replies=%llu timeouts=%llu %s\n",
+				sk_get_ip(&mr->addr, ip), mr->srtt, mr->rttvar,
+				(unsigned long long)__atomic_load_n(&mr->sent, __ATOMIC_RELAXED),
+				(unsigned long long)mr->replies,
+				(unsigned long long)mr->timeouts,
+				(mr->open_until > now) ? "down" : "up");
+		for (o = 0; mr->lat && o < MR_OUT_MAX; o++) {
+			snprintf(name, sizeof(name), "  %s_us", mr_outcome_name[o]);
+			hist_text(fp, name, &mr->lat[o]);
+		}
+	}
+	pthread_mutex_unlock(&mr_mutex);
+}
+
+	void
+mr_stats_json(FILE *fp)
+{
+	struct list_entry_t *ptr;
+	struct mr_entry *mr;
+	char ip[INET6_ADDRSTRLEN];
+	uint64_t now;
+	int first, o;
+
+	fprintf(fp, "[");
+	if (!xtr_mr) {
+		fprintf(fp, "]");
+		return;
+	}
+	now = timer_now_ms();
+	first = 1;
+	pthread_mutex_lock(&mr_mutex);
+	for (ptr = xtr_mr->head.next; ptr != &xtr_mr->tail; ptr = ptr->next) {
+		mr = ptr->data;
+		fprintf(fp, "%s{\"address\":\"%s\",\"srtt_us\":%u,\"rttvar_us\":%u,"
+				"\"sent\":%llu,\"replies\":%llu,\"timeouts\":%llu,\"up\":%s,\"latency\":{",
+				first ? "" : ",", sk_get_ip(&mr->addr, ip), mr->srtt, mr->rttvar,
+				(unsigned long long)__atomic_load_n(&mr->sent, __ATOMIC_RELAXED),
+				(unsigned long long)mr->replies,
+				(unsigned long long)mr->timeouts,
+				(mr->open_until > now) ? "false" : "true");
+		for (o = 0; mr->lat && o < MR_OUT_MAX; o++) {
+			fprintf(fp, "%s", o ? "," : "");
+			hist_json(fp, mr_outcome_name[o], &mr->lat[o]);
+		}
+		fprintf(fp, "}}");
+		first = 0;
+	}
+	pthread_mutex_unlock(&mr_mutex);
+	fprintf(fp, "]");
+}
@@ -0,0 +1,37 @@
+#ifndef _RESOLVER_H
+	#define _RESOLVER_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+struct mr_entry;
+
+/* Outcome of a resolution */
+enum mr_outcome {
+	MR_POSITIVE,
+	MR_NEGATIVE,
+	MR_TIMEOUT,
+	MR_ERROR,	/* Map-Reply without usable record, or lookup abandoned */
+	MR_OUT_MAX
+};
+
+extern const char *mr_outcome_name[MR_OUT_MAX];
+
+/* Map-Resolver for a new Map-Request: power of two choices on smoothed
+   RTT among resolvers not cut off. exclude (may be NULL) is avoided if
+   another one can be used, family 0 for any */
+struct mr_entry *mr_select(struct mr_entry *exclude, int family);
+void mr_sent(struct mr_entry *mr);
+/* Map-Reply matching a nonce sent to mr, rtt in microseconds */
+void mr_reply(struct mr_entry *mr, uint64_t rtt);
+/* Map-Request sent to mr got no reply in time */
+void mr_timeout(struct mr_entry *mr);
+/* Retransmission timeout for mr, milliseconds */
+uint32_t mr_rto(struct mr_entry *mr);
+/* Miss to install (or timeout) latency of a resolution by mr */
+void mr_hist_add(struct mr_entry *mr, enum mr_outcome o, uint64_t usec);
+
+void mr_stats_text(FILE *fp);
+void mr_stats_json(FILE *fp);
+
+#endif
@@ -7,9 +7,9 @@
 #include "plugin_hv/plugin_hv.h"
 
 uint32_t _forward_to_etr(void *data,struct db_node *rn);
-FILE *flog;
 int _daemon;
 int _virtual;
+extern int _rings;
 /* support function */
 
 /* create new mapping */
@@ -27,6 +27,7 @@ generic_mapping_new(struct prefix *eid)
 	
 	locs = list_init();
 	db_node_set_info(rn, locs);
+	__atomic_add_fetch(&db_gen, 1, __ATOMIC_RELEASE);
 
 	return ((void *)rn);
 }
@@ -38,6 +39,7 @@ generic_mapping_set_flags(void *mapping, const struct mapping_flags *mflags)
 	struct db_node *rn;
 	uint8_t fns = 0;
 	void *rsvd = NULL; 
+	struct timer_ev *age = NULL;
 	
 	assert(mapping);
 	rn = (struct db_node *)mapping;
@@ -48,12 +50,15 @@ generic_mapping_set_flags(void *mapping, const struct mapping_flags *mflags)
 	else{
 		fns = ((struct mapping_flags *)rn->flags)->range;
 		rsvd = ((struct mapping_flags *)rn->flags)->rsvd;		
+		age = ((struct mapping_flags *)rn->flags)->age;
 	}	
 	
 	memcpy(rn->flags, mflags, sizeof(struct mapping_flags));
 		((struct mapping_flags *)rn->flags)->range = ((struct mapping_flags *)rn->flags)->range | fns;
 	if (!mflags->rsvd)
 		((struct mapping_flags *)rn->flags)->rsvd = rsvd;
+	((struct mapping_flags *)rn->flags)->age = age;
+	__atomic_add_fetch(&db_gen, 1, __ATOMIC_RELEASE);
 	return (TRUE);
 }
 
@@ -71,6 +76,7 @@ generic_mapping_add_rloc(void *mapping, struct map_entry *entry)
 	assert(locs);
 
 	list_insert(locs, entry, _insert_ip_ordered);
+	__atomic_add_fetch(&db_gen, 1, __ATOMIC_RELEASE);
 
 	return (TRUE);
 }
@@ -718,37 +724,13 @@ reconfigure()
 	etr_db = list_init();
 	printf("Parse main configuration file ...\n\n");
 	cp_log(LLOG, "Parse main configuration file ...\n\n");
+	admit_reset_conf();
 	_parser_config(config_file[0]);	
+	admit_reconfigure();
 }
 
 
 /* main function */
-	void 
-reopenlog()
-{
-	FILE *fd;
-
-	fd = freopen("/var/log/opencp.log","a",flog);
-	flog = fd;
-}
-
-	void 
-cp_log(int level, char *format, ...)
-{
-	va_list args;
-	
-	if (_debug >= level) {
-		va_start(args, format);
-		if (flog != NULL) {
-			vfprintf(flog, format, args);
-			fflush(flog);
-		}	
-		else
-			vfprintf(OUTPUT_STREAM, format, args);
-		va_end(args);
-	}	
-}
-
 	int 
 main(int argc, char **argv)
 {		
@@ -756,7 +738,7 @@ main(int argc, char **argv)
 	int c;
 	opterr = 0;
 	_daemon = 0;
-	while ((c = getopt (argc, argv, "df:v")) != -1) {
+	while ((c = getopt (argc, argv, "df:rv")) != -1) {
 		switch (c) {
 		case 'd':
 			_daemon = 1;
@@ -764,6 +746,9 @@ main(int argc, char **argv)
 		case 'f':
 			config_file[0] = optarg;
 			break;
+		case 'r':
+			_rings = 1;
+			break;
 		case 'v':
 			_virtual = 1;
 			break;
@@ -787,6 +772,11 @@ main(int argc, char **argv)
 		exit(EXIT_FAILURE);
 	}
 	
+	if (_rings && !_virtual) {
+		fprintf (stderr, "Option -r requires -v.\n");
+		exit(EXIT_FAILURE);
+	}
+	
 	if (_daemon) {
 		pid_t pid;
  
@@ -811,12 +801,9 @@ main(int argc, char **argv)
 		fclose(fpid);
 	}
 	
-	if (_daemon) {
-		flog = fopen("/var/log/opencp.log","a");
-		signal(SIGUSR1, reopenlog);
-	}else{
-		flog = NULL;
-	}
+	if (cp_log_open(_daemon ? LOG_FILE : NULL) < 0)
+		fprintf(stderr, "Can not open log file %s\n", LOG_FILE);
+	cp_log_start();
 	
 	//signal(SIGHUP, reconfigure);
 	reconfigure(SIGHUP);
@@ -833,6 +820,6 @@ main(int argc, char **argv)
 	list_db(ms_db->lisp_db6);
 	list_site(site_db);
 	plumb(); 
-	fclose(flog);
+	cp_log_stop();
 	exit(EXIT_SUCCESS);
 }
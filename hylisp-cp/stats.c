@@ -0,0 +1,422 @@
+#include <string.h>
+#include <sys/un.h>
+
+#include "lib.h"
+
+#define STATS_CMDLEN	64
+
+/* Owned by one thread: only the owner writes, exporter only reads */
+struct stats_block {
+	struct stats_block *next;
+	uint64_t counters[STAT_MAX];
+	struct hist hists[HIST_MAX];
+};
+
+static const char *stats_counter_name[STAT_MAX] = {
+	"rx_packets",
+	"rx_bytes",
+	"rx_errors",
+	"rx_truncated",
+	"rx_unsupported",
+	"rx_map_request",
+	"rx_ecm",
+	"rx_map_reply",
+	"rx_map_register",
+	"rx_map_notify",
+	"rx_map_referral",
+	"shed_request",
+	"shed_register",
+	"shed_reply",
+	"drop_bad_request",
+	"drop_unknown_reply",
+	"lookups",
+	"forwarded",
+	"tx_map_reply",
+	"tx_map_referral",
+	"tx_map_request",
+	"tx_map_register",
+	"tx_map_notify",
+	"tx_errors",
+	"tx_hv_ring_dropped",
+	"register_updated",
+	"register_unchanged",
+	"register_invalid",
+	"register_expired",
+	"ddt_started",
+	"ddt_done",
+	"ddt_hole",
+	"ddt_failed",
+	"miss",
+	"miss_resolved",
+	"miss_timeout",
+	"miss_suppressed",
+	"miss_dedup",
+	"miss_dropped",
+	"miss_ratelimited",
+	"mapcache_refresh",
+	"mapcache_expire",
+	"mapcache_idle",
+	"ratelimit_request",
+	"ratelimit_register",
+	"ratelimit_reply",
+	"ratelimit_prefix",
+};
+
+static const char *stats_hist_name[HIST_MAX] = {
+	"queue_us",
+	"process_us",
+	"lookup_us",
+	"reply_us",
+	"register_us",
+	"ddt_us",
+	"miss_us",
+	"miss_queue_us",
+	"miss_install_us",
+	"miss_e2e_us",
+};
+
+/* protects stats_blocks and stats_retired */
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct stats_block *stats_blocks = NULL;
+static struct stats_block stats_retired;
+
+static pthread_key_t stats_key;
+static pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+
+	static void
+_stats_merge(struct stats_block *dst, struct stats_block *src)
+{
+	int i, j;
+	struct hist *d, *s;
+
+	for (i = 0; i < STAT_MAX; i++)
+		dst->counters[i] += __atomic_load_n(&src->counters[i], __ATOMIC_RELAXED);
+	for (i = 0; i < HIST_MAX; i++) {
+		d = &dst->hists[i];
+		s = &src->hists[i];
+		d->count += __atomic_load_n(&s->count, __ATOMIC_RELAXED);
+		d->sum += __atomic_load_n(&s->sum, __ATOMIC_RELAXED);
+		d->max = max(d->max, __atomic_load_n(&s->max, __ATOMIC_RELAXED));
+		for (j = 0; j < HIST_BUCKETS; j++)
+			d->buckets[j] += __atomic_load_n(&s->buckets[j], __ATOMIC_RELAXED);
+	}
+}
+
+/* thread exit: keep its numbers in stats_retired */
+	static void
+_stats_release(void *data)
+{
+	struct stats_block *b = data;
+	struct stats_block **pb;
+
+	pthread_mutex_lock(&stats_mutex);
+	for (pb = &stats_blocks; *pb != NULL; pb = &(*pb)->next) {
+		if (*pb == b) {
+			*pb = b->next;
+			break;
+		}
+	}
+	_stats_merge(&stats_retired, b);
+	pthread_mutex_unlock(&stats_mutex);
+	free(b);
+}
+
+	static void
+_stats_key_init()
+{
+	pthread_key_create(&stats_key, _stats_release);
+}
+
+	static struct stats_block *
+_stats_self()
+{
+	struct stats_block *b;
+
+	pthread_once(&stats_key_once, _stats_key_init);
+	if ((b = pthread_getspecific(stats_key)) != NULL)
+		return b;
+
+	if ((b = calloc(1, sizeof(struct stats_block))) == NULL)
+		return NULL;
+	pthread_setspecific(stats_key, b);
+
+	pthread_mutex_lock(&stats_mutex);
+	b->next = stats_blocks;
+	stats_blocks = b;
+	pthread_mutex_unlock(&stats_mutex);
+	return b;
+}
+
+/* single writer: plain increment published with a relaxed store so that
+   the exporter never reads a torn value */
+#define STATS_ADD(v, n)	__atomic_store_n(&(v), (v) + (n), __ATOMIC_RELAXED)
+
+	void
+stats_add(enum stats_counter c, uint64_t n)
+{
+	struct stats_block *b;
+
+	if ((b = _stats_self()) != NULL)
+		STATS_ADD(b->counters[c], n);
+}
+
+	void
+stats_inc(enum stats_counter c)
+{
+	stats_add(c, 1);
+}
+
+	static int
+_hist_index(uint64_t v)
+{
+	int msb, shift, idx;
+
+	if (v < HIST_SUB)
+		return v;
+	msb = 63 - __builtin_clzll(v);
+	shift = msb - HIST_SUB_BITS;
+	idx = (shift + 1) * HIST_SUB + (int)((v >> shift) - HIST_SUB);
+	return min(idx, HIST_BUCKETS - 1);
+}
+
+/* highest value counted in bucket idx */
+	static uint64_t
+_hist_value(int idx)
+{
+	int shift;
+	uint64_t mant;
+
+	if (idx < HIST_SUB)
+		return idx;
+	shift = idx / HIST_SUB - 1;
+	mant = idx % HIST_SUB + HIST_SUB;
+	return ((mant + 1) << shift) - 1;
+}
+
+	void
+hist_add(struct hist *hs, uint64_t usec)
+{
+	STATS_ADD(hs->count, 1);
+	STATS_ADD(hs->sum, usec);
+	STATS_ADD(hs->buckets[_hist_index(usec)], 1);
+	if (usec > hs->max)
+		__atomic_store_n(&hs->max, usec, __ATOMIC_RELAXED);
+}
+
+	void
+stats_hist_add(enum stats_hist h, uint64_t usec)
+{
+	struct stats_block *b;
+
+	if ((b = _stats_self()) != NULL)
+		hist_add(&b->hists[h], usec);
+}
+
+	void
+stats_now(struct timespec *ts)
+{
+	clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+	void
+stats_hist_since(enum stats_hist h, const struct timespec *start)
+{
+	struct timespec now;
+	int64_t usec;
+
+	if (start->tv_sec == 0 && start->tv_nsec == 0)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	usec = (int64_t)(now.tv_sec - start->tv_sec) * 1000000 +
+				(now.tv_nsec - start->tv_nsec) / 1000;
+	stats_hist_add(h, usec > 0 ? usec : 0);
+}
+
+	static void
+_stats_snapshot(struct stats_block *s)
+{
+	struct stats_block *b;
+
+	memset(s, 0, sizeof(struct stats_block));
+	pthread_mutex_lock(&stats_mutex);
+	_stats_merge(s, &stats_retired);
+	for (b = stats_blocks; b != NULL; b = b->next)
+		_stats_merge(s, b);
+	pthread_mutex_unlock(&stats_mutex);
+}
+
+	static uint64_t
+_hist_percentile(struct hist *h, double p)
+{
+	uint64_t rank, seen;
+	int i;
+
+	if (h->count == 0)
+		return 0;
+	rank = (uint64_t)(p * h->count);
+	if (rank >= h->count)
+		rank = h->count - 1;
+	seen = 0;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen > rank)
+			return min(_hist_value(i), h->max);
+	}
+	return h->max;
+}
+
+	void
+hist_text(FILE *fp, const char *name, struct hist *h)
+{
+	fprintf(fp, "%-12s count=%llu mean=%llu p50=%llu p90=%llu p99=%llu p999=%llu max=%llu\n",
+			name,
+			(unsigned long long)h->count,
+			(unsigned long long)(h->count ? h->sum / h->count : 0),
+			(unsigned long long)_hist_percentile(h, 0.5),
+			(unsigned long long)_hist_percentile(h, 0.9),
+			(unsigned long long)_hist_percentile(h, 0.99),
+			(unsigned long long)_hist_percentile(h, 0.999),
+			(unsigned long long)h->max);
+}
+
+	void
+hist_json(FILE *fp, const char *name, struct hist *h)
+{
+	int j, first;
+
+	fprintf(fp, "\"%s\":{\"count\":%llu,\"sum\":%llu,\"max\":%llu,\"buckets\":[",
+			name,
+			(unsigned long long)h->count,
+			(unsigned long long)h->sum,
+			(unsigned long long)h->max);
+	/* sparse: [upper bound, count] of non empty buckets */
+	first = 1;
+	for (j = 0; j < HIST_BUCKETS; j++) {
+		if (!h->buckets[j])
+			continue;
+		fprintf(fp, "%s[%llu,%llu]", first ? "" : ",",
+				(unsigned long long)_hist_value(j),
+				(unsigned long long)h->buckets[j]);
+		first = 0;
+	}
+	fprintf(fp, "]}");
+}
+
+	static void
+_stats_text(FILE *fp, struct stats_block *s)
+{
+	int i;
+
+	for (i = 0; i < STAT_MAX; i++)
+		fprintf(fp, "%-20s %llu\n", stats_counter_name[i],
+					(unsigned long long)s->counters[i]);
+	fprintf(fp, "%-20s %u\n", "queue_depth", ipq_no);
+	for (i = 0; i < DC_MAX; i++)
+		fprintf(fp, "queue_%-14s %u\n", dispatch_class_name[i], dispatch_depth(i));
+	fprintf(fp, "%-20s %llu\n", "log_dropped",
+				(unsigned long long)cp_log_dropped());
+	mr_stats_text(fp);
+
+	for (i = 0; i < HIST_MAX; i++)
+		hist_text(fp, stats_hist_name[i], &s->hists[i]);
+}
+
+	static void
+_stats_json(FILE *fp, struct stats_block *s)
+{
+	int i;
+
+	fprintf(fp, "{\"counters\":{");
+	for (i = 0; i < STAT_MAX; i++)
+		fprintf(fp, "%s\"%s\":%llu", i ? "," : "", stats_counter_name[i],
+					(unsigned long long)s->counters[i]);
+	fprintf(fp, "},\"gauges\":{\"queue_depth\":%u,\"log_dropped\":%llu",
+				ipq_no, (unsigned long long)cp_log_dropped());
+	for (i = 0; i < DC_MAX; i++)
+		fprintf(fp, ",\"queue_%s\":%u", dispatch_class_name[i], dispatch_depth(i));
+	fprintf(fp, "}");
+
+	fprintf(fp, ",\"histograms\":{");
+	for (i = 0; i < HIST_MAX; i++) {
+		fprintf(fp, "%s", i ? "," : "");
+		hist_json(fp, stats_hist_name[i], &s->hists[i]);
+	}
+	fprintf(fp, "},\"resolvers\":");
+	mr_stats_json(fp);
+	fprintf(fp, "}\n");
+}
+
+/* Process one command of the control socket */
+	static void
+_stats_command(int fd)
+{
+	char cmd[STATS_CMDLEN];
+	struct stats_block *s;
+	ssize_t n;
+	FILE *fp;
+
+	if ((n = read(fd, cmd, STATS_CMDLEN - 1)) <= 0) {
+		close(fd);
+		return;
+	}
+	cmd[n] = '\0';
+	cmd[strcspn(cmd, "\r\n")] = '\0';
+
+	if ((fp = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		return;
+	}
+	if ((s = malloc(sizeof(struct stats_block))) == NULL) {
+		fclose(fp);
+		return;
+	}
+	_stats_snapshot(s);
+
+	if (strcasecmp(cmd, "stats") == 0)
+		_stats_text(fp, s);
+	else if (strcasecmp(cmd, "stats json") == 0)
+		_stats_json(fp, s);
+#ifdef OPENLISP
+	else if (strcasecmp(cmd, "trace") == 0)
+		miss_trace_dump(fp);
+#endif
+	else
+		fprintf(fp, "unknown command, use: stats | stats json | trace\n");
+	free(s);
+	fclose(fp);
+}
+
+/* Local control socket thread */
+	void *
+stats_start_ctl(void *context)
+{
+	int s, c;
+	struct sockaddr_un addr;
+
+	if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		cp_log(LLOG, "stats: can not create control socket\n");
+		return NULL;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, STATS_SOCKET, sizeof(addr.sun_path) - 1);
+	unlink(addr.sun_path);
+
+	if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(s, 4) < 0) {
+		cp_log(LLOG, "stats: can not bind control socket %s\n", STATS_SOCKET);
+		close(s);
+		return NULL;
+	}
+
+	for (;;) {
+		if ((c = accept(s, NULL, NULL)) < 0) {
+			if (errno == EINTR)
+				continue;
+			cp_log(LDEBUG, "stats: accept failed\n");
+			continue;
+		}
+		_stats_command(c);
+	}
+	return NULL;
+}
@@ -0,0 +1,105 @@
+#ifndef _STATS_H
+	#define _STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#define STATS_SOCKET	"/var/run/opencp.ctl"
+
+/* Counters, one slot per thread, summed when exported */
+enum stats_counter {
+	STAT_RX_PKT,
+	STAT_RX_BYTES,
+	STAT_RX_ERR,
+	STAT_RX_TRUNC,
+	STAT_RX_UNSUPPORTED,
+	STAT_RX_REQUEST,
+	STAT_RX_ECM,
+	STAT_RX_REPLY,
+	STAT_RX_REGISTER,
+	STAT_RX_NOTIFY,
+	STAT_RX_REFERRAL,
+	STAT_SHED_REQUEST,
+	STAT_SHED_REGISTER,
+	STAT_SHED_REPLY,
+	STAT_DROP_REQUEST,
+	STAT_DROP_REPLY,
+	STAT_LOOKUP,
+	STAT_FORWARD,
+	STAT_TX_REPLY,
+	STAT_TX_REFERRAL,
+	STAT_TX_REQUEST,
+	STAT_TX_REGISTER,
+	STAT_TX_NOTIFY,
+	STAT_TX_ERR,
+	STAT_TX_HV_DROP,
+	STAT_REG_UPDATE,
+	STAT_REG_NOCHANGE,
+	STAT_REG_INVALID,
+	STAT_REG_EXPIRE,
+	STAT_DDT_START,
+	STAT_DDT_DONE,
+	STAT_DDT_HOLE,
+	STAT_DDT_FAIL,
+	STAT_MISS,
+	STAT_MISS_RESOLVED,
+	STAT_MISS_TIMEOUT,
+	STAT_MISS_SUPPRESSED,
+	STAT_MISS_DEDUP,
+	STAT_MISS_DROP,
+	STAT_MISS_RATELIMIT,
+	STAT_MC_REFRESH,
+	STAT_MC_EXPIRE,
+	STAT_MC_IDLE,
+	STAT_RATE_REQUEST,
+	STAT_RATE_REGISTER,
+	STAT_RATE_REPLY,
+	STAT_RATE_PREFIX,
+	STAT_MAX
+};
+
+/* Latency histograms, values in microseconds */
+enum stats_hist {
+	HIST_QUEUE,	/* receive -> _lisp_process() dispatch */
+	HIST_PROCESS,	/* _lisp_process() */
+	HIST_LOOKUP,	/* database lookup of a Map-Request */
+	HIST_REPLY,	/* receive -> Map-Reply/Referral sent */
+	HIST_REGISTER,	/* Map-Register validation and update */
+	HIST_DDT,	/* DDT walk of Map-Resolver */
+	HIST_MISS,	/* xTR lookup start -> Map-Reply */
+	HIST_MISS_QUEUE,	/* xTR miss -> first Map-Request */
+	HIST_MISS_INSTALL,	/* xTR Map-Reply -> written to data plane */
+	HIST_MISS_E2E,	/* xTR miss -> written to data plane */
+	HIST_MAX
+};
+
+/* HDR-like histogram: 2^HIST_SUB_BITS linear buckets per power of 2,
+   relative error < 1/2^HIST_SUB_BITS, up to 2^HIST_MAX_BITS usec */
+#define HIST_SUB_BITS	3
+#define HIST_SUB	(1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS	40
+#define HIST_BUCKETS	((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[HIST_BUCKETS];
+};
+
+void stats_inc(enum stats_counter c);
+void stats_add(enum stats_counter c, uint64_t n);
+void stats_hist_add(enum stats_hist h, uint64_t usec);
+/* Histogram owned by caller, one writer at a time */
+void hist_add(struct hist *h, uint64_t usec);
+void hist_text(FILE *fp, const char *name, struct hist *h);
+void hist_json(FILE *fp, const char *name, struct hist *h);
+/* Start of a measure, CLOCK_MONOTONIC */
+void stats_now(struct timespec *ts);
+/* Add time elapsed since start, ignored if start is not set */
+void stats_hist_since(enum stats_hist h, const struct timespec *start);
+
+void *stats_start_ctl(void *context);
+
+#endif
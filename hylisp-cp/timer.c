@@ -0,0 +1,239 @@
+#include <time.h>
+
+#include "lib.h"
+
+/* Hierarchical timing wheel.
+   Root wheel has one slot per tick, each upper level has slots covering
+   a whole rotation of the level below. Timers are hashed on their
+   absolute expire tick, the slots of an upper level are cascaded down
+   when the level below wraps. Expired slots are moved in one step to
+   tw_expired and callbacks run without tw_mutex held. */
+
+#define TW_ROOT_BITS	8
+#define TW_BITS		6
+#define TW_ROOT_SIZE	(1 << TW_ROOT_BITS)
+#define TW_SIZE		(1 << TW_BITS)
+#define TW_LEVELS	4
+/* farthest tick reachable, about 497 days with 10ms tick */
+#define TW_SPAN		(((uint64_t)1 << (TW_ROOT_BITS + TW_LEVELS * TW_BITS)) - 1)
+
+#define TW_INDEX(e, lvl)	\
+	(((e) >> (TW_ROOT_BITS + (lvl) * TW_BITS)) & (TW_SIZE - 1))
+
+static struct timer_ev *tw_root[TW_ROOT_SIZE];
+static struct timer_ev *tw_level[TW_LEVELS][TW_SIZE];
+static struct timer_ev *tw_expired;
+static uint64_t tw_tick;	/* next tick to process */
+static struct timespec tw_base;
+static pthread_mutex_t tw_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tw_done = PTHREAD_COND_INITIALIZER;
+static struct timer_ev *tw_running;	/* callback in progress */
+static pthread_t tw_thread;
+static pthread_once_t tw_once = PTHREAD_ONCE_INIT;
+
+	static void
+_tw_init()
+{
+	clock_gettime(CLOCK_MONOTONIC, &tw_base);
+	tw_tick = 0;
+}
+
+	static uint64_t
+_tw_now_tick()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((uint64_t)(now.tv_sec - tw_base.tv_sec) * 1000 +
+			(now.tv_nsec - tw_base.tv_nsec) / 1000000) / TIMER_TICK_MS;
+}
+
+	static void
+_tw_link(struct timer_ev **head, struct timer_ev *t)
+{
+	t->next = *head;
+	if (t->next)
+		t->next->pprev = &t->next;
+	*head = t;
+	t->pprev = head;
+}
+
+	static void
+_tw_unlink(struct timer_ev *t)
+{
+	*t->pprev = t->next;
+	if (t->next)
+		t->next->pprev = t->pprev;
+	t->next = NULL;
+	t->pprev = NULL;
+}
+
+/* Requires tw_mutex */
+	static void
+_tw_place(struct timer_ev *t)
+{
+	uint64_t e, delta;
+	int lvl;
+
+	e = (t->expire < tw_tick) ? tw_tick : t->expire;
+	delta = e - tw_tick;
+	if (delta < TW_ROOT_SIZE) {
+		_tw_link(&tw_root[e & (TW_ROOT_SIZE - 1)], t);
+		return;
+	}
+	if (delta > TW_SPAN)
+		e = tw_tick + TW_SPAN;	/* placed again when cascaded */
+	for (lvl = 0; lvl < TW_LEVELS - 1; lvl++)
+		if (delta < (uint64_t)1 << (TW_ROOT_BITS + (lvl + 1) * TW_BITS))
+			break;
+	_tw_link(&tw_level[lvl][TW_INDEX(e, lvl)], t);
+}
+
+/* Requires tw_mutex. Spread one slot of level lvl to the levels below,
+   return its index */
+	static int
+_tw_cascade(int lvl, int idx)
+{
+	struct timer_ev *t, *next;
+
+	t = tw_level[lvl][idx];
+	tw_level[lvl][idx] = NULL;
+	for (; t != NULL; t = next) {
+		next = t->next;
+		t->next = NULL;
+		t->pprev = NULL;
+		_tw_place(t);
+	}
+	return idx;
+}
+
+/* Requires tw_mutex. Process all ticks up to now */
+	static void
+_tw_advance(uint64_t now)
+{
+	struct timer_ev *t, **tail;
+	int idx, lvl;
+
+	while (tw_tick <= now) {
+		idx = tw_tick & (TW_ROOT_SIZE - 1);
+		for (lvl = 0; !idx && lvl < TW_LEVELS; lvl++)
+			idx = _tw_cascade(lvl, TW_INDEX(tw_tick, lvl));
+		idx = tw_tick & (TW_ROOT_SIZE - 1);
+
+		/* splice the whole slot at the end of tw_expired */
+		if ((t = tw_root[idx]) != NULL) {
+			for (tail = &tw_expired; *tail != NULL; tail = &(*tail)->next)
+				;
+			*tail = t;
+			t->pprev = tail;
+			tw_root[idx] = NULL;
+		}
+		tw_tick++;
+	}
+}
+
+	void
+timer_add(struct timer_ev *t, uint32_t msec, timer_fn fn, void *arg)
+{
+	pthread_once(&tw_once, _tw_init);
+	pthread_mutex_lock(&tw_mutex);
+	if (t->pprev)
+		_tw_unlink(t);
+	t->fn = fn;
+	t->arg = arg;
+	t->expire = _tw_now_tick() + (msec + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+	_tw_place(t);
+	pthread_mutex_unlock(&tw_mutex);
+}
+
+	int
+timer_del(struct timer_ev *t)
+{
+	int armed;
+
+	pthread_mutex_lock(&tw_mutex);
+	if ((armed = (t->pprev != NULL)))
+		_tw_unlink(t);
+	pthread_mutex_unlock(&tw_mutex);
+	return armed;
+}
+
+	int
+timer_del_sync(struct timer_ev *t)
+{
+	int armed;
+
+	pthread_mutex_lock(&tw_mutex);
+	if ((armed = (t->pprev != NULL)))
+		_tw_unlink(t);
+	while (tw_running == t && !pthread_equal(pthread_self(), tw_thread))
+		pthread_cond_wait(&tw_done, &tw_mutex);
+	/* the callback may have armed t again */
+	if (t->pprev)
+		_tw_unlink(t);
+	pthread_mutex_unlock(&tw_mutex);
+	return armed;
+}
+
+	int
+timer_pending(struct timer_ev *t)
+{
+	int armed;
+
+	pthread_mutex_lock(&tw_mutex);
+	armed = (t->pprev != NULL);
+	pthread_mutex_unlock(&tw_mutex);
+	return armed;
+}
+
+	uint32_t
+timer_jitter(uint32_t msec, int pct)
+{
+	uint32_t range;
+
+	range = (uint64_t)msec * pct / 100;
+	if (!range)
+		return msec;
+	return msec - random() % (range + 1);
+}
+
+	uint64_t
+timer_now_ms()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* Timer thread: callbacks must not block, long work is queued elsewhere */
+	void *
+timer_run(void *context)
+{
+	struct timer_ev *t;
+	timer_fn fn;
+	void *arg;
+
+	pthread_once(&tw_once, _tw_init);
+	tw_thread = pthread_self();
+	for (;;) {
+		pthread_mutex_lock(&tw_mutex);
+		_tw_advance(_tw_now_tick());
+		/* a callback may arm or delete any timer, even an expired one
+		   still waiting in tw_expired */
+		while ((t = tw_expired) != NULL) {
+			_tw_unlink(t);
+			fn = t->fn;
+			arg = t->arg;
+			tw_running = t;
+			pthread_mutex_unlock(&tw_mutex);
+			fn(arg);
+			pthread_mutex_lock(&tw_mutex);
+			tw_running = NULL;
+			pthread_cond_broadcast(&tw_done);
+		}
+		pthread_mutex_unlock(&tw_mutex);
+		usleep(TIMER_TICK_MS * 1000);
+	}
+	return NULL;
+}
@@ -0,0 +1,38 @@
+#ifndef _TIMER_H
+	#define _TIMER_H
+
+#include <stdint.h>
+
+#define TIMER_TICK_MS	10	/* resolution of the wheel */
+
+typedef void (*timer_fn)(void *arg);
+
+/* One timer, embedded in the object it works for.
+   A zeroed structure is a valid idle timer */
+struct timer_ev {
+	struct timer_ev *next;
+	struct timer_ev **pprev;	/* NULL if not armed */
+	uint64_t expire;		/* tick */
+	timer_fn fn;
+	void *arg;
+};
+
+/* (Re)arm t to call fn(arg) after msec on the timer thread. O(1) */
+void timer_add(struct timer_ev *t, uint32_t msec, timer_fn fn, void *arg);
+/* Disarm t. O(1). Return 1 if t was armed, 0 if it was idle or its
+   callback is already running */
+int timer_del(struct timer_ev *t);
+/* Like timer_del, and if the callback of t is running, wait for its end,
+   so that the object holding t can be freed. Caller must not hold a lock
+   taken by that callback. From the callback itself it does not wait */
+int timer_del_sync(struct timer_ev *t);
+int timer_pending(struct timer_ev *t);
+/* msec reduced by a random value up to pct percent, so that periodic
+   work of many peers does not stay synchronized */
+uint32_t timer_jitter(uint32_t msec, int pct);
+/* Milliseconds, CLOCK_MONOTONIC */
+uint64_t timer_now_ms();
+
+void *timer_run(void *context);
+
+#endif
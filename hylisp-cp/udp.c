@@ -1,3 +1,5 @@
+#include <fcntl.h>
+
 #include "lib.h"
 #include "udp.h"
 
@@ -13,10 +15,9 @@ size_t _process_referral_record(const union map_referral_record_generic *rec,
 								union afi_address_generic *best_rloc, 
 								struct db_node **node);                                                                                   
 int  _ms_validate_register(struct lisp_db *db, const void *packet, int pkg_len, void **site_ptr);
-void _ms_clean_site_mapping(struct list_entry_t *site);
 size_t _ms_process_register_record(const union map_reply_record_generic *rec,uint8_t proxy_map_repl );
 
-void *general_register_process(void *data);
+void general_register_start();
 void *mr_event_loop(void *context);
 void *get_mr_ddt(void *);
 
@@ -580,11 +581,13 @@ udp_register_terminate(void *data, union sockunion *ds)
 	if (sendtov(skt, (char *)rpk->buf, rpk->buf_len, 0, (struct sockaddr *)&(ds->sa), slen) == -1) {
 		 cp_log(LLOG, "failed\n");
 		 perror("sendtov()");
+		 stats_inc(STAT_TX_ERR);
 		 close(skt);
 		 return (FALSE);
 	}
 	
 	close(skt);
+	stats_inc(STAT_TX_REGISTER);
 	cp_log(LDEBUG, "done\n");
 		
 	return (TRUE);
@@ -972,9 +975,12 @@ udp_reply_terminate(void *data)
 		if (sendtov(socket, (char *)rpk->buf, rpk->buf_len, 0, (struct sockaddr *)&(local.sa), slen) == -1) {
 			cp_log(LLOG, "failed\n");
 			perror("sendtov()");
+			stats_inc(STAT_TX_ERR);
 			_free_rpl_pool_place(rpk, _rm_rpl);
 			return (FALSE);
 		}
+		stats_inc(STAT_TX_REPLY);
+		stats_hist_since(HIST_REPLY, &pke->rx_ts);
 	}	
 	else{
 		if (_debug == LDEBUG) {
@@ -1220,9 +1226,12 @@ udp_referral_terminate(void *data)
 		if (sendtov(socket, rpk->buf, rpk->buf_len, 0, (struct sockaddr *)&(local.sa), slen) == -1) {
 			cp_log(LLOG, "failed\n");
 			perror("sendtov()");
+			stats_inc(STAT_TX_ERR);
 			_free_rpl_pool_place(rpk, _rm_rpl);
 			return (FALSE);
 		}
+		stats_inc(STAT_TX_REFERRAL);
+		stats_hist_since(HIST_REPLY, &pke->rx_ts);
 	}
 	else{
 		if (_debug == LDEBUG) {
@@ -1362,20 +1371,6 @@ udp_request_get_port(void *data, uint16_t *port)
 	return (TRUE);
 }
 
-/* generate checksum of IP header; nwords is the length of the header measured in 16-bit words */
-	uint16_t 
-ip_checksum (uint16_t *buf, int nwords)
-{
-	unsigned long sum;
-
-	for (sum = 0; nwords > 0; nwords--)
-		sum += *buf++;
-	
-	sum = (sum >> 16) + (sum & 0xffff);
-	sum += (sum >> 16);
-	return ~sum;
-}
-
 /* make a new map-request message -	EMC package */
 	void *
 udp_request_add(void *data, uint8_t security, uint8_t ddt,\
@@ -1527,7 +1522,7 @@ udp_request_add(void *data, uint8_t security, uint8_t ddt,\
 		ih->ip_sum        = 0;         
 		ih->ip_src.s_addr = afi_addr_src.ip.address.s_addr;
 		ih->ip_dst.s_addr = afi_addr_dst.ip.address.s_addr;
-		ih->ip_sum 		  = htons(ip_checksum((uint16_t *)ih, (ih->ip_hl)*2));
+		ih->ip_sum 		  = cksum(ih, (ih->ip_hl) * 4);
 		break;
 	case AF_INET6:
 		ip_len = (uint8_t *)rpk->curs - (uint8_t *) udp;
@@ -1611,10 +1606,12 @@ udp_request_ddt_terminate(void *data, const union sockunion *server, char termin
 	if (sendtov(skt, rpk->buf, rpk->buf_len, 0, (struct sockaddr *)&(servaddr.sa),slen) < 0) {
 			cp_log(LLOG, "failed\n");
 			perror("sendtov()");
+			stats_inc(STAT_TX_ERR);
 			_free_rpl_pool_place(rpk, _rm_rpl);
 			close(skt);
 			return (FALSE);
 	}
+	stats_inc(STAT_TX_REQUEST);
 	
 	cp_log(LLOG, "done\n");
 	
@@ -1716,9 +1713,11 @@ _forward(void *data)
 	}
 	if (sendtov(s,(void *)ih, (ih->ip_len), 0, (struct sockaddr *)&sin, sizeof (struct sockaddr)) < 0) {
 		perror("sendto");
+		stats_inc(STAT_TX_ERR);
 		close(s);
 		return (FALSE);
 	}
+	stats_inc(STAT_FORWARD);
 	cp_log(LDEBUG, "done\n");
 	close(s);
 		
@@ -1805,9 +1804,11 @@ _forward_to_etr(void *data, struct db_node *rn)
 		
 	if (sendtov(skt,(void *)packet, pkt_len, 0, (struct sockaddr *)&sin.sa, sin_len) < 0) {
 		perror("sendto");
+		stats_inc(STAT_TX_ERR);
 		close(skt);
 		return (-1);
 	}
+	stats_inc(STAT_FORWARD);
 	close(skt);
 	cp_log(LDEBUG, "done\n");
 	return (TRUE);
@@ -1880,6 +1881,13 @@ udp_init_socket()
 			perror("socket6");
 			exit(0);
 	}
+	/* leave ipv4 to skfd, same port is used by both */
+	setsockopt(skfd6, IPPROTO_IPV6, IPV6_V6ONLY, &ip_recvaddr, sizeof(ip_recvaddr));
+	
+	if (_virtual) {
+		/* hypervisor knows one port per control plane */
+		sprintf(_str_port, "%d", virtual_udp_port);
+	}
 		
 	memset(&hints, 0, sizeof(struct addrinfo));
 	hints.ai_family    = AF_INET6;	/* Bind on AF based on AF of Map-Server */
@@ -1912,7 +1920,10 @@ _lisp_process(void *data)
 	struct lisp_control_hdr *lh;
 	int rt = 0;
 	struct pk_req_entry *pke = data;	
+	struct timespec start, lookup;
 	
+	stats_hist_since(HIST_QUEUE, &pke->rx_ts);
+	stats_now(&start);
 	udp_preparse_pk(pke);
 	buf = pke->buf;
 	
@@ -1930,11 +1941,14 @@ _lisp_process(void *data)
 			rt = udp_prc_request(pke);
 			if (rt <= 0) {
 				cp_log(LDEBUG, "Not correct map-request.....Ignore!\n");
-				
+				stats_inc(STAT_DROP_REQUEST);
 				udp_free_pk(pke);
 				break;
 			}
+			stats_inc(STAT_LOOKUP);
+			stats_now(&lookup);
 			xtr_generic_process_request(pke, &udp_fct);						
+			stats_hist_since(HIST_LOOKUP, &lookup);
 		}
 		udp_free_pk(pke);
 		break;
@@ -1943,18 +1957,23 @@ _lisp_process(void *data)
 		rt = udp_prc_request(pke);
 		if (rt <= 0) {
 			cp_log(LDEBUG, "Not a map-request.....Ignore!\n");
-				
+			stats_inc(STAT_DROP_REQUEST);
 			udp_free_pk(pke);
 			break;
 		}
 		
+		stats_inc(STAT_LOOKUP);
+		stats_now(&lookup);
 		if (_fncs & _FNC_XTR) {
 			xtr_generic_process_request(pke, &udp_fct);
+			stats_hist_since(HIST_LOOKUP, &lookup);
 			udp_free_pk(pke);	
 			break;
 		}		
 		else{
-			if ((rt = generic_process_request(pke, &udp_fct)) <= 0) {
+			rt = generic_process_request(pke, &udp_fct);
+			stats_hist_since(HIST_LOOKUP, &lookup);
+			if (rt <= 0) {
 				cp_log(LDEBUG, "Forwarding mode\n");
 				
 				_forward(pke);					
@@ -1987,16 +2006,27 @@ _lisp_process(void *data)
 		udp_free_pk(pke);
 		cp_log(LDEBUG, "unsupported LISP type\n");			
 	}
+	stats_hist_since(HIST_PROCESS, &start);
 	return NULL;
 }
 
+/* receive counter of each accepted LISP type */
+static const enum stats_counter _rx_counter[16] = {
+	[LISP_TYPE_MAP_REQUEST] = STAT_RX_REQUEST,
+	[LISP_TYPE_MAP_REPLY] = STAT_RX_REPLY,
+	[LISP_TYPE_MAP_REGISTER] = STAT_RX_REGISTER,
+	[LISP_TYPE_MAP_NOTIFY] = STAT_RX_NOTIFY,
+	[LISP_TYPE_MAP_REFERRAL] = STAT_RX_REFERRAL,
+	[LISP_TYPE_ENCAPSULATED_CONTROL_MESSAGE] = STAT_RX_ECM,
+};
+
+static int _udp_accept_pk(char *buf, ssize_t pk_len, union sockunion *ssk, union sockunion *dsk);
+
 	int 
 udp_get_pk(int sockfd, socklen_t slen)
 {
 	ssize_t pk_len;
 	union sockunion ssk, dsk; /* source/destination address */
-	struct lisp_control_hdr *lh;	
-	struct pk_req_entry *pke;
 	char buf[PKBUFLEN];
 	struct iovec iov[1];
 	struct cmsghdr *ctrmsg;
@@ -2023,9 +2053,11 @@ udp_get_pk(int sockfd, socklen_t slen)
 	
 	if ((pk_len = recvmsg(sockfd, &msg,0)) < 0) {
 		cp_log(LDEBUG,"recvmsg: can not read data\n");
+		stats_inc(STAT_RX_ERR);
 		return -1;
 	}else if (msg.msg_flags & MSG_TRUNC) {
 		cp_log(LDEBUG, "recvmsg: datagram too large for buffer: truncated\n");
+		stats_inc(STAT_RX_TRUNC);
 		return -1;
 	}
 	
@@ -2038,8 +2070,7 @@ udp_get_pk(int sockfd, socklen_t slen)
 				pktinfo = (union union_pktinfo *)(CMSG_DATA(ctrmsg));
 				dsk.sin.sin_family = AF_INET;
 				dsk.sin.sin_addr =  pktinfo->pkif;
-				inet_ntop(AF_INET, &dsk.sin.sin_addr,ip, INET6_ADDRSTRLEN);
-				cp_log(LDEBUG, "To: %s\n",ip);
+				cp_log(LDEBUG, "To: %s\n", sk_get_ip(&dsk, ip));
 				break;
 			}
 		}
@@ -2050,14 +2081,25 @@ udp_get_pk(int sockfd, socklen_t slen)
 				pktinfo = (union union_pktinfo *)(CMSG_DATA(ctrmsg));
 				dsk.sin6.sin6_family = AF_INET6;
 				memcpy(&dsk.sin6.sin6_addr, &pktinfo->pkif6.ipi6_addr, sizeof(struct in6_addr));
-				inet_ntop(AF_INET6, &dsk.sin6.sin6_addr,ip, INET6_ADDRSTRLEN);
-				cp_log(LDEBUG, "To: %s\n",ip);
+				cp_log(LDEBUG, "To: %s\n", sk_get_ip(&dsk, ip));
 				break;
 			}				
 		}
 		break;
 	}		
-    
+	return _udp_accept_pk(buf, pk_len, &ssk, &dsk);
+}
+
+/* received packet, from a socket or the hypervisor rings: copied if kept */
+	static int
+_udp_accept_pk(char *buf, ssize_t pk_len, union sockunion *ssk, union sockunion *dsk)
+{
+	struct lisp_control_hdr *lh;	
+	struct pk_req_entry *pke;
+	
+	stats_inc(STAT_RX_PKT);
+	stats_add(STAT_RX_BYTES, pk_len);
+	
 	/* if LISP packet, continue, else drop */
 	lh = (struct lisp_control_hdr *)CO(buf, 0);
 		
@@ -2068,20 +2110,39 @@ udp_get_pk(int sockfd, socklen_t slen)
 	case LISP_TYPE_MAP_REGISTER:
 	case LISP_TYPE_MAP_NOTIFY:
 	case LISP_TYPE_MAP_REFERRAL:
+		stats_inc(_rx_counter[lh->type]);
+		/* source over its rate: shed before any allocation */
+		if (!admit(lh->type, ssk))
+			return 0;
 		pke  = calloc(1,sizeof(struct pk_req_entry));
+		stats_now(&pke->rx_ts);
 		pke->buf = calloc(pk_len,sizeof(char));			
 		memcpy((char *)pke->buf, (char *)buf, pk_len);
 		pke->buf_len = pk_len;
-		memcpy((char *)&pke->si, (char *)&ssk, sizeof(ssk));
-		memcpy((char *)&pke->di, (char *)&dsk, sizeof(dsk));				
-		thr_pool_queue(cpp, _lisp_process, pke);
+		memcpy((char *)&pke->si, (char *)ssk, sizeof(*ssk));
+		memcpy((char *)&pke->di, (char *)dsk, sizeof(*dsk));				
+		pthread_mutex_lock(&ipq_mutex);
+		ipq_no++;
+		pthread_mutex_unlock(&ipq_mutex);
+		/* never blocks, may shed a message of same or lower class */
+		dispatch_queue(lh->type, pke);
 		break;
 	default:
 		cp_log(LDEBUG, "unsupported LISP type\n");
+		stats_inc(STAT_RX_UNSUPPORTED);
 		return -1;
 	}
 	return 1;
 }
+
+/* control packet of hypervisor west ring */
+	static void
+_udp_ring_pk(uint8_t *buf, int pk_len, union sockunion *ssk, union sockunion *dsk)
+{
+	cp_log(LLOG,  "Received packet (%d bytes) from  %s:%d through hypervisor ring\n", 
+			pk_len, sk_get_ip(ssk, ip) , sk_get_port(ssk));
+	_udp_accept_pk((char *)buf, pk_len, ssk, dsk);
+}
 /* get message and push to queue */
 
 	int 
@@ -2177,9 +2238,9 @@ udp_preparse_pk(void *data)
 udp_start_communication(void *context)
 {
 	int nready;
+	int nfds, timeout;
 	int sockfd = 0;
 	int pk_id;
-	pthread_t _thr_map_register_process;
 	pthread_t _thr_lisp_mr;
 			
 	socklen_t slen = 0;
@@ -2192,12 +2253,14 @@ udp_start_communication(void *context)
 	
 	_sk[0].events = POLLRDNORM;
 	_sk[1].events = POLLRDNORM;
+	/* control packets of hypervisor rings, if any */
+	_sk[2].fd = hv_west_doorbell;
+	_sk[2].events = POLLRDNORM;
+	nfds = (hv_west_doorbell >= 0) ? 3 : 2;
 	
-	/*map-register process thread*/
-	
-	if (_fncs & _FNC_XTR) {
-		pthread_create(&_thr_map_register_process, NULL, general_register_process, NULL);				
-	}
+	/*map-register refresh, driven by timer thread */
+	if (_fncs & _FNC_XTR)
+		general_register_start();
 	
 #ifdef OPENLISP	
 	pthread_t _thr_openlisp_plugin;
@@ -2208,12 +2271,21 @@ udp_start_communication(void *context)
 	if (_fncs & _FNC_MR)
 		pthread_create(&_thr_lisp_mr, NULL, mr_event_loop, NULL);
 
-	cpp = thr_pool_create(min_thread,max_thread,linger_thread, NULL);	
-	
 	ipq_no = 0;	
+	if (dispatch_start(_lisp_process, udp_free_pk) < 0) {
+		cp_log(LLOG, "Can not start dispatch workers\n");
+		exit(1);
+	}
+	admit_init();
+	
 	for (;;) {
 		/* reset buffers */
-		nready = poll(_sk, 2, INFTIM);
+		timeout = INFTIM;
+		if (hv_west_doorbell >= 0 && !hv_west_sleep())
+			timeout = 0;
+		nready = poll(_sk, nfds, timeout);
+		if (hv_west_doorbell >= 0)
+			hv_west_receive(_udp_ring_pk);
 		if (nready <=0)
 			continue;
 		/* check socket ready to read */
@@ -2226,17 +2298,11 @@ udp_start_communication(void *context)
 		}
 		else
 			continue;
-		/* get next packet if number packet waitting < PK_POOL_MAX */
+		/* get next packet, overload is handled by dispatch_queue() */
 		if ((pk_id = udp_get_pk(sockfd,slen)) < 0) {
 				cp_log(LDEBUG, "can not get package\n");
 				continue;
 		}
-		pthread_mutex_lock(&ipq_mutex);
-		if (ipq_no+1 >= PK_POOL_MAX)
-			pthread_cond_wait(&ipq_cv, &ipq_mutex);
-		
-		ipq_no++;
-		pthread_mutex_unlock(&ipq_mutex);					
 	}	
 	return NULL;
 }
@@ -2399,6 +2465,26 @@ udp_prc_request(void *data)
 	return (1);
 }
 
+/* guards mr_lookups[] and the referrals they cache: shared by
+   mr_event_loop, the dispatch workers and the timer thread */
+static pthread_mutex_t mr_lookups_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Cached referral reached its TTL: drop its role so that next lookup
+   starts again from a configured parent */
+	static void
+_mr_referral_expire(void *data)
+{
+	struct db_node *node = data;
+	struct mapping_flags *mflags = node->flags;
+	
+	pthread_mutex_lock(&mr_lookups_mutex);
+	cp_log(LDEBUG, "Referral %s expired\n", (char *)prefix2str(&node->p));
+	mflags->range &= ~_MAPP;
+	mflags->referral = 0;
+	pthread_mutex_unlock(&mr_lookups_mutex);
+}
+
+/* Requires mr_lookups_mutex */
 	size_t 
 _process_referral_record(const union map_referral_record_generic *rec, union afi_address_generic *best_rloc, struct db_node **node)
 {
@@ -2464,6 +2550,13 @@ _process_referral_record(const union map_referral_record_generic *rec, union afi
 		*node = mapping = generic_mapping_new(&eid);
 		generic_mapping_set_flags(mapping, &mflags);
 		ms_node_update_type(mapping,_MAPP);
+		/* age cached referral, TTL is in minutes */
+		struct mapping_flags *f = ((struct db_node *)mapping)->flags;
+		if (!f->age)
+			f->age = calloc(1, sizeof(struct timer_ev));
+		if (f->age)
+			timer_add(f->age, min(mflags.ttl, UINT32_MAX / 60000) * 60000,
+						_mr_referral_expire, mapping);
 	}
 
 	/* ====================================================== */
@@ -2641,14 +2734,112 @@ _register_notify(void *data, struct site_info *site )
 	if (sendtov(skt, (char *)buf, pklen, 0, (struct sockaddr *)&(ds.sa), slen) == -1) {
 			cp_log(LDEBUG, "failed\n");
 			perror("sendtov()");
+			stats_inc(STAT_TX_ERR);
 			free(buf);
 			return (-1);
 	}
+	stats_inc(STAT_TX_NOTIFY);
 	cp_log(LDEBUG, "done\n");
 	free(buf);	
 	return (TRUE);	
 }
 
+/* serializes update of registered mappings with their expiry */
+static pthread_mutex_t ms_reg_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+struct list_entry_t *_ms_validate_eid(struct lisp_db *lisp_db, const union map_reply_record_generic *rec,  size_t *rlen);
+
+/* site owning a registered EID-prefix */
+	static struct list_entry_t *
+_ms_node_site(struct db_node *node)
+{
+	while (node && !ms_node_is_type(node, _EID))
+		node = node->parent;
+	if (!node)
+		return NULL;
+	return ((struct mapping_flags *)node->flags)->rsvd;
+}
+
+/* Registered EID-prefix not refreshed during MAP_REGISTER_TTL */
+	static void
+_ms_eid_expire(void *data)
+{
+	struct db_node *node = data;
+	struct mapping_flags *mflags;
+	struct list_entry_t *site;
+	struct site_info *s_info;
+	struct timer_ev *age;
+	uint8_t range;
+	void *rsvd;
+	
+	pthread_mutex_lock(&ms_reg_mutex);
+	cp_log(LLOG, "Map-register:: registration of %s/%d expired\n", 
+				(char *)prefix2str(&node->p), node->p.prefixlen);
+	db_node_set_info(node, NULL);
+	mflags = node->flags;
+	range = mflags->range & ~_MAPP;
+	rsvd = mflags->rsvd;
+	age = mflags->age;
+	bzero(mflags, sizeof(struct mapping_flags));
+	mflags->range = range;
+	mflags->rsvd = rsvd;
+	mflags->age = age;
+	
+	/* next Map-Register of site must update database even if unchanged */
+	if ((site = _ms_node_site(node)) != NULL) {
+		s_info = (struct site_info *)site->data;
+		free(s_info->hashing);
+		s_info->hashing = NULL;
+	}
+	pthread_mutex_unlock(&ms_reg_mutex);
+	stats_inc(STAT_REG_EXPIRE);
+}
+
+/* (Re)start registration TTL of an EID-prefix */
+	static void
+_ms_eid_refresh(struct db_node *node)
+{
+	struct mapping_flags *mflags = node->flags;
+	
+	if (!mflags->age && !(mflags->age = calloc(1, sizeof(struct timer_ev))))
+		return;
+	timer_add(mflags->age, MAP_REGISTER_TTL * 1000, _ms_eid_expire, node);
+}
+
+/* Unchanged Map-Register: restart TTL of its EID-prefixes */
+	static void
+_ms_refresh_register(struct map_register_hdr *lcm)
+{
+	union map_reply_record_generic *rec;
+	uint8_t rcount;
+	struct prefix eid;
+	struct db_table *db;
+	struct db_node *node;
+	size_t rlen;
+	
+	rcount = lcm->record_count;
+	rec = (union map_reply_record_generic *)CO(lcm, 
+				sizeof(struct map_register_hdr) + ntohs(lcm->auth_data_length));
+	while (rcount--) {
+		/* already validated, only used to get record length */
+		_ms_validate_eid(ms_db, rec, &rlen);
+		bzero(&eid, sizeof(struct prefix));
+		if (ntohs(rec->record.eid_prefix_afi) == LISP_AFI_IP) {
+			eid.family = AF_INET;
+			eid.u.prefix4 = rec->record.eid_prefix;
+		}else{
+			eid.family = AF_INET6;
+			eid.u.prefix6 = rec->record6.eid_prefix;
+		}
+		eid.prefixlen = rec->record.eid_mask_len;
+		if ((db = ms_get_db_table(ms_db, &eid)) != NULL &&
+				(node = db_node_match_exact(db, &eid)) != NULL &&
+				ms_node_is_type(node, _MAPP))
+			_ms_eid_refresh(node);
+		rec = (union map_reply_record_generic *)CO(rec, rlen);
+	}
+}
+
 /* Process Map-Register */
 	uint32_t 
 _register(void *data)
@@ -2664,6 +2855,9 @@ _register(void *data)
 	void *packet = pke->buf;	
 	int rt;
 	int pkg_len = pke->buf_len;
+	struct timespec start;
+	
+	stats_now(&start);
 	lcm = (struct map_register_hdr *)CO(packet, 0);
 	rcount = lcm->record_count;
 	cp_log(LDEBUG, "LCM: <type=%u, P=%u, M=%u, rcount=%u, nonce=0x%x - 0x%x, key id=%u, auth data length=%u\n", \
@@ -2679,14 +2873,16 @@ _register(void *data)
 	lcm_len = sizeof(struct map_register_hdr) + ntohs(lcm->auth_data_length);
 	packet_len = lcm_len;
 	
+	pthread_mutex_lock(&ms_reg_mutex);
 	if ((rt = _ms_validate_register(ms_db, packet, pkg_len, (void *)&site)) >=0 ) {
 		/* update */
 		if (rt) {
 			cp_log(LDEBUG, "Map-register:: Valide - OK\n");
 			cp_log(LDEBUG, "Map-register:: Preparing to update database\n");
 			
-			/* cleare mapping of site in database */
-			_ms_clean_site_mapping(site);
+			/* A site registration may be cut in several Map-Registers:
+			   each record replaces its own EID-prefix only, prefixes no
+			   more registered expire after MAP_REGISTER_TTL */
 			
 			/* add new mapping to database */
 			rec = (union map_reply_record_generic *)CO(lcm, lcm_len);
@@ -2700,14 +2896,23 @@ _register(void *data)
 			}
 			cp_log(LDEBUG, "Map-register:: Update......Success\n");
 			cp_log(LDEBUG, "Map-register:: Finish update database\n");
-			
+			stats_inc(STAT_REG_UPDATE);
 		}		
+		else{
+			_ms_refresh_register(lcm);
+			stats_inc(STAT_REG_NOCHANGE);
+		}
+		pthread_mutex_unlock(&ms_reg_mutex);
+		stats_hist_since(HIST_REGISTER, &start);
 		/* Send map-notify if required */
 		if (lcm->want_map_notify && site->data) {
 			_register_notify(pke, site->data);
 		}
 		return 1;
 	}
+	pthread_mutex_unlock(&ms_reg_mutex);
+	stats_inc(STAT_REG_INVALID);
+	stats_hist_since(HIST_REGISTER, &start);
 	return 0;
 }
 
@@ -2885,6 +3090,7 @@ _ms_validate_register(struct lisp_db *db, const void *packet, int pkg_len, void
 	void *s_hmac;
 	void *info_hashing;
 	void *info_hmac;
+	int i;
 	lcm = (struct map_register_hdr *)CO(packet, 0);
 	rcount = lcm->record_count;
 	auth_len = ntohs(lcm->auth_data_length);
@@ -2933,12 +3139,16 @@ _ms_validate_register(struct lisp_db *db, const void *packet, int pkg_len, void
 	s_hashing = calloc(auth_len, sizeof(char));
 	_ms_recal_hashing(packet, pkg_len, s_info->key, s_hashing, 1);
 	
-	if ((info_hashing != NULL) && (strncmp((char *)info_hashing,(char *)s_hashing,auth_len) == 0)) {
-		cp_log(LDEBUG, "Map-register: Not need update\n");
-		cp_log(LDEBUG, "Map-register:: Finish update database\n");
-		
-		free(s_hashing);
-		return 0;		
+	/* site registration may be several Map-Registers: unchanged if
+	   equal to any of the last ones */
+	for (i = 0; info_hashing != NULL && i < MS_REG_HASHES; i++) {
+		if (memcmp((char *)info_hashing + i * HMAC_SHA1_DIGEST_LENGTH, s_hashing, HMAC_SHA1_DIGEST_LENGTH) == 0) {
+			cp_log(LDEBUG, "Map-register: Not need update\n");
+			cp_log(LDEBUG, "Map-register:: Finish update database\n");
+			
+			free(s_hashing);
+			return 0;		
+		}
 	}
 	
 	cp_log(LDEBUG, "Map-register: Authenticate processing........\n");
@@ -2954,104 +3164,19 @@ _ms_validate_register(struct lisp_db *db, const void *packet, int pkg_len, void
 	}
 	
 	/* update site information: hashing, TTL.. */
-	free(info_hashing);
-	info_hashing = s_info->hashing = calloc(auth_len, sizeof(char));
-	memcpy((char *)info_hashing, (char *)s_hashing,auth_len );
+	if (!info_hashing)
+		info_hashing = s_info->hashing = calloc(MS_REG_HASHES, HMAC_SHA1_DIGEST_LENGTH);
+	if (info_hashing) {
+		memcpy((char *)info_hashing + s_info->nhash * HMAC_SHA1_DIGEST_LENGTH, 
+					(char *)s_hashing, HMAC_SHA1_DIGEST_LENGTH);
+		s_info->nhash = (s_info->nhash + 1) % MS_REG_HASHES;
+	}
 	free(s_hashing);
+	free(s_hmac);
 	
 	return (1);
 }
 
-/* Delete an old mapping */
-	void 
-_ms_clean_eid_mapping(struct db_node *node)
-{
-	struct db_node * tmp_node;
-	struct db_node *papa;
-	assert(node);
-	papa = node->parent;
-	if (papa != NULL) {
-		if (papa->l_left == node)
-			papa->l_left = NULL;
-		else
-			papa->l_right = NULL;
-	}
-	
-	node->parent = NULL;	
-	while (node) {
-		if (node->l_left) {
-			node = node->l_left;
-			continue;
-		}
-
-		if (node->l_right) {
-			node = node->l_right;
-			continue;
-		}
-
-		tmp_node = node;
-		node = node->parent;
-
-		if (node != NULL) {
-			if (node->l_left == tmp_node)
-				node->l_left = NULL;
-			else
-				node->l_right = NULL;
-
-			ms_free_node(tmp_node);
-		} else {
-			ms_free_node (tmp_node);
-			break;
-		}
-	}
-
-	
-	
-}
-
-/* Delete mapping of site */
-	void 
-_ms_clean_site_mapping(struct list_entry_t *site)
-{
-	struct list_t *eid_l;
-	struct list_entry_t *cur;
-	struct db_node *node;
-	uint8_t range;
-	void *rsvd;
-	
-	assert(site);
-	eid_l = ((struct site_info *)site->data)->eid;
-	cur = eid_l->head.next;
-	show_site_info((struct site_info *)site->data);
-	while (cur != &(eid_l->tail)) {
-		node = (struct db_node *)cur->data;
-		
-		if (node->l_left) {
-			_ms_clean_eid_mapping(node->l_left);
-			node->l_left = NULL;
-		}
-		if (node->l_right) {
-			_ms_clean_eid_mapping(node->l_right);	
-			node->l_right = NULL;
-		}
-		db_node_set_info(node,NULL);
-		
-		if (node->flags) {
-			range = ((struct mapping_flags *)node->flags)->range;
-			rsvd = ((struct mapping_flags *)node->flags)->rsvd;
-			bzero(node->flags,sizeof(struct mapping_flags));
-			if (range > _MAPP)
-				range = range & ~_MAPP;
-				
-			((struct mapping_flags *)node->flags)->range = range;	
-			((struct mapping_flags *)node->flags)->rsvd = rsvd;	
-		} else {
-			node->flags = NULL;
-		}	
-		cur = cur->next;
-	}
-}
-
 /* Create a new mapping */
 	void *
 _ms_generic_mapping_new(struct db_table *tb, struct prefix *eid)
@@ -3122,6 +3247,7 @@ _ms_process_register_record(const union map_reply_record_generic *rec, uint8_t p
 	/* add entry to mapping table */
 	mapping = generic_mapping_new(&eid);
 	generic_mapping_set_flags(mapping, &mflags);
+	_ms_eid_refresh(mapping);
 	
 	/* ====================================================== */
 	if (_debug == LDEBUG) {	
@@ -3347,138 +3473,251 @@ _ms_process_register_record(const union map_reply_record_generic *rec, uint8_t p
 	return (rlen);
 }
 
-/* Map-register process thread */
-	void *
-general_register_process(void *data)
+/* Add record of node and its locators to Map-Register rpk */
+	static void
+_register_add_mapping(struct ms_entry *ms, struct pk_rpl_entry *rpk, struct db_node *node)
+{
+	struct mapping_flags *mflags;
+	struct map_entry *e = NULL;
+	struct list_entry_t *_iter;
+	struct list_t *l;
+	
+	mflags = node->flags;			
+	l = (struct list_t *)db_node_get_info(node);
+	
+	/* only include PE in map-register message WITH proxy-reply */
+	if (ms->proxy && lisp_te && (_fncs & _FNC_XTR)) {
+		/* cal number of pe */
+		int lcount = 0;
+		_iter = l->head.next;
+		while (_iter != &l->tail) {
+			e = (struct map_entry*)_iter->data;
+			if (e->pe)
+				lcount += e->pe->count;
+			else
+				lcount++;
+			_iter = _iter->next;	
+		}
+		udp_register_add_record(rpk, &node->p, mflags->ttl, lcount, mflags->version, mflags->A, mflags->act);
+	}else{
+		udp_register_add_record(rpk, &node->p, mflags->ttl, l->count, mflags->version, mflags->A, mflags->act);
+	}	
+	
+	/* insert RLOC */
+	_iter = l->head.next;				
+	while (_iter != &l->tail) {
+		e = (struct map_entry*)_iter->data;
+		udp_register_add_locator(rpk, e, 0);
+		_iter = _iter->next;
+	}
+}
+
+/* Close segment rpk: append a copy to seg[], free rpk */
+	static int
+_register_seg_close(struct ms_entry *ms, struct pk_rpl_entry *rpk, struct reg_seg **seg, int *nseg)
+{
+	struct map_register_hdr *hr;
+	struct reg_seg *s;
+	
+	hr = (struct map_register_hdr *)rpk->buf;
+	hr->proxy_map_reply = ms->proxy;
+	hr->key_id = htons(01);
+	hr->auth_data_length = htons(20);
+	
+	if (!(s = realloc(*seg, (*nseg + 1) * sizeof(struct reg_seg)))) {
+		_free_rpl_pool_place(rpk, _rm_rpl);
+		return -1;
+	}
+	*seg = s;
+	s += *nseg;
+	if (!(s->buf = malloc(rpk->buf_len))) {
+		_free_rpl_pool_place(rpk, _rm_rpl);
+		return -1;
+	}
+	memcpy(s->buf, rpk->buf, rpk->buf_len);
+	s->len = rpk->buf_len;
+	(*nseg)++;
+	_free_rpl_pool_place(rpk, _rm_rpl);	
+	return 0;
+}
+
+/* Pre-encode Map-Registers of ms, nonce and authentication data are
+   filled at each send. The EID set is cut in segments of at most
+   MAP_REGISTER_MSS bytes and 255 records, each one is a complete
+   Map-Register. Also prepare HMAC key state.
+   Return -1 if no buffer is available */
+	static int
+_register_build(struct ms_entry *ms)
 {
 	struct pk_rpl_entry *rpk;
-	struct pk_rpl_entry *rpk_ex=NULL;
 	struct list_entry_t *ptr;
 	struct db_node *node;
-	struct ms_entry *ms;
-	struct mapping_flags *mflags;
 	struct map_register_hdr *hr;
+	struct list_t *l = NULL;
+	struct reg_seg *seg = NULL;
+	int nseg = 0;
+	void *curs;
+	uint16_t len;
+	uint32_t gen;
 	int i;
+	
+	/* changes made during the build are seen at next refresh */
+	gen = __atomic_load_n(&db_gen, __ATOMIC_ACQUIRE);
+	if (!(rpk = udp_register_add(NULL)))
+		return -1;
+	
+	/* add mapping to map-register message */
+	ptr = ms->eids->head.next;
+	while (ptr != &ms->eids->tail) {
+		node = (struct db_node *)ptr->data;
+		l = (struct list_t *)db_node_get_info(node);
+		assert(l);
+		if (!l->head.next) {
+			ptr = ptr->next;
+			continue;				
+		}
+		
+		hr = (struct map_register_hdr *)rpk->buf;
+		curs = rpk->curs;
+		len = rpk->buf_len;
+		if (hr->record_count < 255) {
+			_register_add_mapping(ms, rpk, node);
+			/* fits, or too large even alone: send it anyway */
+			if (rpk->buf_len <= MAP_REGISTER_MSS || hr->record_count == 1) {
+				ptr = ptr->next;
+				continue;
+			}
+			/* does not fit: remove it from this segment */
+			rpk->curs = curs;
+			rpk->buf_len = len;
+			hr->record_count--;
+		}
+		/* close segment, mapping goes to the next one */
+		if (_register_seg_close(ms, rpk, &seg, &nseg) < 0 ||
+				!(rpk = udp_register_add(NULL)))
+			goto fail;
+	}; /* add mapping to map-register message */	
+	
+	hr = (struct map_register_hdr *)rpk->buf;
+	if (hr->record_count || !nseg) {
+		if (_register_seg_close(ms, rpk, &seg, &nseg) < 0)
+			goto fail;
+	}else
+		_free_rpl_pool_place(rpk, _rm_rpl);
+	
+	for (i = 0; i < ms->reg_nseg; i++)
+		free(ms->reg_seg[i].buf);
+	free(ms->reg_seg);
+	ms->reg_seg = seg;
+	ms->reg_nseg = nseg;
+	ms->reg_gen = gen;
+	
+	/* key is padded and hashed once, each message starts from here */
+	HMAC_SHA1_Init(&ms->reg_key);
+	HMAC_SHA1_UpdateKey(&ms->reg_key, (unsigned char *)ms->key, strlen((char *)ms->key));
+	HMAC_SHA1_EndKey(&ms->reg_key);
+	HMAC_SHA1_StartMessage(&ms->reg_key);
+	cp_log(LDEBUG, "Map-Register to %s: template rebuilt, %d segment(s)\n",
+				sk_get_ip(&ms->addr, ip), nseg);
+	return 0;
+	
+fail:
+	for (i = 0; i < nseg; i++)
+		free(seg[i].buf);
+	free(seg);
+	return -1;
+}
+
+/* Send segment seg of ms template */
+	static void
+_register_send(struct ms_entry *ms, struct reg_seg *seg, int notify)
+{
+	struct map_register_hdr *hr;
+	struct pk_rpl_entry rpk;
 	HMAC_SHA1_CTX	ctx;
-	unsigned char	buf[BUFLEN];
-	struct map_entry *e = NULL;
-	struct list_entry_t *_iter, *pr;
-	struct list_t *l = NULL;
-	u_char pkbuf[PKMSIZE];
 	uint64_t	nonce;
 	uint32_t	*nonce_trick;
-	int count;
-	int buflen;
-	
-	count = 0;
-	for (; ;) {
-		pr = xtr_ms->head.next;		
-		while (pr != &xtr_ms->tail) {
-			ms = (struct ms_entry *)pr->data;
-			
-			/* init map-register message */
-			while (!(rpk = udp_register_add(NULL)) ) {
-				sleep(1);
-				continue;
-			}
-			
-			if(lisp_te && (_fncs & _FNC_XTR)){
-				while( !(rpk_ex = udp_register_add(NULL)) ){
-					sleep(1);
-					continue;		
-				}
-			}	
-			
-			/* add mapping to map-register message */
-			ptr = ms->eids->head.next;
-			while (ptr != &ms->eids->tail) {
-				node = (struct db_node *)ptr->data;
-				mflags = node->flags;			
-				l = (struct list_t *)db_node_get_info(node);
-				assert(l);
-				_iter = l->head.next;
-			
-				if (!_iter) {
-					ptr = ptr->next;
-					continue;				
-				}
-				
-				/* only include PE in map-register message WITH proxy-reply */
-				if (ms->proxy && lisp_te && (_fncs & _FNC_XTR)) {
-					/* cal number of pe */
-					int lcount = 0;
-					while (_iter != &l->tail) {
-						e = (struct map_entry*)_iter->data;
-						if (e->pe)
-							lcount += e->pe->count;
-						else
-							lcount++;
-						_iter = _iter->next;	
-					}
-					udp_register_add_record(rpk, &node->p, mflags->ttl, lcount, mflags->version, mflags->A, mflags->act);
-				}else{
-					udp_register_add_record(rpk, &node->p, mflags->ttl, l->count, mflags->version, mflags->A, mflags->act);
-				}	
+	
+	/* make nonce, cal authen data and send */
+	hr = (struct map_register_hdr *)seg->buf;
+	hr->want_map_notify = notify;
+	_make_nonce(&nonce);
+	nonce_trick = (void *)&nonce;
+	hr->lisp_nonce0 = htonl((*nonce_trick));
+	hr->lisp_nonce1 = htonl((*(nonce_trick + 1)));
+	
+	/*Calc auth data */
+	memset(hr->auth_data, 0, 20);
+	memcpy(&ctx, &ms->reg_key, sizeof(HMAC_SHA1_CTX));
+	HMAC_SHA1_UpdateMessage(&ctx, seg->buf, seg->len);
+	HMAC_SHA1_EndMessage(hr->auth_data, &ctx);
+	
+	cp_log(LDEBUG, "Map-Register ");
+	cp_log(LDEBUG, " <");
+	cp_log(LDEBUG, "nonce=0x%x - 0x%x", ntohl(hr->lisp_nonce0), ntohl(hr->lisp_nonce1));
+	cp_log(LDEBUG, ">\n");
 				
-				/* insert RLOC */
-				_iter = l->head.next;				
-				while (_iter != &l->tail) {
-					e = (struct map_entry*)_iter->data;
-					udp_register_add_locator(rpk, e, 0);
-					if (lisp_te && (_fncs & _FNC_XTR))
-						udp_register_add_locator(rpk_ex, e, 1);
-					
-					_iter = _iter->next;
-				}
-				ptr = ptr->next;
-			}; /* add mapping to map-register message */	
-			
-			/* make nonce, cal authen data and send */
-			hr = (struct map_register_hdr *)rpk->buf;
-			buflen = rpk->buf_len;
-			hr->proxy_map_reply = ms->proxy;
-			hr->key_id = htons(01);
-			hr->auth_data_length = htons(20);
-			if (!(count %15)) {
-				hr->want_map_notify = 1;
-				count = 0;
-			}
-			count++;
-			
-			/*Calc auth data */
-			for (i = 0; i < 20; i++)
-				hr->auth_data[i]=0;
-			
-			_make_nonce(&nonce);
-			nonce_trick = (void *)&nonce;
-			hr->lisp_nonce0 = htonl((*nonce_trick));
-			hr->lisp_nonce1 = htonl((*(nonce_trick + 1)));
-			memcpy(pkbuf, hr,buflen);
-			HMAC_SHA1_Init(&ctx);
-			HMAC_SHA1_UpdateKey(&ctx, (unsigned char *)ms->key, strlen((char *)ms->key));
-			HMAC_SHA1_EndKey(&ctx);
-			HMAC_SHA1_StartMessage(&ctx);
-			HMAC_SHA1_UpdateMessage(&ctx, pkbuf,buflen);
-			HMAC_SHA1_EndMessage(buf, &ctx);
-			for (i = 0; i < 20; i++) {
-				hr->auth_data[i]=buf[i];
-			}
-			
-			cp_log(LDEBUG, "Map-Register ");
-			cp_log(LDEBUG, " <");
-			cp_log(LDEBUG, "nonce=0x%x - 0x%x", ntohl(hr->lisp_nonce0), ntohl(hr->lisp_nonce1));
-			cp_log(LDEBUG, ">\n");
-						
-			/*Send */
-			udp_register_terminate(rpk, (union sockunion *)&(ms->addr));
-			_free_rpl_pool_place(rpk, _rm_rpl);	
-			pr = pr->next;
-		};/* send map-regiter finish */
-		
-		/* wake up each 1 minute to send map-register */		
-		sleep(60);
+	/*Send */
+	rpk.buf = seg->buf;
+	rpk.buf_len = seg->len;
+	udp_register_terminate(&rpk, (union sockunion *)&(ms->addr));
+}
+
+/* earliest time of next Map-Register (ms), timer thread only */
+static uint64_t reg_pace_next = 0;
+
+/* Timer of each MS: send the segments of its Map-Register as a train,
+   then arm next refresh. Sends of all MS are paced to
+   MAP_REGISTER_RATE per second */
+	static void
+_register_refresh(void *data)
+{
+	struct ms_entry *ms = data;
+	uint64_t now;
+	
+	now = timer_now_ms();
+	if (reg_pace_next > now) {
+		timer_add(&ms->refresh, reg_pace_next - now, _register_refresh, ms);
+		return;
+	}
+	
+	/* template is only rebuilt between two trains */
+	if (!ms->reg_cur &&
+			(!ms->reg_seg || ms->reg_gen != __atomic_load_n(&db_gen, __ATOMIC_ACQUIRE)) &&
+			_register_build(ms) < 0) {
+		timer_add(&ms->refresh, 1000, _register_refresh, ms);
+		return;
+	}
+	
+	reg_pace_next = now + 1000 / MAP_REGISTER_RATE;
+	/* want Map-Notify once every 15 trains */
+	_register_send(ms, &ms->reg_seg[ms->reg_cur], !(ms->reg_count % 15));
+	if (++ms->reg_cur < ms->reg_nseg) {
+		timer_add(&ms->refresh, 1000 / MAP_REGISTER_RATE, _register_refresh, ms);
+		return;
+	}
+	
+	ms->reg_cur = 0;
+	ms->reg_count = (ms->reg_count + 1) % 15;
+	timer_add(&ms->refresh, 
+			timer_jitter(MAP_REGISTER_INTERVAL * 1000, MAP_REGISTER_JITTER),
+			_register_refresh, ms);
+}
+
+/* Start Map-Register refresh, first messages are spread over a second
+   instead of being sent to every MS at once */
+	void
+general_register_start()
+{
+	struct list_entry_t *pr;
+	struct ms_entry *ms;
+	
+	pr = xtr_ms->head.next;		
+	while (pr != &xtr_ms->tail) {
+		ms = (struct ms_entry *)pr->data;
+		timer_add(&ms->refresh, random() % 1000, _register_refresh, ms);
+		pr = pr->next;
 	}
-	return NULL;
 }
 
 /* helper function */
@@ -3558,11 +3797,12 @@ _destroy_fct(void *data)
 /* make DDT-map-request */
 
 int udpproto;
-struct pollfd mr_fds[MAX_LOOKUPS + 1];
-struct pollfd mr_fds6[MAX_LOOKUPS + 1];
-int mr_fds_idx[MAX_LOOKUPS +1];
-int mr_fds_idx6[MAX_LOOKUPS +1];
+/* wake-up pipe first, then IPv4 and IPv6 socket of each lookup */
+struct pollfd mr_fds[2 * MAX_LOOKUPS + 1];
+int mr_fds_idx[2 * MAX_LOOKUPS + 1];
 nfds_t mr_nfds = 0;
+/* written when a lookup is added, so that mr_event_loop polls it */
+static int mr_wake[2] = { -1, -1 };
 int maxcount   = COUNT;
 int timeout = MAP_REPLY_TIMEOUT;
 int seq;
@@ -3581,9 +3821,35 @@ struct eid_pending {
 	void *orgi_pkg;				/* IH package */
 	void *pke;	 /* orig packet */
 	uint16_t orgi_pkg_len;
+	struct timer_ev retry;		/* retransmission */
 } mr_lookups[MAX_LOOKUPS];
 
+	int send_mr_ddt(uint32_t idx);
+	void free_lookups(int idx);
+
+/* Retransmission timer of a DDT lookup */
+	static void
+_mr_lookup_retry(void *data)
+{
+	int idx = (intptr_t)data;
+	
+	pthread_mutex_lock(&mr_lookups_mutex);
+	/* freed, or freed and reused (re-armed), while we waited for the lock */
+	if (!mr_lookups[idx].active || timer_pending(&mr_lookups[idx].retry)) {
+		pthread_mutex_unlock(&mr_lookups_mutex);
+		return;
+	}
+	if (mr_lookups[idx].count > MR_MAX_LOOKUP) {
+		stats_inc(STAT_DDT_FAIL);
+		free_lookups(idx);
+	}else{
+		send_mr_ddt(idx);
+	}
+	pthread_mutex_unlock(&mr_lookups_mutex);
+}
+
 
+/* Requires mr_lookups_mutex */
 	int 
 send_mr_ddt(uint32_t idx)
 {
@@ -3600,8 +3866,11 @@ send_mr_ddt(uint32_t idx)
 		
 		if (!mr_lookups[idx].rloc_cur) {
 			mr_lookups[idx].count = MR_MAX_LOOKUP+1;
+			/* no more RLOC: let the timer free the lookup */
+			timer_add(&mr_lookups[idx].retry, 0, _mr_lookup_retry, (void *)(intptr_t)idx);
 			return 1;
 		}	
+		timer_add(&mr_lookups[idx].retry, timeout * 1000, _mr_lookup_retry, (void *)(intptr_t)idx);
 		e = (struct map_entry *)mr_lookups[idx].rloc_cur->data;
 		rloc = &(e->rloc);
 		bzero(&servaddr,sizeof(servaddr));
@@ -3629,9 +3898,11 @@ send_mr_ddt(uint32_t idx)
 		if (sendtov(skt, (char *)buf, buf_len, 0, (struct sockaddr *)&(servaddr.sa), slen) == -1) {
 			cp_log(LLOG, "failed\n");
 			perror("sendtov()");
+			stats_inc(STAT_TX_ERR);
 			mr_lookups[idx].count++;
 			return (FALSE);
 		}
+		stats_inc(STAT_TX_REQUEST);
 		mr_lookups[idx].count++;
 		
 		struct list_t *l;
@@ -3653,7 +3924,7 @@ send_mr_ddt(uint32_t idx)
 	return (TRUE);
 }
 
-/*Add new EID to poll*/
+/*Add new EID to poll. Requires mr_lookups_mutex */
 	void 
 mr_new_lookup(void *data,struct communication_fct *fct,struct db_node *rn)
 {
@@ -3781,8 +4052,11 @@ mr_new_lookup(void *data,struct communication_fct *fct,struct db_node *rn)
 		mr_lookups[i].rloc_cur = l->tail.previous;
 	else
 		mr_lookups[i].rloc_cur = NULL;
-	clock_gettime(CLOCK_REALTIME, &mr_lookups[i].start);	
+	clock_gettime(CLOCK_MONOTONIC, &mr_lookups[i].start);	
+	stats_inc(STAT_DDT_START);
 	send_mr_ddt(i);
+	if (mr_wake[1] >= 0)
+		write(mr_wake[1], "", 1);
 }
 
 /*if exist request, reset count, else add to request pending */
@@ -3798,6 +4072,7 @@ pending_request(void *data, struct communication_fct *fct, struct db_node *rn)
 	nonce1  = (uint32_t *)(nonce0+1);
 	l = -1;
 	
+	pthread_mutex_lock(&mr_lookups_mutex);
 	for (i = 0; i < MAX_LOOKUPS; i++) {
 		if (!(mr_lookups[i].active)) continue;
 		if (*nonce0 == mr_lookups[i].nonce0 && *nonce1 == mr_lookups[i].nonce1) {
@@ -3814,13 +4089,16 @@ pending_request(void *data, struct communication_fct *fct, struct db_node *rn)
 		/* add new request to pending queue */		
 		mr_new_lookup(pke,fct,rn);
 	}	
+	pthread_mutex_unlock(&mr_lookups_mutex);
 	return 0;
 }
 
+/* Requires mr_lookups_mutex */
 	void
 free_lookups(int idx)
 {
 	if (mr_lookups[idx].active) {
+		timer_del(&mr_lookups[idx].retry);
 		udp_free_pk(mr_lookups[idx].pke);
 		free(mr_lookups[idx].last_eid);
 		mr_lookups[idx].last_eid = NULL;
@@ -3828,11 +4106,15 @@ free_lookups(int idx)
 		close(mr_lookups[idx].rx);
 		close(mr_lookups[idx].rx6);
 		mr_lookups[idx].active = 0;
+		/* stop polling the closed sockets */
+		if (mr_wake[1] >= 0)
+			write(mr_wake[1], "", 1);
 	}
 }
 
-	void *
-read_mr_ddt(void *enid)
+/* Requires mr_lookups_mutex */
+	static void *
+_read_mr_ddt(void *enid)
 {
 	int rcvl;
 	/* enid: encoding of idx and type of socket 
@@ -3854,13 +4136,17 @@ read_mr_ddt(void *enid)
 	
 	free(enid);
 	
-	/* read package */
+	/* freed by another thread since poll() returned */
+	if (!mr_lookups[idx].active)
+		return NULL;
+	
+	/* read package, the socket may already have been drained */
 	if (ipv4) {
 		sockaddr_len = sizeof(struct sockaddr_in);
 		if ((rcvl = recvfrom(mr_lookups[idx].rx,
 			 buf,
 			 PKBUFLEN,
-			0,
+			MSG_DONTWAIT,
 			(struct sockaddr *)&(si.sa),
 			&sockaddr_len)) < 0) {
 			return NULL;
@@ -3871,7 +4157,7 @@ read_mr_ddt(void *enid)
 		if ((rcvl = recvfrom(mr_lookups[idx].rx6,
 			 buf,
 			 PKBUFLEN,
-			0,
+			MSG_DONTWAIT,
 			(struct sockaddr *)&(si.sa),
 			&sockaddr_len)) < 0) {
 			return NULL;
@@ -3920,7 +4206,9 @@ read_mr_ddt(void *enid)
 		switch (rec->record.act) {
 		case LISP_REFERRAL_MS_ACK:
 			rlen = _process_referral_record(rec, &best_rloc, (struct db_node **)&node);
-			cp_log(LDEBUG, "Reach to Map Server...Finish\n");				
+			cp_log(LDEBUG, "Reach to Map Server...Finish\n");
+			stats_inc(STAT_DDT_DONE);
+			stats_hist_since(HIST_DDT, &mr_lookups[idx].start);
 			free_lookups(idx);
 			free(pf);
 			return NULL;
@@ -3930,6 +4218,7 @@ read_mr_ddt(void *enid)
 			rlen = _process_referral_record(rec, &best_rloc, (struct db_node **)&node);
 			if (mr_lookups[idx].last_eid && !prefix_match(mr_lookups[idx].last_eid,pf)) {
 				cp_log(LDEBUG, "Error: Map-referral loop\n");
+				stats_inc(STAT_DDT_FAIL);
 				free(pf);
 				free_lookups(idx);
 				return NULL;
@@ -3968,12 +4257,15 @@ read_mr_ddt(void *enid)
 			break;	
 		case LISP_REFERRAL_DELEGATION_HOLE:
 			/* send map-negative-reply */
+			stats_inc(STAT_DDT_HOLE);
+			stats_hist_since(HIST_DDT, &mr_lookups[idx].start);
 			free(pf);
 			free_lookups(idx);
 			return NULL;
 			break;
 		case LISP_REFERRAL_NOT_AUTHORITATIVE:
 			/* clear cache */
+			stats_inc(STAT_DDT_FAIL);
 			free(pf);
 			free_lookups(idx);
 			return NULL;
@@ -3987,7 +4279,17 @@ read_mr_ddt(void *enid)
 }
 
 	void *
-get_mr_ddt(void *data)
+read_mr_ddt(void *enid)
+{
+	pthread_mutex_lock(&mr_lookups_mutex);
+	_read_mr_ddt(enid);
+	pthread_mutex_unlock(&mr_lookups_mutex);
+	return NULL;
+}
+
+/* Requires mr_lookups_mutex */
+	static void *
+_get_mr_ddt(void *data)
 {
 	int idx;
 	struct map_referral_hdr *lcm;
@@ -4010,41 +4312,35 @@ get_mr_ddt(void *data)
 	/* check nonce for security*/
 	nonce0 = ntohl(lcm->lisp_nonce0);
 	nonce1 = ntohl(lcm->lisp_nonce1);
-	for (idx = 0 ; idx < mr_nfds - 1; idx++) {
-		if (_debug == LDEBUG) {		
-			fprintf(OUTPUT_STREAM, "idx=%d, nonce=0x%x - 0x%x>\n", \
+	for (idx = 0 ; idx < MAX_LOOKUPS; idx++) {
+		if (!mr_lookups[idx].active)
+			continue;
+		cp_log(LDEBUG, "idx=%d, nonce=0x%x - 0x%x>\n", \
 				idx, \
 				mr_lookups[idx].nonce0, \
 				mr_lookups[idx].nonce1);
-		}
 		if (mr_lookups[idx].nonce0 == nonce0 && mr_lookups[idx].nonce1 == nonce1)
 			break;
 	}
-	printf("Match with idx:%d\n",idx);
-	if (_debug == LDEBUG) {		
-		fprintf(OUTPUT_STREAM, "LCM: <type=%u, nonce=0x%x - 0x%x>\n", \
+	cp_log(LDEBUG, "Match with idx:%d\n",idx);
+	cp_log(LDEBUG, "LCM: <type=%u, nonce=0x%x - 0x%x>\n", \
 				lcm->lisp_type, \
 				ntohl(lcm->lisp_nonce0), \
 				ntohl(lcm->lisp_nonce1));
-	}
 	
-	if (idx >= mr_nfds -1)
+	if (idx >= MAX_LOOKUPS)
 		return NULL;
 	
 	rcount = lcm->record_count;	
 	if (rcount <= 0) {
-		if (_debug == LDEBUG)	
-			fprintf(OUTPUT_STREAM, "NO RECORD\n");
-		
+		cp_log(LDEBUG, "NO RECORD\n");
 		return NULL;
 	}
-	if (_debug == LDEBUG) {		
-		fprintf(OUTPUT_STREAM, "LCM: <type=%u, rcount=%u nonce=0x%x - 0x%x>\n", \
+	cp_log(LDEBUG, "LCM: <type=%u, rcount=%u nonce=0x%x - 0x%x>\n", \
 				lcm->lisp_type, \
 				rcount, \
 				ntohl(lcm->lisp_nonce0), \
 				ntohl(lcm->lisp_nonce1));
-	}
 	
 	lcm_len = sizeof(struct map_referral_hdr);
 	rec = (union map_referral_record_generic *)CO(lcm, lcm_len);
@@ -4064,7 +4360,7 @@ get_mr_ddt(void *data)
 			pf->family = AF_INET6;	
 			break;
 		default:
-			printf("Get_mr_dtt function: not support AF\n");
+			cp_log(LLOG, "Get_mr_dtt function: not support AF\n");
 			return NULL;
 		}		
 		
@@ -4073,8 +4369,9 @@ get_mr_ddt(void *data)
 		switch (rec->record.act) {
 		case LISP_REFERRAL_MS_ACK:
 			rlen = _process_referral_record(rec, &best_rloc, (struct db_node **)&node);
-			if (_debug == LDEBUG)	
-				fprintf(OUTPUT_STREAM, "Reach to Map Server...Finish\n");				
+			cp_log(LDEBUG, "Reach to Map Server...Finish\n");
+			stats_inc(STAT_DDT_DONE);
+			stats_hist_since(HIST_DDT, &mr_lookups[idx].start);
 			free_lookups(idx);
 			free(pf);
 			return NULL;
@@ -4083,8 +4380,8 @@ get_mr_ddt(void *data)
 		case LISP_REFERRAL_MS_REFERRAL:
 			rlen = _process_referral_record(rec, &best_rloc, (struct db_node **)&node);
 			if (mr_lookups[idx].last_eid && !prefix_match(mr_lookups[idx].last_eid,pf)) {
-				if (_debug == LDEBUG)	
-					fprintf(OUTPUT_STREAM,"Error: Map-referral loop\n");
+				cp_log(LDEBUG, "Error: Map-referral loop\n");
+				stats_inc(STAT_DDT_FAIL);
 				free(pf);
 				free_lookups(idx);
 				return NULL;
@@ -4122,19 +4419,22 @@ get_mr_ddt(void *data)
 			}
 			break;	
 		case LISP_REFERRAL_DELEGATION_HOLE:
-			printf("HOLE: send map-negative-reply\n");
+			cp_log(LDEBUG, "HOLE: send map-negative-reply\n");
 			struct pk_rpl_entry *rpk;
 			rpk = udp_reply_add(mr_lookups[idx].pke);
-			printf("For EID: %s\n",(char *)prefix2str(pf));
+			cp_log(LDEBUG, "For EID: %s\n",(char *)prefix2str(pf));
 			udp_reply_add_record(rpk, pf, 15, 0, 0, 0, 1);
 			udp_reply_terminate(rpk);
 			//send map-negative-reply
+			stats_inc(STAT_DDT_HOLE);
+			stats_hist_since(HIST_DDT, &mr_lookups[idx].start);
 			free(pf);
 			free_lookups(idx);
 			return NULL;
 			break;
 		case LISP_REFERRAL_NOT_AUTHORITATIVE:
 			//clear cache
+			stats_inc(STAT_DDT_FAIL);
 			free(pf);
 			free_lookups(idx);
 			return NULL;
@@ -4146,6 +4446,16 @@ get_mr_ddt(void *data)
 	send_mr_ddt(idx);
 	return NULL;
 }
+
+	void *
+get_mr_ddt(void *data)
+{
+	pthread_mutex_lock(&mr_lookups_mutex);
+	_get_mr_ddt(data);
+	pthread_mutex_unlock(&mr_lookups_mutex);
+	return NULL;
+}
+
 /* res = x - y */
 	int 
 timespec_subtract(struct timespec *res, struct timespec *x, struct timespec *y)
@@ -4175,75 +4485,50 @@ timespec_subtract(struct timespec *res, struct timespec *x, struct timespec *y)
 	void *
 mr_event_loop(void *context)
 {
-	thr_pool_t *mrworker;
-	mrworker = thr_pool_create(min_thread,max_thread,linger_thread, NULL);
 	int *enid;
+	int e, i, j, ipv4;
+	char c[64];
 	
+	if (pipe(mr_wake) < 0) {
+		cp_log(LLOG, "Can not create wake-up pipe of Map-Resolver\n");
+		return NULL;
+	}
+	fcntl(mr_wake[1], F_SETFL, O_NONBLOCK);
+	
+	/* retransmissions run on timer thread, poll() only waits for
+	   Map-Referrals and added or freed lookups */
 	for (;;) {
-        int e, i, j, l = -1,ipv4;
-		int poll_timeout = timeout*1000;
-        
-		//int poll_timeout = INFTIM; 
-		/* poll() timeout in milliseconds. We initialize
-                                   to INFTIM = -1 (infinity). If there are no
-                                   active lookups, we wait in poll() until a
-                                   mapping socket event is received. */
-        struct timespec now, deadline, delta, to, tmp;
-	
-        to.tv_sec  = timeout;
-        to.tv_nsec = 0;
-
-        mr_nfds = 0;
-
-        clock_gettime(CLOCK_REALTIME, &now);
-
-        for (i = 0; i < MAX_LOOKUPS; i++) {
-            if (!(mr_lookups[i].active)) continue;
-			if (mr_lookups[i].count > MR_MAX_LOOKUP) {
-				free_lookups(i);
-				continue;
-			}
-			
-            deadline.tv_sec = mr_lookups[i].start.tv_sec + mr_lookups[i].count * timeout; 
-            deadline.tv_nsec = mr_lookups[i].start.tv_nsec;
-		
-            timespec_subtract(&delta, &deadline, &now);
-			if (delta.tv_sec < 0) {
-				delta.tv_sec = timeout/2 ;
-				delta.tv_nsec = 0;
-			}
-			
-            mr_fds[mr_nfds].fd     = mr_lookups[i].rx;
-            mr_fds[mr_nfds].events = POLLIN;
+		mr_fds[0].fd = mr_wake[0];
+		mr_fds[0].events = POLLIN;
+		mr_fds_idx[0] = -1;
+		mr_nfds = 1;
+		pthread_mutex_lock(&mr_lookups_mutex);
+		for (i = 0; i < MAX_LOOKUPS; i++) {
+			if (!(mr_lookups[i].active)) continue;
+			mr_fds[mr_nfds].fd     = mr_lookups[i].rx;
+			mr_fds[mr_nfds].events = POLLIN;
 			mr_fds_idx[mr_nfds]    = i;
 			mr_nfds++;
-			mr_fds6[mr_nfds].fd     = mr_lookups[i].rx6;
-            mr_fds[mr_nfds].events = POLLIN;
-            mr_fds_idx[mr_nfds]    = i;
-            mr_nfds++;
-            /* Find the minimum delta */
-            if (timespec_subtract(&tmp, &delta, &to)) {
-				to.tv_sec    = delta.tv_sec;
-                to.tv_nsec   = delta.tv_nsec;
-                poll_timeout = to.tv_sec * 1000 + to.tv_nsec / 1000000;
-                l = i;
-            }			
-        } /* Finished iterating through all lookups */
+			mr_fds[mr_nfds].fd     = mr_lookups[i].rx6;
+			mr_fds[mr_nfds].events = POLLIN;
+			mr_fds_idx[mr_nfds]    = i;
+			mr_nfds++;
+		}
+		pthread_mutex_unlock(&mr_lookups_mutex);
 		
-		e = poll(mr_fds, mr_nfds, poll_timeout);		
-        if (e < 0) continue;		
-        if (e == 0)                             /* If timeout expires */
-            if (l >= 0)                         /* and slot is defined */
-				send_mr_ddt(l);                    /* retry Map-Request */
-		for (j = mr_nfds - 1; j >= 0; j--) {
-            if (mr_fds[j].revents == POLLIN) {
-				ipv4 = (j % 2 == 0)?1:0;
+		e = poll(mr_fds, mr_nfds, INFTIM);		
+		if (e <= 0) continue;		
+		if (mr_fds[0].revents & POLLIN)
+			read(mr_wake[0], c, sizeof(c));
+		for (j = mr_nfds - 1; j > 0; j--) {
+			if (mr_fds[j].revents == POLLIN) {
+				ipv4 = (j % 2 == 1)?1:0;
 				enid = calloc(1,sizeof(int));
 				/*enid: encoding of idx and ipv4 */
 				*enid = mr_fds_idx[j]*2+ipv4;
-                //thr_pool_queue(mrworker, read_mr_ddt, (void *)enid);
 				read_mr_ddt((void *)enid);
-            }
-        }
-    }
+			}
+		}
+	}
+	return NULL;
 }
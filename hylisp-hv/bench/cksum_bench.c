@@ -0,0 +1,172 @@
+/*
+Copyright (c) 2014, Stefano Tribioli
+All rights reserved. 
+
+This file is part of the hyLISP project.
+http://hylisp.org
+
+Redistribution and use in source and binary forms, with or without modification, 
+are permitted provided that the following conditions are met: 
+1. Redistributions of source code must retain the above copyright notice, this 
+   list of conditions and the following disclaimer. 
+2. Redistributions in binary form must reproduce the above copyright notice, 
+   this list of conditions and the following disclaimer in the documentation 
+   and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND 
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON 
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. 
+ */
+
+/*
+ * Throughput of the checksum paths of hylispcksum.h (scalar, SSE2 and
+ * AVX2) on the buffer sizes met by the injector and the control plane.
+ * Every path is first checked against a plain 16-bit sum for random
+ * offsets and lengths. Built with "make bench", x86 only.
+ *
+ * Usage: cksum_bench [megabytes per run]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_BUF_LEN	(9000 + 64)
+#define BENCH_CHECKS	100000
+
+uint16_t cksum_scalar(const void*, size_t);
+uint16_t cksum_sse2(const void*, size_t);
+uint16_t cksum_avx2(const void*, size_t);
+
+typedef struct {
+	const char* name;
+	uint16_t (*fn)(const void*, size_t);
+	int usable;
+} cksum_path;
+
+static const size_t sizes[] = { 20, 64, 576, 1500, 9000 };
+
+/* RFC 1071 as written, 16-bit words in network order */
+static uint16_t reference_cksum(const uint8_t* p, size_t len) {
+	uint32_t sum = 0;
+
+	while (len > 1) {
+		sum += (p[0] << 8) | p[1];
+		p += 2;
+		len -= 2;
+	}
+	if (len == 1) {
+		sum += p[0] << 8;
+	}
+	while (sum >> 16) {
+		sum = (sum & 0xFFFF) + (sum >> 16);
+	}
+	return (uint16_t) ~sum;
+}
+
+static uint64_t now_ns() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int check_path(cksum_path* path, uint8_t* buf) {
+	int i;
+
+	for (i = 0; i < BENCH_CHECKS; i++) {
+		size_t off = random() % 64;
+		size_t len = random() % (BENCH_BUF_LEN - off);
+		uint16_t c = path->fn(buf + off, len);
+		/* Stored as is, the field reads back in network order */
+		uint16_t expected = reference_cksum(buf + off, len);
+		uint8_t* b = (uint8_t*) &c;
+
+		if (((b[0] << 8) | b[1]) != expected) {
+			printf("%s: wrong checksum for offset %zu, length %zu\n", path->name, off, len);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static double run_path(cksum_path* path, uint8_t* buf, size_t len, uint64_t total) {
+	uint64_t rounds = total / len + 1;
+	volatile uint16_t sink = 0;
+	uint64_t i;
+
+	uint64_t start = now_ns();
+	for (i = 0; i < rounds; i++) {
+		sink += path->fn(buf + (i & 7), len);
+	}
+	uint64_t elapsed = now_ns() - start;
+
+	(void) sink;
+	return (double) (rounds * len) / (elapsed > 0 ? elapsed : 1);
+}
+
+int main(int argc, char** argv) {
+	cksum_path paths[] = {
+		{ "scalar", cksum_scalar, 1 },
+		{ "SSE2", cksum_sse2, __builtin_cpu_supports("sse2") },
+		{ "AVX2", cksum_avx2, __builtin_cpu_supports("avx2") },
+	};
+	const int paths_ctr = sizeof(paths) / sizeof(paths[0]);
+	uint64_t total = 256;
+	size_t i;
+	int j;
+
+	if (argc > 1) {
+		total = strtoull(argv[1], NULL, 10);
+		if (total == 0) {
+			fprintf(stderr, "Usage: %s [megabytes per run]\n", argv[0]);
+			return 1;
+		}
+	}
+	total <<= 20;
+
+	uint8_t* buf = malloc(BENCH_BUF_LEN);
+	if (buf == NULL) {
+		return 1;
+	}
+	srandom(1);
+	for (i = 0; i < BENCH_BUF_LEN; i++) {
+		buf[i] = random();
+	}
+
+	for (j = 0; j < paths_ctr; j++) {
+		if (paths[j].usable && check_path(&(paths[j]), buf) < 0) {
+			return 1;
+		}
+	}
+
+	printf("%8s", "size");
+	for (j = 0; j < paths_ctr; j++) {
+		printf("%10s", paths[j].name);
+	}
+	printf("   (GB/s)\n");
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		printf("%6zu B", sizes[i]);
+		for (j = 0; j < paths_ctr; j++) {
+			if (paths[j].usable) {
+				printf("%10.2f", run_path(&(paths[j]), buf, sizes[i], total));
+			} else {
+				printf("%10s", "n/a");
+			}
+		}
+		printf("\n");
+	}
+
+	free(buf);
+	return 0;
+}
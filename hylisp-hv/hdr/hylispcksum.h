@@ -0,0 +1,190 @@
+/*
+Copyright (c) 2014, Stefano Tribioli
+All rights reserved. 
+
+This file is part of the hyLISP project.
+http://hylisp.org
+
+Redistribution and use in source and binary forms, with or without modification, 
+are permitted provided that the following conditions are met: 
+1. Redistributions of source code must retain the above copyright notice, this 
+   list of conditions and the following disclaimer. 
+2. Redistributions in binary form must reproduce the above copyright notice, 
+   this list of conditions and the following disclaimer in the documentation 
+   and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND 
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON 
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. 
+ */
+
+#ifndef HYLISPCKSUM_H_
+#define HYLISPCKSUM_H_
+
+/*
+ * Internet checksum (RFC 1071), shared by hylisp-hv and hylisp-cp.
+ *
+ * Words are summed as they lie in memory into a 64-bit accumulator and
+ * folded only at the end; the folded value is in network order and can
+ * be stored as is. Buffers of a checksum may be summed in several calls,
+ * all of them but the last must have an even length.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* Adds len octets at buf to sum */
+static inline uint64_t cksum_add(uint64_t sum, const void* buf, size_t len) {
+	const uint8_t* p = buf;
+
+#if defined(__AVX2__)
+	if (len >= 64) {
+		const __m256i zero = _mm256_setzero_si256();
+		__m256i acc = _mm256_setzero_si256();
+
+		while (len >= 32) {
+			__m256i v = _mm256_loadu_si256((const __m256i*) p);
+			/* 32-bit words widened to 64 bits never overflow */
+			acc = _mm256_add_epi64(acc, _mm256_unpacklo_epi32(v, zero));
+			acc = _mm256_add_epi64(acc, _mm256_unpackhi_epi32(v, zero));
+			p += 32;
+			len -= 32;
+		}
+
+		uint64_t lanes[4];
+		_mm256_storeu_si256((__m256i*) lanes, acc);
+		sum += (lanes[0] >> 32) + (uint32_t) lanes[0] + (lanes[1] >> 32) + (uint32_t) lanes[1];
+		sum += (lanes[2] >> 32) + (uint32_t) lanes[2] + (lanes[3] >> 32) + (uint32_t) lanes[3];
+	}
+#elif defined(__SSE2__)
+	if (len >= 64) {
+		const __m128i zero = _mm_setzero_si128();
+		__m128i acc = _mm_setzero_si128();
+
+		while (len >= 16) {
+			__m128i v = _mm_loadu_si128((const __m128i*) p);
+			/* 32-bit words widened to 64 bits never overflow */
+			acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(v, zero));
+			acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(v, zero));
+			p += 16;
+			len -= 16;
+		}
+
+		uint64_t lanes[2];
+		_mm_storeu_si128((__m128i*) lanes, acc);
+		sum += (lanes[0] >> 32) + (uint32_t) lanes[0] + (lanes[1] >> 32) + (uint32_t) lanes[1];
+	}
+#endif
+
+	while (len >= 4) {
+		uint32_t w;
+		memcpy(&w, p, 4);
+		sum += w;
+		p += 4;
+		len -= 4;
+	}
+
+	if (len >= 2) {
+		uint16_t w;
+		memcpy(&w, p, 2);
+		sum += w;
+		p += 2;
+		len -= 2;
+	}
+
+	if (len == 1) {
+		/* Padded with a zero octet */
+		uint16_t w = 0;
+		memcpy(&w, p, 1);
+		sum += w;
+	}
+
+	return sum;
+}
+
+/* Folds sum to 16 bits, not complemented */
+static inline uint16_t cksum_fold(uint64_t sum) {
+	sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+	sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	return (uint16_t) sum;
+}
+
+/* Checksum field value for sum */
+static inline uint16_t cksum_finish(uint64_t sum) {
+	return (uint16_t) ~cksum_fold(sum);
+}
+
+/* Checksum of a whole buffer */
+static inline uint16_t cksum(const void* buf, size_t len) {
+	return cksum_finish(cksum_add(0, buf, len));
+}
+
+/*
+ * Sum of the IPv4 and IPv6 pseudo headers of TCP and UDP, to be added to
+ * the sum of the transport header and payload. Addresses in network
+ * order, proto and len in host order.
+ */
+static inline uint64_t cksum_pseudo_ipv4(const void* src, const void* dst, uint8_t proto, uint16_t len) {
+	uint16_t w[2] = { 0, 0 };
+	uint8_t* b = (uint8_t*) w;
+
+	b[1] = proto;
+	b[2] = len >> 8;
+	b[3] = len & 0xFF;
+
+	uint64_t sum = cksum_add(0, src, 4);
+	sum = cksum_add(sum, dst, 4);
+	return cksum_add(sum, w, 4);
+}
+
+static inline uint64_t cksum_pseudo_ipv6(const void* src, const void* dst, uint8_t proto, uint32_t len) {
+	uint8_t b[8] = { 0 };
+
+	b[0] = len >> 24;
+	b[1] = (len >> 16) & 0xFF;
+	b[2] = (len >> 8) & 0xFF;
+	b[3] = len & 0xFF;
+	b[7] = proto;
+
+	uint64_t sum = cksum_add(0, src, 16);
+	sum = cksum_add(sum, dst, 16);
+	return cksum_add(sum, b, 8);
+}
+
+/*
+ * Incremental update (RFC 1624, eqn. 3) of checksum field hc when a
+ * 16-bit word old of the covered data becomes new, all as in memory:
+ * HC' = ~(~HC + ~m + m')
+ */
+static inline uint16_t cksum_update16(uint16_t hc, uint16_t old, uint16_t new) {
+	uint64_t sum = (uint16_t) ~hc;
+	sum += (uint16_t) ~old;
+	sum += new;
+	return cksum_finish(sum);
+}
+
+/* Same for a 32-bit word, e.g. an IPv4 address */
+static inline uint16_t cksum_update32(uint16_t hc, uint32_t old, uint32_t new) {
+	uint64_t sum = (uint16_t) ~hc;
+	sum += (uint32_t) ~old;
+	sum += new;
+	return cksum_finish(sum);
+}
+
+#endif /* HYLISPCKSUM_H_ */
@@ -39,9 +39,28 @@ typedef struct {
 	pid_t pid;
 } hv_registration_message;
 
+/*
+ * Sent by a control plane before each Map-Request, Map-Register or
+ * Encapsulated Control Message, so that the answer carrying the same nonce
+ * is delivered to it only.
+ */
+typedef struct {
+	int action;
+	uint16_t port;
+	uint8_t type;
+	uint64_t nonce;
+} hv_nonce_message;
+
+/*
+ * ACTION_REGISTER_RINGS registers asking for shared-memory rings (see
+ * hylispring.h); the hypervisor acknowledges with "ACKR" and passes the
+ * region and its doorbells after the sockets, or with "ACK" if it has none.
+ */
 enum {
 	ACTION_REGISTER,
-	ACTION_DEREGISTER
+	ACTION_DEREGISTER,
+	ACTION_NONCE,
+	ACTION_REGISTER_RINGS
 };
 
 #endif /* HYLISPHV_H_ */
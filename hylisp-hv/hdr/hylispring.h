@@ -0,0 +1,166 @@
+/*
+Copyright (c) 2014, Stefano Tribioli
+All rights reserved. 
+
+This file is part of the hyLISP project.
+http://hylisp.org
+
+Redistribution and use in source and binary forms, with or without modification, 
+are permitted provided that the following conditions are met: 
+1. Redistributions of source code must retain the above copyright notice, this 
+   list of conditions and the following disclaimer. 
+2. Redistributions in binary form must reproduce the above copyright notice, 
+   this list of conditions and the following disclaimer in the documentation 
+   and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND 
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON 
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. 
+ */
+
+#ifndef HYLISPRING_H_
+#define HYLISPRING_H_
+
+/*
+ * Shared-memory rings between the hypervisor and a control plane, shared
+ * by hylisp-hv and hylisp-cp.
+ *
+ * The hypervisor creates one region per control plane asking for it at
+ * registration, and passes it together with two doorbells (pipes): the
+ * west ring carries control packets to the control plane, the east ring
+ * carries Map messages from it. Each ring has one producer and one
+ * consumer, with fixed size slots read and written in place.
+ *
+ * A consumer only sleeps on its doorbell after hv_ring_sleep(), and a
+ * producer only rings the doorbell when hv_ring_commit() says the consumer
+ * sleeps, so a busy ring costs no system call.
+ */
+
+#include <stdint.h>
+
+#define HV_RING_MAGIC		0x484c5247	/* "HLRG" */
+#define HV_RING_VERSION		1
+#define HV_RING_SLOTS		512		/* Power of 2 */
+#define HV_RING_SLOT_LEN	4608
+
+typedef struct {
+	uint16_t len;				/* Of data */
+	uint8_t family;				/* AF_INET or AF_INET6 for control packets, 0 for Map messages */
+	uint8_t reserved;
+	uint16_t source_port;		/* Network order */
+	uint16_t destination_port;
+	uint8_t source[16];			/* IPv4 addresses use the first 4 bytes */
+	uint8_t destination[16];
+} hv_ring_slot_header;
+
+#define HV_RING_DATA_LEN	(HV_RING_SLOT_LEN - sizeof(hv_ring_slot_header))
+
+typedef struct {
+	hv_ring_slot_header h;
+	uint8_t data[HV_RING_DATA_LEN];
+} hv_ring_slot;
+
+typedef struct {
+	uint32_t head;				/* Next slot to write, producer only */
+	uint8_t pad0[60];
+	uint32_t tail;				/* Next slot to read, consumer only */
+	uint32_t sleeping;			/* Consumer waits on its doorbell */
+	uint8_t pad1[56];
+	hv_ring_slot slots[HV_RING_SLOTS];
+} hv_ring;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint8_t pad[56];
+	hv_ring west;				/* Hypervisor -> control plane */
+	hv_ring east;				/* Control plane -> hypervisor */
+} hv_shared_rings;
+
+/* Producer: free slot to fill, or NULL if the ring is full */
+static inline hv_ring_slot* hv_ring_reserve(hv_ring* r) {
+	uint32_t head = __atomic_load_n(&(r->head), __ATOMIC_RELAXED);
+	uint32_t tail = __atomic_load_n(&(r->tail), __ATOMIC_ACQUIRE);
+
+	if (head - tail >= HV_RING_SLOTS) {
+		return NULL;
+	}
+
+	return &(r->slots[head & (HV_RING_SLOTS - 1)]);
+}
+
+/* Producer: publishes the reserved slot, returns 1 if the doorbell must be rung */
+static inline int hv_ring_commit(hv_ring* r) {
+	uint32_t head = __atomic_load_n(&(r->head), __ATOMIC_RELAXED);
+
+	__atomic_store_n(&(r->head), head + 1, __ATOMIC_RELEASE);
+
+	/* Pairs with the fence of hv_ring_sleep() */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return __atomic_load_n(&(r->sleeping), __ATOMIC_RELAXED);
+}
+
+/* Consumer: oldest slot, or NULL if the ring is empty */
+static inline hv_ring_slot* hv_ring_peek(hv_ring* r) {
+	uint32_t tail = __atomic_load_n(&(r->tail), __ATOMIC_RELAXED);
+	uint32_t head = __atomic_load_n(&(r->head), __ATOMIC_ACQUIRE);
+
+	if (tail == head) {
+		return NULL;
+	}
+
+	return &(r->slots[tail & (HV_RING_SLOTS - 1)]);
+}
+
+/* Consumer: gives back the slot returned by hv_ring_peek() */
+static inline void hv_ring_release(hv_ring* r) {
+	uint32_t tail = __atomic_load_n(&(r->tail), __ATOMIC_RELAXED);
+
+	__atomic_store_n(&(r->tail), tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Consumer: the n-th oldest slot, or NULL if fewer are filled */
+static inline hv_ring_slot* hv_ring_peek_nth(hv_ring* r, uint32_t n) {
+	uint32_t tail = __atomic_load_n(&(r->tail), __ATOMIC_RELAXED);
+	uint32_t head = __atomic_load_n(&(r->head), __ATOMIC_ACQUIRE);
+
+	if (head - tail <= n) {
+		return NULL;
+	}
+
+	return &(r->slots[(tail + n) & (HV_RING_SLOTS - 1)]);
+}
+
+/* Consumer: gives back the n oldest slots at once */
+static inline void hv_ring_release_n(hv_ring* r, uint32_t n) {
+	uint32_t tail = __atomic_load_n(&(r->tail), __ATOMIC_RELAXED);
+
+	__atomic_store_n(&(r->tail), tail + n, __ATOMIC_RELEASE);
+}
+
+/* Consumer: returns 1 if it may sleep on the doorbell, 0 if the ring is not empty */
+static inline int hv_ring_sleep(hv_ring* r) {
+	__atomic_store_n(&(r->sleeping), 1, __ATOMIC_RELAXED);
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (hv_ring_peek(r) != NULL) {
+		__atomic_store_n(&(r->sleeping), 0, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Consumer: woken up, or done waiting */
+static inline void hv_ring_awake(hv_ring* r) {
+	__atomic_store_n(&(r->sleeping), 0, __ATOMIC_RELAXED);
+}
+
+#endif /* HYLISPRING_H_ */
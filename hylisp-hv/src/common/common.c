@@ -26,16 +26,18 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
 #include "common.h"
+#include "trace.h"
 
-#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
 #include <sys/socket.h>
-#include <arpa/inet.h>
 
 int hv_debug = 0;
+int hv_workers = 0;
+int hv_queue_len = 256;
+int hv_miss_policy = MISS_POLICY_COALESCE;
 
 void check_allocation(void* ptr) {
 	if (ptr == NULL) {
@@ -51,6 +53,7 @@ void fatal(char* msg) {
 	
 	if (hv_debug) {
 		fflush(stderr);
+		flush_traces();
 		abort();
 	} else {
 		exit(-1);
@@ -64,6 +67,7 @@ void fatalr(char* msg, int custom_errno) {
 	
 	if (hv_debug) {
 		fflush(stderr);
+		flush_traces();
 		abort();
 	} else {
 		exit(-1);
@@ -83,38 +87,3 @@ void warningr(char* msg, int custom_errno) {
 	perror(NULL);
 	fflush(stderr);
 }
-
-void debug_printf(const char* template, ...) {
-	if (!hv_debug) {
-		return;
-	}
-
-	char* nl_template = malloc(strlen(template) + 2);
-	check_allocation(nl_template);
-	strcpy(nl_template, template);
-	strcat(nl_template, "\n");
-	
-	va_list args;
-	va_start(args, template);
-	vfprintf(stdout, nl_template, args);
-	fflush(stdout);
-	va_end(args);
-	
-	free(nl_template);
-}
-
-void debug_printf_prefix(ipv6_prefix* subject) {
-	if (!hv_debug) {
-		return;
-	}
-	
-	char buf[INET6_ADDRSTRLEN];
-	inet_ntop(AF_INET6, subject->prefix, buf, INET6_ADDRSTRLEN);
-	
-	if (subject->reason == PRFX_ASIS) {
-		fprintf(stdout, "Affected EID is %.*s/%u\n", INET6_ADDRSTRLEN, buf, subject->prefix_length);
-	} else {
-		fprintf(stdout, "Affected EID is %.*s/%u (reason %d)\n", INET6_ADDRSTRLEN, buf, subject->prefix_length, subject->reason);
-	}
-	fflush(stdout);
-}
\ No newline at end of file
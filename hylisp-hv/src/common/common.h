@@ -62,18 +62,32 @@ typedef struct {
 	int payload_len;
 } ipv4_datagram;
 
+typedef struct {
+	struct sockaddr_in6 source;
+	struct sockaddr_in6 destination;
+	uint8_t* payload;
+	int payload_len;
+} ipv6_datagram;
+
 extern int ipv4_controlpackets_socket;
 extern int ipv6_controlpackets_socket;
 extern int map_socket;
 
+enum {
+	MISS_POLICY_TAIL,		// A full queue drops the newest miss
+	MISS_POLICY_HEAD,		// A full queue drops its oldest miss
+	MISS_POLICY_COALESCE	// Like tail, and a miss for an EID already queued is dropped
+};
+
 extern int hv_debug;
+extern int hv_workers;
+extern int hv_queue_len;
+extern int hv_miss_policy;
 
 void check_allocation(void*);
 void fatal(char*);
 void fatalr(char*, int);
 void warning(char*);
 void warningr(char*, int);
-void debug_printf(const char*, ...);
-void debug_printf_prefix(ipv6_prefix*);
 
 #endif /* COMMON_COMMON_H_ */
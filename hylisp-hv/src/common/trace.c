@@ -0,0 +1,475 @@
+/*
+Copyright (c) 2014, Stefano Tribioli
+All rights reserved. 
+
+This file is part of the hyLISP project.
+http://hylisp.org
+
+Redistribution and use in source and binary forms, with or without modification, 
+are permitted provided that the following conditions are met: 
+1. Redistributions of source code must retain the above copyright notice, this 
+   list of conditions and the following disclaimer. 
+2. Redistributions in binary form must reproduce the above copyright notice, 
+   this list of conditions and the following disclaimer in the documentation 
+   and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND 
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON 
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. 
+ */
+
+#include "trace.h"
+
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+
+/*
+ * Every thread appends fixed-size binary records to a ring of its own,
+ * without locks or stdio: only the arguments are copied, as told by the
+ * format. The trace writer formats and writes them in the background. A
+ * record that finds its ring full is dropped and counted.
+ */
+
+#define TRACE_THREADS	256
+#define TRACE_RING_LEN	4096		// Power of 2
+#define TRACE_ARGS		8
+#define TRACE_IDLE		10000000	// Nsec the writer sleeps if all rings are empty
+#define TRACE_LINE_LEN	512
+
+enum {
+	RECORD_TEXT,
+	RECORD_ADDRESSES,
+	RECORD_PREFIX
+};
+
+enum {
+	LEN_INT,
+	LEN_LONG,
+	LEN_LONG_LONG,
+	LEN_SIZE
+};
+
+typedef struct {
+	struct timespec time;
+	const char* format;
+	uint64_t args[TRACE_ARGS];
+	uint8_t data[32];				// Addresses or prefix
+	uint8_t kind;
+	uint8_t family;
+	uint16_t pad;
+	uint32_t subsystem;
+} trace_entry;
+
+typedef struct {
+	uint32_t head;					// Owner thread only
+	uint8_t pad0[60];
+	uint32_t tail;					// Trace writer only
+	uint32_t lost;
+	uint8_t pad1[56];
+	trace_entry entries[TRACE_RING_LEN];
+} trace_ring;
+
+int hv_trace_level = 0;
+uint32_t hv_trace_mask = TRACE_ALL;
+
+static trace_ring* trace_rings[TRACE_THREADS];
+static int trace_rings_ctr = 0;
+static __thread trace_ring* my_ring = NULL;
+static __thread int my_ring_missing = 0;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char* SUBSYSTEM_NAMES[] = {"west", "east", "north", "south"};
+
+static trace_entry* reserve_entry();
+static void commit_entry();
+static const char* parse_spec(const char*, int*, const char**);
+static void collect_args(trace_entry*, const char*, va_list);
+static int format_text(char*, int, const char*, uint64_t*);
+static void write_entry(int, trace_entry*);
+static int drain_traces();
+
+int parse_trace_mask(char* list) {
+	uint32_t mask = 0;
+
+	char* copy = strdup(list);
+	check_allocation(copy);
+
+	char* saveptr;
+	char* name = strtok_r(copy, ",", &saveptr);
+	while (name != NULL) {
+		int i;
+		for (i = 0; i < 4; i++) {
+			if (strcmp(name, SUBSYSTEM_NAMES[i]) == 0) {
+				mask |= (1 << i);
+				break;
+			}
+		}
+
+		if (strcmp(name, "all") == 0) {
+			mask |= TRACE_ALL;
+		} else if (i == 4) {
+			free(copy);
+			return -1;
+		}
+
+		name = strtok_r(NULL, ",", &saveptr);
+	}
+
+	free(copy);
+	return mask;
+}
+
+void trace_record(uint32_t subsystem, const char* format, ...) {
+	trace_entry* e = reserve_entry();
+	if (e == NULL) {
+		return;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &(e->time));
+	e->kind = RECORD_TEXT;
+	e->subsystem = subsystem;
+	e->format = format;
+
+	va_list args;
+	va_start(args, format);
+	collect_args(e, format, args);
+	va_end(args);
+
+	commit_entry();
+}
+
+/* Converted to text by the writer, not by the caller */
+void trace_record_addresses(uint32_t subsystem, const char* format, int family, void* source, void* destination) {
+	trace_entry* e = reserve_entry();
+	if (e == NULL) {
+		return;
+	}
+
+	int len = (family == AF_INET) ? sizeof(struct in_addr) : sizeof(struct in6_addr);
+
+	clock_gettime(CLOCK_REALTIME, &(e->time));
+	e->kind = RECORD_ADDRESSES;
+	e->subsystem = subsystem;
+	e->format = format;
+	e->family = family;
+	memcpy(e->data, source, len);
+	memcpy(e->data + 16, destination, len);
+
+	commit_entry();
+}
+
+void trace_record_prefix(uint32_t subsystem, ipv6_prefix* prefix) {
+	trace_entry* e = reserve_entry();
+	if (e == NULL) {
+		return;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &(e->time));
+	e->kind = RECORD_PREFIX;
+	e->subsystem = subsystem;
+	memcpy(e->data, prefix->prefix, 16);
+	e->args[0] = prefix->prefix_length;
+	e->args[1] = prefix->reason;
+
+	commit_entry();
+}
+
+/* Called by fatal errors, so the last records are not lost */
+void flush_traces() {
+	drain_traces();
+}
+
+void* start_trace_writer(void* arg) {
+	while (1) {
+		if (drain_traces() == 0) {
+			struct timespec rqtp = {0, TRACE_IDLE};
+			nanosleep(&rqtp, NULL);
+		}
+	}
+
+	pthread_exit(0);
+}
+
+static trace_entry* reserve_entry() {
+	if (my_ring == NULL) {
+		if (my_ring_missing) {
+			return NULL;
+		}
+
+		int i = __atomic_fetch_add(&trace_rings_ctr, 1, __ATOMIC_RELAXED);
+		if (i >= TRACE_THREADS) {
+			/* Too many threads: this one is not traced */
+			my_ring_missing = 1;
+			return NULL;
+		}
+
+		my_ring = calloc(1, sizeof(trace_ring));
+		check_allocation(my_ring);
+		__atomic_store_n(&(trace_rings[i]), my_ring, __ATOMIC_RELEASE);
+	}
+
+	uint32_t head = my_ring->head;
+	uint32_t tail = __atomic_load_n(&(my_ring->tail), __ATOMIC_ACQUIRE);
+
+	if (head - tail >= TRACE_RING_LEN) {
+		__atomic_add_fetch(&(my_ring->lost), 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	return &(my_ring->entries[head & (TRACE_RING_LEN - 1)]);
+}
+
+static void commit_entry() {
+	__atomic_store_n(&(my_ring->head), my_ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * p follows a '%': skips flags, width and precision, then returns the
+ * conversion character, the length modifier and where it starts.
+ */
+static const char* parse_spec(const char* p, int* length, const char** length_start) {
+	while (*p != '\0' && strchr("-+ #0123456789.", *p) != NULL) {
+		p++;
+	}
+
+	*length_start = p;
+	*length = LEN_INT;
+	if (p[0] == 'l' && p[1] == 'l') {
+		*length = LEN_LONG_LONG;
+		p += 2;
+	} else if (p[0] == 'l') {
+		*length = LEN_LONG;
+		p++;
+	} else if (p[0] == 'z') {
+		*length = LEN_SIZE;
+		p++;
+	} else {
+		while (*p == 'h') {
+			p++;
+		}
+	}
+
+	return p;
+}
+
+static void collect_args(trace_entry* e, const char* p, va_list args) {
+	int n = 0;
+	int length;
+	const char* length_start;
+
+	while ((p = strchr(p, '%')) != NULL && n < TRACE_ARGS) {
+		p = parse_spec(p + 1, &length, &length_start);
+
+		switch (*p) {
+		case '\0':
+			return;
+		case 'd':
+		case 'i':
+			switch (length) {
+			case LEN_LONG_LONG:
+				e->args[n++] = (uint64_t) va_arg(args, long long);
+				break;
+			case LEN_LONG:
+				e->args[n++] = (uint64_t) va_arg(args, long);
+				break;
+			case LEN_SIZE:
+				e->args[n++] = (uint64_t) va_arg(args, ssize_t);
+				break;
+			default:
+				e->args[n++] = (uint64_t) va_arg(args, int);
+				break;
+			}
+			break;
+		case 'u':
+		case 'x':
+		case 'X':
+		case 'o':
+		case 'c':
+			switch (length) {
+			case LEN_LONG_LONG:
+				e->args[n++] = va_arg(args, unsigned long long);
+				break;
+			case LEN_LONG:
+				e->args[n++] = va_arg(args, unsigned long);
+				break;
+			case LEN_SIZE:
+				e->args[n++] = va_arg(args, size_t);
+				break;
+			default:
+				e->args[n++] = va_arg(args, unsigned int);
+				break;
+			}
+			break;
+		case 's':
+		case 'p':
+			e->args[n++] = (uint64_t) (uintptr_t) va_arg(args, void*);
+			break;
+		default:
+			break;
+		}
+
+		p++;
+	}
+}
+
+/* The arguments of every conversion are widened to 64 bits */
+static int format_text(char* buf, int size, const char* p, uint64_t* args) {
+	int off = 0;
+	int n = 0;
+	int length;
+	const char* length_start;
+	char spec[32];
+
+	while (*p != '\0' && off < size - 1) {
+		if (*p != '%') {
+			buf[off++] = *(p++);
+			continue;
+		}
+
+		const char* c = parse_spec(p + 1, &length, &length_start);
+		if (*c == '\0') {
+			break;
+		}
+		if (*c == '%') {
+			buf[off++] = '%';
+			p = c + 1;
+			continue;
+		}
+
+		int flags_len = length_start - p;
+		if (flags_len > 16) {
+			flags_len = 16;
+		}
+
+		uint64_t a = (n < TRACE_ARGS) ? args[n++] : 0;
+		int r = 0;
+		switch (*c) {
+		case 'd':
+		case 'i':
+			snprintf(spec, sizeof(spec), "%.*sll%c", flags_len, p, *c);
+			r = snprintf(buf + off, size - off, spec, (long long) a);
+			break;
+		case 'u':
+		case 'x':
+		case 'X':
+		case 'o':
+			snprintf(spec, sizeof(spec), "%.*sll%c", flags_len, p, *c);
+			r = snprintf(buf + off, size - off, spec, (unsigned long long) a);
+			break;
+		case 'c':
+			snprintf(spec, sizeof(spec), "%.*sc", flags_len, p);
+			r = snprintf(buf + off, size - off, spec, (int) a);
+			break;
+		case 's':
+			snprintf(spec, sizeof(spec), "%.*ss", flags_len, p);
+			r = snprintf(buf + off, size - off, spec, (a != 0) ? (const char*) (uintptr_t) a : "(null)");
+			break;
+		case 'p':
+			r = snprintf(buf + off, size - off, "%p", (void*) (uintptr_t) a);
+			break;
+		default:
+			r = snprintf(buf + off, size - off, "%.*s", (int) (c + 1 - p), p);
+			break;
+		}
+
+		if (r > 0) {
+			off += (r < size - off) ? r : size - off - 1;
+		}
+		p = c + 1;
+	}
+
+	buf[off] = '\0';
+	return off;
+}
+
+static void write_entry(int thread, trace_entry* e) {
+	char text[TRACE_LINE_LEN];
+	char addresses[2][INET6_ADDRSTRLEN];
+	uint64_t args[TRACE_ARGS];
+
+	switch (e->kind) {
+	case RECORD_ADDRESSES:
+		inet_ntop(e->family, e->data, addresses[0], INET6_ADDRSTRLEN);
+		inet_ntop(e->family, e->data + 16, addresses[1], INET6_ADDRSTRLEN);
+		args[0] = (uint64_t) (uintptr_t) addresses[0];
+		args[1] = (uint64_t) (uintptr_t) addresses[1];
+		format_text(text, TRACE_LINE_LEN, e->format, args);
+		break;
+	case RECORD_PREFIX:
+		inet_ntop(AF_INET6, e->data, addresses[0], INET6_ADDRSTRLEN);
+		if (e->args[1] == PRFX_ASIS) {
+			snprintf(text, TRACE_LINE_LEN, "Affected EID is %s/%u", addresses[0], (unsigned) e->args[0]);
+		} else {
+			snprintf(text, TRACE_LINE_LEN, "Affected EID is %s/%u (reason %d)", addresses[0], (unsigned) e->args[0], (int) e->args[1]);
+		}
+		break;
+	default:
+		format_text(text, TRACE_LINE_LEN, e->format, e->args);
+		break;
+	}
+
+	int s = 0;
+	while (s < 3 && !(e->subsystem & (1 << s))) {
+		s++;
+	}
+
+	fprintf(stdout, "%lld.%06ld t%d %s %s\n", (long long) e->time.tv_sec, e->time.tv_nsec / 1000, thread, 
+			SUBSYSTEM_NAMES[s], text);
+}
+
+/* Returns the number of records written */
+static int drain_traces() {
+	int written = 0;
+
+	pthread_mutex_lock(&drain_lock);
+
+	int ctr = __atomic_load_n(&trace_rings_ctr, __ATOMIC_RELAXED);
+	if (ctr > TRACE_THREADS) {
+		ctr = TRACE_THREADS;
+	}
+
+	for (int i = 0; i < ctr; i++) {
+		trace_ring* ring = __atomic_load_n(&(trace_rings[i]), __ATOMIC_ACQUIRE);
+		if (ring == NULL) {
+			continue;
+		}
+
+		uint32_t lost = __atomic_exchange_n(&(ring->lost), 0, __ATOMIC_RELAXED);
+		if (lost > 0) {
+			fprintf(stdout, "%u trace records lost by thread t%d\n", lost, i);
+			written++;
+		}
+
+		uint32_t tail = ring->tail;
+		uint32_t head = __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE);
+		while (tail != head) {
+			write_entry(i, &(ring->entries[tail & (TRACE_RING_LEN - 1)]));
+			tail++;
+			written++;
+			__atomic_store_n(&(ring->tail), tail, __ATOMIC_RELEASE);
+		}
+	}
+
+	if (written > 0) {
+		fflush(stdout);
+	}
+
+	pthread_mutex_unlock(&drain_lock);
+
+	return written;
+}
@@ -0,0 +1,91 @@
+/*
+Copyright (c) 2014, Stefano Tribioli
+All rights reserved. 
+
+This file is part of the hyLISP project.
+http://hylisp.org
+
+Redistribution and use in source and binary forms, with or without modification, 
+are permitted provided that the following conditions are met: 
+1. Redistributions of source code must retain the above copyright notice, this 
+   list of conditions and the following disclaimer. 
+2. Redistributions in binary form must reproduce the above copyright notice, 
+   this list of conditions and the following disclaimer in the documentation 
+   and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND 
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON 
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. 
+ */
+
+#ifndef COMMON_TRACE_H_
+#define COMMON_TRACE_H_
+
+#include <stdint.h>
+
+#include "common.h"
+
+/* Subsystems, enabled one by one with -t */
+#define TRACE_WEST		0x01	// Control packets from the network
+#define TRACE_EAST		0x02	// Registrations and routing state
+#define TRACE_NORTH		0x04	// Map messages from and to control planes
+#define TRACE_SOUTH		0x08	// Map messages from the data plane
+#define TRACE_ALL		0x0f
+
+/* Levels, the higher the more verbose */
+#define TRACE_LEVEL_EVENT	1	// Listeners, registrations, snapshots
+#define TRACE_LEVEL_PACKET	2	// Every datagram and map message
+
+/* Records above this level are not compiled at all */
+#ifndef HV_TRACE_MAX_LEVEL
+#define HV_TRACE_MAX_LEVEL	TRACE_LEVEL_PACKET
+#endif
+
+extern int hv_trace_level;
+extern uint32_t hv_trace_mask;
+
+#define trace_enabled(level, subsystem) \
+	((level) <= HV_TRACE_MAX_LEVEL && (level) <= hv_trace_level && (hv_trace_mask & (subsystem)))
+
+/*
+ * Arguments are evaluated only if the record is enabled. The format must be
+ * a literal with at most 8 conversions; so must any %s argument, since it
+ * is formatted later by the trace writer.
+ */
+#define trace(level, subsystem, ...) \
+	do { \
+		if (trace_enabled(level, subsystem)) { \
+			trace_record(subsystem, __VA_ARGS__); \
+		} \
+	} while (0)
+
+/* The format takes the two addresses as %s */
+#define trace_addresses(level, subsystem, format, family, source, destination) \
+	do { \
+		if (trace_enabled(level, subsystem)) { \
+			trace_record_addresses(subsystem, format, family, source, destination); \
+		} \
+	} while (0)
+
+#define trace_prefix(level, subsystem, prefix) \
+	do { \
+		if (trace_enabled(level, subsystem)) { \
+			trace_record_prefix(subsystem, prefix); \
+		} \
+	} while (0)
+
+int parse_trace_mask(char*);
+void trace_record(uint32_t, const char*, ...);
+void trace_record_addresses(uint32_t, const char*, int, void*, void*);
+void trace_record_prefix(uint32_t, ipv6_prefix*);
+void flush_traces();
+void* start_trace_writer(void*);
+
+#endif /* COMMON_TRACE_H_ */
@@ -25,6 +25,10 @@ ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
 SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. 
  */
 
+#ifdef LINUX_OS
+#define _GNU_SOURCE		/* struct in6_pktinfo */
+#endif
+
 #include "demux.h"
 #include <netdb.h>
 #include <netinet/in.h>
@@ -38,14 +42,23 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <arpa/inet.h>
 
 #include "../common/common.h"
+#include "../common/trace.h"
 #include "../controlplanes/connected.h"
+#include "../controlplanes/nonces.h"
 #include "../controlplanes/sorting.h"
+#include "../controlplanes/snapshot.h"
+#include "../controlplanes/transport.h"
 #include "inject.h"
 #include "parsedatagram.h"
 
 #define LISP_CONTROL_PORT "4342"
 #define IP_MAXLEN 65535
 #define SOCK_MSG_CONTROL_LEN 512
+#define SEND_ALL_PORTS 64
+#define DEMUX_WORKERS_MAX 64
+#define DEMUX_POOL 1024			// Datagrams received and not yet processed
+#define DEMUX_QUEUE_LEN 256		// Per worker
+#define DEMUX_BUF_LEN 2048		// Larger datagrams are moved to the heap
 
 #ifdef LINUX_OS
 #define IP_RECVDSTADDR 0
@@ -54,186 +67,548 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 int ipv4_controlpackets_socket = -1;
 int ipv6_controlpackets_socket = -1;
 
-static void* start_controlpackets_demuxer_ipv4(void*);
-static void process_ipv4_datagram(ipv4_datagram*);
-static void send_ipv4_datagram_to_all(ipv4_datagram*);
+/*
+ * One listener thread per address family receives into pooled buffers and
+ * hands each datagram to a worker chosen by its source address and port, so
+ * datagrams of a source are processed in order while parsing, sorting and
+ * injection of different sources run in parallel. Both listeners share the
+ * same pool and workers. A listener never waits for workers: with no free
+ * buffer or a full worker queue the datagram is dropped.
+ */
+typedef struct demux_job {
+	struct demux_job* next;
+	int family;					// AF_INET or AF_INET6, selecting the datagram
+	union {
+		ipv4_datagram v4;
+		ipv6_datagram v6;
+	} datagram;
+	uint8_t* heap;				// Payload not fitting in buf, or NULL
+	uint8_t buf[DEMUX_BUF_LEN];
+} demux_job;
+
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	demux_job* head;
+	demux_job** tail;
+	int len;
+} demux_worker;
+
+static demux_job* demux_pool = NULL;
+static pthread_mutex_t demux_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static demux_worker* demux_workers = NULL;
+static int demux_workers_ctr = 0;
+
+static int demux_family_ipv4 = AF_INET;
+static int demux_family_ipv6 = AF_INET6;
+
+static void* start_controlpackets_listener(void*);
+static int bind_controlpackets_socket(int);
+static void read_destination(demux_job*, struct msghdr*);
+static void* start_demux_worker(void*);
+static void init_demux_workers();
+static demux_job* get_demux_job();
+static void put_demux_job(demux_job*);
+static void queue_demux_job(demux_job*);
+static void process_datagram(demux_job*);
+static int sort_answer(routing_snapshot*, uint8_t*, int, ipv6_prefix*, int*);
+static void deliver_job(demux_job*, control_plane*, int);
+static int inject_job(demux_job*, uint16_t*, int);
 
 void* start_controlpackets_demuxer(void* arg) {
 	int r;
 
+	init_demux_workers();
+
 	pthread_attr_t tattr;
 	pthread_attr_init(&tattr);
 	pthread_attr_setdetachstate(&tattr, PTHREAD_CREATE_DETACHED);
 
 	pthread_t tid4;
-	r = pthread_create(&tid4, &tattr, start_controlpackets_demuxer_ipv4, NULL);
+	r = pthread_create(&tid4, &tattr, start_controlpackets_listener, &demux_family_ipv4);
 	if (r != 0) {
 		fatal("Unable to start westbound IPv4 listener thread");
 	}
 
-	// TODO IPv6
+	pthread_t tid6;
+	r = pthread_create(&tid6, &tattr, start_controlpackets_listener, &demux_family_ipv6);
+	if (r != 0) {
+		fatal("Unable to start westbound IPv6 listener thread");
+	}
 
 	pthread_exit(0);
 }
 
-static void* start_controlpackets_demuxer_ipv4(void* arg) {
+/* Returns the bound socket, or -1 */
+static int bind_controlpackets_socket(int family) {
 	int r;
 
 	struct addrinfo hints;
 	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = AF_INET;
+	hints.ai_family = family;
 	hints.ai_socktype = SOCK_DGRAM;
 	hints.ai_flags = AI_PASSIVE;
 
 	struct addrinfo* sorter_addr;
 	r = getaddrinfo(NULL, LISP_CONTROL_PORT, &hints, &sorter_addr);
 	if (r != 0) {
-		fatalr("Unable to get westbound IPv4 listener address", r);
+		return -1;
 	}
 
 	struct addrinfo* curr_addr;
-	int s;
+	int s = -1;
 	for (curr_addr = sorter_addr; curr_addr != NULL; curr_addr = curr_addr->ai_next) {
 		s = socket(curr_addr->ai_family, curr_addr->ai_socktype, curr_addr->ai_protocol);
 		if (s == -1) {
 			continue;
 		}
 
+		if (family == AF_INET6) {
+			/* The IPv4 listener owns the port for IPv4 */
+			int opt = 1;
+			setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, &opt, sizeof(opt));
+		}
+
 		r = bind(s, curr_addr->ai_addr, curr_addr->ai_addrlen);
 		if (r == -1) {
+			close(s);
+			s = -1;
 			continue;
 		}
 
-		freeaddrinfo(sorter_addr);
 		break;
 	}
 
-	if (curr_addr == NULL) {
-		fatal("Unable to bind westbound IPv4 listener");
-	}
+	freeaddrinfo(sorter_addr);
 
-	ipv4_controlpackets_socket = s;
+	return s;
+}
 
-	debug_printf("IPv4 westbound server is listening");
+static void* start_controlpackets_listener(void* arg) {
+	int family = *((int*) arg);
+	const char* name = (family == AF_INET) ? "IPv4" : "IPv6";
 
-	/*
-	 * The datagram is kept in the stack space. Should the processing be offloaded to a pool of worker threads,
-	 * it will be necessary to move it to the heap.
-	 */
-	uint8_t buf[IP_MAXLEN];
-	char control_buf[SOCK_MSG_CONTROL_LEN];
+	int s = bind_controlpackets_socket(family);
+	if (s == -1) {
+		if (family == AF_INET) {
+			fatal("Unable to bind westbound IPv4 listener");
+		}
+
+		/* Not fatal, the host may have no IPv6 */
+		warning("Unable to bind westbound IPv6 listener");
+		pthread_exit(0);
+	}
 
 	int opt = 1;
-	setsockopt(s, IPPROTO_IP, IP_RECVDSTADDR, &opt, sizeof(opt));
+	if (family == AF_INET) {
+		setsockopt(s, IPPROTO_IP, IP_RECVDSTADDR, &opt, sizeof(opt));
+		ipv4_controlpackets_socket = s;
+	} else {
+		setsockopt(s, IPPROTO_IPV6, IPV6_RECVPKTINFO, &opt, sizeof(opt));
+		ipv6_controlpackets_socket = s;
+	}
+
+	trace(TRACE_LEVEL_EVENT, TRACE_WEST, "%s westbound server is listening (%d workers)", name, demux_workers_ctr);
+
+	/* Tail of datagrams longer than a pooled buffer, or whole datagrams to drop */
+	uint8_t* overflow_buf = malloc(IP_MAXLEN);
+	check_allocation(overflow_buf);
+	char control_buf[SOCK_MSG_CONTROL_LEN];
 
 	while (1) {
-		ipv4_datagram datagram;
-		datagram.payload = buf;
+		demux_job* job = get_demux_job();
+		demux_job discarded;
+		if (job == NULL) {
+			job = &discarded;
+			job->heap = NULL;
+		}
+		job->family = family;
 
 		struct msghdr raw_msg;
-		struct iovec iov;
-
-		raw_msg.msg_name = &(datagram.source);
-		raw_msg.msg_namelen = sizeof(datagram.source);
-		raw_msg.msg_iov = &iov;
-		raw_msg.msg_iovlen = 1;
-		raw_msg.msg_iov->iov_base = datagram.payload;
-		raw_msg.msg_iov->iov_len = IP_MAXLEN;
+		struct iovec iov[2];
+		
+		if (job != &discarded) {
+			iov[0].iov_base = job->buf;
+			iov[0].iov_len = DEMUX_BUF_LEN;
+			iov[1].iov_base = overflow_buf;
+			iov[1].iov_len = IP_MAXLEN - DEMUX_BUF_LEN;
+			raw_msg.msg_iovlen = 2;
+		} else {
+			iov[0].iov_base = overflow_buf;
+			iov[0].iov_len = IP_MAXLEN;
+			raw_msg.msg_iovlen = 1;
+		}
+
+		if (family == AF_INET) {
+			raw_msg.msg_name = &(job->datagram.v4.source);
+			raw_msg.msg_namelen = sizeof(job->datagram.v4.source);
+		} else {
+			raw_msg.msg_name = &(job->datagram.v6.source);
+			raw_msg.msg_namelen = sizeof(job->datagram.v6.source);
+		}
+		raw_msg.msg_iov = iov;
 		raw_msg.msg_control = (caddr_t) &control_buf;
 		raw_msg.msg_controllen = SOCK_MSG_CONTROL_LEN;
 		raw_msg.msg_flags = 0;
 
-		datagram.payload_len = recvmsg(s, &raw_msg, 0);
+		int payload_len = recvmsg(s, &raw_msg, 0);
+
+		if (payload_len < 0) {
+			if (family == AF_INET) {
+				fatal("Error reading from westbound IPv4 socket");
+			} else {
+				fatal("Error reading from westbound IPv6 socket");
+			}
+		}
 
-		if (datagram.payload_len < 0) {
-			fatal("Error reading from westbound IPv4 socket");
+		if (job == &discarded) {
+			trace(TRACE_LEVEL_PACKET, TRACE_WEST, "No free westbound buffer, %s datagram dropped", name);
+			continue;
 		}
 
-		for (struct cmsghdr *c = CMSG_FIRSTHDR(&raw_msg); c != NULL; c = CMSG_NXTHDR(&raw_msg, c)) {
-			if (c->cmsg_level != IPPROTO_IP || c->cmsg_type != IP_RECVDSTADDR) {
-				continue;
-			}
+		uint8_t* payload;
+		if (payload_len > DEMUX_BUF_LEN) {
+			job->heap = malloc(payload_len);
+			check_allocation(job->heap);
+			memcpy(job->heap, job->buf, DEMUX_BUF_LEN);
+			memcpy(job->heap + DEMUX_BUF_LEN, overflow_buf, payload_len - DEMUX_BUF_LEN);
+			payload = job->heap;
+		} else {
+			payload = job->buf;
+		}
+
+		if (family == AF_INET) {
+			job->datagram.v4.payload = payload;
+			job->datagram.v4.payload_len = payload_len;
+		} else {
+			job->datagram.v6.payload = payload;
+			job->datagram.v6.payload_len = payload_len;
+		}
 
+		read_destination(job, &raw_msg);
+
+		queue_demux_job(job);
+	}
+
+	pthread_exit(0);
+}
+
+/* Destination address of the datagram, from the ancillary data */
+static void read_destination(demux_job* job, struct msghdr* raw_msg) {
+	for (struct cmsghdr *c = CMSG_FIRSTHDR(raw_msg); c != NULL; c = CMSG_NXTHDR(raw_msg, c)) {
+		if (job->family == AF_INET && c->cmsg_level == IPPROTO_IP && c->cmsg_type == IP_RECVDSTADDR) {
+			ipv4_datagram* datagram = &(job->datagram.v4);
 			struct in_addr* tmp_destination = (struct in_addr*) CMSG_DATA(c);
 
-			memset(&(datagram.destination), 0, sizeof(datagram.destination));
+			memset(&(datagram->destination), 0, sizeof(datagram->destination));
+#ifndef LINUX_OS
+			datagram->destination.sin_len = sizeof(datagram->destination);
+#endif
+			datagram->destination.sin_family = AF_INET;
+			datagram->destination.sin_addr = *tmp_destination;
+		} else if (job->family == AF_INET6 && c->cmsg_level == IPPROTO_IPV6 && c->cmsg_type == IPV6_PKTINFO) {
+			ipv6_datagram* datagram = &(job->datagram.v6);
+			struct in6_pktinfo* tmp_info = (struct in6_pktinfo*) CMSG_DATA(c);
+
+			memset(&(datagram->destination), 0, sizeof(datagram->destination));
 #ifndef LINUX_OS
-			datagram.destination.sin_len = sizeof(datagram.destination);
+			datagram->destination.sin6_len = sizeof(datagram->destination);
 #endif
-			datagram.destination.sin_family = AF_INET;
-			datagram.destination.sin_addr = *tmp_destination;
+			datagram->destination.sin6_family = AF_INET6;
+			datagram->destination.sin6_addr = tmp_info->ipi6_addr;
+			datagram->destination.sin6_scope_id = tmp_info->ipi6_ifindex;	// Needed by link-local destinations
 		}
+	}
+}
+static void init_demux_workers() {
+	int r;
+	int i;
+
+	demux_workers_ctr = hv_workers;
+	if (demux_workers_ctr <= 0) {
+		demux_workers_ctr = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (demux_workers_ctr <= 0) {
+		demux_workers_ctr = 1;
+	}
+	if (demux_workers_ctr > DEMUX_WORKERS_MAX) {
+		demux_workers_ctr = DEMUX_WORKERS_MAX;
+	}
+
+	demux_job* jobs = calloc(DEMUX_POOL, sizeof(demux_job));
+	check_allocation(jobs);
+	for (i = 0; i < DEMUX_POOL; i++) {
+		jobs[i].next = demux_pool;
+		demux_pool = &(jobs[i]);
+	}
+
+	demux_workers = calloc(demux_workers_ctr, sizeof(demux_worker));
+	check_allocation(demux_workers);
+
+	pthread_attr_t tattr;
+	pthread_attr_init(&tattr);
+	pthread_attr_setdetachstate(&tattr, PTHREAD_CREATE_DETACHED);
+
+	for (i = 0; i < demux_workers_ctr; i++) {
+		pthread_mutex_init(&(demux_workers[i].lock), NULL);
+		pthread_cond_init(&(demux_workers[i].cond), NULL);
+		demux_workers[i].tail = &(demux_workers[i].head);
+
+		pthread_t tid;
+		r = pthread_create(&tid, &tattr, start_demux_worker, &(demux_workers[i]));
+		if (r != 0) {
+			fatalr("Unable to start westbound worker thread", r);
+		}
+	}
+
+	pthread_attr_destroy(&tattr);
+}
+
+static demux_job* get_demux_job() {
+	pthread_mutex_lock(&demux_pool_lock);
+
+	demux_job* job = demux_pool;
+	if (job != NULL) {
+		demux_pool = job->next;
+	}
 
-		char src[INET_ADDRSTRLEN];
-		inet_ntop(AF_INET, &(datagram.source.sin_addr), src, INET_ADDRSTRLEN);
-		char dst[INET_ADDRSTRLEN];
-		inet_ntop(AF_INET, &(datagram.destination.sin_addr), dst, INET_ADDRSTRLEN);
-		debug_printf("Processing UDPv4 datagram from %s to %s", src, dst);
+	pthread_mutex_unlock(&demux_pool_lock);
 
-		process_ipv4_datagram(&datagram);
+	if (job != NULL) {
+		job->next = NULL;
+		job->heap = NULL;
+	}
+
+	return job;
+}
+
+static void put_demux_job(demux_job* job) {
+	if (job->heap != NULL) {
+		free(job->heap);
+		job->heap = NULL;
+	}
+
+	pthread_mutex_lock(&demux_pool_lock);
+	job->next = demux_pool;
+	demux_pool = job;
+	pthread_mutex_unlock(&demux_pool_lock);
+}
+
+/* Same source address and port, same worker */
+static void queue_demux_job(demux_job* job) {
+	uint32_t h;
+	if (job->family == AF_INET) {
+		h = job->datagram.v4.source.sin_addr.s_addr ^ ((uint32_t) job->datagram.v4.source.sin_port << 16);
+	} else {
+		uint32_t a[4];
+		memcpy(a, &(job->datagram.v6.source.sin6_addr), 16);
+		h = a[0] ^ a[1] ^ a[2] ^ a[3] ^ ((uint32_t) job->datagram.v6.source.sin6_port << 16);
+	}
+	h ^= h >> 16;
+	h *= 0x45d9f3b;
+	h ^= h >> 16;
+
+	demux_worker* w = &(demux_workers[h % demux_workers_ctr]);
+
+	pthread_mutex_lock(&(w->lock));
+
+	if (w->len >= DEMUX_QUEUE_LEN) {
+		pthread_mutex_unlock(&(w->lock));
+		trace(TRACE_LEVEL_PACKET, TRACE_WEST, "Westbound worker queue full, datagram dropped");
+		put_demux_job(job);
+		return;
+	}
+
+	*(w->tail) = job;
+	w->tail = &(job->next);
+	w->len++;
+
+	pthread_cond_signal(&(w->cond));
+	pthread_mutex_unlock(&(w->lock));
+}
+
+static void* start_demux_worker(void* arg) {
+	demux_worker* w = arg;
+
+	while (1) {
+		pthread_mutex_lock(&(w->lock));
+
+		while (w->head == NULL) {
+			pthread_cond_wait(&(w->cond), &(w->lock));
+		}
+
+		/* Taking the whole queue at once */
+		demux_job* job = w->head;
+		w->head = NULL;
+		w->tail = &(w->head);
+		w->len = 0;
+
+		pthread_mutex_unlock(&(w->lock));
+
+		while (job != NULL) {
+			demux_job* next = job->next;
+
+			if (job->family == AF_INET) {
+				trace_addresses(TRACE_LEVEL_PACKET, TRACE_WEST, "Processing UDPv4 datagram from %s to %s", AF_INET, 
+						&(job->datagram.v4.source.sin_addr), &(job->datagram.v4.destination.sin_addr));
+			} else {
+				trace_addresses(TRACE_LEVEL_PACKET, TRACE_WEST, "Processing UDPv6 datagram from %s to %s", AF_INET6, 
+						&(job->datagram.v6.source.sin6_addr), &(job->datagram.v6.destination.sin6_addr));
+			}
+
+			process_datagram(job);
+			put_demux_job(job);
+
+			job = next;
+		}
 	}
 
 	pthread_exit(0);
 }
 
-static void process_ipv4_datagram(ipv4_datagram* datagram) {
+static void process_datagram(demux_job* job) {
 	int r;
 
+	uint8_t* payload;
+	int payload_len;
+	if (job->family == AF_INET) {
+		payload = job->datagram.v4.payload;
+		payload_len = job->datagram.v4.payload_len;
+	} else {
+		payload = job->datagram.v6.payload;
+		payload_len = job->datagram.v6.payload_len;
+	}
+
 	uint16_t recipient_port = 0;
 
 	ipv6_prefix significant_eid;
-	significant_eid = extract_eid_cp(datagram->payload, datagram->payload_len);
+	significant_eid = extract_eid_cp(payload, payload_len);
 
-	pthread_rwlock_rdlock(&control_planes_lock);
-	pthread_rwlock_rdlock(&assignments_lock);
+	routing_snapshot* snapshot = snapshot_enter();
 
 	int control_plane_index;
-	r = sort(&significant_eid, &control_plane_index);
+	r = snapshot_sort(snapshot, &significant_eid, &control_plane_index);
 
-	if (r == SORTING_ONE || r == SORTING_NON) {
-		recipient_port = control_planes[control_plane_index].port;
+	if (r == SORTING_ALL && sort_answer(snapshot, payload, payload_len, &significant_eid, &control_plane_index)) {
+		r = SORTING_ONE;
 	}
 
-	pthread_rwlock_unlock(&assignments_lock);
-	pthread_rwlock_unlock(&control_planes_lock);
+	if (r == SORTING_ONE || r == SORTING_NON) {
+		recipient_port = snapshot->control_planes[control_plane_index].port;
+	}
 
 	switch (r) {
 	case SORTING_ONE:
-		debug_printf("Demuxing control datagram to port %d", recipient_port);
-		debug_printf_prefix(&significant_eid);
+		trace(TRACE_LEVEL_PACKET, TRACE_WEST, "Demuxing control datagram to port %d", recipient_port);
+		trace_prefix(TRACE_LEVEL_PACKET, TRACE_WEST, &significant_eid);
 
-		datagram->destination.sin_port = recipient_port;
-		inject_datagram_ipv4(datagram);
+		deliver_job(job, &(snapshot->control_planes[control_plane_index]), 1);
 		break;
 	case SORTING_NON:
-		debug_printf("Demuxing control datagram to port %d (default)", recipient_port);
-		debug_printf_prefix(&significant_eid);
+		trace(TRACE_LEVEL_PACKET, TRACE_WEST, "Demuxing control datagram to port %d (default)", recipient_port);
+		trace_prefix(TRACE_LEVEL_PACKET, TRACE_WEST, &significant_eid);
 
-		datagram->destination.sin_port = recipient_port;
-		inject_datagram_ipv4(datagram);
+		deliver_job(job, &(snapshot->control_planes[control_plane_index]), 1);
 		break;
 	case SORTING_ALL:
-		debug_printf("Demuxing control datagram to all registered ports");
-		debug_printf_prefix(&significant_eid);
+		trace(TRACE_LEVEL_EVENT, TRACE_WEST, "Demuxing control datagram to all registered ports");
+		trace_prefix(TRACE_LEVEL_PACKET, TRACE_WEST, &significant_eid);
 
-		send_ipv4_datagram_to_all(datagram);
+		deliver_job(job, snapshot->control_planes, snapshot->control_planes_ctr);
 		break;
 	case SORTING_ERR:
 	default:
-		debug_printf("Unable to demux control datagram");
-		debug_printf_prefix(&significant_eid);
+		trace(TRACE_LEVEL_PACKET, TRACE_WEST, "Unable to demux control datagram");
+		trace_prefix(TRACE_LEVEL_PACKET, TRACE_WEST, &significant_eid);
 		break;;
 	}
+
+	snapshot_exit();
+}
+
+/*
+ * Map-Replies and Map-Notifies are sent to all control planes, unless the
+ * nonce they carry was announced by one of them or, for Map-Notifies only,
+ * the EID of their first record is assigned to exactly one of them (the
+ * records of a Map-Reply are remote EIDs, which say nothing on who asked).
+ */
+static int sort_answer(routing_snapshot* snapshot, uint8_t* payload, int payload_len, ipv6_prefix* significant_eid, int* control_plane_index) {
+	if (significant_eid->reason != BPRFX_MAPREPLY && significant_eid->reason != BPRFX_MAPNOTIFY) {
+		return 0;
+	}
+
+	uint64_t nonce;
+	uint16_t nonce_port;
+	if (extract_nonce_cp(payload, payload_len, &nonce) && lookup_nonce(nonce, &nonce_port)) {
+		int i;
+		for (i = 0; i < snapshot->control_planes_ctr; i++) {
+			if (snapshot->control_planes[i].port == nonce_port) {
+				trace(TRACE_LEVEL_PACKET, TRACE_WEST, "Nonce 0x%llx was announced by port %d", (unsigned long long) nonce, nonce_port);
+
+				*control_plane_index = i;
+				return 1;
+			}
+		}
+	}
+
+	if (significant_eid->reason == BPRFX_MAPNOTIFY) {
+		ipv6_prefix record_eid;
+		record_eid = extract_eid_mapnotify(payload, payload_len);
+
+		if (snapshot_sort(snapshot, &record_eid, control_plane_index) == SORTING_ONE) {
+			return 1;
+		}
+	}
+
+	return 0;
 }
 
-static void send_ipv4_datagram_to_all(ipv4_datagram* datagram) {
-	pthread_rwlock_rdlock(&control_planes_lock);
+/*
+ * Through the shared-memory rings of the control planes having them,
+ * re-injecting for the others and when a ring is full.
+ */
+static void deliver_job(demux_job* job, control_plane* recipients, int recipients_ctr) {
+	/* Heap only for an unusual number of control planes */
+	uint16_t ports_buf[SEND_ALL_PORTS];
+	uint16_t* ports = ports_buf;
+	if (recipients_ctr > SEND_ALL_PORTS) {
+		ports = malloc(recipients_ctr * sizeof(uint16_t));
+		check_allocation(ports);
+	}
 
+	int ports_ctr = 0;
 	int i;
-	for (i = 0; i < control_planes_ctr; i++) {
-		datagram->destination.sin_port = control_planes[i].port;
-		inject_datagram_ipv4(datagram);
+	for (i = 0; i < recipients_ctr; i++) {
+		cp_transport* transport = recipients[i].transport;
+		if (transport != NULL) {
+			int r;
+			if (job->family == AF_INET) {
+				r = transport_send_ipv4(transport, &(job->datagram.v4), recipients[i].port);
+			} else {
+				r = transport_send_ipv6(transport, &(job->datagram.v6), recipients[i].port);
+			}
+
+			if (r == 0) {
+				continue;
+			}
+		}
+
+		ports[ports_ctr++] = recipients[i].port;
+	}
+
+	if (ports_ctr > 0) {
+		inject_job(job, ports, ports_ctr);
 	}
 
-	pthread_rwlock_unlock(&control_planes_lock);
+	if (ports != ports_buf) {
+		free(ports);
+	}
+}
+
+static int inject_job(demux_job* job, uint16_t* ports, int ports_ctr) {
+	if (job->family == AF_INET) {
+		return inject_datagram_ipv4_ports(&(job->datagram.v4), ports, ports_ctr);
+	} else {
+		return inject_datagram_ipv6_ports(&(job->datagram.v6), ports, ports_ctr);
+	}
 }
@@ -25,36 +25,105 @@ ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
 SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. 
  */
 
+#ifdef LINUX_OS
+#define _GNU_SOURCE		/* sendmmsg() */
+#endif
+
 #include "inject.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
 #include "../common/common.h"
+#include "../../hdr/hylispcksum.h"
 
-static uint16_t checksum_ipv4(uint16_t*);
-static uint16_t checksum_udp(uint16_t*, uint8_t*, int);
-static uint16_t checksum(uint16_t*, int);
+#define INJECT_HEADER_LEN 28
+#define INJECT_HEADER6_LEN 48
+#define INJECT_BATCH 64
 
-int inject_datagram_ipv4(ipv4_datagram* datagram) {
+/*
+ * One raw socket is opened at the first injection and kept for the whole
+ * life of the process; sendmsg() on it is safe from any thread. Headers
+ * are built on the stack and sent with the untouched payload through an
+ * iovec, the checksum is summed over both in place.
+ */
+static int inject_socket = -1;
+static pthread_once_t inject_once = PTHREAD_ONCE_INIT;
+
+/*
+ * IPv6 has no portable IP_HDRINCL. Linux includes the header on IPPROTO_RAW
+ * sockets; elsewhere the socket is IPPROTO_UDP, the IPv6 header built here
+ * is skipped and the foreign source address is given as IPV6_PKTINFO,
+ * allowed by IPV6_BINDANY.
+ */
+static int inject_socket6 = -1;
+static pthread_once_t inject_once6 = PTHREAD_ONCE_INIT;
+
+static void open_inject_socket();
+static void open_inject_socket6();
+static void build_header_ipv4(uint16_t*, ipv4_datagram*, uint16_t, uint64_t);
+static void build_header_ipv6(uint16_t*, ipv6_datagram*, uint16_t, uint64_t);
+static uint64_t checksum_payload(ipv4_datagram*);
+static uint64_t checksum_payload6(ipv6_datagram*);
+
+static void open_inject_socket() {
 	int s;
 	s = socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
 
 	if (s == -1) {
 		warning("Unable to create raw injecting socket");
-		return -1;
+		return;
 	}
 	
 	shutdown(s, SHUT_RD);
 	
 	const int one = 1;
 	setsockopt(s, IPPROTO_IP, IP_HDRINCL, &one, sizeof(one));
+	
+	inject_socket = s;
+}
+
+static void open_inject_socket6() {
+	int s;
+#ifdef LINUX_OS
+	s = socket(AF_INET6, SOCK_RAW, IPPROTO_RAW);
+#else
+	s = socket(AF_INET6, SOCK_RAW, IPPROTO_UDP);
+#endif
+
+	if (s == -1) {
+		warning("Unable to create raw IPv6 injecting socket");
+		return;
+	}
+	
+	shutdown(s, SHUT_RD);
 
-	uint16_t header[14];
+#ifndef LINUX_OS
+	const int one = 1;
+	if (setsockopt(s, IPPROTO_IPV6, IPV6_BINDANY, &one, sizeof(one)) == -1) {
+		warning("Unable to let the raw IPv6 injecting socket use foreign addresses");
+	}
+#endif
+	
+	inject_socket6 = s;
+}
+
+/* Sum of the pseudo header fields not depending on the port and of the payload */
+static uint64_t checksum_payload(ipv4_datagram* datagram) {
+	uint64_t sum;
+	sum = cksum_pseudo_ipv4(&(datagram->source.sin_addr.s_addr), &(datagram->destination.sin_addr.s_addr), 
+			IPPROTO_UDP, 8 + datagram->payload_len);
+
+	return cksum_add(sum, datagram->payload, datagram->payload_len);
+}
 
+/* IP and UDP headers towards port, sum is checksum_payload() */
+static void build_header_ipv4(uint16_t* header, ipv4_datagram* datagram, uint16_t port, uint64_t sum) {
 	header[0] = htons(0x4500);								// Version, IHL, DSCP, ECN
 	
 	header[1] = 20 + 8 + datagram->payload_len;				// Total length (IP header + UDP header + payload)
@@ -72,106 +141,214 @@ int inject_datagram_ipv4(ipv4_datagram* datagram) {
 	/* Destination IP address, localhost */
 	memcpy(&(header[8]), &(datagram->destination.sin_addr.s_addr), 4);
 	
-	header[5] = checksum_ipv4(header);
+	header[5] = cksum(header, 20);
 	
 	/* UDP header */
 	header[10] = datagram->source.sin_port;					// Source port
-	header[11] = htons(datagram->destination.sin_port);	// Destination port
+	header[11] = htons(port);								// Destination port
 	header[12] = htons(8 + datagram->payload_len);			// Length
 
 	header[13] = 0x0000;									// Checksum (dummy)
-	header[13] = checksum_udp(header, datagram->payload, datagram->payload_len);
+	header[13] = cksum_finish(cksum_add(sum, &(header[10]), 8));
+	if (header[13] == 0x0000) {
+		header[13] = 0xFFFF;								// Zero means no checksum
+	}
+}
 
-	const int packet_len = 20 + 8 + datagram->payload_len;
-	uint8_t* buf;
-	buf = malloc(packet_len);
-	check_allocation(buf);
-	memcpy(buf, header, 20 + 8);
-	memcpy(buf + 20 + 8, datagram->payload, datagram->payload_len);
+/* Sum of the pseudo header fields not depending on the port and of the payload */
+static uint64_t checksum_payload6(ipv6_datagram* datagram) {
+	uint64_t sum;
+	sum = cksum_pseudo_ipv6(&(datagram->source.sin6_addr), &(datagram->destination.sin6_addr), 
+			IPPROTO_UDP, 8 + datagram->payload_len);
 
-	int r = sendto(s, buf, packet_len, 0, (struct sockaddr*) &(datagram->destination), sizeof(datagram->destination));
+	return cksum_add(sum, datagram->payload, datagram->payload_len);
+}
 
-	if (r == -1) {
-		warning("Unable to write to raw injecting socket");
-		free(buf);
-		close(s);
-		return -1;
-	}
+/* IPv6 and UDP headers towards port, sum is checksum_payload6() */
+static void build_header_ipv6(uint16_t* header, ipv6_datagram* datagram, uint16_t port, uint64_t sum) {
+	header[0] = htons(0x6000);								// Version, traffic class, flow label
+	header[1] = htons(0x0000);
+	header[2] = htons(8 + datagram->payload_len);			// Payload length (UDP header + payload)
+	header[3] = htons(0x1140);								// Next header, hop limit
 
-	free(buf);
-	close(s);
+	/* Source IP address */
+	memcpy(&(header[4]), &(datagram->source.sin6_addr), 16);
 
-	return 0;
+	/* Destination IP address, localhost */
+	memcpy(&(header[12]), &(datagram->destination.sin6_addr), 16);
+
+	/* UDP header */
+	header[20] = datagram->source.sin6_port;				// Source port
+	header[21] = htons(port);								// Destination port
+	header[22] = htons(8 + datagram->payload_len);			// Length
+
+	header[23] = 0x0000;									// Checksum (dummy)
+	header[23] = cksum_finish(cksum_add(sum, &(header[20]), 8));
+	if (header[23] == 0x0000) {
+		header[23] = 0xFFFF;								// Zero is not allowed over IPv6
+	}
 }
 
-static uint16_t checksum_ipv4(uint16_t* header) {
-	const int header_len = 20;
-	return checksum(header, header_len);
+int inject_datagram_ipv4(ipv4_datagram* datagram) {
+	uint16_t port = datagram->destination.sin_port;
+	return inject_datagram_ipv4_ports(datagram, &port, 1);
 }
 
-static uint16_t checksum_udp(uint16_t* true_header, uint8_t* payload, int payload_len) {
-	const int pseudo_header_len = 20;
+int inject_datagram_ipv4_ports(ipv4_datagram* datagram, uint16_t* ports, int ports_ctr) {
+	pthread_once(&inject_once, open_inject_socket);
 
-	uint16_t pseudo_header[10];
+	if (inject_socket == -1) {
+		return -1;
+	}
 
-	/* Source IP address */
-	pseudo_header[0] = true_header[6];
-	pseudo_header[1] = true_header[7];
+	uint64_t sum = checksum_payload(datagram);
 
-	/* Destination IP address */
-	pseudo_header[2] = true_header[8];
-	pseudo_header[3] = true_header[9];
+	uint16_t header[INJECT_BATCH][INJECT_HEADER_LEN / 2];
+	struct iovec iov[INJECT_BATCH][2];
+	struct mmsghdr msg[INJECT_BATCH];
 
-	pseudo_header[4] = htons(0x0011);				// Zeroes, protocol
-	pseudo_header[5] = htons(8 + payload_len);		// UDP length
+	int sent = 0;
+	int ok = 0;
+	int err = 0;
+	while (sent < ports_ctr) {
+		int n = ports_ctr - sent;
+		if (n > INJECT_BATCH) {
+			n = INJECT_BATCH;
+		}
 
-	/* UDP header */
-	pseudo_header[6] = true_header[10];
-	pseudo_header[7] = true_header[11];
-	pseudo_header[8] = true_header[12];
-	pseudo_header[9] = 0x0000;
+		int i;
+		for (i = 0; i < n; i++) {
+			build_header_ipv4(header[i], datagram, ports[sent + i], sum);
 
-	uint8_t* buf;
+			iov[i][0].iov_base = header[i];
+			iov[i][0].iov_len = INJECT_HEADER_LEN;
+			iov[i][1].iov_base = datagram->payload;
+			iov[i][1].iov_len = datagram->payload_len;
 
-	buf = malloc(pseudo_header_len + payload_len);
-	check_allocation(buf);
+			memset(&(msg[i]), 0, sizeof(struct mmsghdr));
+			msg[i].msg_hdr.msg_name = &(datagram->destination);
+			msg[i].msg_hdr.msg_namelen = sizeof(datagram->destination);
+			msg[i].msg_hdr.msg_iov = iov[i];
+			msg[i].msg_hdr.msg_iovlen = 2;
+		}
 
-	memcpy(buf, pseudo_header, pseudo_header_len);
-	memcpy(buf + pseudo_header_len, payload, payload_len);
+		/* One system call for the whole batch */
+		int r;
+		if (n == 1) {
+			r = (sendmsg(inject_socket, &(msg[0].msg_hdr), 0) == -1) ? -1 : 1;
+		} else {
+			r = sendmmsg(inject_socket, msg, n, 0);
+		}
 
-	/* Zero-pad if odd number of octets */
-	if (payload_len & 1) {
-		buf = realloc(buf, pseudo_header_len + payload_len + 1);
-		check_allocation(buf);
+		if (r <= 0) {
+			err = errno;
+			warning("Unable to write to raw injecting socket");
+			/* Skipping the datagram that failed */
+			r = 1;
+		} else {
+			ok += r;
+		}
 
-		*(buf + pseudo_header_len + payload_len) = 0;
-		payload_len++;
+		sent += r;
 	}
 
-	uint16_t result;
-	result = checksum((uint16_t*) buf, pseudo_header_len + payload_len);
-
-	free(buf);
+	/* Nothing sent, report the last error as a single send did */
+	if (ok == 0 && ports_ctr > 0) {
+		errno = err;
+		return -1;
+	}
 
-	return result;
+	return 0;
 }
 
-static uint16_t checksum(uint16_t* subject, int subject_len) {
-	unsigned long sum = 0;
+int inject_datagram_ipv6_ports(ipv6_datagram* datagram, uint16_t* ports, int ports_ctr) {
+	pthread_once(&inject_once6, open_inject_socket6);
 
-	while (subject_len > 1) {
-		sum += *subject++;
+	if (inject_socket6 == -1) {
+		return -1;
+	}
+
+	uint64_t sum = checksum_payload6(datagram);
+
+	/* Raw IPv6 sockets take the protocol, not the port, in sin6_port */
+	struct sockaddr_in6 destination = datagram->destination;
+	destination.sin6_port = 0;
+
+#ifdef LINUX_OS
+	const int header_skip = 0;
+#else
+	const int header_skip = 40;
+
+	char control_buf[CMSG_SPACE(sizeof(struct in6_pktinfo))];
+	memset(control_buf, 0, sizeof(control_buf));
+
+	struct cmsghdr* c = (struct cmsghdr*) control_buf;
+	c->cmsg_level = IPPROTO_IPV6;
+	c->cmsg_type = IPV6_PKTINFO;
+	c->cmsg_len = CMSG_LEN(sizeof(struct in6_pktinfo));
+
+	struct in6_pktinfo* info = (struct in6_pktinfo*) CMSG_DATA(c);
+	info->ipi6_addr = datagram->source.sin6_addr;
+#endif
+
+	uint16_t header[INJECT_BATCH][INJECT_HEADER6_LEN / 2];
+	struct iovec iov[INJECT_BATCH][2];
+	struct mmsghdr msg[INJECT_BATCH];
 
-		if (sum & 0x80000000) {
-			sum = (sum & 0xFFFF) + (sum >> 16);
+	int sent = 0;
+	int ok = 0;
+	int err = 0;
+	while (sent < ports_ctr) {
+		int n = ports_ctr - sent;
+		if (n > INJECT_BATCH) {
+			n = INJECT_BATCH;
 		}
 
-		subject_len -= 2;
+		int i;
+		for (i = 0; i < n; i++) {
+			build_header_ipv6(header[i], datagram, ports[sent + i], sum);
+
+			iov[i][0].iov_base = (uint8_t*) header[i] + header_skip;
+			iov[i][0].iov_len = INJECT_HEADER6_LEN - header_skip;
+			iov[i][1].iov_base = datagram->payload;
+			iov[i][1].iov_len = datagram->payload_len;
+
+			memset(&(msg[i]), 0, sizeof(struct mmsghdr));
+			msg[i].msg_hdr.msg_name = &destination;
+			msg[i].msg_hdr.msg_namelen = sizeof(destination);
+			msg[i].msg_hdr.msg_iov = iov[i];
+			msg[i].msg_hdr.msg_iovlen = 2;
+#ifndef LINUX_OS
+			msg[i].msg_hdr.msg_control = control_buf;
+			msg[i].msg_hdr.msg_controllen = sizeof(control_buf);
+#endif
+		}
+
+		/* One system call for the whole batch */
+		int r;
+		if (n == 1) {
+			r = (sendmsg(inject_socket6, &(msg[0].msg_hdr), 0) == -1) ? -1 : 1;
+		} else {
+			r = sendmmsg(inject_socket6, msg, n, 0);
+		}
+
+		if (r <= 0) {
+			err = errno;
+			warning("Unable to write to raw IPv6 injecting socket");
+			/* Skipping the datagram that failed */
+			r = 1;
+		} else {
+			ok += r;
+		}
+
+		sent += r;
 	}
 
-	while (sum >> 16) {
-		sum = (sum & 0xFFFF) + (sum >> 16);
+	/* Nothing sent, report the last error as a single send did */
+	if (ok == 0 && ports_ctr > 0) {
+		errno = err;
+		return -1;
 	}
 
-	return (~sum);
+	return 0;
 }
@@ -30,6 +30,12 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "../common/common.h"
 
+#include <stdint.h>
+
 int inject_datagram_ipv4(ipv4_datagram*);
+/* Same datagram to many ports in as few system calls as possible,
+   -1 with errno set if none of them could be sent */
+int inject_datagram_ipv4_ports(ipv4_datagram*, uint16_t*, int);
+int inject_datagram_ipv6_ports(ipv6_datagram*, uint16_t*, int);
 
 #endif /* CONTROLPACKETS_INJECT_H_ */
@@ -31,6 +31,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <string.h>
 
 #include "../common/common.h"
+#include "../common/trace.h"
 
 #define IRC_MAX 32
 
@@ -57,7 +58,7 @@ ipv6_prefix extract_eid_cp(uint8_t* datagram, int datagram_len) {
 	type = *datagram;
 	type = type >> 4;
 
-	debug_printf("Processing control packet of type 0x%x", type);
+	trace(TRACE_LEVEL_PACKET, TRACE_WEST, "Processing control packet of type 0x%x", type);
 
 	switch (type) {
 	case LISP_PKTTYPE_MAPREQUEST:
@@ -73,6 +74,58 @@ ipv6_prefix extract_eid_cp(uint8_t* datagram, int datagram_len) {
 	}
 }
 
+/*
+ * Extracts the nonce of a Map-Reply or a Map-Notify, the messages answering
+ * a nonce sent by a control plane. Returns 0 for other messages.
+ */
+int extract_nonce_cp(uint8_t* datagram, int datagram_len, uint64_t* nonce) {
+	if (datagram_len < 12) {
+		return 0;
+	}
+
+	switch (*datagram >> 4) {
+	case LISP_PKTTYPE_MAPREPLY:
+	case LISP_PKTTYPE_NOTIFY:
+		memcpy(nonce, datagram + 4, 8);
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Extracts the EID of the first record of a Map-Notify, that is an EID
+ * registered by the control plane the notify is for.
+ */
+ipv6_prefix extract_eid_mapnotify(uint8_t* datagram, int datagram_len) {
+	int offset = 14;	// Starting at authentication data length
+
+	if (offset + 2 > datagram_len) {
+		return get_undefined_eid(UPRFX_MALFORMED);
+	}
+
+	uint16_t auth_len = ntohs(*((uint16_t*) (datagram + offset)));
+	offset = offset + 2 + auth_len;
+
+	/* Record: TTL, locator count, EID mask, flags, map version, EID AFI */
+	if (offset + 12 > datagram_len) {
+		return get_undefined_eid(UPRFX_MALFORMED);
+	}
+
+	uint16_t afi = ntohs(*((uint16_t*) (datagram + offset + 10)));
+	if ((afi == AFI_IPV4 && offset + 12 + 4 > datagram_len) || (afi == AFI_IPV6 && offset + 12 + 16 > datagram_len)) {
+		return get_undefined_eid(UPRFX_MALFORMED);
+	}
+
+	ipv6_prefix significant_eid;
+	significant_eid.reason = PRFX_ASIS;
+	significant_eid.prefix_length = *(datagram + offset + 5);
+
+	process_afi_address_couple(datagram + offset + 10, &significant_eid);
+
+	return significant_eid;
+}
+
 /*
  * Extracts requested EID from a Map-Request message. Only the first record is read; currently, LISP specifications do not specify how to handle
  * multi-record messages.
@@ -142,7 +195,7 @@ static ipv6_prefix extract_eid_encapsulated(uint8_t* datagram, int datagram_len)
 		return get_undefined_eid(UPRFX_MALFORMED);
 	}
 
-	debug_printf("External header stripped (%d bytes long), processing inner packet.", offset);
+	trace(TRACE_LEVEL_PACKET, TRACE_WEST, "External header stripped (%d bytes long), processing inner packet.", offset);
 
 	return extract_eid_cp(datagram + offset, datagram_len - offset);
 }
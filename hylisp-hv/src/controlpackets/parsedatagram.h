@@ -31,5 +31,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "../controlplanes/sorting.h"
 
 ipv6_prefix extract_eid_cp(uint8_t*, int);
+int extract_nonce_cp(uint8_t*, int, uint64_t*);
+ipv6_prefix extract_eid_mapnotify(uint8_t*, int);
 
 #endif /* CONTROLPACKETS_PARSEDATAGRAM_H_ */
@@ -33,9 +33,11 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <math.h>
 
 #include "../common/common.h"
+#include "../common/trace.h"
 #include "sorting.h"
 
 static void expand_assignments();
+static void drop_assignment(assignment*);
 
 static const int DYN_ARRAY_INIT = 128;
 static const double DYN_ARRAY_INCR = 2;
@@ -44,6 +46,7 @@ assignment** assignments = NULL;
 int assignments_ctr = 0;
 int assignments_max = 0;
 pthread_rwlock_t assignments_lock;
+sorting_index assignments_index;
 
 void init_assignments() {
 	assignments = malloc(DYN_ARRAY_INIT * sizeof(assignment*));
@@ -52,6 +55,8 @@ void init_assignments() {
 	assignments_ctr = 0;
 	assignments_max = DYN_ARRAY_INIT;
 	
+	init_sorting_index(&assignments_index, 0);
+	
 	pthread_rwlock_init(&assignments_lock, NULL);
 }
 
@@ -62,19 +67,37 @@ static void expand_assignments() {
 	check_allocation(assignments);
 }
 
+/* Requires assignments wrlock. The last assignment takes the free slot */
+static void drop_assignment(assignment* item) {
+	int ind = item->slot;
+	
+	unindex_assignment(&assignments_index, item);
+	
+	assignments_ctr--;
+	if (ind != assignments_ctr) {
+		assignments[ind] = assignments[assignments_ctr];
+		assignments[ind]->slot = ind;
+	}
+	
+	free(item);
+}
+
 /* Requires assignments wrlock */
 int add_assignment(assignment* item) {
-	/* Checking if already present */
+	/* Checking if valid */
 	int present_index;
 	int sorting = exact_sort(&(item->eid), &present_index);
-	switch (sorting) {
-		case SORTING_ONE:
-			/* Overwriting in place */
-			assignments[present_index]->assignee_index = item->assignee_index;
-			return present_index;
-		case SORTING_ERR:
-			/* Invalid EID */
-			return -1;
+	if (sorting == SORTING_ERR) {
+		/* Invalid EID */
+		return -1;
+	}
+	
+	/* Checking if already present */
+	assignment* present = find_assignment(&assignments_index, &(item->eid), 1);
+	if (present != NULL) {
+		/* Overwriting in place */
+		present->assignee_index = item->assignee_index;
+		return present->slot;
 	}
 	
 	if (assignments_ctr > assignments_max) {
@@ -90,51 +113,54 @@ int add_assignment(assignment* item) {
 	check_allocation(assignments[ind]);
 	
 	memcpy(assignments[ind], item, sizeof(assignment));
+	assignments[ind]->slot = ind;
+	index_assignment(&assignments_index, assignments[ind]);
 
-	debug_printf("New assignment registered at index %d by control plane at index %d", ind, item->assignee_index);
-	debug_printf_prefix(&(item->eid));
+	trace(TRACE_LEVEL_EVENT, TRACE_EAST, "New assignment registered at index %d by control plane at index %d", ind, item->assignee_index);
+	trace_prefix(TRACE_LEVEL_PACKET, TRACE_EAST, &(item->eid));
 	
 	return ind;
 }
 
 /* Requires assignments wrlock */
 void remove_assignment(assignment* item) {
-	int present_index;
-	int sorting = exact_sort(&(item->eid), &present_index);
+	assignment* present = find_assignment(&assignments_index, &(item->eid), 1);
 	
-	if (sorting != SORTING_ONE) {
-		debug_printf("Assignment not removed: not present (requested by control plane at index %d)", item->assignee_index);
-		debug_printf_prefix(&(item->eid));
+	if (present == NULL) {
+		trace(TRACE_LEVEL_PACKET, TRACE_EAST, "Assignment not removed: not present (requested by control plane at index %d)", item->assignee_index);
+		trace_prefix(TRACE_LEVEL_PACKET, TRACE_EAST, &(item->eid));
 		return;
 	}
 	
-	if (item->assignee_index != assignments[present_index]->assignee_index) {
-		debug_printf("Assignment not removed: control plane at index %d made the request, but the assignee is at index %d", item->assignee_index, assignments[present_index]->assignee_index);
-		debug_printf_prefix(&(item->eid));
+	if (item->assignee_index != present->assignee_index) {
+		trace(TRACE_LEVEL_PACKET, TRACE_EAST, "Assignment not removed: control plane at index %d made the request, but the assignee is at index %d", item->assignee_index, present->assignee_index);
+		trace_prefix(TRACE_LEVEL_PACKET, TRACE_EAST, &(item->eid));
 		return;
 	}
 	
-	free(assignments[present_index]);
+	int present_index = present->slot;
+	drop_assignment(present);
 	
-	memmove(&(assignments[present_index]), &(assignments[present_index + 1]), (assignments_ctr - 1 - present_index) * sizeof(assignment*));
-	
-	assignments_ctr--;
-	
-	debug_printf("Assignment removed from index %d (requested by control plane at index %d)", present_index, item->assignee_index);
-	debug_printf_prefix(&(item->eid));
+	trace(TRACE_LEVEL_PACKET, TRACE_EAST, "Assignment removed from index %d (requested by control plane at index %d)", present_index, item->assignee_index);
+	trace_prefix(TRACE_LEVEL_PACKET, TRACE_EAST, &(item->eid));
 }
 
-/* Requires assignments wrlock */
+/* Requires assignments wrlock, assignee_index is the control_planes index
+   the assignee had before remove_control_plane() */
 int remove_assignee(int assignee_index) {
 	int count = 0;
 	
 	int i = 0;
 	while (i < assignments_ctr) {
 		if (assignments[i]->assignee_index == assignee_index) {
-			free(assignments[i]);
-			memmove(&(assignments[i]), &(assignments[i + 1]), (assignments_ctr - 1 - i) * sizeof(assignment*));
-			assignments_ctr--;
+			/* slot i now holds the former last assignment */
+			drop_assignment(assignments[i]);
+			count++;
 		} else {
+			/* Following control planes moved down by one in control_planes */
+			if (assignments[i]->assignee_index > assignee_index) {
+				assignments[i]->assignee_index--;
+			}
 			i++;
 		}
 	}
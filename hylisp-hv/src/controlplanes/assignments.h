@@ -35,16 +35,25 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 typedef uint32_t control_plane_id;
 
+struct cp_transport;
+struct cp_outqueue;
+
 typedef struct {
 	control_plane_id id;
 	int socket_descriptor;
 	uint16_t port;
 	pid_t pid;
+	struct cp_transport* transport;	// Shared-memory rings, or NULL
+	struct cp_outqueue* outqueue;	// Map messages not yet taken by the northbound socket
 } control_plane;
 
-typedef struct {
+typedef struct assignment {
 	ipv6_prefix eid;
 	int assignee_index;
+	/* Sorting index */
+	struct assignment* next;
+	uint8_t masked[16];
+	int slot;
 } assignment;
 
 extern assignment** assignments;
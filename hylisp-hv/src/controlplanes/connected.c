@@ -32,6 +32,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <math.h>
 #include <string.h>
 #include "../common/common.h"
+#include "../common/trace.h"
 
 static const int DYN_ARRAY_INIT = 16;
 static const double DYN_ARRAY_INCR = 2;
@@ -74,7 +75,7 @@ int add_control_plane(control_plane* cp) {
 	int ind = control_planes_ctr++;
 	memcpy(&(control_planes[ind]), cp, sizeof(control_plane));
 
-	debug_printf("New control plane registered with id %d", control_planes_autoindex - 1);
+	trace(TRACE_LEVEL_EVENT, TRACE_EAST, "New control plane registered with id %d", control_planes_autoindex - 1);
 	
 	return ind;
 }
@@ -0,0 +1,135 @@
+/*
+Copyright (c) 2014, Stefano Tribioli
+All rights reserved. 
+
+This file is part of the hyLISP project.
+http://hylisp.org
+
+Redistribution and use in source and binary forms, with or without modification, 
+are permitted provided that the following conditions are met: 
+1. Redistributions of source code must retain the above copyright notice, this 
+   list of conditions and the following disclaimer. 
+2. Redistributions in binary form must reproduce the above copyright notice, 
+   this list of conditions and the following disclaimer in the documentation 
+   and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND 
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON 
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. 
+ */
+
+#include "nonces.h"
+
+#include <pthread.h>
+#include <time.h>
+
+#include "../common/common.h"
+
+/*
+ * Nonces of Map-Requests and Map-Registers announced by control planes,
+ * so that Map-Replies and Map-Notifies can be injected to the sender only.
+ * Fixed size open addressing table: an entry lives NONCE_TTL and, when
+ * all slots of its probe are taken, replaces the one expiring first.
+ * Readers take no lock, an entry being written has nonce 0.
+ */
+
+#define NONCE_TABLE 65536			// Power of 2
+#define NONCE_PROBE 8
+#define NONCE_TTL 10000				// msec
+
+typedef struct {
+	uint64_t nonce;					// 0 if free
+	uint64_t data;					// expire (msec) << 16 | port
+} nonce_entry;
+
+static nonce_entry nonces[NONCE_TABLE];
+static pthread_mutex_t nonces_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t now_ms();
+static uint32_t hash_nonce(uint64_t);
+
+static uint64_t now_ms() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static uint32_t hash_nonce(uint64_t nonce) {
+	nonce ^= nonce >> 33;
+	nonce *= 0xff51afd7ed558ccdULL;
+	nonce ^= nonce >> 33;
+	return (uint32_t) nonce;
+}
+
+void learn_nonce(uint64_t nonce, uint16_t port) {
+	if (nonce == 0) {
+		return;
+	}
+
+	uint64_t now = now_ms();
+	uint32_t h = hash_nonce(nonce);
+	nonce_entry* victim = NULL;
+	int i;
+
+	pthread_mutex_lock(&nonces_lock);
+
+	for (i = 0; i < NONCE_PROBE; i++) {
+		nonce_entry* e = &(nonces[(h + i) & (NONCE_TABLE - 1)]);
+
+		if (e->nonce == nonce || e->nonce == 0 || (e->data >> 16) <= now) {
+			victim = e;
+			break;
+		}
+		if (victim == NULL || (e->data >> 16) < (victim->data >> 16)) {
+			victim = e;
+		}
+	}
+
+	__atomic_store_n(&(victim->nonce), 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&(victim->data), ((now + NONCE_TTL) << 16) | port, __ATOMIC_RELAXED);
+	__atomic_store_n(&(victim->nonce), nonce, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&nonces_lock);
+}
+
+int lookup_nonce(uint64_t nonce, uint16_t* port) {
+	if (nonce == 0) {
+		return 0;
+	}
+
+	uint32_t h = hash_nonce(nonce);
+	int i;
+
+	for (i = 0; i < NONCE_PROBE; i++) {
+		nonce_entry* e = &(nonces[(h + i) & (NONCE_TABLE - 1)]);
+
+		if (__atomic_load_n(&(e->nonce), __ATOMIC_ACQUIRE) != nonce) {
+			continue;
+		}
+
+		uint64_t data = __atomic_load_n(&(e->data), __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		/* Rewritten meanwhile */
+		if (__atomic_load_n(&(e->nonce), __ATOMIC_RELAXED) != nonce) {
+			return 0;
+		}
+
+		if ((data >> 16) <= now_ms()) {
+			return 0;
+		}
+
+		*port = data & 0xFFFF;
+		return 1;
+	}
+
+	return 0;
+}
@@ -37,8 +37,13 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <sys/stat.h>
 
 #include "../common/common.h"
+#include "../common/trace.h"
 #include "assignments.h"
 #include "connected.h"
+#include "nonces.h"
+#include "snapshot.h"
+#include "transport.h"
+#include "../mapmessages/outqueue.h"
 
 typedef struct {
 	int action;
@@ -47,8 +52,17 @@ typedef struct {
 	pid_t pid;
 } hv_registration_message;
 
+typedef struct {
+	int action;
+	uint16_t port;
+	uint8_t type;
+	uint64_t nonce;
+} hv_nonce_message;
+
 #define ACTION_REGISTER		0
 #define ACTION_DEREGISTER	1
+#define ACTION_NONCE		2
+#define ACTION_REGISTER_RINGS	3
 
 int ipv4_controlpackets_socket;
 int ipv6_controlpackets_socket;
@@ -56,7 +70,7 @@ int ipv6_controlpackets_socket;
 static void register_control_plane(hv_registration_message*);
 static void deregister_control_plane(hv_registration_message*);
 static void ping_mmm();
-static void ack_registration(int);
+static void ack_registration(int, cp_transport*);
 
 static int s_ping_is_connected = 0;
 static int s_ping = -1;
@@ -66,6 +80,7 @@ void* start_registering_server(void* arg) {
 
 	init_control_planes();
 	init_assignments();
+	publish_snapshot();
 
 	int s = socket(AF_UNIX, SOCK_DGRAM, 0);
 	if (s < 0) {
@@ -97,7 +112,7 @@ void* start_registering_server(void* arg) {
 		fatal("Unable to create internal ping socket");
 	}
 
-	debug_printf("Eastbound server is listening");
+	trace(TRACE_LEVEL_EVENT, TRACE_EAST, "Eastbound server is listening");
 
 	int msg_len;
 	uint8_t buf[REG_BUF_LEN];
@@ -115,17 +130,23 @@ void* start_registering_server(void* arg) {
 
 			switch (msg->action) {
 			case ACTION_REGISTER:
+			case ACTION_REGISTER_RINGS:
 				register_control_plane(msg);
 				break;
 			case ACTION_DEREGISTER:
 				deregister_control_plane(msg);
 				break;
 			default:
-				debug_printf("Unknown action (%d) sent to eastbound server", msg->action);
+				trace(TRACE_LEVEL_EVENT, TRACE_EAST, "Unknown action (%d) sent to eastbound server", msg->action);
 				continue;
 			}
+		} else if (msg_len == sizeof(hv_nonce_message) && ((hv_nonce_message*) buf)->action == ACTION_NONCE) {
+			hv_nonce_message* msg;
+			msg = (hv_nonce_message*) buf;
+
+			learn_nonce(msg->nonce, msg->port);
 		} else {
-			debug_printf("Message of wrong length (%d) sent to eastbound server", msg_len);
+			trace(TRACE_LEVEL_EVENT, TRACE_EAST, "Message of wrong length (%d) sent to eastbound server", msg_len);
 		}
 	}
 }
@@ -166,21 +187,33 @@ static void register_control_plane(hv_registration_message* msg) {
 	cp.socket_descriptor = s;
 	cp.port = msg->port;
 	cp.pid = msg->pid;
+	cp.transport = NULL;
+	if (msg->action == ACTION_REGISTER_RINGS) {
+		/* Without it, the control plane is served through sockets */
+		cp.transport = create_transport(cp.id);
+	}
+	cp.outqueue = create_outqueue(cp.id, s);
 	
 	add_control_plane(&cp);
 
 	pthread_rwlock_unlock(&control_planes_lock);
 
-	debug_printf("Control plane %d registered; northbound socket %d; UDPv4 port %d", cp.id, s, cp.port);
+	publish_snapshot();
+
+	trace(TRACE_LEVEL_EVENT, TRACE_EAST, "Control plane %d registered; northbound socket %d; UDPv4 port %d%s", cp.id, s, cp.port, 
+			(cp.transport != NULL) ? "; shared-memory rings" : "");
 
-	ack_registration(s);
+	ack_registration(s, cp.transport);
 
 	/* Pinging  MapMessagesMuxer to force update */
 	ping_mmm();
 }
 
 static void deregister_control_plane(hv_registration_message* msg) {
+	/* Both updated before either lock is released, so that a snapshot never
+	   sees compacted control planes with assignments to the old indices */
 	pthread_rwlock_wrlock(&control_planes_lock);
+	pthread_rwlock_wrlock(&assignments_lock);
 
 	/* Finding control plane */
 	int i;
@@ -191,23 +224,32 @@ static void deregister_control_plane(hv_registration_message* msg) {
 	}
 
 	uint32_t id;
-	if (i < control_planes_ctr) {
+	cp_transport* transport = NULL;
+	cp_outqueue* outqueue = NULL;
+	int found = (i < control_planes_ctr);
+	if (found) {
+		transport = control_planes[i].transport;
+		outqueue = control_planes[i].outqueue;
 		id = remove_control_plane(i);
+		remove_assignee(i);
 
-		debug_printf("Control plane %d deregistered", id);
+		trace(TRACE_LEVEL_EVENT, TRACE_EAST, "Control plane %d deregistered", id);
 	} else {
-		debug_printf("Control plane asked to be deregistered, but port %d is not registered", msg->port);
+		trace(TRACE_LEVEL_EVENT, TRACE_EAST, "Control plane asked to be deregistered, but port %d is not registered", msg->port);
 	}
 
+	pthread_rwlock_unlock(&assignments_lock);
 	pthread_rwlock_unlock(&control_planes_lock);
 
-	pthread_rwlock_wrlock(&assignments_lock);
+	publish_snapshot();
 
-	if (i < control_planes_ctr) {
-		remove_assignee(id);
+	/* Mapped until the last snapshot and the muxer let it go */
+	if (transport != NULL) {
+		put_transport(transport);
+	}
+	if (outqueue != NULL) {
+		put_outqueue(outqueue);
 	}
-
-	pthread_rwlock_unlock(&assignments_lock);
 
 	ping_mmm();
 }
@@ -239,8 +281,16 @@ static void ping_mmm() {
 	}
 }
 
-static void ack_registration(int s) {
+/*
+ * Passes the westbound sockets and, if any, the shared-memory region and
+ * its two doorbells. A control plane tells them apart by the reply: "ACK"
+ * for sockets only, "ACKR" when the last three descriptors are the rings.
+ */
+static void ack_registration(int s, cp_transport* transport) {
 	char buf[5] = "ACK";
+	if (transport != NULL) {
+		strcpy(buf, "ACKR");
+	}
 
 	struct iovec iov[1];
 	iov[0].iov_base = buf;
@@ -254,19 +304,23 @@ static void ack_registration(int s) {
 	msg.msg_name = NULL;
 	msg.msg_namelen = 0;
 
-	int number_of_sockets = 1;
+	int fds[5];
+	int number_of_sockets = 0;
+	fds[number_of_sockets++] = ipv4_controlpackets_socket;
 	if (ipv6_controlpackets_socket >= 0) {
-		number_of_sockets = 2;
+		fds[number_of_sockets++] = ipv6_controlpackets_socket;
+	}
+	if (transport != NULL) {
+		memcpy(&(fds[number_of_sockets]), transport->passed_fds, 3 * sizeof(int));
+		number_of_sockets += 3;
 	}
 
-	cmptr = malloc(CMSG_SPACE(2 * sizeof(int)));
+	cmptr = malloc(CMSG_SPACE(5 * sizeof(int)));
 	check_allocation(cmptr);
 	cmptr->cmsg_level = SOL_SOCKET;
 	cmptr->cmsg_type = SCM_RIGHTS;
 	cmptr->cmsg_len = CMSG_LEN(number_of_sockets * sizeof(int));
-	int* cmsg_data = (int*) CMSG_DATA(cmptr);
-	cmsg_data[0] = ipv4_controlpackets_socket;
-	cmsg_data[1] = ipv6_controlpackets_socket;
+	memcpy(CMSG_DATA(cmptr), fds, number_of_sockets * sizeof(int));
 
 	msg.msg_control = (caddr_t) cmptr;
 	msg.msg_controllen = CMSG_SPACE(number_of_sockets * sizeof(int));
@@ -279,4 +333,8 @@ static void ack_registration(int s) {
 	}
 
 	free(cmptr);
+
+	if (transport != NULL) {
+		close_passed_fds(transport);
+	}
 }
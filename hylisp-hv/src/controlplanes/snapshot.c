@@ -0,0 +1,204 @@
+/*
+Copyright (c) 2014, Stefano Tribioli
+All rights reserved. 
+
+This file is part of the hyLISP project.
+http://hylisp.org
+
+Redistribution and use in source and binary forms, with or without modification, 
+are permitted provided that the following conditions are met: 
+1. Redistributions of source code must retain the above copyright notice, this 
+   list of conditions and the following disclaimer. 
+2. Redistributions in binary form must reproduce the above copyright notice, 
+   this list of conditions and the following disclaimer in the documentation 
+   and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND 
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON 
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. 
+ */
+
+#include "snapshot.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "../common/common.h"
+#include "../common/trace.h"
+#include "assignments.h"
+#include "connected.h"
+#include "sorting.h"
+#include "transport.h"
+#include "../mapmessages/outqueue.h"
+
+/*
+ * Writers change control_planes and assignments under their locks as
+ * before, then publish_snapshot() copies both into a new snapshot and
+ * swaps the global pointer. Readers only announce the epoch they entered
+ * in; a replaced snapshot is freed once every reader inside has left the
+ * epoch it was retired in (epoch-based reclamation).
+ */
+
+#define SNAPSHOT_READERS 256
+
+typedef struct {
+	uint64_t epoch;			// 0 outside any snapshot
+	uint8_t pad[56];		// One cache line each
+} snapshot_reader;
+
+static snapshot_reader snapshot_readers[SNAPSHOT_READERS];
+static int snapshot_readers_ctr = 0;
+static __thread snapshot_reader* my_reader = NULL;
+
+static routing_snapshot* current_snapshot = NULL;
+static uint64_t snapshot_epoch = 1;
+static uint64_t snapshot_version = 0;
+static routing_snapshot* retired_snapshots = NULL;
+static pthread_mutex_t publish_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static routing_snapshot* build_snapshot();
+static void free_snapshot(routing_snapshot*);
+static void reclaim_snapshots();
+
+routing_snapshot* snapshot_enter() {
+	if (my_reader == NULL) {
+		int i = __atomic_fetch_add(&snapshot_readers_ctr, 1, __ATOMIC_RELAXED);
+		if (i >= SNAPSHOT_READERS) {
+			fatal("Too many snapshot reader threads");
+		}
+		my_reader = &(snapshot_readers[i]);
+	}
+
+	/* Epoch visible before the pointer is read */
+	__atomic_store_n(&(my_reader->epoch), __atomic_load_n(&snapshot_epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+	return __atomic_load_n(&current_snapshot, __ATOMIC_SEQ_CST);
+}
+
+void snapshot_exit() {
+	__atomic_store_n(&(my_reader->epoch), 0, __ATOMIC_RELEASE);
+}
+
+int snapshot_sort(routing_snapshot* snapshot, ipv6_prefix* significant_eid, int* control_plane_index) {
+	if (snapshot == NULL) {
+		return SORTING_ERR;
+	}
+
+	return flex_sort(&(snapshot->index), snapshot->control_planes_ctr, snapshot->control_planes_def, significant_eid, control_plane_index, 0);
+}
+
+/* Requires control_planes rdlock and assignments rdlock */
+static routing_snapshot* build_snapshot() {
+	routing_snapshot* snapshot = calloc(1, sizeof(routing_snapshot));
+	check_allocation(snapshot);
+
+	snapshot->control_planes_ctr = control_planes_ctr;
+	snapshot->control_planes_def = control_planes_def;
+	snapshot->control_planes = malloc((control_planes_ctr > 0 ? control_planes_ctr : 1) * sizeof(control_plane));
+	check_allocation(snapshot->control_planes);
+	memcpy(snapshot->control_planes, control_planes, control_planes_ctr * sizeof(control_plane));
+
+	int i;
+	for (i = 0; i < control_planes_ctr; i++) {
+		if (control_planes[i].transport != NULL) {
+			get_transport(control_planes[i].transport);
+		}
+		get_outqueue(control_planes[i].outqueue);
+	}
+
+	int size = 16;
+	while (size < assignments_ctr) {
+		size *= 2;
+	}
+	init_sorting_index(&(snapshot->index), size);
+
+	snapshot->assignments = malloc((assignments_ctr > 0 ? assignments_ctr : 1) * sizeof(assignment));
+	check_allocation(snapshot->assignments);
+
+	for (i = 0; i < assignments_ctr; i++) {
+		memcpy(&(snapshot->assignments[i]), assignments[i], sizeof(assignment));
+		snapshot->assignments[i].slot = i;
+		index_assignment(&(snapshot->index), &(snapshot->assignments[i]));
+	}
+
+	return snapshot;
+}
+
+static void free_snapshot(routing_snapshot* snapshot) {
+	int i;
+	for (i = 0; i < snapshot->control_planes_ctr; i++) {
+		if (snapshot->control_planes[i].transport != NULL) {
+			put_transport(snapshot->control_planes[i].transport);
+		}
+		put_outqueue(snapshot->control_planes[i].outqueue);
+	}
+
+	free_sorting_index(&(snapshot->index));
+	free(snapshot->assignments);
+	free(snapshot->control_planes);
+	free(snapshot);
+}
+
+/* Requires publish_lock */
+static void reclaim_snapshots() {
+	uint64_t oldest = UINT64_MAX;
+	int readers_ctr = __atomic_load_n(&snapshot_readers_ctr, __ATOMIC_RELAXED);
+	int i;
+
+	if (readers_ctr > SNAPSHOT_READERS) {
+		readers_ctr = SNAPSHOT_READERS;
+	}
+
+	for (i = 0; i < readers_ctr; i++) {
+		uint64_t e = __atomic_load_n(&(snapshot_readers[i].epoch), __ATOMIC_SEQ_CST);
+		if (e != 0 && e < oldest) {
+			oldest = e;
+		}
+	}
+
+	routing_snapshot** ps = &retired_snapshots;
+	while (*ps != NULL) {
+		routing_snapshot* s = *ps;
+		/* Readers of s entered at the latest in its retirement epoch */
+		if (s->retired_epoch < oldest) {
+			*ps = s->retired_next;
+			free_snapshot(s);
+		} else {
+			ps = &(s->retired_next);
+		}
+	}
+}
+
+void publish_snapshot() {
+	pthread_mutex_lock(&publish_lock);
+
+	pthread_rwlock_rdlock(&control_planes_lock);
+	pthread_rwlock_rdlock(&assignments_lock);
+
+	routing_snapshot* snapshot = build_snapshot();
+
+	pthread_rwlock_unlock(&assignments_lock);
+	pthread_rwlock_unlock(&control_planes_lock);
+
+	snapshot->version = ++snapshot_version;
+
+	routing_snapshot* old = __atomic_exchange_n(&current_snapshot, snapshot, __ATOMIC_SEQ_CST);
+	if (old != NULL) {
+		old->retired_epoch = __atomic_fetch_add(&snapshot_epoch, 1, __ATOMIC_SEQ_CST);
+		old->retired_next = retired_snapshots;
+		retired_snapshots = old;
+	}
+
+	reclaim_snapshots();
+
+	pthread_mutex_unlock(&publish_lock);
+
+	trace(TRACE_LEVEL_EVENT, TRACE_EAST, "Routing snapshot %llu published: %d control planes, %d assignments", (unsigned long long) snapshot->version, snapshot->control_planes_ctr, snapshot->index.ctr);
+}
@@ -0,0 +1,61 @@
+/*
+Copyright (c) 2014, Stefano Tribioli
+All rights reserved. 
+
+This file is part of the hyLISP project.
+http://hylisp.org
+
+Redistribution and use in source and binary forms, with or without modification, 
+are permitted provided that the following conditions are met: 
+1. Redistributions of source code must retain the above copyright notice, this 
+   list of conditions and the following disclaimer. 
+2. Redistributions in binary form must reproduce the above copyright notice, 
+   this list of conditions and the following disclaimer in the documentation 
+   and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND 
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON 
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. 
+ */
+
+#ifndef CONTROLPLANES_SNAPSHOT_H_
+#define CONTROLPLANES_SNAPSHOT_H_
+
+#include <stdint.h>
+
+#include "../common/common.h"
+#include "assignments.h"
+#include "sorting.h"
+
+/*
+ * Immutable copy of control planes and assignments, read by the demux
+ * paths without any lock.
+ */
+typedef struct routing_snapshot {
+	uint64_t version;
+	control_plane* control_planes;
+	int control_planes_ctr;
+	int control_planes_def;
+	assignment* assignments;
+	sorting_index index;
+	/* Reclamation */
+	struct routing_snapshot* retired_next;
+	uint64_t retired_epoch;
+} routing_snapshot;
+
+/* Readers: no snapshot returned by enter is freed before the matching exit */
+routing_snapshot* snapshot_enter();
+void snapshot_exit();
+int snapshot_sort(routing_snapshot*, ipv6_prefix*, int*);
+
+/* Writers: requires neither control_planes nor assignments lock */
+void publish_snapshot();
+
+#endif /* CONTROLPLANES_SNAPSHOT_H_ */
@@ -27,29 +27,194 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "sorting.h"
 
+#include <stdlib.h>
+
 #include "assignments.h"
 #include "connected.h"
 #include "string.h"
 
-assignment** assignments;
-int assignments_ctr;
+/*
+ * Assignments are indexed by one hash table keyed on (masked prefix,
+ * prefix length). Longest match probes, from the longest down, only the
+ * prefix lengths having at least one assignment: a packet pays one probe
+ * per distinct length instead of one check per assignment, and adding or
+ * removing an assignment is O(1).
+ */
+
+static const int INDEX_INIT = 256;
 
 static int precomputed_masks[8] = { 0x00, 0x80, 0xC0, 0xE0, 0xF0, 0xF8, 0xFC, 0xFE };
 
-static int flex_sort(ipv6_prefix*, int*, int);
+static void mask_prefix(uint8_t*, uint8_t*, int);
+static uint32_t hash_prefix(uint8_t*, int);
+static assignment* find_in_index(sorting_index*, uint8_t*, int);
+static void update_lengths(sorting_index*);
+static void expand_index(sorting_index*);
+
+/* size is a power of 2, 0 for the default */
+void init_sorting_index(sorting_index* index, int size) {
+	if (size <= 0) {
+		size = INDEX_INIT;
+	}
+
+	memset(index, 0, sizeof(sorting_index));
+
+	index->buckets = calloc(size, sizeof(assignment*));
+	check_allocation(index->buckets);
+
+	index->size = size;
+}
+
+void free_sorting_index(sorting_index* index) {
+	free(index->buckets);
+	index->buckets = NULL;
+	index->size = 0;
+}
+
+static void mask_prefix(uint8_t* dst, uint8_t* src, int prefix_length) {
+	int whole_bytes = prefix_length / 8;
+	int left_bits = prefix_length % 8;
+
+	memset(dst, 0, 16);
+	memcpy(dst, src, whole_bytes);
+	if (left_bits != 0) {
+		dst[whole_bytes] = src[whole_bytes] & precomputed_masks[left_bits];
+	}
+}
+
+/* FNV-1a on a masked prefix and its length */
+static uint32_t hash_prefix(uint8_t* masked, int prefix_length) {
+	uint32_t h = 2166136261u ^ prefix_length;
+	int i;
+
+	for (i = 0; i < (prefix_length + 7) / 8; i++) {
+		h = (h ^ masked[i]) * 16777619u;
+	}
+
+	return h;
+}
+
+static assignment* find_in_index(sorting_index* index, uint8_t* masked, int prefix_length) {
+	assignment* a = index->buckets[hash_prefix(masked, prefix_length) & (index->size - 1)];
+
+	for (; a != NULL; a = a->next) {
+		if (a->eid.prefix_length == prefix_length && memcmp(a->masked, masked, 16) == 0) {
+			return a;
+		}
+	}
+
+	return NULL;
+}
+
+static void update_lengths(sorting_index* index) {
+	int l;
+
+	index->lengths_ctr = 0;
+	for (l = 128; l >= 0; l--) {
+		if (index->length_ctr[l] > 0) {
+			index->lengths[index->lengths_ctr++] = l;
+		}
+	}
+}
+
+static void expand_index(sorting_index* index) {
+	int new_size = 2 * index->size;
+	assignment** new_buckets = calloc(new_size, sizeof(assignment*));
+	check_allocation(new_buckets);
+
+	int i;
+	for (i = 0; i < index->size; i++) {
+		assignment* a = index->buckets[i];
+		while (a != NULL) {
+			assignment* next = a->next;
+			uint32_t b = hash_prefix(a->masked, a->eid.prefix_length) & (new_size - 1);
+			a->next = new_buckets[b];
+			new_buckets[b] = a;
+			a = next;
+		}
+	}
+
+	free(index->buckets);
+	index->buckets = new_buckets;
+	index->size = new_size;
+}
+
+void index_assignment(sorting_index* index, assignment* item) {
+	if (index->ctr >= index->size) {
+		expand_index(index);
+	}
+
+	mask_prefix(item->masked, item->eid.prefix, item->eid.prefix_length);
+
+	uint32_t b = hash_prefix(item->masked, item->eid.prefix_length) & (index->size - 1);
+	item->next = index->buckets[b];
+	index->buckets[b] = item;
+	index->ctr++;
+
+	if (index->length_ctr[item->eid.prefix_length]++ == 0) {
+		update_lengths(index);
+	}
+}
+
+void unindex_assignment(sorting_index* index, assignment* item) {
+	assignment** pa = &(index->buckets[hash_prefix(item->masked, item->eid.prefix_length) & (index->size - 1)]);
+
+	for (; *pa != NULL; pa = &((*pa)->next)) {
+		if (*pa == item) {
+			*pa = item->next;
+			item->next = NULL;
+			index->ctr--;
+
+			if (--index->length_ctr[item->eid.prefix_length] == 0) {
+				update_lengths(index);
+			}
+			return;
+		}
+	}
+}
+
+assignment* find_assignment(sorting_index* index, ipv6_prefix* significant_eid, int exact) {
+	uint8_t masked[16];
+	assignment* a;
+	int i;
+
+	if (significant_eid->prefix_length > 128) {
+		significant_eid->prefix_length = 128;
+	}
+
+	if (exact) {
+		if (index->length_ctr[significant_eid->prefix_length] == 0) {
+			return NULL;
+		}
+		mask_prefix(masked, significant_eid->prefix, significant_eid->prefix_length);
+		return find_in_index(index, masked, significant_eid->prefix_length);
+	}
+
+	for (i = 0; i < index->lengths_ctr; i++) {
+		if (index->lengths[i] > significant_eid->prefix_length) {
+			continue;
+		}
+		mask_prefix(masked, significant_eid->prefix, index->lengths[i]);
+		if ((a = find_in_index(index, masked, index->lengths[i])) != NULL) {
+			return a;
+		}
+	}
+
+	return NULL;
+}
 
 /* Requires control_planes rdlock and assignments rdlock */
 int sort(ipv6_prefix* significant_eid, int* control_plane_index) {
-	return flex_sort(significant_eid, control_plane_index, 0);
+	return flex_sort(&assignments_index, control_planes_ctr, control_planes_def, significant_eid, control_plane_index, 0);
 }
 
 /* Requires control_planes rdlock and assignments rdlock */
 int exact_sort(ipv6_prefix* significant_eid, int* control_plane_index) {
-	return flex_sort(significant_eid, control_plane_index, 1);
+	return flex_sort(&assignments_index, control_planes_ctr, control_planes_def, significant_eid, control_plane_index, 1);
 }
 
-static int flex_sort(ipv6_prefix* significant_eid, int* control_plane_index, int exact) {
-	if (control_planes_ctr == 0) {
+int flex_sort(sorting_index* index, int cp_ctr, int cp_def, ipv6_prefix* significant_eid, int* control_plane_index, int exact) {
+	if (cp_ctr == 0) {
 		return SORTING_ERR;
 	}
 
@@ -70,52 +235,13 @@ static int flex_sort(ipv6_prefix* significant_eid, int* control_plane_index, int
 		}
 	}
 
-	int i;
-	int max_prefix_lenght = -1;
-
-	for (i = 0; i < assignments_ctr; i++) {
-		int match = 0;
-		
-		if (exact && significant_eid->prefix_length != assignments[i]->eid.prefix_length) {
-			continue;
-		}
-
-		if (significant_eid->prefix_length >= assignments[i]->eid.prefix_length) {
-			/* Sanitizing prefix_length */
-			if (significant_eid->prefix_length > 128) {
-				significant_eid->prefix_length = 128;
-			}
-
-			int whole_bytes = assignments[i]->eid.prefix_length / 8;
-			int left_bits = assignments[i]->eid.prefix_length % 8;
-
-			/* Checking whole bytes */
-			if (memcmp(&(significant_eid->prefix), &(assignments[i]->eid.prefix), whole_bytes) == 0) {
-				if (left_bits == 0) {
-					match = 1;
-				} else {
-					/* Checking leftover bits */
-					uint8_t challenge = significant_eid->prefix[whole_bytes] & precomputed_masks[left_bits];
-					uint8_t stored = assignments[i]->eid.prefix[whole_bytes] & precomputed_masks[left_bits];
-
-					if (challenge == stored) {
-						match = 1;
-					}
-				}
-			}
-		}
-		
-		/* Prefix is longer (or equal) than previous entries */
-		if (match && assignments[i]->eid.prefix_length >= max_prefix_lenght) {
-			max_prefix_lenght = assignments[i]->eid.prefix_length;
-			*(control_plane_index) = assignments[i]->assignee_index;
-		}
-	}
+	assignment* a = find_assignment(index, significant_eid, exact);
 
-	if (max_prefix_lenght > -1) {
+	if (a != NULL) {
+		*(control_plane_index) = a->assignee_index;
 		return SORTING_ONE;
 	} else {
-		*(control_plane_index) = control_planes_def;
+		*(control_plane_index) = cp_def;
 		return SORTING_NON;
 	}
 }
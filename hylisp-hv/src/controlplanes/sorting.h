@@ -31,6 +31,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <stdint.h>
 #include "../common/common.h"
 #include "connected.h"
+#include "assignments.h"
 
 enum {
 	SORTING_ERR,
@@ -39,6 +40,25 @@ enum {
 	SORTING_NON
 };
 
+typedef struct {
+	assignment** buckets;
+	int size;
+	int ctr;
+	int length_ctr[129];		// Assignments per prefix length
+	uint8_t lengths[129];		// Prefix lengths in use, longest first
+	int lengths_ctr;
+} sorting_index;
+
+/* Index of assignments, requires assignments lock */
+extern sorting_index assignments_index;
+
+void init_sorting_index(sorting_index*, int);
+void free_sorting_index(sorting_index*);
+void index_assignment(sorting_index*, assignment*);
+void unindex_assignment(sorting_index*, assignment*);
+assignment* find_assignment(sorting_index*, ipv6_prefix*, int);
+int flex_sort(sorting_index*, int, int, ipv6_prefix*, int*, int);
+
 int sort(ipv6_prefix*, int*);
 int exact_sort(ipv6_prefix*, int*);
 ipv6_prefix get_undefined_eid(int);
@@ -0,0 +1,196 @@
+/*
+Copyright (c) 2014, Stefano Tribioli
+All rights reserved. 
+
+This file is part of the hyLISP project.
+http://hylisp.org
+
+Redistribution and use in source and binary forms, with or without modification, 
+are permitted provided that the following conditions are met: 
+1. Redistributions of source code must retain the above copyright notice, this 
+   list of conditions and the following disclaimer. 
+2. Redistributions in binary form must reproduce the above copyright notice, 
+   this list of conditions and the following disclaimer in the documentation 
+   and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND 
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON 
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. 
+ */
+
+#include "transport.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static int open_region(uint32_t);
+static int send_datagram(cp_transport*, uint8_t, void*, void*, int, uint16_t, uint16_t, uint8_t*, int);
+
+/* Anonymous region: the name is unlinked as soon as it is opened */
+static int open_region(uint32_t id) {
+	char name[64];
+	snprintf(name, sizeof(name), "/hylisphv_%d_%u", (int) getpid(), id);
+
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0) {
+		return -1;
+	}
+	shm_unlink(name);
+
+	if (ftruncate(fd, sizeof(hv_shared_rings)) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+cp_transport* create_transport(uint32_t id) {
+	int fd = open_region(id);
+	if (fd < 0) {
+		warning("Unable to create shared memory for a control plane");
+		return NULL;
+	}
+
+	hv_shared_rings* rings;
+	rings = mmap(NULL, sizeof(hv_shared_rings), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (rings == MAP_FAILED) {
+		warning("Unable to map shared memory for a control plane");
+		close(fd);
+		return NULL;
+	}
+
+	int west[2];
+	int east[2];
+	if (pipe(west) < 0) {
+		warning("Unable to create a doorbell for a control plane");
+		munmap(rings, sizeof(hv_shared_rings));
+		close(fd);
+		return NULL;
+	}
+	if (pipe(east) < 0) {
+		warning("Unable to create a doorbell for a control plane");
+		close(west[0]);
+		close(west[1]);
+		munmap(rings, sizeof(hv_shared_rings));
+		close(fd);
+		return NULL;
+	}
+
+	fcntl(west[1], F_SETFL, O_NONBLOCK);
+	fcntl(east[0], F_SETFL, O_NONBLOCK);
+
+	/* The region is zeroed by ftruncate() */
+	rings->magic = HV_RING_MAGIC;
+	rings->version = HV_RING_VERSION;
+
+	cp_transport* t = calloc(1, sizeof(cp_transport));
+	check_allocation(t);
+
+	t->rings = rings;
+	t->west_doorbell = west[1];
+	t->east_doorbell = east[0];
+	t->passed_fds[0] = fd;
+	t->passed_fds[1] = west[0];
+	t->passed_fds[2] = east[1];
+	pthread_mutex_init(&(t->west_lock), NULL);
+	t->refs = 1;
+
+	return t;
+}
+
+/* Once passed to the control plane, the hypervisor needs only its ends */
+void close_passed_fds(cp_transport* t) {
+	int i;
+	for (i = 0; i < 3; i++) {
+		if (t->passed_fds[i] >= 0) {
+			close(t->passed_fds[i]);
+			t->passed_fds[i] = -1;
+		}
+	}
+}
+
+void get_transport(cp_transport* t) {
+	__atomic_add_fetch(&(t->refs), 1, __ATOMIC_RELAXED);
+}
+
+void put_transport(cp_transport* t) {
+	if (__atomic_sub_fetch(&(t->refs), 1, __ATOMIC_ACQ_REL) != 0) {
+		return;
+	}
+
+	close_passed_fds(t);
+	close(t->west_doorbell);
+	close(t->east_doorbell);
+	munmap(t->rings, sizeof(hv_shared_rings));
+	pthread_mutex_destroy(&(t->west_lock));
+	free(t);
+}
+
+static int send_datagram(cp_transport* t, uint8_t family, void* source, void* destination, int address_len, 
+		uint16_t source_port, uint16_t destination_port, uint8_t* payload, int payload_len) {
+	if (payload_len > HV_RING_DATA_LEN) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&(t->west_lock));
+
+	hv_ring_slot* slot = hv_ring_reserve(&(t->rings->west));
+	if (slot == NULL) {
+		pthread_mutex_unlock(&(t->west_lock));
+		return -1;
+	}
+
+	memset(&(slot->h), 0, sizeof(hv_ring_slot_header));
+	slot->h.len = payload_len;
+	slot->h.family = family;
+	slot->h.source_port = source_port;
+	slot->h.destination_port = destination_port;
+	memcpy(slot->h.source, source, address_len);
+	memcpy(slot->h.destination, destination, address_len);
+	memcpy(slot->data, payload, payload_len);
+
+	int ring = hv_ring_commit(&(t->rings->west));
+
+	pthread_mutex_unlock(&(t->west_lock));
+
+	if (ring) {
+		/* Full pipe: the control plane has yet to wake up anyway */
+		uint8_t b = 0;
+		if (write(t->west_doorbell, &b, 1) < 0 && errno != EAGAIN) {
+			warning("Unable to ring a westbound doorbell");
+		}
+	}
+
+	return 0;
+}
+
+int transport_send_ipv4(cp_transport* t, ipv4_datagram* datagram, uint16_t port) {
+	return send_datagram(t, AF_INET, &(datagram->source.sin_addr), &(datagram->destination.sin_addr), 4, 
+			datagram->source.sin_port, htons(port), datagram->payload, datagram->payload_len);
+}
+
+int transport_send_ipv6(cp_transport* t, ipv6_datagram* datagram, uint16_t port) {
+	return send_datagram(t, AF_INET6, &(datagram->source.sin6_addr), &(datagram->destination.sin6_addr), 16, 
+			datagram->source.sin6_port, htons(port), datagram->payload, datagram->payload_len);
+}
+
+void drain_east_doorbell(cp_transport* t) {
+	uint8_t buf[64];
+	while (read(t->east_doorbell, buf, sizeof(buf)) > 0) {
+		;
+	}
+}
@@ -0,0 +1,63 @@
+/*
+Copyright (c) 2014, Stefano Tribioli
+All rights reserved. 
+
+This file is part of the hyLISP project.
+http://hylisp.org
+
+Redistribution and use in source and binary forms, with or without modification, 
+are permitted provided that the following conditions are met: 
+1. Redistributions of source code must retain the above copyright notice, this 
+   list of conditions and the following disclaimer. 
+2. Redistributions in binary form must reproduce the above copyright notice, 
+   this list of conditions and the following disclaimer in the documentation 
+   and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND 
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON 
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. 
+ */
+
+#ifndef CONTROLPLANES_TRANSPORT_H_
+#define CONTROLPLANES_TRANSPORT_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "../common/common.h"
+#include "../../hdr/hylispring.h"
+
+/*
+ * Shared-memory rings of a control plane that asked for them. Snapshots and
+ * the map messages muxer hold references, so the region stays mapped until
+ * the last of them is gone.
+ */
+typedef struct cp_transport {
+	hv_shared_rings* rings;
+	int west_doorbell;			// Write end
+	int east_doorbell;			// Read end
+	int passed_fds[3];			// Region, west read end, east write end
+	pthread_mutex_t west_lock;	// Demux workers are many producers
+	int refs;
+} cp_transport;
+
+/* Returns NULL if shared memory is not available */
+cp_transport* create_transport(uint32_t);
+void close_passed_fds(cp_transport*);
+void get_transport(cp_transport*);
+void put_transport(cp_transport*);
+
+/* Return -1 if the ring is full or the payload too long */
+int transport_send_ipv4(cp_transport*, ipv4_datagram*, uint16_t);
+int transport_send_ipv6(cp_transport*, ipv6_datagram*, uint16_t);
+
+void drain_east_doorbell(cp_transport*);
+
+#endif /* CONTROLPLANES_TRANSPORT_H_ */
@@ -26,17 +26,21 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
 #include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <ctype.h>
 #include <stdlib.h>
 
 #include "common/common.h"
+#include "common/trace.h"
 #include "controlpackets/demux.h"
 #include "controlplanes/register.h"
 #include "mapmessages/demux.h"
 #include "mapmessages/mux.h"
+#include "mapmessages/outqueue.h"
 
 int hv_debug;
 
@@ -45,9 +49,11 @@ int main(int argc, char **argv) {
 	int c;
 	
 	int daemon = 0;
+	int trace_level = TRACE_LEVEL_PACKET;
+	int trace_mask = TRACE_ALL;
 	
 	opterr = 0;
-	while ((c = getopt(argc, argv, "do:O:e:E:")) != -1) {
+	while ((c = getopt(argc, argv, "do:O:e:E:w:q:m:t:l:")) != -1) {
 		switch (c) {
 		case 'd':
 			daemon = 1;
@@ -66,6 +72,37 @@ int main(int argc, char **argv) {
 		case 'E':
 			freopen(optarg, "a", stderr);
 			break;
+		case 'w':
+			hv_workers = atoi(optarg);
+			break;
+		case 'q':
+			if (atoi(optarg) > 0) {
+				hv_queue_len = atoi(optarg);
+			} else {
+				fprintf(stderr, "Invalid queue length %s\n", optarg);
+			}
+			break;
+		case 'm':
+			if (strcmp(optarg, "tail") == 0) {
+				hv_miss_policy = MISS_POLICY_TAIL;
+			} else if (strcmp(optarg, "head") == 0) {
+				hv_miss_policy = MISS_POLICY_HEAD;
+			} else if (strcmp(optarg, "coalesce") == 0) {
+				hv_miss_policy = MISS_POLICY_COALESCE;
+			} else {
+				fprintf(stderr, "Unknown miss policy %s\n", optarg);
+			}
+			break;
+		case 't':
+			trace_mask = parse_trace_mask(optarg);
+			if (trace_mask < 0) {
+				fprintf(stderr, "Unknown subsystem in %s\n", optarg);
+				trace_mask = TRACE_ALL;
+			}
+			break;
+		case 'l':
+			trace_level = atoi(optarg);
+			break;
 		case '?':
 			if (optopt == 'o') {
 				hv_debug = 1;
@@ -95,6 +132,23 @@ int main(int argc, char **argv) {
 		fclose(fpid);
 	}
 
+	/* Only the northbound writer takes SIGUSR1, to dump its counters */
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	if (hv_debug) {
+		hv_trace_level = trace_level;
+		hv_trace_mask = trace_mask;
+
+		pthread_t tw_id;
+		r = pthread_create(&tw_id, NULL, start_trace_writer, NULL);
+		if (r != 0) {
+			fatalr("Unable to start trace writer", r);
+		}
+	}
+
 	pthread_t rs_id;
 	r = pthread_create(&rs_id, NULL, start_registering_server, NULL);
 	if (r != 0) {
@@ -113,6 +167,12 @@ int main(int argc, char **argv) {
 		fatalr("Unable to start northbound loop", r);
 	}
 
+	pthread_t mmw_id;
+	r = pthread_create(&mmw_id, NULL, start_mapmessages_writer, NULL);
+	if (r != 0) {
+		fatalr("Unable to start northbound writer", r);
+	}
+
 	pthread_t mmd_id;
 	r = pthread_create(&mmd_id, NULL, start_mapmessages_demuxer, NULL);
 	if (r != 0) {
@@ -123,6 +183,7 @@ int main(int argc, char **argv) {
 	pthread_join(cps_id, NULL);
 	pthread_join(mmd_id, NULL);
 	pthread_join(mmm_id, NULL);
+	pthread_join(mmw_id, NULL);
 
 	return 0;
 }
@@ -54,6 +54,8 @@ struct map_msghdr {
 	int map_seq;
 	int map_errno;
 };
+#define MAPM_MISS		   0x05
+#define MAPM_MISS_PACKET   0x08
 
 int sysctlbyname(const char *name, void *oldp, size_t *oldlenp, const void *newp, size_t newlen) {
 	return 0;	
@@ -67,7 +69,10 @@ int sysctlbyname(const char *name, void *oldp, size_t *oldlenp, const void *newp
 #endif	/* LINUX_OS */
 
 #include "../common/common.h"
+#include "../common/trace.h"
 #include "parsemessage.h"
+#include "../controlplanes/snapshot.h"
+#include "outqueue.h"
 
 int map_socket;
 
@@ -90,10 +95,14 @@ void* start_mapmessages_demuxer(void* arg) {
 	int l;
 	uint8_t buf[MAP_BUF_LEN];
 
-	debug_printf("Map message demuxer is listening");
+	trace(TRACE_LEVEL_EVENT, TRACE_SOUTH, "Map message demuxer is listening");
 
 	while (1) {
 		l = read(map_socket, buf, MAP_BUF_LEN);
+		if (l <= 0) {
+			warning("Unable to read from mapping socket");
+			continue;
+		}
 		process_message(buf, l);
 	}
 
@@ -103,50 +112,44 @@ void* start_mapmessages_demuxer(void* arg) {
 static void process_message(uint8_t* buf, int msg_len) {
 	int r;
 
-	int recipient_socket;
-
 	ipv6_prefix significant_eid;
 	significant_eid = extract_eid_mm(buf, msg_len);
 
-	pthread_rwlock_rdlock(&control_planes_lock);
-	pthread_rwlock_rdlock(&assignments_lock);
+	uint16_t type = ((struct map_msghdr*) buf)->map_type;
+	int is_miss = (type >= MAPM_MISS && type <= MAPM_MISS_PACKET);
+
+	routing_snapshot* snapshot = snapshot_enter();
 
 	int control_plane_index;
-	r = sort(&significant_eid, &control_plane_index);
+	r = snapshot_sort(snapshot, &significant_eid, &control_plane_index);
 
+	/* Queued, never waiting for a slow control plane */
 	if (r == SORTING_ONE) {
-		recipient_socket = control_planes[control_plane_index].socket_descriptor;
-	}
-
-	pthread_rwlock_unlock(&assignments_lock);
-	pthread_rwlock_unlock(&control_planes_lock);
+		control_plane* cp = &(snapshot->control_planes[control_plane_index]);
 
-	if (r == SORTING_ONE) {
-		r = write(recipient_socket, buf, msg_len);
+		r = outqueue_push(cp->outqueue, buf, msg_len, is_miss, &significant_eid);
 
-		if (r == -1) {
-			warning("Unable to write to UNIX socket");
-			return;
+		if (r == OUTQ_DROPPED) {
+			trace(TRACE_LEVEL_PACKET, TRACE_SOUTH, "Map message (type %u) to control plane %d dropped", type, cp->id);
+		} else {
+			trace(TRACE_LEVEL_PACKET, TRACE_SOUTH, "Demuxing map message (type %u) from data plane to northbound socket %d%s", type, cp->socket_descriptor, 
+					(r == OUTQ_SENT) ? "" : ((r == OUTQ_QUEUED) ? " (queued)" : " (coalesced)"));
+			trace_prefix(TRACE_LEVEL_PACKET, TRACE_SOUTH, &significant_eid);
 		}
-
-		debug_printf("Demuxing map message (type %u) from data plane to northbound socket %d", ((struct map_msghdr*) buf)->map_type, recipient_socket);
-		debug_printf_prefix(&significant_eid);
 	} else {
-		debug_printf("Unable to demux map message (type %u; result 0x%x), broadcasting to all control planes", ((struct map_msghdr*) buf)->map_type, r);
-		debug_printf_prefix(&significant_eid);
+		trace(TRACE_LEVEL_PACKET, TRACE_SOUTH, "Unable to demux map message (type %u; result 0x%x), broadcasting to all control planes", type, r);
+		trace_prefix(TRACE_LEVEL_PACKET, TRACE_SOUTH, &significant_eid);
 
 		/* Broadcasting map message */
 
-		pthread_rwlock_rdlock(&control_planes_lock);
-
-		for (int i = 0; i < control_planes_ctr; i++) {
-			r = write(control_planes[i].socket_descriptor, buf, msg_len);
+		for (int i = 0; snapshot != NULL && i < snapshot->control_planes_ctr; i++) {
+			r = outqueue_push(snapshot->control_planes[i].outqueue, buf, msg_len, is_miss, &significant_eid);
 
-			if (r == -1) {
-				warning("Unable to write to UNIX socket");
+			if (r == OUTQ_DROPPED) {
+				trace(TRACE_LEVEL_PACKET, TRACE_SOUTH, "Map message (type %u) to control plane %d dropped", type, snapshot->control_planes[i].id);
 			}
 		}
-
-		pthread_rwlock_unlock(&control_planes_lock);
 	}
+
+	snapshot_exit();
 }
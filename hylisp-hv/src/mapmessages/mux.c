@@ -28,7 +28,6 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "mux.h"
 
 #include <pthread.h>
-#include <math.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -41,6 +40,8 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #ifdef LINUX_OS
 
+#include <sys/epoll.h>
+
 /* From OpenLISP <net/lisp/maptables.h> */
 #define MAPF_DB       0x001
 #define MAPM_ADD	   0x01
@@ -48,31 +49,78 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #else 	/* LINUX_OS */
 
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
 #include <net/lisp/lisp.h>
 #include <net/lisp/maptables.h>
 
 #endif	/* LINUX_OS */
 
 #include "../common/common.h"
+#include "../common/trace.h"
 #include "../controlplanes/assignments.h"
 #include "../controlplanes/connected.h"
+#include "../controlplanes/snapshot.h"
+#include "../controlplanes/transport.h"
 #include "parsemessage.h"
 
 #ifndef INFTIM
 #define INFTIM	-1
 #endif
 
-static void init_mmm_poll();
-static void expand_mmm_poll();
-static void update_mmm_poll();
-static void process_message();
+#define MAP_BUF_LEN		8192
+#define MMM_BURST		32		// Map messages taken from a control plane at a time
+#define MMM_EVENTS		64
+
+typedef struct mmm_source mmm_source;
+
+/* What an event refers to; NULL source for the internal ping socket */
+typedef struct {
+	mmm_source* source;
+	int is_doorbell;
+} mmm_handle;
+
+/*
+ * A registered control plane: its northbound socket and, if it has
+ * shared-memory rings, its east doorbell are in the interest set. The
+ * muxer holds a reference to the rings.
+ */
+struct mmm_source {
+	control_plane_id id;
+	int socket_descriptor;
+	cp_transport* transport;
+	mmm_handle socket_handle;
+	mmm_handle doorbell_handle;
+	int seen;
+};
+
+static void init_mmm_events();
+static void watch_fd(int, mmm_handle*);
+static void unwatch_fd(int);
+static int wait_events(mmm_handle**, int, int);
+static void update_mmm_sources();
+static void add_source(control_plane*);
+static void remove_source(int);
+static void process_socket(mmm_source*);
+static void process_ring(mmm_source*);
+static void process_map_batch(mmm_source*, uint8_t**, int*, int);
+static void write_map_message(mmm_source*, uint8_t*, int);
+
+static int assignments_changed = 0;
 
 static const int DYN_ARRAY_INIT = 16;
-static const double DYN_ARRAY_INCR = 1.5;
 
-struct pollfd* mmm_poll = NULL;
-int mmm_poll_ctr = 0;
-int mmm_poll_max = 0;
+static int mmm_events_fd = -1;
+static int mmm_ping_socket = -1;
+static mmm_handle mmm_ping_handle = {NULL, 0};
+static mmm_source** mmm_sources = NULL;
+static int mmm_sources_ctr = 0;
+static int mmm_sources_max = 0;
+
+/* Burst read from a northbound socket, not cleared between uses */
+static uint8_t mmm_burst[MMM_BURST][MAP_BUF_LEN];
+
 int map_socket = -1;
 
 void* start_mapmessages_muxer(void* arg) {
@@ -82,44 +130,82 @@ void* start_mapmessages_muxer(void* arg) {
 		fatal("Unable to open mapping socket");
 	}
 	
-	init_mmm_poll();
+	init_mmm_events();
 
-	debug_printf("Map message muxer is listening");
+	trace(TRACE_LEVEL_EVENT, TRACE_NORTH, "Map message muxer is listening");
 	
+	mmm_handle* ready[MMM_EVENTS];
 	int r;
 	while (1) {
-		r = poll(mmm_poll, mmm_poll_ctr, INFTIM);
+		/* Not sleeping while a ring has messages */
+		int timeout = INFTIM;
+		for (int i = 0; i < mmm_sources_ctr; ++i) {
+			if (mmm_sources[i]->transport != NULL && !hv_ring_sleep(&(mmm_sources[i]->transport->rings->east))) {
+				timeout = 0;
+			}
+		}
+
+		r = wait_events(ready, MMM_EVENTS, timeout);
 
 		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
 			fatal("Error while polling in map messages muxer");
 		}
 
-		if (mmm_poll[0].revents & POLLIN) {
-			/* Registering_server thread signalled a change */
-			update_mmm_poll();
+		for (int i = 0; i < mmm_sources_ctr; ++i) {
+			if (mmm_sources[i]->transport != NULL) {
+				hv_ring_awake(&(mmm_sources[i]->transport->rings->east));
+			}
+		}
 
-			if (r == 1) {
-				/* No other socket is ready */
-				continue;
+		int update = 0;
+		for (int i = 0; i < r; ++i) {
+			if (ready[i] == &mmm_ping_handle) {
+				update = 1;
+			} else if (ready[i]->is_doorbell) {
+				drain_east_doorbell(ready[i]->source->transport);
+			} else {
+				process_socket(ready[i]->source);
 			}
 		}
 
-		for (int i = 1; i < mmm_poll_ctr; ++i) {
-			if (mmm_poll[i].revents & POLLIN) {
-				process_message(mmm_poll[i].fd);
+		for (int i = 0; i < mmm_sources_ctr; ++i) {
+			if (mmm_sources[i]->transport != NULL) {
+				process_ring(mmm_sources[i]);
 			}
 		}
+
+		/* Registering_server thread signalled a change; no event refers to a source any longer */
+		if (update) {
+			update_mmm_sources();
+		}
+
+		/* One new snapshot for all the assignments changed in this round */
+		if (assignments_changed) {
+			assignments_changed = 0;
+			publish_snapshot();
+		}
 	}
 
 	pthread_exit(0);
 }
 
-static void init_mmm_poll() {
-	mmm_poll = malloc(DYN_ARRAY_INIT * sizeof(struct pollfd));
-	check_allocation(mmm_poll);
+static void init_mmm_events() {
+#ifdef LINUX_OS
+	mmm_events_fd = epoll_create(MMM_EVENTS);
+#else	/* LINUX_OS */
+	mmm_events_fd = kqueue();
+#endif	/* LINUX_OS */
+	if (mmm_events_fd < 0) {
+		fatal("Unable to create map messages muxer event queue");
+	}
 
-	mmm_poll_ctr = 0;
-	mmm_poll_max = DYN_ARRAY_INIT;
+	mmm_sources = malloc(DYN_ARRAY_INIT * sizeof(mmm_source*));
+	check_allocation(mmm_sources);
+	mmm_sources_ctr = 0;
+	mmm_sources_max = DYN_ARRAY_INIT;
 
 	int s = socket(AF_UNIX, SOCK_DGRAM, 0);
 	if (s < 0) {
@@ -142,107 +228,277 @@ static void init_mmm_poll() {
 		fatal("Unable to bind internal UNIX socket");
 	}
 
-	mmm_poll[0].fd = s;
-	mmm_poll[0].events = POLLIN;
-	mmm_poll[0].revents = 0x0;
-
-	mmm_poll_ctr = 1;
+	mmm_ping_socket = s;
+	watch_fd(s, &mmm_ping_handle);
 }
 
-static void expand_mmm_poll(int guaranteed_capacity) {
-	mmm_poll_max = (int) ceil(DYN_ARRAY_INCR * mmm_poll_max);
+static void watch_fd(int fd, mmm_handle* handle) {
+	int r;
+#ifdef LINUX_OS
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(struct epoll_event));
+	ev.events = EPOLLIN;
+	ev.data.ptr = handle;
+	r = epoll_ctl(mmm_events_fd, EPOLL_CTL_ADD, fd, &ev);
+#else	/* LINUX_OS */
+	struct kevent ev;
+	EV_SET(&ev, fd, EVFILT_READ, EV_ADD, 0, 0, handle);
+	r = kevent(mmm_events_fd, &ev, 1, NULL, 0, NULL);
+#endif	/* LINUX_OS */
+	if (r < 0) {
+		fatal("Unable to add a socket to map messages muxer event queue");
+	}
+}
 
-	if (guaranteed_capacity > 0 && mmm_poll_max < guaranteed_capacity) {
-		mmm_poll_max = guaranteed_capacity;
+static void unwatch_fd(int fd) {
+	int r;
+#ifdef LINUX_OS
+	struct epoll_event ev;
+	r = epoll_ctl(mmm_events_fd, EPOLL_CTL_DEL, fd, &ev);
+#else	/* LINUX_OS */
+	struct kevent ev;
+	EV_SET(&ev, fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+	r = kevent(mmm_events_fd, &ev, 1, NULL, 0, NULL);
+#endif	/* LINUX_OS */
+	if (r < 0) {
+		warning("Unable to remove a socket from map messages muxer event queue");
 	}
+}
 
-	mmm_poll = realloc(mmm_poll, mmm_poll_max * sizeof(struct pollfd));
-	check_allocation(mmm_poll);
+/* Level-triggered: a socket left with messages is reported again */
+static int wait_events(mmm_handle** ready, int max, int timeout) {
+	int r;
+#ifdef LINUX_OS
+	struct epoll_event evs[MMM_EVENTS];
+	r = epoll_wait(mmm_events_fd, evs, max, timeout);
+	for (int i = 0; i < r; i++) {
+		ready[i] = evs[i].data.ptr;
+	}
+#else	/* LINUX_OS */
+	struct kevent evs[MMM_EVENTS];
+	struct timespec ts = {timeout / 1000, (timeout % 1000) * 1000000};
+	r = kevent(mmm_events_fd, NULL, 0, evs, max, (timeout == INFTIM) ? NULL : &ts);
+	for (int i = 0; i < r; i++) {
+		ready[i] = evs[i].udata;
+	}
+#endif	/* LINUX_OS */
+	return r;
 }
 
-static void update_mmm_poll() {
+/* Only the control planes that came or went change the interest set */
+static void update_mmm_sources() {
 	const int INT_BUF_LEN = 8;
 
 	uint8_t buf[INT_BUF_LEN];
 
-	pthread_rwlock_rdlock(&control_planes_lock);
-
-	int pre_update_ctr = mmm_poll_ctr-1;
-	
 	int r = 1;
 	while (r > 0) {
-		r = recv(mmm_poll[0].fd, buf, INT_BUF_LEN, 0);
+		r = recv(mmm_ping_socket, buf, INT_BUF_LEN, 0);
 	}
 
-	if (control_planes_ctr > mmm_poll_max - 1) {
-		expand_mmm_poll(control_planes_ctr + 1);
-	}
+	pthread_rwlock_rdlock(&control_planes_lock);
 
-	mmm_poll_ctr = control_planes_ctr + 1;
+	int pre_update_ctr = mmm_sources_ctr;
+
+	for (int i = 0; i < mmm_sources_ctr; i++) {
+		mmm_sources[i]->seen = 0;
+	}
 
 	for (int i = 0; i < control_planes_ctr; i++) {
-		mmm_poll[i + 1].fd = control_planes[i].socket_descriptor;
-		mmm_poll[i + 1].events = POLLIN;
-		mmm_poll[i + 1].revents = 0x0;
+		int j;
+		for (j = 0; j < mmm_sources_ctr; j++) {
+			if (mmm_sources[j]->id == control_planes[i].id) {
+				break;
+			}
+		}
+
+		if (j < mmm_sources_ctr) {
+			mmm_sources[j]->seen = 1;
+		} else {
+			add_source(&(control_planes[i]));
+		}
+	}
+
+	int i = 0;
+	while (i < mmm_sources_ctr) {
+		if (mmm_sources[i]->seen) {
+			i++;
+		} else {
+			remove_source(i);
+		}
 	}
-	
-	debug_printf("Updating MapMessagesMuxer. Currently %d control planes are in the pool (they were %d)", mmm_poll_ctr-1, pre_update_ctr);
+
+	trace(TRACE_LEVEL_EVENT, TRACE_NORTH, "Updating MapMessagesMuxer. Currently %d control planes are in the pool (they were %d)", mmm_sources_ctr, pre_update_ctr);
 
 	pthread_rwlock_unlock(&control_planes_lock);
 }
 
-static void process_message(int socket_descriptor) {
-	const int MAP_BUF_LEN = 8192;
+/* Requires control_planes rdlock */
+static void add_source(control_plane* cp) {
+	if (mmm_sources_ctr == mmm_sources_max) {
+		mmm_sources_max *= 2;
+		mmm_sources = realloc(mmm_sources, mmm_sources_max * sizeof(mmm_source*));
+		check_allocation(mmm_sources);
+	}
+
+	mmm_source* source = calloc(1, sizeof(mmm_source));
+	check_allocation(source);
 
-	int msg_len;
-	uint8_t buf[MAP_BUF_LEN];
+	source->id = cp->id;
+	source->socket_descriptor = cp->socket_descriptor;
+	source->transport = cp->transport;
+	source->socket_handle.source = source;
+	source->socket_handle.is_doorbell = 0;
+	source->doorbell_handle.source = source;
+	source->doorbell_handle.is_doorbell = 1;
+	source->seen = 1;
 
-	memset(buf, 0, MAP_BUF_LEN);
-	msg_len = recv(socket_descriptor, buf, MAP_BUF_LEN, 0);
+	watch_fd(source->socket_descriptor, &(source->socket_handle));
 
-	if (msg_len < 0) {
-		warning("Error while reading from northbound socket");
-		return;
+	if (source->transport != NULL) {
+		get_transport(source->transport);
+		watch_fd(source->transport->east_doorbell, &(source->doorbell_handle));
 	}
 
-	uint16_t msg_type = extract_type_mm(buf, msg_len);
-	uint32_t msg_flags = extract_flags_mm(buf, msg_len);
-	
-	/* Add to/remove from assignments if EID is local */
-	if ((msg_flags & MAPF_DB) && (msg_type == MAPM_ADD || msg_type == MAPM_DELETE)) {
-		pthread_rwlock_rdlock(&control_planes_lock);
-		pthread_rwlock_rdlock(&assignments_lock);
-
-		ipv6_prefix significant_eid;
-		significant_eid = extract_eid_mm(buf, msg_len);
-		
-		assignment item;
-		memcpy(&(item.eid), &(significant_eid), sizeof(ipv6_prefix));
-		
-		int i;
-		for (i = 0; i < control_planes_ctr; ++i) {
-			if (control_planes[i].socket_descriptor == socket_descriptor) {
-				break;
+	mmm_sources[mmm_sources_ctr++] = source;
+}
+
+static void remove_source(int ind) {
+	mmm_source* source = mmm_sources[ind];
+
+	unwatch_fd(source->socket_descriptor);
+
+	/* Rings may go away with their control plane */
+	if (source->transport != NULL) {
+		unwatch_fd(source->transport->east_doorbell);
+		put_transport(source->transport);
+	}
+
+	free(source);
+
+	mmm_sources[ind] = mmm_sources[--mmm_sources_ctr];
+}
+
+static void process_socket(mmm_source* source) {
+	uint8_t* bufs[MMM_BURST];
+	int lens[MMM_BURST];
+
+	int n;
+	for (n = 0; n < MMM_BURST; n++) {
+		int msg_len = recv(source->socket_descriptor, mmm_burst[n], MAP_BUF_LEN, MSG_DONTWAIT);
+
+		if (msg_len < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				warning("Error while reading from northbound socket");
 			}
+			break;
 		}
-		
-		item.assignee_index = i;
-		
-		if (i < control_planes_ctr) {
-			switch (msg_type) {
-				case MAPM_ADD:
-					add_assignment(&item);
-					break;
-				case MAPM_DELETE:
-					remove_assignment(&item);
+
+		bufs[n] = mmm_burst[n];
+		lens[n] = msg_len;
+	}
+
+	process_map_batch(source, bufs, lens, n);
+}
+
+/*
+ * Map messages are written to the data plane straight from the ring. One
+ * burst per round, like sockets: a ring left non-empty keeps the next
+ * wait from sleeping, so it is served again after the other sources.
+ */
+static void process_ring(mmm_source* source) {
+	hv_ring* ring = &(source->transport->rings->east);
+
+	uint8_t* bufs[MMM_BURST];
+	int lens[MMM_BURST];
+
+	hv_ring_slot* slot;
+	int n;
+	for (n = 0; n < MMM_BURST && (slot = hv_ring_peek_nth(ring, n)) != NULL; n++) {
+		bufs[n] = slot->data;
+		lens[n] = slot->h.len;
+		if (lens[n] > HV_RING_DATA_LEN) {
+			lens[n] = HV_RING_DATA_LEN;
+		}
+	}
+
+	if (n > 0) {
+		process_map_batch(source, bufs, lens, n);
+		hv_ring_release_n(ring, n);
+	}
+}
+
+/* Map messages from one control plane, in order */
+static void process_map_batch(mmm_source* source, uint8_t** bufs, int* lens, int n) {
+	int locked = 0;
+	int index = -1;
+
+	/* Add to/remove from assignments if EID is local, taking the locks once */
+	for (int k = 0; k < n; k++) {
+		uint16_t msg_type = extract_type_mm(bufs[k], lens[k]);
+		uint32_t msg_flags = extract_flags_mm(bufs[k], lens[k]);
+
+		if (!(msg_flags & MAPF_DB) || (msg_type != MAPM_ADD && msg_type != MAPM_DELETE)) {
+			continue;
+		}
+
+		if (!locked) {
+			pthread_rwlock_rdlock(&control_planes_lock);
+			pthread_rwlock_wrlock(&assignments_lock);
+			locked = 1;
+
+			for (index = 0; index < control_planes_ctr; ++index) {
+				if (control_planes[index].id == source->id) {
 					break;
+				}
 			}
 		}
-		
+
+		if (index == control_planes_ctr) {
+			/* Deregistered meanwhile */
+			continue;
+		}
+
+		assignment item;
+		item.eid = extract_eid_mm(bufs[k], lens[k]);
+		item.assignee_index = index;
+
+		switch (msg_type) {
+			case MAPM_ADD:
+				add_assignment(&item);
+				break;
+			case MAPM_DELETE:
+				remove_assignment(&item);
+				break;
+		}
+		assignments_changed = 1;
+	}
+
+	if (locked) {
 		pthread_rwlock_unlock(&assignments_lock);
 		pthread_rwlock_unlock(&control_planes_lock);
 	}
-		
+
+	/*
+	 * The mapping socket takes one message per write, like a routing
+	 * socket. A repeated add or delete would only be refused (EEXIST,
+	 * ESRCH), so it is not written again.
+	 */
+	for (int k = 0; k < n; k++) {
+		uint16_t msg_type = extract_type_mm(bufs[k], lens[k]);
+		if (k > 0 && (msg_type == MAPM_ADD || msg_type == MAPM_DELETE) && 
+				lens[k] == lens[k - 1] && memcmp(bufs[k], bufs[k - 1], lens[k]) == 0) {
+			trace(TRACE_LEVEL_PACKET, TRACE_NORTH, "Skipping repeated map message from northbound socket %d", source->socket_descriptor);
+			continue;
+		}
+
+		write_map_message(source, bufs[k], lens[k]);
+	}
+}
+
+static void write_map_message(mmm_source* source, uint8_t* buf, int msg_len) {
+	uint16_t msg_type = extract_type_mm(buf, msg_len);
+
 	int r = write(map_socket, buf, msg_len);
 
 	if (r == -1) {
@@ -263,8 +519,8 @@ static void process_message(int socket_descriptor) {
 		r = 0;
 	}
 
-	debug_printf("Muxing map message of type %d from northbound socket %d to data plane", msg_type, socket_descriptor);
+	trace(TRACE_LEVEL_PACKET, TRACE_NORTH, "Muxing map message of type %d from northbound socket %d to data plane", msg_type, source->socket_descriptor);
 	if (r != 0) {
-		debug_printf("However, map socket returned errno %d", r);
+		trace(TRACE_LEVEL_PACKET, TRACE_NORTH, "However, map socket returned errno %d", r);
 	}
 }
@@ -28,12 +28,6 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #ifndef MAPMESSAGES_MUX_H_
 #define MAPMESSAGES_MUX_H_
 
-#include <poll.h>
-
-extern struct pollfd* mmm_poll;
-extern int mmm_poll_ctr;
-extern int mmm_poll_max;
-
 void* start_mapmessages_muxer(void*);
 
 #endif /* MAPMESSAGES_MUX_H_ */
@@ -0,0 +1,463 @@
+/*
+Copyright (c) 2014, Stefano Tribioli
+All rights reserved. 
+
+This file is part of the hyLISP project.
+http://hylisp.org
+
+Redistribution and use in source and binary forms, with or without modification, 
+are permitted provided that the following conditions are met: 
+1. Redistributions of source code must retain the above copyright notice, this 
+   list of conditions and the following disclaimer. 
+2. Redistributions in binary form must reproduce the above copyright notice, 
+   this list of conditions and the following disclaimer in the documentation 
+   and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND 
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON 
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. 
+ */
+
+#include "outqueue.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "../common/trace.h"
+#include "../controlplanes/snapshot.h"
+
+#ifndef INFTIM
+#define INFTIM	-1
+#endif
+
+/*
+ * A socket polled as writable may still refuse a datagram (on FreeBSD,
+ * POLLOUT does not tell about the peer's buffer): such a queue is left out
+ * of the poll set for OUTQ_RETRY msec instead of spinning on it.
+ */
+#define OUTQ_RETRY	10
+
+enum {
+	TRY_NONE,
+	TRY_NEW,
+	TRY_WRITABLE
+};
+
+static void init_writer();
+static void request_dump(int);
+static void dump_counters();
+static int is_full(int);
+static int same_eid(ipv6_prefix*, ipv6_prefix*);
+static int make_room(cp_outqueue*, int);
+static void hand_over(cp_outqueue*);
+static int flush_outqueue(cp_outqueue*, int*);
+static uint64_t now_msec();
+
+static const int DYN_ARRAY_INIT = 16;
+
+static pthread_once_t writer_once = PTHREAD_ONCE_INIT;
+static int writer_pipe[2] = {-1, -1};
+static volatile sig_atomic_t dump_requested = 0;
+
+/* Queues that became non-empty, not yet taken over by the writer */
+static pthread_mutex_t handoff_lock = PTHREAD_MUTEX_INITIALIZER;
+static cp_outqueue** handoff = NULL;
+static int handoff_ctr = 0;
+static int handoff_max = 0;
+
+cp_outqueue* create_outqueue(uint32_t id, int socket_descriptor) {
+	cp_outqueue* q = calloc(1, sizeof(cp_outqueue));
+	check_allocation(q);
+
+	q->id = id;
+	q->socket_descriptor = socket_descriptor;
+	pthread_mutex_init(&(q->lock), NULL);
+	q->refs = 1;
+
+	return q;
+}
+
+void get_outqueue(cp_outqueue* q) {
+	__atomic_add_fetch(&(q->refs), 1, __ATOMIC_RELAXED);
+}
+
+void put_outqueue(cp_outqueue* q) {
+	if (__atomic_sub_fetch(&(q->refs), 1, __ATOMIC_ACQ_REL) != 0) {
+		return;
+	}
+
+	outqueue_message* m = q->head;
+	while (m != NULL) {
+		outqueue_message* next = m->next;
+		free(m);
+		m = next;
+	}
+
+	pthread_mutex_destroy(&(q->lock));
+	free(q);
+}
+
+int outqueue_push(cp_outqueue* q, uint8_t* buf, int len, int is_miss, ipv6_prefix* eid) {
+	int r;
+
+	pthread_mutex_lock(&(q->lock));
+
+	if (q->head == NULL) {
+		/* Nothing to keep the order of: trying at once */
+		r = send(q->socket_descriptor, buf, len, MSG_DONTWAIT);
+		if (r >= 0) {
+			q->sent++;
+			pthread_mutex_unlock(&(q->lock));
+			return OUTQ_SENT;
+		}
+
+		int e = errno;
+		if (!is_full(e)) {
+			q->dropped++;
+			pthread_mutex_unlock(&(q->lock));
+			warningr("Unable to write to UNIX socket", e);
+			return OUTQ_DROPPED;
+		}
+	} else if (is_miss && hv_miss_policy == MISS_POLICY_COALESCE && eid->reason == PRFX_ASIS) {
+		/* The control plane is going to resolve that EID anyway */
+		outqueue_message* m;
+		for (m = q->head; m != NULL; m = m->next) {
+			if (m->is_miss && same_eid(&(m->eid), eid)) {
+				q->coalesced++;
+				pthread_mutex_unlock(&(q->lock));
+				return OUTQ_COALESCED;
+			}
+		}
+	}
+
+	if (q->depth >= hv_queue_len && !make_room(q, is_miss)) {
+		q->dropped++;
+		pthread_mutex_unlock(&(q->lock));
+		return OUTQ_DROPPED;
+	}
+
+	outqueue_message* m = malloc(sizeof(outqueue_message) + len);
+	check_allocation(m);
+	m->next = NULL;
+	m->is_miss = is_miss;
+	memcpy(&(m->eid), eid, sizeof(ipv6_prefix));
+	m->len = len;
+	memcpy(m->buf, buf, len);
+
+	if (q->tail == NULL) {
+		q->head = m;
+	} else {
+		q->tail->next = m;
+	}
+	q->tail = m;
+
+	q->queued++;
+	if (++(q->depth) > q->max_depth) {
+		q->max_depth = q->depth;
+	}
+
+	int new_pending = !q->pending;
+	q->pending = 1;
+
+	pthread_mutex_unlock(&(q->lock));
+
+	if (new_pending) {
+		hand_over(q);
+	}
+
+	return OUTQ_QUEUED;
+}
+
+void* start_mapmessages_writer(void* arg) {
+	pthread_once(&writer_once, init_writer);
+
+	/* The only thread taking SIGUSR1: see main() */
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(struct sigaction));
+	sa.sa_handler = request_dump;
+	sigemptyset(&(sa.sa_mask));
+	sigaction(SIGUSR1, &sa, NULL);
+
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+
+	/* queues[i] is polled by fds[i + 1]; fds[0] is the wake-up pipe */
+	int ctr = 0;
+	int max = DYN_ARRAY_INIT;
+	cp_outqueue** queues = malloc(max * sizeof(cp_outqueue*));
+	check_allocation(queues);
+	int* try = malloc(max * sizeof(int));
+	check_allocation(try);
+	struct pollfd* fds = malloc((max + 1) * sizeof(struct pollfd));
+	check_allocation(fds);
+
+	trace(TRACE_LEVEL_EVENT, TRACE_NORTH, "Northbound writer is running");
+
+	int r;
+	int i;
+	while (1) {
+		/* Taking over the queues that became non-empty */
+		pthread_mutex_lock(&handoff_lock);
+		if (ctr + handoff_ctr > max) {
+			while (ctr + handoff_ctr > max) {
+				max *= 2;
+			}
+			queues = realloc(queues, max * sizeof(cp_outqueue*));
+			check_allocation(queues);
+			try = realloc(try, max * sizeof(int));
+			check_allocation(try);
+			fds = realloc(fds, (max + 1) * sizeof(struct pollfd));
+			check_allocation(fds);
+		}
+		for (i = 0; i < handoff_ctr; i++) {
+			queues[ctr] = handoff[i];
+			try[ctr] = TRY_NEW;
+			ctr++;
+		}
+		handoff_ctr = 0;
+		pthread_mutex_unlock(&handoff_lock);
+
+		/* Sending as much as every writable socket takes */
+		uint64_t now = now_msec();
+		int timeout = INFTIM;
+		i = 0;
+		while (i < ctr) {
+			cp_outqueue* q = queues[i];
+
+			/* A new queue is just tried; one polled as writable must make progress */
+			int writable = (try[i] == TRY_WRITABLE || (q->retry_at != 0 && q->retry_at <= now));
+			if (try[i] != TRY_NONE || writable) {
+				int progress;
+				if (flush_outqueue(q, &progress)) {
+					queues[i] = queues[ctr - 1];
+					try[i] = try[ctr - 1];
+					ctr--;
+					put_outqueue(q);
+					continue;
+				}
+
+				q->retry_at = (writable && !progress) ? now + OUTQ_RETRY : 0;
+			}
+
+			try[i] = TRY_NONE;
+			if (q->retry_at != 0) {
+				fds[i + 1].fd = -1;
+				if (timeout == INFTIM || (int) (q->retry_at - now) < timeout) {
+					timeout = (int) (q->retry_at - now);
+				}
+			} else {
+				fds[i + 1].fd = q->socket_descriptor;
+			}
+			fds[i + 1].events = POLLOUT;
+			fds[i + 1].revents = 0;
+			i++;
+		}
+
+		fds[0].fd = writer_pipe[0];
+		fds[0].events = POLLIN;
+		fds[0].revents = 0;
+
+		r = poll(fds, ctr + 1, timeout);
+
+		if (r == -1 && errno != EINTR) {
+			fatal("Error while polling in northbound writer");
+		}
+
+		if (r > 0 && (fds[0].revents & POLLIN)) {
+			uint8_t b[64];
+			while (read(writer_pipe[0], b, sizeof(b)) > 0);
+		}
+
+		for (i = 0; r > 0 && i < ctr; i++) {
+			if (fds[i + 1].revents & (POLLOUT | POLLERR | POLLHUP)) {
+				try[i] = TRY_WRITABLE;
+			}
+		}
+
+		if (dump_requested) {
+			dump_requested = 0;
+			dump_counters();
+		}
+	}
+
+	pthread_exit(0);
+}
+
+static void init_writer() {
+	if (pipe(writer_pipe) < 0) {
+		fatal("Unable to create northbound writer pipe");
+	}
+
+	fcntl(writer_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(writer_pipe[1], F_SETFL, O_NONBLOCK);
+
+	handoff = malloc(DYN_ARRAY_INIT * sizeof(cp_outqueue*));
+	check_allocation(handoff);
+	handoff_max = DYN_ARRAY_INIT;
+}
+
+static void request_dump(int sig) {
+	dump_requested = 1;
+
+	uint8_t b = 0;
+	int saved_errno = errno;
+	write(writer_pipe[1], &b, 1);
+	errno = saved_errno;
+}
+
+/* Per control plane counters, written to the error log */
+static void dump_counters() {
+	routing_snapshot* snapshot = snapshot_enter();
+
+	for (int i = 0; snapshot != NULL && i < snapshot->control_planes_ctr; i++) {
+		cp_outqueue* q = snapshot->control_planes[i].outqueue;
+		if (q == NULL) {
+			continue;
+		}
+
+		pthread_mutex_lock(&(q->lock));
+		fprintf(stderr, "Control plane %u: depth %d (max %d); sent %llu; queued %llu; dropped %llu; coalesced %llu\n",
+				q->id, q->depth, q->max_depth, (unsigned long long) q->sent, (unsigned long long) q->queued,
+				(unsigned long long) q->dropped, (unsigned long long) q->coalesced);
+		pthread_mutex_unlock(&(q->lock));
+	}
+
+	snapshot_exit();
+
+	fflush(stderr);
+}
+
+static int is_full(int e) {
+	return (e == EAGAIN || e == EWOULDBLOCK || e == ENOBUFS);
+}
+
+static int same_eid(ipv6_prefix* a, ipv6_prefix* b) {
+	return (a->prefix_length == b->prefix_length && memcmp(a->prefix, b->prefix, 16) == 0);
+}
+
+/* Requires q->lock. Drops the oldest queued miss, if the policy allows it */
+static int make_room(cp_outqueue* q, int is_miss) {
+	if (is_miss && hv_miss_policy != MISS_POLICY_HEAD) {
+		return 0;
+	}
+
+	outqueue_message* prev = NULL;
+	outqueue_message* m = q->head;
+	while (m != NULL && !m->is_miss) {
+		prev = m;
+		m = m->next;
+	}
+
+	if (m == NULL) {
+		return 0;
+	}
+
+	if (prev == NULL) {
+		q->head = m->next;
+	} else {
+		prev->next = m->next;
+	}
+	if (q->tail == m) {
+		q->tail = prev;
+	}
+	free(m);
+
+	q->depth--;
+	q->dropped++;
+
+	return 1;
+}
+
+static void hand_over(cp_outqueue* q) {
+	pthread_once(&writer_once, init_writer);
+
+	get_outqueue(q);
+
+	pthread_mutex_lock(&handoff_lock);
+	if (handoff_ctr == handoff_max) {
+		handoff_max *= 2;
+		handoff = realloc(handoff, handoff_max * sizeof(cp_outqueue*));
+		check_allocation(handoff);
+	}
+	handoff[handoff_ctr++] = q;
+	pthread_mutex_unlock(&handoff_lock);
+
+	/* Full pipe: the writer has yet to wake up anyway */
+	uint8_t b = 0;
+	if (write(writer_pipe[1], &b, 1) < 0 && errno != EAGAIN) {
+		warning("Unable to wake up northbound writer");
+	}
+}
+
+/* Returns 1 once the queue is empty, and it is no longer the writer's */
+static int flush_outqueue(cp_outqueue* q, int* progress) {
+	int r;
+	int failed = 0;
+	int e = 0;
+
+	*progress = 0;
+
+	pthread_mutex_lock(&(q->lock));
+
+	while (q->head != NULL) {
+		outqueue_message* m = q->head;
+
+		r = send(q->socket_descriptor, m->buf, m->len, MSG_DONTWAIT);
+		if (r < 0 && is_full(errno)) {
+			break;
+		}
+
+		if (r < 0) {
+			e = errno;
+			failed++;
+			q->dropped++;
+		} else {
+			q->sent++;
+			*progress = 1;
+		}
+
+		q->head = m->next;
+		if (q->head == NULL) {
+			q->tail = NULL;
+		}
+		q->depth--;
+		free(m);
+	}
+
+	int empty = (q->head == NULL);
+	if (empty) {
+		q->pending = 0;
+	}
+
+	pthread_mutex_unlock(&(q->lock));
+
+	if (failed) {
+		warningr("Unable to write to UNIX socket", e);
+	}
+
+	return empty;
+}
+
+static uint64_t now_msec() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
@@ -0,0 +1,84 @@
+/*
+Copyright (c) 2014, Stefano Tribioli
+All rights reserved. 
+
+This file is part of the hyLISP project.
+http://hylisp.org
+
+Redistribution and use in source and binary forms, with or without modification, 
+are permitted provided that the following conditions are met: 
+1. Redistributions of source code must retain the above copyright notice, this 
+   list of conditions and the following disclaimer. 
+2. Redistributions in binary form must reproduce the above copyright notice, 
+   this list of conditions and the following disclaimer in the documentation 
+   and/or other materials provided with the distribution. 
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND 
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED 
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE 
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR 
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES 
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON 
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT 
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS 
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. 
+ */
+
+#ifndef MAPMESSAGES_OUTQUEUE_H_
+#define MAPMESSAGES_OUTQUEUE_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "../common/common.h"
+
+typedef struct outqueue_message {
+	struct outqueue_message* next;
+	int is_miss;
+	ipv6_prefix eid;
+	int len;
+	uint8_t buf[];
+} outqueue_message;
+
+/*
+ * Map messages waiting for the northbound socket of a control plane. The
+ * southbound listener appends, the northbound writer sends them once the
+ * socket is writable again. Snapshots, the registering server and the writer
+ * hold references.
+ */
+typedef struct cp_outqueue {
+	uint32_t id;
+	int socket_descriptor;
+	pthread_mutex_t lock;
+	outqueue_message* head;
+	outqueue_message* tail;
+	int depth;
+	int pending;					// Handed to the writer
+	uint64_t retry_at;				// Msec; the socket claimed to be writable, but was not
+	/* Counters */
+	uint64_t sent;
+	uint64_t queued;
+	uint64_t dropped;
+	uint64_t coalesced;
+	int max_depth;
+	int refs;
+} cp_outqueue;
+
+enum {
+	OUTQ_SENT,
+	OUTQ_QUEUED,
+	OUTQ_COALESCED,
+	OUTQ_DROPPED
+};
+
+cp_outqueue* create_outqueue(uint32_t, int);
+void get_outqueue(cp_outqueue*);
+void put_outqueue(cp_outqueue*);
+
+/* Never blocks; the message is copied if it can not be sent at once */
+int outqueue_push(cp_outqueue*, uint8_t*, int, int, ipv6_prefix*);
+
+void* start_mapmessages_writer(void*);
+
+#endif /* MAPMESSAGES_OUTQUEUE_H_ */